@@ -32,12 +32,17 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <pthread.h>
 #include "config.h"
 #include "proclib.h"
 #include "ipc.h"
 #include "cmd.h"
 #include "debug.h"
 #include "hashtable.h"
+#include "memPool.h"
 #include "xdr.h"
 #include "cmd-pkt.h"
 
@@ -49,9 +54,24 @@ static struct HashTable *xdrCommandHash = NULL;
 static struct DatareqCmd *xdrDatareqList = NULL;
 static struct HashTable *xdrErrorHash = NULL;
 
+// CMD_XDR_* flags of a command number, kept out of CMD_XDRCommandInfo
+//  because callers define arrays of those
+struct XDRCommandFlags {
+   uint32_t command;
+   uint32_t flags;
+};
+static struct HashTable *xdrFlagsHash = NULL;
+
 /// Value in the PROT element in the CMD structure that indicates protected cmd
 #define CMD_PROTECTED 1
 
+/// Initial bucket count of the pending response table, a power of two
+#define RESP_TABLE_MIN_SIZE 64
+/// Number of pending response records allocated at once
+#define RESP_POOL_SLAB 64
+/// Chunk size of the arena incoming XDR commands are decoded into
+#define DECODE_ARENA_CHUNK 4096
+
 // Code to handle multicast packet management
 struct MulticastCommand {
    int cmdNum;
@@ -61,14 +81,39 @@ struct MulticastCommand {
    struct MulticastCommand *next;
 };
 
+// A typed callback for telemetry published to a multicast group
+struct TelemetrySub {
+   uint32_t type;
+   MCAST_telemetry_handler_t callback;
+   void *callbackParam;
+
+   struct TelemetrySub *next;
+};
+
 struct McastCommandState {
    struct in_addr srcAddr;
    uint16_t port;
    int fd;
    struct MulticastCommand *cmds;
+   struct TelemetrySub *subs;
+   struct CommandCbArg *owner;
    struct McastCommandState *next;
 };
 
+// Receive ring used to drain several datagrams per event loop wakeup
+struct CMDRxBatch {
+   unsigned int size;               // Most datagrams to read per wakeup
+   unsigned int want;               // Slots to back on the next read
+   unsigned int alloced;            // Slots currently backed by buffers
+   unsigned char *buffers;          // alloced * MAX_IP_PACKET_SIZE bytes
+   struct sockaddr_in *src;
+   int *lens;
+#ifdef __linux__
+   struct mmsghdr *msgs;
+   struct iovec *iov;
+#endif
+};
+
 struct CMDResponseCb {
    uint32_t id;
    struct sockaddr_in host;
@@ -77,16 +122,101 @@ struct CMDResponseCb {
    enum IPC_CB_TYPE cb_type;
    void *to_evt;
    ProcessData *proc;
-   struct CMDResponseCb *next;
+   struct CMDResponseCb *next;     // Next entry in the same hash bucket
 };
 
+// Outstanding XDR command responses, hashed on (ipcref, host)
+struct CMDResponseTable {
+   struct CMDResponseCb **buckets;
+   size_t size;                    // Bucket count, always a power of two
+   size_t count;
+   struct MemPool *pool;
+};
+
+struct DataReqFanIn;
+struct DataSnapshot;
+
+// One requested type of a DATA_REQ in progress
 struct DataReqParams {
-   struct IPC_OpaqueStruct *dest;
+   struct DataReqFanIn *fanin;
    uint32_t type;
+   uint32_t error;
+   struct IPC_OpaqueStruct enc;     // Encoded union, once done
+   struct DataSnapshotBlob *blob;   // Set when enc belongs to a snapshot
+   struct DataSnapshot *snap;       // Set while populating or waiting for it
+   struct DataReqParams *nextWaiter;
+   int delivered;                   // The populator has called back
+   int done;                        // The result reached the loop thread
+};
+
+// A DATA_REQ waiting for its populators.  The response is sent and the
+//  fan-in freed once every populator has called back or the deadline
+//  passes, whichever is first.  Telemetry publications reuse it with a
+//  complete callback in place of the response.
+struct DataReqFanIn {
+   struct CommandCbArg *cmds;
    struct ProcessData *proc;
-   int direct_resp;
-   struct IPC_Command *cmd;
-   struct sockaddr_in *from;
+   EVTHandler *evt;
+   pthread_t loopThread;
+   uintptr_t id;
+   uint32_t ipcref;
+   struct sockaddr_in from;
+   void *deadlineEvt;
+   int pending, responded, direct;
+   int count;
+   void (*complete)(struct DataReqFanIn *fanin);
+   void *completeArg;
+   struct DataReqFanIn *next;       // In cmds->dataReqs
+   struct DataReqParams slots[];
+};
+
+#define DATA_REQ_MAX_TYPES 1024
+#define DATA_REQ_SLOT_BITS 10
+#define DATA_REQ_HASH_SIZE 31
+
+// Populators are handed (fan-in id << DATA_REQ_SLOT_BITS | slot) instead of
+//  a pointer, so a callback that arrives after its DATA_REQ was answered,
+//  from any thread and even after PROC_cleanup, finds nothing here and is
+//  ignored rather than touching freed memory.
+static pthread_mutex_t dataReqLock = PTHREAD_MUTEX_INITIALIZER;
+static struct HashTable *dataReqs = NULL;
+static uintptr_t dataReqNextId = 0;
+
+#define DATA_SNAPSHOT_HASH_SIZE 37
+
+// Encoded populator result, shared by the snapshot and any responses
+//  still waiting on other populators
+struct DataSnapshotBlob {
+   int refs;
+   int32_t length;
+   char data[];
+};
+
+// The encoded result of a populator registered with a max age, reused by
+//  DATA_REQ commands until it expires.  Only one miss at a time populates;
+//  the others wait for its result.
+struct DataSnapshot {
+   uint32_t type;
+   struct timeval stamp;
+   struct DataSnapshotBlob *blob;
+   struct DataReqParams *leader;    // The slot populating after a miss
+   struct DataReqParams *waiters;   // Misses waiting on the leader
+};
+
+// A type pushed to the process's multicast group.  Each run populates and
+//  encodes the type once, no matter how many processes are subscribed.
+struct TelemetryPub {
+   struct CommandCbArg *cmds;
+   EVTHandler *evt;
+   uint32_t type;
+   uint32_t flags;
+   uint32_t seq;
+   unsigned int periodMs;
+   void *timer;
+   struct DataReqFanIn *run;        // The populate in progress, if any
+   int force;
+   struct IPC_OpaqueStruct last;    // Last encoding sent, for on change
+   struct TelemetryPub *next;
 };
 
 struct Command {
@@ -98,11 +228,32 @@ struct CommandCbArg {
    struct Command *cmds;
    struct McastCommandState *mcast;
    struct ProcessData *proc;
-   struct CMDResponseCb *resp;
+   struct CMDResponseTable resp;
    struct IPC_Heartbeat beats;
+   struct IPC_HeartbeatExt beatsExt;
+   struct CMDRxBatch rx;
+   struct MemArena *decodeArena;
+   struct CMDShard *shards;
+   struct HashTable *snapshots;
+   unsigned int dataReqDeadlineMs;
+   struct DataReqFanIn *dataReqs;
+   struct TelemetryPub *pubs;
+};
+
+// Receive state for an extra command socket read by a shard loop thread.
+//  The counters are written by that thread and read by the heartbeat
+//  populator on the main loop, so both sides use atomics.
+struct CMDShard {
+   struct CommandCbArg *owner;
+   struct CMDRxBatch rx;
+   struct MemArena *decodeArena;
+   struct IPC_Heartbeat beats;
+   struct IPC_HeartbeatExt beatsExt;
+   struct CMDShard *next;
 };
 
 struct CMD_XDRCommandInfo *CMD_xdr_cmd_by_number(uint32_t num);
+static uint32_t cmd_xdr_flags(uint32_t num);
 static void fakeStatusCommand(int socket, unsigned char cmd, void * data,
       size_t dataLen, struct sockaddr_in * src);
 
@@ -112,51 +263,588 @@ void heartbeat_populator(void *arg, XDR_tx_struct cb, void *cb_args)
 {
    struct CommandCbArg *cmds = (struct CommandCbArg*)arg;
 
+   struct IPC_Heartbeat beats;
+   struct CMDShard *shard;
+
    if (!cmds)
       return;
 
    cmds->beats.heartbeats++;
-   cb(&cmds->beats, cb_args, IPC_RESULTCODE_SUCCESS);
+   beats = cmds->beats;
+   for (shard = cmds->shards; shard; shard = shard->next)
+      beats.commands += __atomic_load_n(&shard->beats.commands,
+            __ATOMIC_RELAXED);
+   cb(&beats, cb_args, IPC_RESULTCODE_SUCCESS);
 }
 
-void data_req_populate_cb(void *data, void *arg, uint32_t error)
+// Counters added after the Heartbeat wire format was fixed
+static void heartbeat_ext_populator(void *arg, XDR_tx_struct cb,
+      void *cb_args)
+{
+   struct CommandCbArg *cmds = (struct CommandCbArg*)arg;
+   struct IPC_HeartbeatExt beats;
+   struct CMDShard *shard;
+   uint64_t batch;
+
+   if (!cmds)
+      return;
+
+   beats = cmds->beatsExt;
+   for (shard = cmds->shards; shard; shard = shard->next) {
+      beats.rx_wakeups += __atomic_load_n(&shard->beatsExt.rx_wakeups,
+            __ATOMIC_RELAXED);
+      batch = __atomic_load_n(&shard->beatsExt.rx_batch_max,
+            __ATOMIC_RELAXED);
+      if (batch > beats.rx_batch_max)
+         beats.rx_batch_max = batch;
+   }
+   cb(&beats, cb_args, IPC_RESULTCODE_SUCCESS);
+}
+
+static void data_snapshot_blob_unref(struct DataSnapshotBlob *blob)
+{
+   if (blob && --blob->refs <= 0)
+      free(blob);
+}
+
+static size_t data_snapshot_hash_func(void *key)
 {
-   struct DataReqParams *params;
+   return (uintptr_t)key;
+}
+
+static void *data_snapshot_key_for_data(void *data)
+{
+   return (void*)(uintptr_t)((struct DataSnapshot*)data)->type;
+}
+
+static int data_snapshot_cmp_key(void *key1, void *key2)
+{
+   return key1 == key2;
+}
+
+static void data_snapshot_free(void *data)
+{
+   struct DataSnapshot *snap = (struct DataSnapshot*)data;
+
+   data_snapshot_blob_unref(snap->blob);
+   free(snap);
+}
+
+// Fills in a slot from a snapshot that is younger than the type's max age
+static int data_snapshot_lookup(struct CommandCbArg *cmds,
+      struct XDR_StructDefinition *def, struct DataReqParams *slot)
+{
+   struct DataSnapshot *snap = NULL;
+   struct timeval now, age;
+
+   if (cmds->snapshots)
+      snap = HASH_find_key(cmds->snapshots, (void*)(uintptr_t)def->type);
+
+   if (snap && snap->blob) {
+      EVT_get_monotonic_time(PROC_evt(cmds->proc), &now);
+      timersub(&now, &snap->stamp, &age);
+      if (age.tv_sec * 1000 + age.tv_usec / 1000 <
+            XDR_populator_max_age(def->type)) {
+         cmds->beatsExt.data_req_cache_hits++;
+         slot->blob = snap->blob;
+         slot->blob->refs++;
+         slot->enc.data = slot->blob->data;
+         slot->enc.length = slot->blob->length;
+         slot->error = IPC_RESULTCODE_SUCCESS;
+         slot->done = 1;
+         return 1;
+      }
+   }
+
+   cmds->beatsExt.data_req_cache_misses++;
+   return 0;
+}
+
+// Finds the type's snapshot entry, creating an empty one if needed
+static struct DataSnapshot *data_snapshot_get(struct CommandCbArg *cmds,
+      uint32_t type)
+{
+   struct DataSnapshot *snap;
+
+   if (!cmds->snapshots) {
+      cmds->snapshots = HASH_create_table(DATA_SNAPSHOT_HASH_SIZE,
+            &data_snapshot_hash_func, &data_snapshot_cmp_key,
+            &data_snapshot_key_for_data);
+      if (!cmds->snapshots)
+         return NULL;
+   }
+
+   snap = HASH_find_key(cmds->snapshots, (void*)(uintptr_t)type);
+   if (!snap) {
+      snap = malloc(sizeof(*snap));
+      if (!snap)
+         return NULL;
+      memset(snap, 0, sizeof(*snap));
+      snap->type = type;
+      HASH_add_data(cmds->snapshots, snap);
+   }
+
+   return snap;
+}
+
+// Saves a completed populator result as the type's snapshot
+static struct DataSnapshotBlob *data_snapshot_store(
+      struct CommandCbArg *cmds, uint32_t type, struct IPC_OpaqueStruct *enc)
+{
+   struct DataSnapshot *snap;
+   struct DataSnapshotBlob *blob;
+
+   if (!(snap = data_snapshot_get(cmds, type)))
+      return NULL;
+
+   blob = malloc(sizeof(*blob) + enc->length);
+   if (!blob)
+      return NULL;
+   blob->refs = 1;
+   blob->length = enc->length;
+   memcpy(blob->data, enc->data, enc->length);
+
+   data_snapshot_blob_unref(snap->blob);
+   snap->blob = blob;
+   EVT_get_monotonic_time(PROC_evt(cmds->proc), &snap->stamp);
+
+   return blob;
+}
+
+/* Called after a cache miss.  The first miss for a type becomes the
+ * leader and populates; while it is out, later misses wait for its result
+ * rather than running the populator again.
+ * @return Non-zero if the slot is now waiting on another slot's populate
+ */
+static int data_snapshot_join(struct CommandCbArg *cmds,
+      struct DataReqParams *slot)
+{
+   struct DataSnapshot *snap = data_snapshot_get(cmds, slot->type);
+
+   if (!snap)
+      return 0;
+
+   slot->snap = snap;
+   if (!snap->leader) {
+      snap->leader = slot;
+      return 0;
+   }
+
+   slot->nextWaiter = snap->waiters;
+   snap->waiters = slot;
+   return 1;
+}
+
+// Unhooks a slot that is going away from its snapshot entry.  Waiters stay
+//  attached when the leader goes, and are woken by the next populate.
+static void data_snapshot_leave(struct DataReqParams *slot)
+{
+   struct DataSnapshot *snap = slot->snap;
+   struct DataReqParams **itr;
+
+   if (!snap)
+      return;
+   slot->snap = NULL;
+
+   if (snap->leader == slot) {
+      snap->leader = NULL;
+      return;
+   }
+   for (itr = &snap->waiters; *itr; itr = &(*itr)->nextWaiter)
+      if (*itr == slot) {
+         *itr = slot->nextWaiter;
+         break;
+      }
+}
+
+static void data_req_send(struct DataReqFanIn *fanin)
+{
+   struct IPC_OpaqueStructArr resp;
    struct IPC_PopulatorError err;
+   struct IPC_Command cmd;
+   struct DataReqParams *slot;
+   char *temp;
+   int i;
 
-   if (!arg || !data)
+   fanin->responded = 1;
+   memset(&cmd, 0, sizeof(cmd));
+   cmd.ipcref = fanin->ipcref;
+
+   if (fanin->direct) {
+      slot = &fanin->slots[0];
+      if (!slot->done)
+         IPC_error(fanin->proc, &cmd, IPC_RESULTCODE_TIMEOUT, &fanin->from);
+      else if (slot->error != IPC_RESULTCODE_SUCCESS)
+         IPC_error(fanin->proc, &cmd, slot->error, &fanin->from);
+      else if (slot->enc.data)
+         IPC_response_encoded(fanin->proc, &cmd, slot->enc.data,
+               slot->enc.length, &fanin->from);
+      else
+         IPC_response(fanin->proc, &cmd, IPC_TYPES_VOID, NULL, &fanin->from);
       return;
-   params = (struct DataReqParams*)arg;
-   if (!params->dest)
+   }
+
+   resp.length = 0;
+   resp.structs = malloc(sizeof(struct IPC_OpaqueStruct) * (fanin->count + 1));
+   // Marks entries of resp.structs that were encoded here and must be freed
+   temp = calloc(fanin->count + 1, 1);
+   if (!resp.structs || !temp) {
+      free(resp.structs);
+      free(temp);
+      IPC_error(fanin->proc, &cmd, IPC_RESULTCODE_ALLOCATION_ERR, &fanin->from);
       return;
+   }
+
+   for (i = 0; i < fanin->count; i++) {
+      slot = &fanin->slots[i];
+      if (slot->done && slot->error == IPC_RESULTCODE_SUCCESS) {
+         if (slot->enc.data)
+            resp.structs[resp.length++] = slot->enc;
+         continue;
+      }
+
+      err.type = slot->type;
+      err.error = slot->done ? slot->error : IPC_RESULTCODE_TIMEOUT;
+      resp.structs[resp.length] = CMD_struct_to_opaque_struct(&err,
+            IPC_TYPES_POPULATOR_ERROR);
+      if (resp.structs[resp.length].data)
+         temp[resp.length++] = 1;
+   }
+
+   IPC_response(fanin->proc, &cmd, IPC_TYPES_OPAQUE_STRUCT_ARR, &resp,
+         &fanin->from);
+
+   for (i = 0; i < resp.length; i++)
+      if (temp[i])
+         free(resp.structs[i].data);
+   free(resp.structs);
+   free(temp);
+}
+
+static size_t data_req_hash_func(void *key)
+{
+   return (size_t)(uintptr_t)key;
+}
+
+static void *data_req_key_for_data(void *data)
+{
+   return (void*)((struct DataReqFanIn*)data)->id;
+}
+
+static int data_req_cmp_key(void *key1, void *key2)
+{
+   return key1 == key2;
+}
+
+// Gives the fan-in an id populators can call back with
+static int data_req_register(struct DataReqFanIn *fanin)
+{
+   int res = -1;
+
+   pthread_mutex_lock(&dataReqLock);
+   if (!dataReqs)
+      dataReqs = HASH_create_table(DATA_REQ_HASH_SIZE, &data_req_hash_func,
+            &data_req_cmp_key, &data_req_key_for_data);
+   if (dataReqs) {
+      // Ids are never 0 and skip any still in use after wrapping
+      do {
+         dataReqNextId = (dataReqNextId + 1) &
+               (UINTPTR_MAX >> DATA_REQ_SLOT_BITS);
+      } while (!dataReqNextId ||
+            HASH_find_key(dataReqs, (void*)dataReqNextId));
+      fanin->id = dataReqNextId;
+      res = HASH_add_data(dataReqs, fanin);
+   }
+   pthread_mutex_unlock(&dataReqLock);
+
+   if (res >= 0 && fanin->cmds) {
+      fanin->next = fanin->cmds->dataReqs;
+      fanin->cmds->dataReqs = fanin;
+   }
+
+   return res;
+}
+
+// Finds the slot a populator callback argument refers to.  Called with
+//  dataReqLock held.
+static struct DataReqParams *data_req_slot_find(void *arg)
+{
+   uintptr_t key = (uintptr_t)arg;
+   struct DataReqFanIn *fanin = NULL;
+   uintptr_t idx = key & ((1 << DATA_REQ_SLOT_BITS) - 1);
+
+   if (dataReqs)
+      fanin = HASH_find_key(dataReqs, (void*)(key >> DATA_REQ_SLOT_BITS));
+   if (!fanin || idx >= (uintptr_t)fanin->count)
+      return NULL;
+
+   return &fanin->slots[idx];
+}
 
-   if (params->direct_resp) {
-      if (error != IPC_RESULTCODE_SUCCESS)
-         IPC_error(params->proc, params->cmd, error, params->from);
+static void data_req_free(struct DataReqFanIn *fanin)
+{
+   struct DataReqParams *slot;
+   int i;
+
+   for (i = 0; i < fanin->count; i++) {
+      slot = &fanin->slots[i];
+      data_snapshot_leave(slot);
+      if (slot->blob)
+         data_snapshot_blob_unref(slot->blob);
       else
-         IPC_response(params->proc, params->cmd, params->type,
-               data, params->from);
+         free(slot->enc.data);
    }
-   else {
-      if (error != IPC_RESULTCODE_SUCCESS) {
-         err.type = params->type;
-         err.error = error;
-         *params->dest = CMD_struct_to_opaque_struct(&err,
-               IPC_TYPES_POPULATOR_ERROR);
+   free(fanin);
+}
+
+/* Responds, if that hasn't happened yet, and frees the fan-in.  Populators
+ * that haven't called back are reported as timed out, and their callbacks
+ * are ignored from here on.
+ */
+static void data_req_finish(struct DataReqFanIn *fanin)
+{
+   struct DataReqFanIn **itr;
+
+   pthread_mutex_lock(&dataReqLock);
+   if (fanin->id)
+      HASH_remove_data(dataReqs, fanin);
+   pthread_mutex_unlock(&dataReqLock);
+
+   for (itr = fanin->cmds ? &fanin->cmds->dataReqs : NULL; itr && *itr;
+         itr = &(*itr)->next)
+      if (*itr == fanin) {
+         *itr = fanin->next;
+         break;
       }
+
+   if (fanin->deadlineEvt) {
+      EVT_sched_remove(fanin->evt, fanin->deadlineEvt);
+      fanin->deadlineEvt = NULL;
+   }
+   if (!fanin->responded) {
+      fanin->responded = 1;
+      if (fanin->complete)
+         fanin->complete(fanin);
       else
-         *params->dest = CMD_struct_to_opaque_struct(data, params->type);
+         data_req_send(fanin);
+   }
+   data_req_free(fanin);
+}
+
+static int data_req_deadline_cb(void *arg)
+{
+   struct DataReqFanIn *fanin = (struct DataReqFanIn*)arg;
+
+   fanin->deadlineEvt = NULL;
+   if (!fanin->complete)
+      DBG_print(DBG_LEVEL_WARN, "DATA_REQ deadline passed with %d "
+            "populator(s) outstanding\n", fanin->pending);
+   data_req_finish(fanin);
+
+   return EVENT_REMOVE;
+}
+
+// Drops one reference to the fan-in, finishing it on the last
+static void data_req_release(struct DataReqFanIn *fanin)
+{
+   if (--fanin->pending > 0)
+      return;
+
+   data_req_finish(fanin);
+}
+
+/* Hands a leader's result to the misses waiting on it.  A result that
+ * couldn't be kept as a snapshot is reported to them as an allocation
+ * error.
+ */
+static void data_snapshot_wake(struct DataReqParams *leader,
+      struct DataSnapshotBlob *blob)
+{
+   struct DataSnapshot *snap = leader->snap;
+   struct DataReqParams *waiter, *next;
+
+   data_snapshot_leave(leader);
+   next = snap->waiters;
+   snap->waiters = NULL;
+
+   while ((waiter = next)) {
+      next = waiter->nextWaiter;
+      waiter->nextWaiter = NULL;
+      waiter->snap = NULL;
+      waiter->delivered = waiter->done = 1;
+      waiter->error = leader->error;
+      if (leader->error == IPC_RESULTCODE_SUCCESS && leader->enc.data) {
+         if (blob) {
+            waiter->blob = blob;
+            blob->refs++;
+            waiter->enc.data = blob->data;
+            waiter->enc.length = blob->length;
+         }
+         else
+            waiter->error = IPC_RESULTCODE_ALLOCATION_ERR;
+      }
+      data_req_release(waiter->fanin);
+   }
+}
+
+// Runs on the event loop once a populator has delivered its result
+static void data_req_slot_done(struct DataReqParams *slot)
+{
+   struct DataReqFanIn *fanin = slot->fanin;
+   struct DataSnapshotBlob *blob = NULL;
+
+   slot->done = 1;
+   if (slot->error == IPC_RESULTCODE_SUCCESS && slot->enc.data &&
+         XDR_populator_max_age(slot->type))
+      blob = data_snapshot_store(fanin->cmds, slot->type, &slot->enc);
+   if (slot->snap)
+      data_snapshot_wake(slot, blob);
+
+   data_req_release(fanin);
+}
+
+// Runs a result posted by a populator on another thread.  The fan-in may
+//  have finished while the post was queued.
+static void data_req_slot_posted(void *arg, void *msg, size_t len)
+{
+   struct DataReqParams *slot;
+   void *key;
+
+   memcpy(&key, msg, sizeof(key));
+   pthread_mutex_lock(&dataReqLock);
+   slot = data_req_slot_find(key);
+   pthread_mutex_unlock(&dataReqLock);
+
+   // Only this thread frees fan-ins, so the slot stays valid
+   if (slot && !slot->done)
+      data_req_slot_done(slot);
+}
+
+void data_req_populate_cb(void *data, void *arg, uint32_t error)
+{
+   struct DataReqParams *slot;
+   struct IPC_PopulatorError err;
+
+   pthread_mutex_lock(&dataReqLock);
+   slot = data_req_slot_find(arg);
+   if (!slot) {
+      pthread_mutex_unlock(&dataReqLock);
+      DBG_print(DBG_LEVEL_INFO, "Ignoring populator result for a finished "
+            "DATA_REQ\n");
+      return;
+   }
+   if (slot->delivered) {
+      pthread_mutex_unlock(&dataReqLock);
+      DBG_print(DBG_LEVEL_WARN, "Populator for type 0x%x called back twice\n",
+            slot->type);
+      return;
+   }
+
+   // Encode now; the populator's data is only valid during this call
+   slot->delivered = 1;
+   slot->error = error;
+   if (error == IPC_RESULTCODE_SUCCESS && data)
+      slot->enc = CMD_struct_to_opaque_struct(data, slot->type);
+   else if (error != IPC_RESULTCODE_SUCCESS && !slot->fanin->direct) {
+      err.type = slot->type;
+      err.error = error;
+      slot->enc = CMD_struct_to_opaque_struct(&err,
+            IPC_TYPES_POPULATOR_ERROR);
    }
+
+   // Populators that finish on another thread hand the result to the loop.
+   //  Posting under the lock keeps the loop from being freed meanwhile.
+   if (!pthread_equal(pthread_self(), slot->fanin->loopThread)) {
+      struct iovec iov = { &arg, sizeof(arg) };
+
+      if (EVT_post_msg(slot->fanin->evt, &data_req_slot_posted, NULL,
+               &iov, 1) < 0)
+         DBG_print(DBG_LEVEL_WARN, "Failed to post DATA_REQ result\n");
+      pthread_mutex_unlock(&dataReqLock);
+      return;
+   }
+   pthread_mutex_unlock(&dataReqLock);
+
+   data_req_slot_done(slot);
+}
+
+// Allocates a fan-in with room for count populators
+static struct DataReqFanIn *data_req_alloc(struct CommandCbArg *cmds,
+      struct ProcessData *proc, int count)
+{
+   struct DataReqFanIn *fanin;
+
+   fanin = malloc(sizeof(*fanin) + sizeof(fanin->slots[0]) * count);
+   if (!fanin)
+      return NULL;
+   memset(fanin, 0, sizeof(*fanin) + sizeof(fanin->slots[0]) * count);
+   fanin->cmds = cmds;
+   fanin->proc = proc;
+   fanin->evt = PROC_evt(proc);
+   fanin->loopThread = pthread_self();
+
+   return fanin;
+}
+
+/* Registers a fan-in whose slots are filled in and starts its populators.
+ * It finishes once they all report or deadlineMs passes; with no deadline,
+ * only the populators that finish before returning are reported.
+ * @return 0 on success, -1 if the fan-in couldn't be registered, in which
+ *          case it is freed without finishing
+ */
+static int data_req_start(struct DataReqFanIn *fanin, unsigned int deadlineMs,
+      int useSnapshots)
+{
+   struct XDR_StructDefinition *def;
+   struct DataReqParams *slot;
+   int i;
+
+   // One reference is held until every populator has been started
+   fanin->pending = fanin->count + 1;
+
+   if (data_req_register(fanin) < 0) {
+      data_req_free(fanin);
+      return -1;
+   }
+
+   for (i = 0; i < fanin->count; i++) {
+      slot = &fanin->slots[i];
+      def = XDR_definition_for_type(slot->type);
+      if (useSnapshots && fanin->cmds &&
+            XDR_populator_max_age(slot->type)) {
+         if (data_snapshot_lookup(fanin->cmds, def, slot)) {
+            slot->delivered = 1;
+            fanin->pending--;
+            continue;
+         }
+         // Released when the populate it waits on finishes
+         if (data_snapshot_join(fanin->cmds, slot))
+            continue;
+      }
+      def->populate(def->populate_arg, &data_req_populate_cb,
+            (void*)(fanin->id << DATA_REQ_SLOT_BITS | i));
+   }
+
+   if (--fanin->pending > 0) {
+      if (deadlineMs)
+         fanin->deadlineEvt = EVT_sched_add(fanin->evt, EVT_ms2tv(deadlineMs),
+               &data_req_deadline_cb, fanin);
+      if (fanin->deadlineEvt)
+         return 0;
+   }
+
+   data_req_finish(fanin);
+   return 0;
 }
 
 void cmd_handle_data_req(struct ProcessData *proc, struct IPC_Command *cmd,
       struct sockaddr_in *from, void *arg, int fd)
 {
+   struct CommandCbArg *cmds = (struct CommandCbArg*)arg;
    struct IPC_DataReq *req;
-   int i;
-   struct IPC_OpaqueStructArr resp;
    struct XDR_StructDefinition *def = NULL;
-   struct DataReqParams params;
+   struct DataReqFanIn *fanin;
+   int i;
 
    if (cmd->parameters.type != IPC_TYPES_DATAREQ) {
       IPC_error(proc, cmd, IPC_RESULTCODE_INCORRECT_PARAMETER_TYPE, from);
@@ -164,72 +852,454 @@ void cmd_handle_data_req(struct ProcessData *proc, struct IPC_Command *cmd,
    }
 
    req = (struct IPC_DataReq*)cmd->parameters.data;
-   if (!req || !req->reqs || req->length <= 0 || req->length > 1024) {
+   if (!req || !req->reqs || req->length <= 0 ||
+         req->length > DATA_REQ_MAX_TYPES) {
       IPC_response(proc, cmd, IPC_TYPES_VOID, NULL, from);
       return;
    }
 
-   params.proc = proc;
-   params.cmd = cmd;
-   params.from = from;
-   params.direct_resp = 0;
-   resp.structs = malloc(sizeof(struct IPC_OpaqueStruct) * req->length);
-   if (!resp.structs)
+   fanin = data_req_alloc(cmds, proc, req->length);
+   if (!fanin) {
       IPC_error(proc, cmd, IPC_RESULTCODE_ALLOCATION_ERR, from);
-   memset(resp.structs, 0,  sizeof(struct IPC_OpaqueStruct) * req->length);
-   resp.length = 0;
+      return;
+   }
+   fanin->ipcref = cmd->ipcref;
+   fanin->from = *from;
 
-   for (i = 0; req && i < req->length && req->reqs; i++) {
+   // Claim every slot before starting any populator
+   for (i = 0; i < req->length; i++) {
       def = XDR_definition_for_type(req->reqs[i]);
       if (!def || !def->populate)
          continue;
+      fanin->slots[fanin->count].fanin = fanin;
+      fanin->slots[fanin->count++].type = req->reqs[i];
+   }
+   fanin->direct = (1 == req->length && 1 == fanin->count);
 
-      if (0 == i && 1 == req->length)
-         params.direct_resp = 1;
+   if (data_req_start(fanin, cmds ? cmds->dataReqDeadlineMs : 0, 1) < 0)
+      IPC_error(proc, cmd, IPC_RESULTCODE_ALLOCATION_ERR, from);
+}
 
-      params.dest = &resp.structs[resp.length];
-      params.type = req->reqs[i];
-      def->populate(def->populate_arg, &data_req_populate_cb, &params);
-      if (resp.structs[resp.length].data)
-         resp.length++;
+int cmd_set_data_req_deadline(struct CommandCbArg *cmds, unsigned int ms)
+{
+   if (!cmds)
+      return -1;
+
+   cmds->dataReqDeadlineMs = ms;
+
+   return 0;
+}
+
+static void telemetry_pub_free(struct TelemetryPub *pub)
+{
+   // Drop a populate still in progress; its callback will be ignored
+   if (pub->run) {
+      pub->run->responded = 1;
+      data_req_finish(pub->run);
    }
+   free(pub->last.data);
+   free(pub);
+}
 
-   if (!params.direct_resp)
-      IPC_response(proc, cmd, IPC_TYPES_OPAQUE_STRUCT_ARR, &resp, from);
+// Sends an encoded union to the process's multicast group as a TELEMETRY
+//  command.  The union is copied straight into the datagram.
+static void telemetry_pub_send(struct TelemetryPub *pub,
+      struct IPC_OpaqueStruct *enc)
+{
+   struct ProcessData *proc = pub->cmds->proc;
+   uint16_t port = socket_multicast_port_by_name(proc->name);
+   struct sockaddr_in addr;
+   uint32_t hdr[2];
+   char *buff;
+   size_t len = 0, used, max;
+   int i;
 
-   for (i = 0; req && i < req->length && req->reqs; i++)
-      if (resp.structs[i].data)
-         free(resp.structs[i].data);
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_addr = socket_multicast_addr_by_name(proc->name);
+   if (!port || !addr.sin_addr.s_addr)
+      return;
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons(port);
+
+   hdr[0] = IPC_CMDS_TELEMETRY;
+   hdr[1] = pub->seq++;
+   max = sizeof(hdr) + enc->length;
+   buff = proc_tx_reserve(proc, max);
+   if (!buff)
+      return;
+   for (i = 0; i < 2; i++) {
+      if (XDR_encode_uint32(&hdr[i], buff + len, &used, max - len, NULL) < 0)
+         return;
+      len += used;
+   }
+   memcpy(buff + len, enc->data, enc->length);
 
-   free(resp.structs);
+   proc_tx_commit(proc, proc->cmdFd, len + enc->length, &addr);
+}
+
+/* Runs on the event loop once the populator has delivered its result or
+ * missed its deadline.  Published values are stored as DATA_REQ snapshots
+ * on the way in, just like populates for DATA_REQ.
+ */
+static void telemetry_pub_done(struct DataReqFanIn *fanin)
+{
+   struct TelemetryPub *pub = (struct TelemetryPub*)fanin->completeArg;
+   struct DataReqParams *slot = &fanin->slots[0];
+
+   pub->run = NULL;
+   if (!slot->done) {
+      DBG_print(DBG_LEVEL_WARN, "Telemetry populator for type 0x%x missed "
+            "its deadline\n", pub->type);
+      return;
+   }
+   if (slot->error != IPC_RESULTCODE_SUCCESS || !slot->enc.data)
+      return;
+
+   if (pub->force || !(pub->flags & CMD_PUBLISH_ON_CHANGE) ||
+         pub->last.length != slot->enc.length ||
+         memcmp(pub->last.data, slot->enc.data, slot->enc.length))
+      telemetry_pub_send(pub, &slot->enc);
+
+   free(pub->last.data);
+   pub->last = slot->enc;
+   slot->enc.data = NULL;
+   slot->enc.length = 0;
+}
+
+static void telemetry_pub_run(struct TelemetryPub *pub, int force)
+{
+   struct XDR_StructDefinition *def = XDR_definition_for_type(pub->type);
+   struct DataReqFanIn *fanin;
+
+   if (!def || !def->populate)
+      return;
+
+   // A populator still working on the last run covers this one as well
+   if (pub->run) {
+      pub->force |= force;
+      return;
+   }
+
+   fanin = data_req_alloc(pub->cmds, pub->cmds->proc, 1);
+   if (!fanin)
+      return;
+   fanin->direct = 1;
+   fanin->complete = &telemetry_pub_done;
+   fanin->completeArg = pub;
+   fanin->slots[0].fanin = fanin;
+   fanin->slots[0].type = pub->type;
+   fanin->count = 1;
+
+   // A run that outlasts the period would only hold up the next one, so
+   //  the period doubles as the deadline
+   pub->force = force;
+   pub->run = fanin;
+   if (data_req_start(fanin, pub->periodMs ? pub->periodMs :
+            CMD_DEFAULT_DATA_REQ_DEADLINE_MS, 0) < 0)
+      pub->run = NULL;
+}
+
+static int telemetry_pub_timer_cb(void *arg)
+{
+   telemetry_pub_run((struct TelemetryPub*)arg, 0);
+
+   return EVENT_KEEP;
+}
+
+static struct TelemetryPub *telemetry_pub_find(struct CommandCbArg *cmds,
+      uint32_t type)
+{
+   struct TelemetryPub *pub;
+
+   for (pub = cmds->pubs; pub; pub = pub->next)
+      if (pub->type == type)
+         return pub;
+
+   return NULL;
+}
+
+int cmd_publish_telemetry(struct CommandCbArg *cmds, uint32_t type,
+      unsigned int periodMs, uint32_t flags)
+{
+   struct XDR_StructDefinition *def = XDR_definition_for_type(type);
+   struct TelemetryPub *pub;
+
+   if (!cmds || !def || !def->populate)
+      return -1;
+
+   pub = telemetry_pub_find(cmds, type);
+   if (!pub) {
+      pub = malloc(sizeof(*pub));
+      if (!pub)
+         return -1;
+      memset(pub, 0, sizeof(*pub));
+      pub->cmds = cmds;
+      pub->evt = PROC_evt(cmds->proc);
+      pub->type = type;
+      pub->next = cmds->pubs;
+      cmds->pubs = pub;
+   }
+   else if (pub->timer) {
+      EVT_sched_remove(pub->evt, pub->timer);
+      pub->timer = NULL;
+   }
+
+   pub->flags = flags;
+   pub->periodMs = periodMs;
+   if (periodMs)
+      pub->timer = EVT_sched_add(pub->evt, EVT_ms2tv(periodMs),
+            &telemetry_pub_timer_cb, pub);
+
+   return 0;
+}
+
+int cmd_publish_telemetry_now(struct CommandCbArg *cmds, uint32_t type)
+{
+   struct TelemetryPub *pub;
+
+   if (!cmds || !(pub = telemetry_pub_find(cmds, type)))
+      return -1;
+
+   telemetry_pub_run(pub, 1);
+
+   return 0;
+}
+
+int cmd_unpublish_telemetry(struct CommandCbArg *cmds, uint32_t type)
+{
+   struct TelemetryPub **itr, *pub;
+
+   if (!cmds)
+      return -1;
+
+   for (itr = &cmds->pubs; *itr; itr = &(*itr)->next)
+      if ((*itr)->type == type)
+         break;
+   if (!(pub = *itr))
+      return -1;
+   *itr = pub->next;
+
+   if (pub->timer)
+      EVT_sched_remove(pub->evt, pub->timer);
+   telemetry_pub_free(pub);
+
+   return 0;
+}
+
+static void cmd_rx_batch_free(struct CMDRxBatch *rx)
+{
+   free(rx->buffers);
+   free(rx->src);
+   free(rx->lens);
+   rx->buffers = NULL;
+   rx->src = NULL;
+   rx->lens = NULL;
+#ifdef __linux__
+   free(rx->msgs);
+   free(rx->iov);
+   rx->msgs = NULL;
+   rx->iov = NULL;
+#endif
+   rx->alloced = 0;
+}
+
+// (Re)allocates the receive ring so it holds cnt datagrams
+static int cmd_rx_batch_alloc(struct CMDRxBatch *rx, unsigned int cnt)
+{
+   unsigned int i;
+
+   if (rx->alloced == cnt && rx->buffers)
+      return 0;
+
+   cmd_rx_batch_free(rx);
+   rx->buffers = malloc((size_t)cnt * MAX_IP_PACKET_SIZE);
+   rx->src = calloc(cnt, sizeof(*rx->src));
+   rx->lens = calloc(cnt, sizeof(*rx->lens));
+#ifdef __linux__
+   rx->msgs = calloc(cnt, sizeof(*rx->msgs));
+   rx->iov = calloc(cnt, sizeof(*rx->iov));
+   if (!rx->msgs || !rx->iov) {
+      cmd_rx_batch_free(rx);
+      return -1;
+   }
+#endif
+   if (!rx->buffers || !rx->src || !rx->lens) {
+      cmd_rx_batch_free(rx);
+      return -1;
+   }
+
+#ifdef __linux__
+   for (i = 0; i < cnt; i++) {
+      rx->iov[i].iov_base = rx->buffers + (size_t)i * MAX_IP_PACKET_SIZE;
+      rx->iov[i].iov_len = MAX_IP_PACKET_SIZE;
+      rx->msgs[i].msg_hdr.msg_name = &rx->src[i];
+      rx->msgs[i].msg_hdr.msg_iov = &rx->iov[i];
+      rx->msgs[i].msg_hdr.msg_iovlen = 1;
+   }
+#else
+   (void)i;
+#endif
+   rx->alloced = cnt;
+
+   return 0;
+}
+
+/* Reads up to rx->size datagrams from the socket into the receive ring.
+ * The event loop only calls this once the socket is readable, so the first
+ * datagram is always available and the rest are collected without blocking.
+ *
+ * The ring starts with a single slot and doubles, up to rx->size, each time
+ * a wakeup fills it, so sockets that never see bursts never pay for a batch.
+ *
+ * @return The number of datagrams read
+ */
+static int cmd_rx_batch_read(int socket, struct CMDRxBatch *rx)
+{
+   int cnt = 0;
+#ifdef __linux__
+   int i;
+#endif
+
+   if (!rx->size)
+      rx->size = CMD_DEFAULT_RX_BATCH;
+   if (!rx->want)
+      rx->want = 1;
+   else if (rx->want > rx->size)
+      rx->want = rx->size;
+   if (cmd_rx_batch_alloc(rx, rx->want) < 0)
+      return 0;
+
+#ifdef __linux__
+   if (rx->alloced > 1) {
+      for (i = 0; i < rx->alloced; i++)
+         rx->msgs[i].msg_hdr.msg_namelen = sizeof(rx->src[i]);
+
+      cnt = recvmmsg(socket, rx->msgs, rx->alloced, MSG_DONTWAIT, NULL);
+      if (cnt < 0) {
+         if (errno != EAGAIN && errno != EWOULDBLOCK)
+            ERR_REPORT(DBG_LEVEL_WARN, "recvmmsg failed on fd %d\n", socket);
+         return 0;
+      }
+
+      for (i = 0; i < cnt; i++)
+         rx->lens[i] = rx->msgs[i].msg_len;
+   }
+   else
+#endif
+   if ((rx->lens[0] = socket_read(socket, rx->buffers, MAX_IP_PACKET_SIZE,
+               &rx->src[0])) >= 0)
+      cnt = 1;
+
+   // The buffers are still in use, so a full ring grows on the next read
+   if (cnt == (int)rx->alloced && rx->alloced < rx->size)
+      rx->want = rx->alloced * 2 > rx->size ? rx->size : rx->alloced * 2;
+
+   return cnt;
+}
+
+// Updates the heartbeat receive counters after draining a socket
+static void cmd_rx_batch_account(struct CommandCbArg *cmds, int cnt)
+{
+   if (cnt <= 0)
+      return;
+
+   cmds->beatsExt.rx_wakeups++;
+   if (cnt > cmds->beatsExt.rx_batch_max)
+      cmds->beatsExt.rx_batch_max = cnt;
+}
+
+int cmd_set_rx_batch_size(struct CommandCbArg *cmds, unsigned int size)
+{
+   if (!cmds || !size || size > CMD_MAX_RX_BATCH)
+      return -1;
+
+   // The ring is resized on the next read, outside of any packet handler
+   cmds->rx.size = size;
+
+   return 0;
+}
+
+// Decodes a TELEMETRY command and hands its structure to the subscribers
+//  for its type
+static void mcast_dispatch_telemetry(struct McastCommandState *state,
+      unsigned char *data, size_t dataLen, struct sockaddr_in *src)
+{
+   struct MemArena **arena = &state->owner->decodeArena;
+   struct MemArena *prev_arena;
+   struct TelemetrySub *sub, *next;
+   struct IPC_Command xdr_cmd;
+   size_t used = 0;
+   int res;
+
+   if (!*arena)
+      *arena = MPOOL_arena_create(DECODE_ARENA_CHUNK);
+   prev_arena = XDR_set_decode_arena(*arena);
+   res = IPC_Command_decode((char*)data, &xdr_cmd, &used, dataLen, NULL);
+   XDR_set_decode_arena(prev_arena);
+
+   if (res < 0)
+      DBG_print(DBG_LEVEL_WARN, "Failed to decode telemetry of "
+            "length %lu\n", dataLen);
+   else {
+      for (sub = state->subs; sub; sub = next) {
+         next = sub->next;
+         if (!sub->type || sub->type == xdr_cmd.parameters.type)
+            sub->callback(sub->callbackParam, xdr_cmd.parameters.type,
+                  xdr_cmd.parameters.data, src);
+      }
+   }
+
+   if (*arena)
+      MPOOL_arena_reset(*arena);
+   else if (res >= 0)
+      XDR_free_union(&xdr_cmd.parameters);
 }
 
 static int multicast_cmd_handler_cb(int socket, char type, void * arg)
 {
-   unsigned char data[MAX_IP_PACKET_SIZE];
+   unsigned char *data;
    struct MulticastCommand *cmd = NULL;
    struct McastCommandState *state = (struct McastCommandState*)arg;
-   size_t dataLen;
-   struct sockaddr_in src;
-   data[0] = 0;
+   struct CMDRxBatch *rx;
+   int dataLen, cnt, i, telemetry;
+   uint32_t cmdNum;
+   size_t used;
 
    if (!state)
       return EVENT_KEEP;
 
    // should only be read events, but make sure
    if (type == EVENT_FD_READ) {
-      // read from the socket to get the command and its data
-      dataLen = socket_read(socket, data, MAX_IP_PACKET_SIZE, &src);
+      // read from the socket to get the commands and their data
+      rx = &state->owner->rx;
+      cnt = cmd_rx_batch_read(socket, rx);
+      cmd_rx_batch_account(state->owner, cnt);
+
+      for (i = 0; i < cnt; i++) {
+         data = rx->buffers + (size_t)i * MAX_IP_PACKET_SIZE;
+         dataLen = rx->lens[i];
+
+         // make sure something was actually read
+         if (dataLen <= 0)
+            continue;
 
-      // make sure something was actually read
-      if (dataLen > 0) {
          DBG_print(DBG_LEVEL_INFO, "MCast Received command 0x%02x", *data);
 
+         // Published telemetry goes only to its subscribers, since
+         //  wildcard handlers predate it and don't expect to see it
+         used = 0;
+         telemetry = *data == 0 &&
+            XDR_decode_uint32((char*)data, &cmdNum, &used, dataLen, NULL) >= 0
+            && cmdNum == IPC_CMDS_TELEMETRY;
+
          for (cmd = state->cmds; cmd; cmd = cmd->next) {
-            if (cmd->cmdNum < 0 || cmd->cmdNum == *data)
+            if (cmd->cmdNum == *data || (cmd->cmdNum < 0 && !telemetry))
                cmd->callback(cmd->callbackParam, socket, *data, &data[1],
-                  dataLen - 1, &src);
+                  dataLen - 1, &rx->src[i]);
          }
+
+         if (telemetry && state->subs)
+            mcast_dispatch_telemetry(state, data, dataLen, &rx->src[i]);
       }
    }
 
@@ -248,20 +1318,20 @@ static struct McastCommandState *find_mcast_state(struct CommandCbArg *st,
 
     return NULL;
 }
-
-//look here to subscribe to multicasts
-void cmd_set_multicast_handler(struct CommandCbArg *st,
-   struct EventState *evt_loop, const char *service, int cmdNum,
-   MCAST_handler_t handler, void *arg)
+
+//look here to subscribe to multicasts
+// Finds the listener for a service's multicast group, joining the group if
+//  this is its first handler
+static struct McastCommandState *mcast_state_join(struct CommandCbArg *st,
+   struct EventState *evt_loop, const char *service)
 {
-   struct MulticastCommand *cmd;
    struct in_addr addr = socket_multicast_addr_by_name(service);
    uint16_t port = socket_multicast_port_by_name(service);
    struct McastCommandState *state;
    struct ip_mreq mreq;
 
    if (!addr.s_addr || !port)
-      return;
+      return NULL;
 
    state = find_mcast_state(st, addr, port);
    if (!state) {
@@ -270,10 +1340,11 @@ void cmd_set_multicast_handler(struct CommandCbArg *st,
 
       state->srcAddr = addr;
       state->port = htons(port);
+      state->owner = st;
       state->fd = socket_init(port);
       if (state->fd <= 0) {
          free(state);
-         return;
+         return NULL;
       }
 
       // Join multicast group
@@ -286,7 +1357,9 @@ void cmd_set_multicast_handler(struct CommandCbArg *st,
 		 sizeof(struct ip_mreq)) == -1) {
          ERR_REPORT(DBG_LEVEL_WARN, "Failed to join multicast group for %s\n",
             service);
-         return;
+         close(state->fd);
+         free(state);
+         return NULL;
       }
 
       EVT_fd_add(evt_loop, state->fd, EVENT_FD_READ, multicast_cmd_handler_cb,
@@ -296,6 +1369,20 @@ void cmd_set_multicast_handler(struct CommandCbArg *st,
       st->mcast = state;
    }
 
+   return state;
+}
+
+void cmd_set_multicast_handler(struct CommandCbArg *st,
+   struct EventState *evt_loop, const char *service, int cmdNum,
+   MCAST_handler_t handler, void *arg)
+{
+   struct MulticastCommand *cmd;
+   struct McastCommandState *state;
+
+   state = mcast_state_join(st, evt_loop, service);
+   if (!state)
+      return;
+
    cmd = (struct MulticastCommand*)malloc(sizeof(*cmd));
    memset(cmd, 0, sizeof(*cmd));
 
@@ -307,12 +1394,39 @@ void cmd_set_multicast_handler(struct CommandCbArg *st,
    state->cmds = cmd;
 }
 
+// Leaves the multicast group once nothing is listening to it any more
+static void mcast_state_release(struct CommandCbArg *st,
+   struct McastCommandState *state, struct EventState *evt_loop)
+{
+   struct McastCommandState **st_itr;
+   struct ip_mreq mreq;
+
+   if (state->cmds || state->subs)
+      return;
+
+   if (state->fd > 0) {
+      EVT_fd_remove(evt_loop, state->fd, EVENT_FD_READ);
+
+      mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+      mreq.imr_multiaddr.s_addr = state->srcAddr.s_addr;
+      setsockopt(state->fd, IPPROTO_IP, IP_DROP_MEMBERSHIP, &mreq,
+                                sizeof(struct ip_mreq));
+      close(state->fd);
+   }
+
+   for (st_itr = &st->mcast; *st_itr; st_itr = &(*st_itr)->next)
+      if (*st_itr == state) {
+         *st_itr = state->next;
+         break;
+      }
+   free(state);
+}
+
 void cmd_remove_multicast_handler(struct CommandCbArg *st,
    const char *service, int cmdNum, struct EventState *evt_loop)
 {
    struct MulticastCommand **itr, *cmd;
-   struct McastCommandState **st_itr, *state;
-   struct ip_mreq mreq;
+   struct McastCommandState *state;
    struct in_addr addr = socket_multicast_addr_by_name(service);
    uint16_t port = socket_multicast_port_by_name(service);
 
@@ -334,41 +1448,95 @@ void cmd_remove_multicast_handler(struct CommandCbArg *st,
    }
 
    // Clean up the socket if there are no more commands registered
-   if (!state->cmds) {
-      if (state->fd > 0) {
-         EVT_fd_remove(evt_loop, state->fd, EVENT_FD_READ);
+   mcast_state_release(st, state, evt_loop);
+}
 
-         mreq.imr_interface.s_addr = htonl(INADDR_ANY);
-         mreq.imr_multiaddr.s_addr = addr.s_addr;
-         setsockopt(state->fd, IPPROTO_IP, IP_DROP_MEMBERSHIP, &mreq,
-	                             sizeof(struct ip_mreq));
-         close(state->fd);
-      }
-      state->fd = 0;
+int cmd_subscribe_telemetry(struct CommandCbArg *st,
+   struct EventState *evt_loop, const char *service, uint32_t type,
+   MCAST_telemetry_handler_t handler, void *arg)
+{
+   struct TelemetrySub *sub;
+   struct McastCommandState *state;
 
-      for (st_itr = &st->mcast; st_itr && *st_itr; ) {
-         state = *st_itr;
-         if (!state->fd) {
-            *st_itr = state->next;
-            free(state);
-         }
-         else
-            st_itr = &state->next;
+   if (!handler)
+      return -1;
+
+   state = mcast_state_join(st, evt_loop, service);
+   if (!state)
+      return -1;
+
+   sub = (struct TelemetrySub*)malloc(sizeof(*sub));
+   if (!sub) {
+      mcast_state_release(st, state, evt_loop);
+      return -1;
+   }
+   memset(sub, 0, sizeof(*sub));
+
+   sub->type = type;
+   sub->callback = handler;
+   sub->callbackParam = arg;
+
+   sub->next = state->subs;
+   state->subs = sub;
+
+   return 0;
+}
+
+int cmd_unsubscribe_telemetry(struct CommandCbArg *st,
+   const char *service, uint32_t type, struct EventState *evt_loop)
+{
+   struct TelemetrySub **itr, *sub;
+   struct McastCommandState *state;
+   struct in_addr addr = socket_multicast_addr_by_name(service);
+   uint16_t port = socket_multicast_port_by_name(service);
+   int found = 0;
+
+   state = find_mcast_state(st, addr, port);
+   if (!state)
+      return -1;
+
+   for (itr = &state->subs; *itr; ) {
+      sub = *itr;
+      if (sub->type == type) {
+         *itr = sub->next;
+         free(sub);
+         found = 1;
+         continue;
       }
+
+      itr = &sub->next;
    }
+
+   mcast_state_release(st, state, evt_loop);
+
+   return found ? 0 : -1;
 }
 
 void cmd_cleanup_cb_state(struct CommandCbArg *st, struct EventState *evt_loop)
 {
    struct McastCommandState *state;
    struct MulticastCommand *cmd;
+   struct TelemetrySub *sub;
    struct ip_mreq mreq;
 
+   while (st->pubs)
+      cmd_unpublish_telemetry(st, st->pubs->type);
+
+   // The response path is already gone, so outstanding DATA_REQs go quietly
+   while (st->dataReqs) {
+      st->dataReqs->responded = 1;
+      data_req_finish(st->dataReqs);
+   }
+
    while ((state = st->mcast)) {
       while ((cmd = state->cmds)) {
          state->cmds = cmd->next;
          free(cmd);
       }
+      while ((sub = state->subs)) {
+         state->subs = sub->next;
+         free(sub);
+      }
 
       if (state->fd > 0) {
          EVT_fd_remove(evt_loop, state->fd, EVENT_FD_READ);
@@ -459,9 +1627,12 @@ int cmd_handler_init(const char * procName, struct ProcessData *proc,
       return -1;
    memset(cmds, 0, sizeof(*cmds));
    *cmds_ptr = cmds;
+   cmds->dataReqDeadlineMs = CMD_DEFAULT_DATA_REQ_DEADLINE_MS;
 
    CMD_set_xdr_cmd_handler(IPC_CMDS_DATA_REQ, &cmd_handle_data_req, cmds);
    XDR_register_populator(&heartbeat_populator, cmds, IPC_TYPES_HEARTBEAT);
+   XDR_register_populator(&heartbeat_ext_populator, cmds,
+         IPC_TYPES_HEARTBEAT_EXT);
    cmds->proc = proc;
    if (procName) {
       sprintf(cfgFile, "./%s.cmd.cfg", procName);
@@ -516,27 +1687,126 @@ int cmd_handler_init(const char * procName, struct ProcessData *proc,
    return EXIT_SUCCESS;
 }
 
+static size_t resp_hash(uint32_t id, const struct sockaddr_in *host)
+{
+   uint32_t hash;
+
+   hash = id * 2654435761u;
+   hash ^= host->sin_addr.s_addr * 2246822519u;
+   hash ^= host->sin_port * 3266489917u;
+
+   return hash ^ (hash >> 16);
+}
+
+static struct CMDResponseCb **resp_bucket(struct CMDResponseTable *tbl,
+      uint32_t id, const struct sockaddr_in *host)
+{
+   return &tbl->buckets[resp_hash(id, host) & (tbl->size - 1)];
+}
+
+// Doubles the bucket count once the table is more than fully loaded
+static int resp_table_grow(struct CMDResponseTable *tbl)
+{
+   struct CMDResponseCb **old = tbl->buckets, *curr, **bucket;
+   size_t oldSize = tbl->size, i;
+
+   tbl->size = oldSize ? oldSize * 2 : RESP_TABLE_MIN_SIZE;
+   tbl->buckets = calloc(tbl->size, sizeof(*tbl->buckets));
+   if (!tbl->buckets) {
+      tbl->buckets = old;
+      tbl->size = oldSize;
+      return -1;
+   }
+
+   for (i = 0; i < oldSize; i++) {
+      while ((curr = old[i])) {
+         old[i] = curr->next;
+         bucket = resp_bucket(tbl, curr->id, &curr->host);
+         curr->next = *bucket;
+         *bucket = curr;
+      }
+   }
+   free(old);
+
+   return 0;
+}
+
+static void resp_table_insert(struct CommandCbArg *st,
+      struct CMDResponseCb *state)
+{
+   struct CMDResponseTable *tbl = &st->resp;
+   struct CMDResponseCb **bucket;
+
+   bucket = resp_bucket(tbl, state->id, &state->host);
+   state->next = *bucket;
+   *bucket = state;
+
+   tbl->count++;
+   st->beatsExt.in_flight = tbl->count;
+   if (tbl->count > st->beatsExt.in_flight_max)
+      st->beatsExt.in_flight_max = tbl->count;
+}
+
+// Removes and returns the entry matching the key, or NULL if there is none
+static struct CMDResponseCb *resp_table_take(struct CommandCbArg *st,
+      uint32_t id, const struct sockaddr_in *host)
+{
+   struct CMDResponseTable *tbl = &st->resp;
+   struct CMDResponseCb **itr, *state;
+
+   if (!tbl->count)
+      return NULL;
+
+   for (itr = resp_bucket(tbl, id, host); *itr; itr = &(*itr)->next) {
+      if ((*itr)->id == id && (*itr)->host.sin_port == host->sin_port &&
+            (*itr)->host.sin_addr.s_addr == host->sin_addr.s_addr ) {
+         state = *itr;
+         *itr = state->next;
+         st->beatsExt.in_flight = --tbl->count;
+         return state;
+      }
+   }
+
+   return NULL;
+}
+
+static void resp_table_unlink(struct CommandCbArg *st,
+      struct CMDResponseCb *state)
+{
+   struct CMDResponseTable *tbl = &st->resp;
+   struct CMDResponseCb **itr;
+
+   for (itr = resp_bucket(tbl, state->id, &state->host); *itr;
+         itr = &(*itr)->next) {
+      if (*itr == state) {
+         *itr = state->next;
+         st->beatsExt.in_flight = --tbl->count;
+         return;
+      }
+   }
+}
+
+static void resp_table_free(struct CMDResponseTable *tbl)
+{
+   // Releasing the pool frees any entries that never got a response
+   MPOOL_free_pool(tbl->pool);
+   free(tbl->buckets);
+   memset(tbl, 0, sizeof(*tbl));
+}
+
 static void cmd_handle_xdr_response(ProcessData *proc,
       char *data, size_t dataLen, struct sockaddr_in *src)
 {
    struct IPC_ResponseHeader hdr;
    size_t len = 0;
-   struct CMDResponseCb **itr, *state = NULL;
+   struct CMDResponseCb *state = NULL;
 
    if (IPC_ResponseHeader_decode(data, &hdr, &len, dataLen, NULL) < 0)
       return;
    if (hdr.cmd != IPC_CMDS_RESPONSE)
       return;
 
-   for (itr = &proc->cmds->resp; itr && (*itr); itr = &(*itr)->next) {
-      if ((*itr)->id == hdr.ipcref && (*itr)->host.sin_port == src->sin_port &&
-            (*itr)->host.sin_addr.s_addr == src->sin_addr.s_addr ) {
-         state = *itr;
-         *itr = state->next;
-         break;
-      }
-   }
-
+   state = resp_table_take(proc->cmds, hdr.ipcref, src);
    if (!state)
       return;
 
@@ -548,80 +1818,229 @@ static void cmd_handle_xdr_response(ProcessData *proc,
       state->to_evt = NULL;
    }
 
-   free(state);
+   MPOOL_release(proc->cmds->resp.pool, state);
 }
 
-int cmd_handler_cb(int socket, char type, void * arg)
+// Decodes an XDR command and runs its handler
+static void cmd_run_xdr_command(ProcessData *proc, struct MemArena **arena,
+      int socket, unsigned char *data, size_t dataLen,
+      struct sockaddr_in *src)
 {
-   ProcessData *proc = (ProcessData*)arg;
-   unsigned char data[MAX_IP_PACKET_SIZE];
-   struct Command *cmd = NULL;
-   struct CommandCbArg *cmds = proc->cmds;
-   size_t dataLen, used = 0;
-   struct sockaddr_in src;
    struct IPC_Command xdr_cmd;
    struct CMD_XDRCommandInfo *cmd_info;
+   struct MemArena *prev_arena;
+   size_t used = 0;
+   int res;
+
+   // The whole decoded command lives in the arena and is released
+   //  with one reset once the handler returns
+   if (!*arena)
+      *arena = MPOOL_arena_create(DECODE_ARENA_CHUNK);
+   prev_arena = XDR_set_decode_arena(*arena);
+   res = IPC_Command_decode((char*)data, &xdr_cmd, &used, dataLen, NULL);
+   XDR_set_decode_arena(prev_arena);
+
+   if (res < 0)
+      DBG_print(DBG_LEVEL_WARN, "Failed to decode XDR command of "
+            "length %lu\n", dataLen);
+   else {
+      cmd_info = CMD_xdr_cmd_by_number(xdr_cmd.cmd);
+      if (cmd_info && cmd_info->handler)
+         cmd_info->handler(proc, &xdr_cmd, src, cmd_info->arg, socket);
+      else if (cmd_info)
+         IPC_error(proc, &xdr_cmd, IPC_RESULTCODE_UNSUPPORTED, src);
+   }
+
+   if (*arena)
+      MPOOL_arena_reset(*arena);
+   else if (res >= 0)
+      XDR_free_union(&xdr_cmd.parameters);
+}
+
+// Dispatches a single datagram read from the command socket
+static void cmd_dispatch_packet(ProcessData *proc, int socket,
+      unsigned char *data, size_t dataLen, struct sockaddr_in *src)
+{
+   struct Command *cmd = NULL;
+   struct CommandCbArg *cmds = proc->cmds;
+   size_t used = 0;
    uint32_t cmd_num;
-   data[0] = 0;
+
+   // Command 0 was never used.  Now it is used to tell the difference
+   //  between the old command format and the newer XDR format
+   if (*data == 0) {
+      if (XDR_decode_uint32((char*)data, &cmd_num,
+               &used, dataLen, NULL) < 0)
+         DBG_print(DBG_LEVEL_WARN, "Failed to decode XDR uint32 of "
+               "length %lu\n", dataLen);
+      if (cmd_num == IPC_CMDS_RESPONSE) {
+         cmds->beats.responses++;
+         cmd_handle_xdr_response(proc, (char*)data, dataLen, src);
+      }
+      else {
+         cmds->beats.commands++;
+         cmd_run_xdr_command(proc, &cmds->decodeArena, socket, data,
+               dataLen, src);
+      }
+   }
+   else {
+      cmds->beats.commands++;
+      cmd = cmds->cmds + *data;
+      DBG_print(DBG_LEVEL_INFO, "Received command 0x%02x (%d - %d)",
+                                 *data, cmd->uid, cmd->group);
+
+      // Check to see if command is protected
+      if (cmd->prot == CMD_PROTECTED) {
+         //NOTE(Joshua Anderson): Cryptography support was reomved for now, so this is now a No-OP.
+         DBG_print(DBG_LEVEL_WARN, "Protected commands are not supported\n");
+      } else {
+         // Un-protected command, nothing out of the ordinary here
+         (*(cmd->cmd_cb))(socket, *data, data+1, dataLen-1, src);
+      }
+   }
+}
+
+void cmd_handle_packet(ProcessData *proc, int socket, void *data,
+      size_t dataLen, struct sockaddr_in *src)
+{
+   cmdGProc = proc;
+   if (dataLen > 0)
+      cmd_dispatch_packet(proc, socket, (unsigned char*)data, dataLen, src);
+}
+
+int cmd_handler_cb(int socket, char type, void * arg)
+{
+   ProcessData *proc = (ProcessData*)arg;
+   struct CommandCbArg *cmds = proc->cmds;
+   struct CMDRxBatch *rx = &cmds->rx;
+   int cnt, i;
    cmdGProc = proc;
 
    // should only be read events, but make sure
    if (type == EVENT_FD_READ) {
-      // read from the socket to get the command and it's data
-      dataLen = socket_read(socket, data, MAX_IP_PACKET_SIZE, &src);
+      // drain up to a batch of commands from the socket
+      cnt = cmd_rx_batch_read(socket, rx);
+      cmd_rx_batch_account(cmds, cnt);
+
+      for (i = 0; i < cnt; i++) {
+         // make sure something was actually read
+         if (rx->lens[i] > 0)
+            cmd_dispatch_packet(proc, socket,
+                  rx->buffers + (size_t)i * MAX_IP_PACKET_SIZE,
+                  rx->lens[i], &rx->src[i]);
+      }
+   }
 
-      // make sure something was actually read
-      if (dataLen > 0) {
-         // Command 0 was never used.  Now it is used to tell the difference
-         //  between the old command format and the newer XDR format
-         if (*data == 0) {
-            if (XDR_decode_uint32((char*)data, &cmd_num,
-                     &used, dataLen, NULL) < 0)
-               DBG_print(DBG_LEVEL_WARN, "Failed to decode XDR uint32 of "
-                     "length %lu\n", dataLen);
-            if (cmd_num == IPC_CMDS_RESPONSE) {
-               cmds->beats.responses++;
-               cmd_handle_xdr_response(proc, (char*)data, dataLen, &src);
-            }
-            else if (IPC_Command_decode((char*)data, &xdr_cmd,
-                     &used, dataLen, NULL) < 0) {
-               cmds->beats.commands++;
-               DBG_print(DBG_LEVEL_WARN, "Failed to decode XDR command of "
-                     "length %lu\n", dataLen);
-            }
-            else {
-               cmds->beats.commands++;
-               cmd_info = CMD_xdr_cmd_by_number(xdr_cmd.cmd);
-               if (cmd_info && cmd_info->handler)
-                  cmd_info->handler(cmds->proc, &xdr_cmd, &src,
-                        cmd_info->arg, socket);
-               else if (cmd_info)
-                  IPC_error(proc, &xdr_cmd, IPC_RESULTCODE_UNSUPPORTED, &src);
-
-               XDR_free_union(&xdr_cmd.parameters);
-            }
-         }
-         else {
-            cmds->beats.commands++;
-            cmd = cmds->cmds + *data;
-            DBG_print(DBG_LEVEL_INFO, "Received command 0x%02x (%d - %d)",
-                                       *data, cmd->uid, cmd->group);
-
-            // Check to see if command is protected
-            if (cmd->prot == CMD_PROTECTED) {
-               //NOTE(Joshua Anderson): Cryptography support was reomved for now, so this is now a No-OP.
-               DBG_print(DBG_LEVEL_WARN, "Protected commands are not supported\n");
-            } else {
-               // Un-protected command, nothing out of the ordinary here
-               (*(cmd->cmd_cb))(socket, *data, data+1, dataLen-1, &src);
-            }
-         }
+   return EVENT_KEEP;
+}
+
+// Runs on the main loop with a datagram a shard could not handle itself
+static void cmd_shard_forward_cb(void *arg, void *msg, size_t len)
+{
+   ProcessData *proc = (ProcessData*)arg;
+   struct sockaddr_in src;
+
+   memcpy(&src, msg, sizeof(src));
+   cmd_dispatch_packet(proc, proc->cmdFd, (unsigned char*)msg + sizeof(src),
+         len - sizeof(src), &src);
+}
+
+static void cmd_shard_dispatch(struct CMDShard *shard, int socket,
+      unsigned char *data, size_t dataLen, struct sockaddr_in *src)
+{
+   ProcessData *proc = shard->owner->proc;
+   struct CMD_XDRCommandInfo *cmd_info;
+   struct iovec fwd[2];
+   uint32_t cmd_num;
+   size_t used = 0;
+
+   if (*data == 0 && XDR_decode_uint32((char*)data, &cmd_num, &used,
+            dataLen, NULL) >= 0 && cmd_num != IPC_CMDS_RESPONSE) {
+      cmd_info = CMD_xdr_cmd_by_number(cmd_num);
+      if (cmd_info && cmd_info->handler &&
+            (cmd_xdr_flags(cmd_num) & CMD_XDR_THREAD_SAFE)) {
+         __atomic_fetch_add(&shard->beats.commands, 1, __ATOMIC_RELAXED);
+         cmd_run_xdr_command(proc, &shard->decodeArena, socket, data,
+               dataLen, src);
+         return;
       }
    }
 
+   // Legacy commands, responses and loop-affine handlers all touch main
+   //  loop state, so hand the datagram over, prefixed by its source
+   fwd[0].iov_base = src;
+   fwd[0].iov_len = sizeof(*src);
+   fwd[1].iov_base = data;
+   fwd[1].iov_len = dataLen;
+   if (EVT_post_msg(proc->evtHandler, &cmd_shard_forward_cb, proc,
+            fwd, 2) < 0)
+      DBG_print(DBG_LEVEL_WARN, "Failed to forward shard command\n");
+}
+
+int cmd_shard_handler_cb(int socket, char type, void *arg)
+{
+   struct CMDShard *shard = (struct CMDShard*)arg;
+   struct CMDRxBatch *rx = &shard->rx;
+   int cnt, i;
+
+   if (type != EVENT_FD_READ)
+      return EVENT_KEEP;
+
+   // Only this thread writes the counters
+   cnt = cmd_rx_batch_read(socket, rx);
+   if (cnt > 0) {
+      __atomic_fetch_add(&shard->beatsExt.rx_wakeups, 1, __ATOMIC_RELAXED);
+      if (cnt > shard->beatsExt.rx_batch_max)
+         __atomic_store_n(&shard->beatsExt.rx_batch_max, cnt,
+               __ATOMIC_RELAXED);
+   }
+
+   for (i = 0; i < cnt; i++) {
+      if (rx->lens[i] > 0)
+         cmd_shard_dispatch(shard, socket,
+               rx->buffers + (size_t)i * MAX_IP_PACKET_SIZE,
+               rx->lens[i], &rx->src[i]);
+   }
+
    return EVENT_KEEP;
 }
 
+struct CMDShard *cmd_shard_create(struct CommandCbArg *cmds)
+{
+   struct CMDShard *shard;
+
+   shard = malloc(sizeof(*shard));
+   if (!shard)
+      return NULL;
+   memset(shard, 0, sizeof(*shard));
+
+   shard->owner = cmds;
+   shard->rx.size = cmds->rx.size;
+   shard->next = cmds->shards;
+   cmds->shards = shard;
+
+   return shard;
+}
+
+void cmd_shard_free(struct CMDShard *shard)
+{
+   struct CMDShard **itr;
+
+   if (!shard)
+      return;
+
+   for (itr = &shard->owner->shards; *itr; itr = &(*itr)->next) {
+      if (*itr == shard) {
+         *itr = shard->next;
+         break;
+      }
+   }
+
+   cmd_rx_batch_free(&shard->rx);
+   MPOOL_arena_free(shard->decodeArena);
+   free(shard);
+}
+
 int tx_cmd_handler_cb(int socket, char type, void * arg)
 {
    unsigned char data[MAX_IP_PACKET_SIZE];
@@ -670,6 +2089,15 @@ void cmd_handler_cleanup(struct CommandCbArg **goner)
    if (cmds && cmds->cmds) {
       free(cmds->cmds);
    }
+   if (cmds) {
+      cmd_rx_batch_free(&cmds->rx);
+      resp_table_free(&cmds->resp);
+      MPOOL_arena_free(cmds->decodeArena);
+      if (cmds->snapshots) {
+         HASH_extract(cmds->snapshots, &data_snapshot_free);
+         HASH_free_table(cmds->snapshots);
+      }
+   }
    free(cmds);
    *goner = NULL;
 }
@@ -1171,6 +2599,51 @@ void CMD_set_xdr_cmd_handler(uint32_t num, CMD_XDR_handler_t cb, void *arg)
    cmd->arg = arg;
 }
 
+static void *xdr_flags_key_for_data(void *data)
+{
+   if (!data)
+      return 0;
+   return (void*)(uintptr_t)(((struct XDRCommandFlags*)data)->command);
+}
+
+void CMD_set_xdr_cmd_flags(uint32_t num, uint32_t flags)
+{
+   struct XDRCommandFlags *entry = NULL;
+
+   if (!xdrFlagsHash) {
+      xdrFlagsHash = HASH_create_table(37, &xdr_cmd_hash_func,
+            &xdr_cmd_cmp_key, &xdr_flags_key_for_data);
+      if (!xdrFlagsHash)
+         return;
+   }
+
+   entry = (struct XDRCommandFlags*)
+      HASH_find_key(xdrFlagsHash, (void*)(uintptr_t)num);
+   if (!entry) {
+      entry = (struct XDRCommandFlags*)calloc(1, sizeof(*entry));
+      if (!entry)
+         return;
+      entry->command = num;
+      if (HASH_add_data(xdrFlagsHash, entry) < 0) {
+         free(entry);
+         return;
+      }
+   }
+
+   entry->flags = flags;
+}
+
+static uint32_t cmd_xdr_flags(uint32_t num)
+{
+   struct XDRCommandFlags *entry = NULL;
+
+   if (xdrFlagsHash)
+      entry = (struct XDRCommandFlags*)
+         HASH_find_key(xdrFlagsHash, (void*)(uintptr_t)num);
+
+   return entry ? entry->flags : 0;
+}
+
 int CMD_resolve_callback(ProcessData *proc, IPC_command_callback cb,
       void *arg, enum IPC_CB_TYPE cb_type, void *rxbuff, size_t rxlen)
 {
@@ -1278,21 +2751,15 @@ struct IPC_OpaqueStruct CMD_struct_to_opaque_struct(void *src, uint32_t type)
 static int response_timeout_cb(void *arg)
 {
    struct CMDResponseCb *state = (struct CMDResponseCb*)arg;
-   struct CMDResponseCb **itr;
 
    if (!arg)
       return EVENT_REMOVE;
 
-   for (itr = &state->proc->cmds->resp; itr && (*itr); itr = &(*itr)->next) {
-      if (*itr == state) {
-         *itr = state->next;
-         break;
-      }
-   }
+   resp_table_unlink(state->proc->cmds, state);
 
    state->cb(state->proc, 1, state->arg, NULL, 0, state->cb_type);
    state->to_evt = NULL;
-   free(state);
+   MPOOL_release(state->proc->cmds->resp.pool, state);
 
    return EVENT_REMOVE;
 }
@@ -1308,7 +2775,18 @@ void CMD_add_response_cb(ProcessData *proc, uint32_t id,
    if (!st)
       return;
 
-   state = malloc(sizeof(*state));
+   if (!st->resp.pool) {
+      st->resp.pool = MPOOL_create(sizeof(*state), RESP_POOL_SLAB);
+      if (!st->resp.pool)
+         return;
+   }
+   if (st->resp.count >= st->resp.size && resp_table_grow(&st->resp) < 0 &&
+         !st->resp.size)
+      return;
+
+   state = MPOOL_alloc(st->resp.pool);
+   if (!state)
+      return;
    memset(state, 0, sizeof(*state));
 
    state->id = id;
@@ -1317,8 +2795,7 @@ void CMD_add_response_cb(ProcessData *proc, uint32_t id,
    state->arg = arg;
    state->cb_type = cb_type;
    state->proc = proc;
-   state->next = st->resp;
-   st->resp = state;
+   resp_table_insert(st, state);
 
    if (timeout)
       state->to_evt = EVT_sched_add(PROC_evt(proc), EVT_ms2tv(timeout),
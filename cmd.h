@@ -69,17 +69,34 @@ extern "C" {
 /// Maximum number of commands
 #define MAX_NUM_CMDS 256
 
+/// Default limit on datagrams read from a command socket per wakeup.  The
+///  receive ring only grows toward it while wakeups keep filling the ring.
+#define CMD_DEFAULT_RX_BATCH 8
+/// Largest supported command socket receive batch
+#define CMD_MAX_RX_BATCH 64
+
+// Default time a DATA_REQ waits for its populators, in milliseconds
+#define CMD_DEFAULT_DATA_REQ_DEADLINE_MS 1000
+
+/// XDR command handler flag: the handler may run on any command shard's
+/// thread, concurrently with itself and the main loop.  Handlers without it
+/// are loop-affine and always run on the main event loop.
+#define CMD_XDR_THREAD_SAFE 0x0001
+
 struct EventState;
 struct IPC_Command;
 struct ProcessData;
 struct CommandCbArg;
+struct CMDShard;
 struct XDR_StructDefinition;
 
 // Format for a command callback function
 typedef void (*CMD_handler_t)(int socket, unsigned char cmd, void *data,
    size_t dataLen, struct sockaddr_in *fromAddr);
 
-// Format for a XDR command callback function
+// Format for a XDR command callback function.  cmd and its decoded
+//  parameters live in an arena that is reset as soon as the handler returns,
+//  so they are only valid during the call.  Copy anything needed later.
 typedef void (*CMD_XDR_handler_t)(struct ProcessData *, struct IPC_Command *cmd,
    struct sockaddr_in *fromAddr, void *arg, int fd);
 
@@ -87,6 +104,15 @@ typedef void (*CMD_XDR_handler_t)(struct ProcessData *, struct IPC_Command *cmd,
 typedef void (*MCAST_handler_t)(void *arg, int socket, unsigned char cmd,
    void *data, size_t dataLen, struct sockaddr_in *fromAddr);
 
+// Format for a telemetry subscription callback.  data is the decoded
+//  structure of the given type and is only valid during the call.
+typedef void (*MCAST_telemetry_handler_t)(void *arg, uint32_t type,
+   void *data, struct sockaddr_in *fromAddr);
+
+// Publication flag: only send when the encoded value differs from the
+//  last one sent
+#define CMD_PUBLISH_ON_CHANGE 1
+
 // Initializes the command callbacks
 int cmd_handler_init(const char * process_name, struct ProcessData *proc,
       struct CommandCbArg **cmds);
@@ -94,8 +120,20 @@ int cmd_handler_init(const char * process_name, struct ProcessData *proc,
 // The actual command handler callback for the event handler
 int cmd_handler_cb(int socket, char type, void *arg);
 
+// Handles one datagram that arrived for the command socket by other means
+void cmd_handle_packet(struct ProcessData *proc, int socket, void *data,
+      size_t dataLen, struct sockaddr_in *src);
+
 void cmd_handler_cleanup(struct CommandCbArg **cmds);
 
+// Sets how many datagrams are drained from a command socket per wakeup
+int cmd_set_rx_batch_size(struct CommandCbArg *cmds, unsigned int size);
+
+// Sets how long a DATA_REQ waits for asynchronous populators before
+//  answering without them.  0 answers with only the populators that
+//  called back before returning.
+int cmd_set_data_req_deadline(struct CommandCbArg *cmds, unsigned int ms);
+
 //look here to subscribe to multicasts
 void cmd_set_multicast_handler(struct CommandCbArg *st,
    struct EventState *evt_loop, const char *service, int cmdNum,
@@ -104,10 +142,37 @@ void cmd_set_multicast_handler(struct CommandCbArg *st,
 void cmd_remove_multicast_handler(struct CommandCbArg *st,
    const char *service, int cmdNum, struct EventState *evt_loop);
 
+// Typed callbacks for telemetry a service publishes to its multicast group.
+//  A type of 0 receives every published type.  Both return 0 on success
+//  and -1 on failure.
+int cmd_subscribe_telemetry(struct CommandCbArg *st,
+   struct EventState *evt_loop, const char *service, uint32_t type,
+   MCAST_telemetry_handler_t handler, void *arg);
+
+int cmd_unsubscribe_telemetry(struct CommandCbArg *st,
+   const char *service, uint32_t type, struct EventState *evt_loop);
+
+// Pushes a type with a registered populator to the process's multicast
+//  group every periodMs milliseconds.  A period of 0 only publishes when
+//  cmd_publish_telemetry_now is called.
+int cmd_publish_telemetry(struct CommandCbArg *cmds, uint32_t type,
+   unsigned int periodMs, uint32_t flags);
+int cmd_publish_telemetry_now(struct CommandCbArg *cmds, uint32_t type);
+int cmd_unpublish_telemetry(struct CommandCbArg *cmds, uint32_t type);
+
 void cmd_cleanup_cb_state(struct CommandCbArg *st, struct EventState *evt_loop);
 
 int tx_cmd_handler_cb(int socket, char type, void * arg);
 
+// Receive state for a command socket shard running on its own event loop.
+//  Created and freed on the main loop's thread.
+struct CMDShard *cmd_shard_create(struct CommandCbArg *cmds);
+void cmd_shard_free(struct CMDShard *shard);
+
+// Command socket callback for a shard's event loop.  Runs thread-safe XDR
+//  commands in place and forwards everything else to the main loop.
+int cmd_shard_handler_cb(int socket, char type, void *arg);
+
 typedef void (*CMD_struct_itr)(uint32_t type, struct XDR_StructDefinition *,
       char *buff, size_t len, void *arg1, int arg2, const char *parent);
 extern int CMD_iterate_structs(char *src, size_t len, CMD_struct_itr itr_cb,
@@ -145,6 +210,9 @@ extern void CMD_register_commands(struct CMD_XDRCommandInfo*, int);
 extern void CMD_register_command(struct CMD_XDRCommandInfo*, int);
 extern void CMD_set_xdr_cmd_handler(uint32_t num, CMD_XDR_handler_t cb,
       void *arg);
+// Sets CMD_XDR_* flags for a command number.  They are kept apart from
+//  CMD_XDRCommandInfo, so may be set before or after it is registered.
+extern void CMD_set_xdr_cmd_flags(uint32_t num, uint32_t flags);
 extern int CMD_xdr_cmd_help(struct CMD_XDRCommandInfo *command);
 extern int CMD_mc_cmd_help(struct CMD_MulticallInfo *command);
 extern int CMD_send_command_line_command(int argc, char **argv,
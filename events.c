@@ -24,6 +24,8 @@
  */
 #include "events.h"
 #include "priorityQueue.h"
+#include "timerWheel.h"
+#include "memPool.h"
 #include "eventTimer.h"
 #include "proclib.h"
 #include <stdlib.h>
@@ -46,8 +48,32 @@
 #include "ipc.h"
 #include "json.h"
 #include <inttypes.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 
 #define EDBG_ENV_VAR "LIBPROC_DEBUGGER"
+#define BACKEND_ENV_VAR "LIBPROC_EVT_BACKEND"
+#define SCHEDULER_ENV_VAR "LIBPROC_EVT_SCHEDULER"
+
+// Tick length of the timer wheel, in microseconds
+#define WHEEL_RESOLUTION_US 1000
+
+// Initial number of slots in the fd table
+#define FD_TABLE_MIN_SIZE 64
+// Records per slab in the timed and fd event pools
+#define SCHED_POOL_SLAB 64
+#define FD_POOL_SLAB 16
+// Maximum number of ready descriptors collected by one epoll_wait call
+#define EPOLL_BATCH_SIZE 64
+
+// A queue of timed events, backed by either a binary heap or a timer wheel
+struct TimedEventQueue
+{
+   pqueue_t *heap;
+   twheel_t *wheel;
+};
 
 // Structure representing a schedule callback
 typedef struct _ScheduleCB
@@ -57,25 +83,31 @@ typedef struct _ScheduleCB
    EVT_sched_cb callback;
    void *arg;
    size_t pos;
+   twheel_entry_t wheel;
    struct timeval timeStep;
-   pqueue_t *queue;
+   struct TimedEventQueue *queue;
    uint32_t count;
    char breakpoint;
-   char name[128];
+   char *name;                   // Optional debugger name, NULL if unset
 } ScheduleCB;
 
 // Structure which defines a file callback
 typedef struct EventCB
 {
+   // Fields touched on every dispatch come first
    EVT_fd_cb cb[EVENT_MAX];        // An array of function callbacks to call
-   EVT_fd_cb cleanup[EVENT_MAX]; // An array of cleanup callback to call
    void *arg[EVENT_MAX];               // An array of arguments to pass to callbacks
    uint32_t counts[EVENT_MAX];
+   int fd;                           // The file descriptor which will launch the event 
+   uint32_t epollMask;               // Events currently registered with epoll
    char breakpoint[EVENT_MAX];
    char pausable;
-   int fd;                           // The file descriptor which will launch the event 
-   char name[128];
-   struct EventCB *next;            // The next signal callback
+   char alwaysReady;                 // epoll refused the fd, poll it each loop
+   uint32_t gen;                     // Distinguishes reuses of a pooled record
+
+   // Registration-time and debugger-only state
+   EVT_fd_cb cleanup[EVENT_MAX]; // An array of cleanup callback to call
+   char *name;                      // Optional debugger name, NULL if unset
 } *EventCBPtr;
 
 struct GPIOInterruptCBList {
@@ -90,6 +122,34 @@ struct GPIOInterruptDesc {
    struct GPIOInterruptCBList *callbacks;
 };
 
+// One callback posted from another thread.  Nodes form an intrusive
+// multi-producer, single-consumer queue (Vyukov): producers swap themselves
+// into head, the loop thread pops from tail.
+struct EVTPostNode {
+   struct EVTPostNode *next;
+   EVT_post_cb cb;
+   EVT_post_msg_cb msg_cb;
+   void *arg;
+   size_t len;
+   char msg[];
+};
+
+#define EVT_POST_BATCH 256
+
+struct EVTPostQueue {
+   struct EVTPostNode *head;        // Last node pushed, written by producers
+   struct EVTPostNode *tail;        // Next node to pop, loop thread only
+   struct EVTPostNode stub;
+   int signalled;                   // A wakeup is pending on the fd
+   int readFd, writeFd;             // eventfd (both the same) or pipe
+};
+
+struct EVTLoopHook {
+   EVT_loop_hook_cb cb;
+   void *arg;
+   struct EVTLoopHook *next;
+};
+
 struct EDBGClient {
    int fd;
    EVTHandler *ctx;
@@ -106,9 +166,21 @@ struct EventState
    fd_set blockedSet[EVENT_MAX];                          // File descriptor sets to watch
    int maxFd, maxFds[EVENT_MAX], eventCnt[EVENT_MAX]; // fd information
    int hashSize;                                         // The hash size of the event handler
+   EventCBPtr *fdTable;                               // EventCBs indexed by fd
+   int fdTableSize;                                   // Number of fdTable slots
    int keepGoing;                                        // Whether the handler should loop or not
+   char inLoop;                                       // EVT_start_loop is running
+   struct EVTLoopHook *loopHooks;                     // Run before each block
+   struct EVTPostQueue *postQueue;                    // Cross-thread callbacks
+   enum EVTBackend backend;                           // select or epoll
+   int epollFd;                                       // epoll instance, or -1
+   char epollPaused;                                  // epoll set holds blockedSet
+   int alwaysReadyCnt;                                // EventCBs epoll refused
+   uint32_t fdGen;                                    // Last EventCB generation
    struct GPIOInterruptDesc gpio_intrs[2];            // GPIO interrupt state
-   pqueue_t *queue, *dbg_queue;                       // The schedule queue
+   struct TimedEventQueue queue, dbg_queue;           // The schedule queues
+   struct MemPool *schedPool;                         // ScheduleCB records
+   struct MemPool *fdPool;                            // EventCB records
    struct EventTimer *evt_timer;
    char custom_timer;
    enum EVTDebuggerState initialDebuggerState;
@@ -132,15 +204,14 @@ struct EventState
    uint8_t break_on_next:1;
    uint8_t dump_every_loop:1;
    uint8_t full_dump_format:1;
-
-   // MUST be last entry in struct
-   EventCBPtr events[1];                                  // List of pointers to event callbacks
 };
 
 // Static global for virtual time
 static EVTHandler *global_evt = NULL;
 
 static void edbg_init(EVTHandler *ctx);
+static void evt_post_init(EVTHandler *ctx);
+static void evt_post_cleanup(EVTHandler *ctx);
 static void edbg_report_state(EVTHandler *ctx, uint8_t full_format);
 void evt_fd_set_pausable(EVTHandler *ctx, int fd, char pausable);
 extern int ET_default_monotonic(struct EventTimer *et, struct timeval *tv);
@@ -246,25 +317,318 @@ static void set_pos(void *a, size_t pos)
 	((ScheduleCB *) a)->pos = pos;
 }
 
+// Get timer wheel entry callback
+static twheel_entry_t *get_wheel_entry(void *a)
+{
+	return &((ScheduleCB *) a)->wheel;
+}
+
+static int tq_init(struct TimedEventQueue *q, size_t size,
+      enum EVTScheduler sched)
+{
+   q->heap = NULL;
+   q->wheel = NULL;
+
+   if (sched == EVT_SCHED_WHEEL)
+      q->wheel = twheel_init(WHEEL_RESOLUTION_US, get_pri, get_wheel_entry);
+   else
+      q->heap = pqueue_init(size, cmp_pri, get_pri, set_pri, get_pos, set_pos);
+
+   return (q->heap || q->wheel) ? 0 : -1;
+}
+
+static void tq_free(struct TimedEventQueue *q)
+{
+   if (q->heap)
+      pqueue_free(q->heap);
+   if (q->wheel)
+      twheel_free(q->wheel);
+   q->heap = NULL;
+   q->wheel = NULL;
+}
+
+static int tq_insert(struct TimedEventQueue *q, ScheduleCB *evt)
+{
+   if (q->wheel) {
+      evt->pos = 0;
+      return twheel_insert(q->wheel, evt);
+   }
+   return pqueue_insert(q->heap, evt);
+}
+
+static int tq_remove(struct TimedEventQueue *q, ScheduleCB *evt)
+{
+   if (q->wheel)
+      return twheel_remove(q->wheel, evt);
+   return pqueue_remove(q->heap, evt);
+}
+
+// Reposition an event after its nextAwake changed
+static void tq_change(struct TimedEventQueue *q, ScheduleCB *evt)
+{
+   if (SIZE_MAX == evt->pos)
+      return;
+
+   if (q->wheel) {
+      if (0 == twheel_remove(q->wheel, evt))
+         twheel_insert(q->wheel, evt);
+   }
+   else
+      pqueue_change_priority(q->heap, evt->nextAwake, evt);
+}
+
+/* Returns the earliest event, which may not be due yet.  The timer wheel
+ * only returns events within one tick of now, so it is advanced first.
+ */
+static ScheduleCB *tq_peek(struct TimedEventQueue *q, struct timeval *now)
+{
+   if (q->wheel) {
+      twheel_advance(q->wheel, now);
+      return twheel_peek(q->wheel);
+   }
+   return pqueue_peek(q->heap);
+}
+
+static void tq_pop(struct TimedEventQueue *q)
+{
+   if (q->wheel)
+      twheel_pop(q->wheel);
+   else
+      pqueue_pop(q->heap);
+}
+
+/* Computes when the loop must wake up to service the queue.  For the timer
+ * wheel this may be earlier than the next event, which is harmless.
+ *
+ * @return 1 if the queue is not empty, otherwise 0
+ */
+static int tq_next_awake(struct TimedEventQueue *q, struct timeval *now,
+      struct timeval *awake)
+{
+   ScheduleCB *evt;
+
+   if (q->wheel) {
+      twheel_advance(q->wheel, now);
+      return twheel_next_wakeup(q->wheel, awake);
+   }
+
+   evt = pqueue_peek(q->heap);
+   if (!evt)
+      return 0;
+   *awake = evt->nextAwake;
+   return 1;
+}
+
+// Calls visit for every event.  visit may remove the event it is passed.
+static void tq_foreach(struct TimedEventQueue *q,
+      void (*visit)(void *evt, void *arg), void *arg)
+{
+   size_t i;
+
+   if (q->wheel) {
+      twheel_foreach(q->wheel, visit, arg);
+      return;
+   }
+
+   for (i = pqueue_size(q->heap); i >= 1; i--)
+      visit(q->heap->d[i], arg);
+}
+
+struct TimedEventQueueMove {
+   struct TimedEventQueue *src, *dst;
+};
+
+static void tq_move_event(void *evt, void *arg)
+{
+   struct TimedEventQueueMove *move = (struct TimedEventQueueMove*)arg;
+   ScheduleCB *sched = (ScheduleCB*)evt;
+
+   tq_remove(move->src, sched);
+   sched->queue = move->dst;
+   tq_insert(move->dst, sched);
+}
+
 int null_evt_callback(void *arg)
 {
    return EVENT_REMOVE;
 }
 
-/* Initializes an EventState with a given hash size.
- * @param hashSize The hash size of the event handler.
- * @return A pointer to the new EventState
+// True if the event is allowed to fire while the debugger has paused the loop
+#define EVT_UNBLOCKED(curr, event) \
+      (!(curr)->pausable || !(curr)->breakpoint[(event)])
+
+#ifdef __linux__
+// The epoll readiness flags that trigger each libproc event type.  This
+//  mirrors select(), which reports errors and hangups as readable/writable.
+static const uint32_t epoll_ready_flags[EVENT_MAX] = {
+   EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR,
+   EPOLLOUT | EPOLLHUP | EPOLLERR,
+   EPOLLPRI,
+};
+
+static const uint32_t epoll_watch_flags[EVENT_MAX] = {
+   EPOLLIN, EPOLLOUT, EPOLLPRI
+};
+#endif
+
+/* Brings the kernel's view of a file descriptor in line with the callbacks
+ * registered in the EventCB.  For select this is the eventSet and blockedSet,
+ * for epoll the interest list.  The epoll interest list only contains the
+ * blocked set while the debugger has the loop paused.
  */
-struct EventState *EVT_initWithSize(int hashSize, EVT_debug_state_cb debug_cb,
-        void *arg)
+static void evt_sync_fd(struct EventState *ctx, struct EventCB *curr)
+{
+   int event;
+#ifdef __linux__
+   struct epoll_event ev;
+   uint32_t mask = 0;
+   int op, res;
+#endif
+
+   if (ctx->backend == EVT_BACKEND_SELECT) {
+      for (event = 0; event < EVENT_MAX; event++) {
+         if (curr->cb[event])
+            FD_SET(curr->fd, &ctx->eventSet[event]);
+         else
+            FD_CLR(curr->fd, &ctx->eventSet[event]);
+
+         if (curr->cb[event] && EVT_UNBLOCKED(curr, event))
+            FD_SET(curr->fd, &ctx->blockedSet[event]);
+         else
+            FD_CLR(curr->fd, &ctx->blockedSet[event]);
+      }
+      return;
+   }
+
+#ifdef __linux__
+   for (event = 0; event < EVENT_MAX; event++)
+      if (curr->cb[event] && (!ctx->epollPaused || EVT_UNBLOCKED(curr, event)))
+         mask |= epoll_watch_flags[event];
+
+   if (mask == curr->epollMask)
+      return;
+
+   memset(&ev, 0, sizeof(ev));
+   ev.events = mask;
+   ev.data.fd = curr->fd;
+
+   // An empty mask must be deleted outright, otherwise epoll keeps
+   //  reporting EPOLLHUP / EPOLLERR for the descriptor
+   if (!mask)
+      op = EPOLL_CTL_DEL;
+   else if (!curr->epollMask)
+      op = EPOLL_CTL_ADD;
+   else
+      op = EPOLL_CTL_MOD;
+
+   res = epoll_ctl(ctx->epollFd, op, curr->fd, &ev);
+
+   // The kernel drops closed descriptors from the interest list on its own,
+   //  so our cached mask can be stale if the fd number was recycled
+   if (res < 0 && op == EPOLL_CTL_MOD && errno == ENOENT)
+      res = epoll_ctl(ctx->epollFd, EPOLL_CTL_ADD, curr->fd, &ev);
+   else if (res < 0 && op == EPOLL_CTL_ADD && errno == EEXIST)
+      res = epoll_ctl(ctx->epollFd, EPOLL_CTL_MOD, curr->fd, &ev);
+   else if (res < 0 && op == EPOLL_CTL_DEL && (errno == ENOENT ||
+            errno == EBADF))
+      res = 0;
+
+   // Regular files can't be polled.  select() always reports them ready, so
+   //  do the same by dispatching them on every loop iteration.
+   if (res < 0 && errno == EPERM) {
+      if (!curr->alwaysReady) {
+         curr->alwaysReady = 1;
+         ctx->alwaysReadyCnt++;
+      }
+      res = 0;
+   }
+
+   if (res < 0)
+      DBG_print(DBG_LEVEL_WARN, "epoll_ctl failed for fd %d: %s\n",
+            curr->fd, strerror(errno));
+   else
+      curr->epollMask = mask;
+#endif
+}
+
+// Re-synchronize every descriptor after a change in the debugger pause state
+static void evt_sync_all_fds(struct EventState *ctx)
+{
+   struct EventCB *curr;
+   int i;
+
+   for (i = 0; i < ctx->fdTableSize; i++)
+      if ((curr = ctx->fdTable[i]))
+         evt_sync_fd(ctx, curr);
+}
+
+// Returns the fd table slot for fd, or NULL if fd is outside the table
+static struct EventCB **evt_fd_slot(struct EventState *ctx, int fd)
+{
+   if (fd < 0 || fd >= ctx->fdTableSize)
+      return NULL;
+   return &ctx->fdTable[fd];
+}
+
+/* Grows the fd table so that it has a slot for fd.  Any EventCB ** pointers
+ * into the table are invalidated.
+ * @return 0 on success, -1 on allocation failure
+ */
+static int evt_fd_table_grow(struct EventState *ctx, int fd)
+{
+   EventCBPtr *table;
+   int size = ctx->fdTableSize;
+
+   if (fd < size)
+      return 0;
+
+   if (size < FD_TABLE_MIN_SIZE)
+      size = FD_TABLE_MIN_SIZE;
+   while (size <= fd)
+      size *= 2;
+
+   table = (EventCBPtr*)realloc(ctx->fdTable, size * sizeof(EventCBPtr));
+   if (!table)
+      return -1;
+
+   memset(&table[ctx->fdTableSize], 0,
+         (size - ctx->fdTableSize) * sizeof(EventCBPtr));
+   ctx->fdTable = table;
+   ctx->fdTableSize = size;
+
+   return 0;
+}
+
+// Returns a timed event record to the handler's pool
+static void evt_sched_release(struct EventState *ctx, ScheduleCB *sched)
+{
+   if (sched == &ctx->null_evt)
+      return;
+   free(sched->name);
+   MPOOL_release(ctx->schedPool, sched);
+}
+
+// Returns a fd event record to the handler's pool
+static void evt_fd_release(struct EventState *ctx, struct EventCB *evt)
+{
+   if (evt->alwaysReady)
+      ctx->alwaysReadyCnt--;
+   free(evt->name);
+   MPOOL_release(ctx->fdPool, evt);
+}
+
+// Creates an EventState using the given fd backend
+static struct EventState *evt_init(int hashSize, EVT_debug_state_cb debug_cb,
+        void *arg, enum EVTBackend backend)
 {
    struct EventState *res = NULL;
    int i;
    const char *dbg_state;
+   const char *backend_name;
+   const char *sched_name;
+   enum EVTScheduler sched;
 
-   printf("INIT!!!\n");
-   res = (struct EventState*)malloc(
-         sizeof(struct EventState) + hashSize * sizeof(EventCBPtr));
+   res = (struct EventState*)malloc(sizeof(struct EventState));
    if (!res)
       return NULL;
    memset(res, 0, sizeof(struct EventState));
@@ -277,7 +641,6 @@ struct EventState *EVT_initWithSize(int hashSize, EVT_debug_state_cb debug_cb,
    dbg_state = getenv(EDBG_ENV_VAR);
    res->initialDebuggerState = EDBG_DISABLED;
    res->debuggerState = EDBG_DISABLED;
-   printf("dbg_state %p\n", dbg_state);
    if (dbg_state) {
       if (!strcasecmp(dbg_state, "ENABLED"))
          res->initialDebuggerState = EDBG_ENABLED;
@@ -297,32 +660,86 @@ struct EventState *EVT_initWithSize(int hashSize, EVT_debug_state_cb debug_cb,
    }
    res->hashSize = hashSize;
    res->maxFd = 0;
-   for (i = 0; i < res->hashSize; i++)
-      res->events[i] = NULL;
+   res->schedPool = MPOOL_create(sizeof(ScheduleCB), SCHED_POOL_SLAB);
+   res->fdPool = MPOOL_create(sizeof(struct EventCB), FD_POOL_SLAB);
+   if (!res->schedPool || !res->fdPool ||
+         evt_fd_table_grow(res, FD_TABLE_MIN_SIZE - 1) < 0) {
+      MPOOL_free_pool(res->schedPool);
+      MPOOL_free_pool(res->fdPool);
+      free(res->fdTable);
+      free(res);
+      return NULL;
+   }
 
-   res->queue = pqueue_init(hashSize, cmp_pri, get_pri, set_pri,
-         get_pos, set_pos);
-   if (res->queue == NULL){
+   // Select the fd backend
+   backend_name = getenv(BACKEND_ENV_VAR);
+   if (backend == EVT_BACKEND_DEFAULT && backend_name) {
+      if (!strcasecmp(backend_name, "select"))
+         backend = EVT_BACKEND_SELECT;
+      else if (!strcasecmp(backend_name, "epoll"))
+         backend = EVT_BACKEND_EPOLL;
+   }
+   if (backend == EVT_BACKEND_DEFAULT)
+      backend = EVT_BACKEND_EPOLL;
+
+   res->epollFd = -1;
+   res->epollPaused = 0;
+   res->backend = EVT_BACKEND_SELECT;
+#ifdef __linux__
+   if (backend == EVT_BACKEND_EPOLL) {
+      res->epollFd = epoll_create1(EPOLL_CLOEXEC);
+      if (res->epollFd >= 0)
+         res->backend = EVT_BACKEND_EPOLL;
+      else
+         DBG_print(DBG_LEVEL_WARN, "epoll_create1 failed, using select: %s\n",
+               strerror(errno));
+   }
+#endif
+
+   // Select the timed event scheduler
+   sched_name = getenv(SCHEDULER_ENV_VAR);
+   sched = EVT_SCHED_HEAP;
+   if (sched_name && !strcasecmp(sched_name, "wheel"))
+      sched = EVT_SCHED_WHEEL;
+
+   if (tq_init(&res->queue, hashSize, sched) < 0) {
+      if (res->epollFd >= 0)
+         close(res->epollFd);
+      MPOOL_free_pool(res->schedPool);
+      MPOOL_free_pool(res->fdPool);
+      free(res->fdTable);
       free(res);
  	   return NULL;
    }
 
-   res->dbg_queue = pqueue_init(hashSize, cmp_pri, get_pri, set_pri,
-         get_pos, set_pos);
-   if (res->dbg_queue == NULL){
-      free(res->queue);
+   if (tq_init(&res->dbg_queue, hashSize, EVT_SCHED_HEAP) < 0) {
+      tq_free(&res->queue);
+      if (res->epollFd >= 0)
+         close(res->epollFd);
+      MPOOL_free_pool(res->schedPool);
+      MPOOL_free_pool(res->fdPool);
+      free(res->fdTable);
       free(res);
  	   return NULL;
    }
    
    res->evt_timer = ET_default_init();
    if (!res->evt_timer) {
-      free(res->queue);
+      tq_free(&res->queue);
+      tq_free(&res->dbg_queue);
+      if (res->epollFd >= 0)
+         close(res->epollFd);
+      MPOOL_free_pool(res->schedPool);
+      MPOOL_free_pool(res->fdPool);
+      free(res->fdTable);
       free(res);
       return NULL;
    }
    
-   global_evt = res;
+   // The first handler is the process' main loop; later ones (such as
+   //  command shards) don't take over the virtual clock
+   if (!global_evt)
+      global_evt = res;
    res->loop_counter = 0;
    res->timed_event_counter = 0;
    res->fd_event_counter = 0;
@@ -337,10 +754,21 @@ struct EventState *EVT_initWithSize(int hashSize, EVT_debug_state_cb debug_cb,
    res->dbg_step = 0;
    memset(&res->null_evt, 0, sizeof(res->null_evt));
    res->null_evt.callback = null_evt_callback;
+   evt_post_init(res);
 
    return res;
 }
 
+/* Initializes an EventState with a given hash size.
+ * @param hashSize The hash size of the event handler.
+ * @return A pointer to the new EventState
+ */
+struct EventState *EVT_initWithSize(int hashSize, EVT_debug_state_cb debug_cb,
+        void *arg)
+{
+   return evt_init(hashSize, debug_cb, arg, EVT_BACKEND_DEFAULT);
+}
+
 /* Initializes an EventState with a hash size of 19
  * @return A pointer to the new EventState
  */
@@ -349,6 +777,48 @@ EVTHandler *EVT_create_handler(EVT_debug_state_cb debug_cb, void *arg)
    return (EVTHandler *)EVT_initWithSize(19, debug_cb, arg);
 }
 
+EVTHandler *EVT_create_handler_with_backend(EVT_debug_state_cb debug_cb,
+      void *arg, enum EVTBackend backend)
+{
+   return (EVTHandler *)evt_init(19, debug_cb, arg, backend);
+}
+
+enum EVTBackend EVT_get_backend(EVTHandler *handler)
+{
+   return handler->backend;
+}
+
+int EVT_set_scheduler(EVTHandler *handler, enum EVTScheduler sched)
+{
+   struct TimedEventQueue old;
+   struct TimedEventQueueMove move;
+
+   if (sched == EVT_SCHED_DEFAULT)
+      sched = EVT_SCHED_HEAP;
+   if (sched == EVT_get_scheduler(handler))
+      return 0;
+
+   old = handler->queue;
+   if (tq_init(&handler->queue, handler->hashSize, sched) < 0) {
+      handler->queue = old;
+      return -1;
+   }
+
+   // Every event already points at handler->queue, so only the
+   //  backing storage changes
+   move.src = &old;
+   move.dst = &handler->queue;
+   tq_foreach(&old, &tq_move_event, &move);
+   tq_free(&old);
+
+   return 0;
+}
+
+enum EVTScheduler EVT_get_scheduler(EVTHandler *handler)
+{
+   return handler->queue.wheel ? EVT_SCHED_WHEEL : EVT_SCHED_HEAP;
+}
+
 struct timeval EVT_sched_remaining(EVTHandler *handler, void *eventId)
 {
    ScheduleCB *evt = (ScheduleCB*)eventId;
@@ -379,10 +849,9 @@ static int EVT_remove_internal(struct EventState *ctx, struct EventCB **curr,
    tmp->cb[event] = NULL;
    tmp->cleanup[event] = NULL;
    tmp->arg[event] = NULL;
-   FD_CLR(tmp->fd, &ctx->eventSet[event]);
-   FD_CLR(tmp->fd, &ctx->blockedSet[event]);
+   evt_sync_fd(ctx, tmp);
 
-	if (tmp->fd == ctx->maxFds[event]) {
+	if (ctx->backend == EVT_BACKEND_SELECT && tmp->fd == ctx->maxFds[event]) {
       ctx->maxFds[event] = 0;;
       if (ctx->eventCnt[event] > 0) {
       	//Find next highest
@@ -407,17 +876,31 @@ static int EVT_remove_internal(struct EventState *ctx, struct EventCB **curr,
    }
 
    if (deleteIt) {
-      *curr = tmp->next;
-      free(tmp);
+      *curr = NULL;
+      // Keep the loop paused if the debugger was stopped on this descriptor
+      if (ctx->next_fd_event == tmp) {
+         ctx->next_fd_event = NULL;
+         if (!ctx->next_timed_event)
+            ctx->next_timed_event = &ctx->null_evt;
+      }
+      evt_fd_release(ctx, tmp);
    }
 
    return deleteIt;
 }
 
+static void tq_free_event(void *evt, void *arg)
+{
+   EVTHandler *ctx = (EVTHandler*)arg;
+   ScheduleCB *sched = (ScheduleCB*)evt;
+
+   tq_remove(sched->queue, sched);
+   evt_sched_release(ctx, sched);
+}
+
 void EVT_free_handler(EVTHandler *ctx)
 {
    int i, event;
-   ScheduleCB *curProc;
 
    if (!ctx)
       return;
@@ -427,51 +910,41 @@ void EVT_free_handler(EVTHandler *ctx)
 
    if (ctx->evt_timer)
       ctx->evt_timer->cleanup(ctx->evt_timer);
-   global_evt = NULL;
+   if (global_evt == ctx)
+      global_evt = NULL;
+
+   evt_post_cleanup(ctx);
 
    if (ctx->breakpoint_evt)
       EVT_sched_remove(ctx, ctx->breakpoint_evt);
    if (ctx->dump_evt)
       EVT_sched_remove(ctx, ctx->dump_evt);
 
-   for(i = 0; i < ctx->hashSize; i++){
-      while(ctx->events[i]){
-         for(event = 0; event < EVENT_MAX; event++){
-            EVT_remove_internal(ctx, &ctx->events[i], event);
-         }
+   for(i = 0; i < ctx->fdTableSize; i++){
+      for(event = 0; event < EVENT_MAX && ctx->fdTable[i]; event++){
+         EVT_remove_internal(ctx, &ctx->fdTable[i], event);
       }
    }
 
-   while ((curProc = pqueue_peek(ctx->queue))) {
-       pqueue_pop(ctx->queue);
-       // Call the callback and see if it wants to be kept
-       if (curProc != &ctx->null_evt)
-          free(curProc);
-   }
+   tq_foreach(&ctx->queue, &tq_free_event, ctx);
+   tq_foreach(&ctx->dbg_queue, &tq_free_event, ctx);
 
-   while ((curProc = pqueue_peek(ctx->dbg_queue))) {
-       pqueue_pop(ctx->dbg_queue);
-       // Call the callback and see if it wants to be kept
-       if (curProc != &ctx->null_evt)
-          free(curProc);
-   }
+   while (ctx->loopHooks)
+      EVT_loop_hook_remove(ctx, ctx->loopHooks);
 
-   pqueue_free(ctx->queue);
-   pqueue_free(ctx->dbg_queue);
+   tq_free(&ctx->queue);
+   tq_free(&ctx->dbg_queue);
+   if (ctx->epollFd >= 0)
+      close(ctx->epollFd);
+   MPOOL_free_pool(ctx->schedPool);
+   MPOOL_free_pool(ctx->fdPool);
+   free(ctx->fdTable);
    free(ctx);
 }
 
 void EVT_fd_remove(EVTHandler *ctx, int fd, int event)
 {
-   struct EventCB **curr;
-
-   for (curr = &ctx->events[fd % ctx->hashSize]; *curr; )
-      if ((*curr)->fd == fd) {
-         if (!EVT_remove_internal(ctx, curr, event))
-            curr = &(*curr)->next;
-      }
-      else
-         curr = &(*curr)->next;
+   EVT_remove_internal(ctx, evt_fd_slot(ctx, fd), event);
 }
 
 char EVT_fd_add(EVTHandler *ctx, int fd, int event, EVT_fd_cb cb, void *p)
@@ -482,7 +955,7 @@ char EVT_fd_add(EVTHandler *ctx, int fd, int event, EVT_fd_cb cb, void *p)
 char EVT_fd_add_with_cleanup(EVTHandler *ctx, int fd, int event,
       EVT_fd_cb cb, EVT_fd_cb cleanup_cb, void *p)
 {
-   struct EventCB *curr, **currP;
+   struct EventCB *curr;
    int i;
 
    if (!cb) {
@@ -490,22 +963,25 @@ char EVT_fd_add_with_cleanup(EVTHandler *ctx, int fd, int event,
       return 0;
    }
 
-   for (currP = &ctx->events[fd % ctx->hashSize];
-         *currP && (*currP)->fd != fd;
-         currP = &(*currP)->next)
-      ;
-   curr = *currP;
+   if (ctx->backend == EVT_BACKEND_SELECT && (fd < 0 || fd >= FD_SETSIZE)) {
+      DBG_print(DBG_LEVEL_WARN, "fd %d is out of range for select()\n", fd);
+      return 0;
+   }
+
+   if (fd < 0 || evt_fd_table_grow(ctx, fd) < 0)
+      return 0;
+   curr = ctx->fdTable[fd];
 
    if (!curr) {
-      curr = (struct EventCB*)malloc(sizeof(struct EventCB));
+      curr = (struct EventCB*)MPOOL_alloc(ctx->fdPool);
       if (!curr)
-         return -1;
+         return 0;
 
       memset(curr, 0, sizeof(*curr));
       curr->pausable = 1;
       curr->fd = fd;
-      curr->next = ctx->events[fd % ctx->hashSize];
-      ctx->events[fd % ctx->hashSize] = curr;
+      curr->gen = ++ctx->fdGen;
+      ctx->fdTable[fd] = curr;
    }
    if (!curr->cb[event])
       ctx->eventCnt[event]++;
@@ -519,10 +995,7 @@ char EVT_fd_add_with_cleanup(EVTHandler *ctx, int fd, int event,
    curr->cb[event] = cb;
    curr->cleanup[event] = cleanup_cb;
    curr->arg[event] = p;
-
-   FD_SET(fd, &ctx->eventSet[event]);
-   if (!curr->pausable || !curr->breakpoint[event])
-      FD_SET(fd, &ctx->blockedSet[event]);
+   evt_sync_fd(ctx, curr);
 
    if (fd > ctx->maxFds[event]){
       ctx->maxFds[event] = fd;
@@ -695,43 +1168,53 @@ static int evt_process_timed_event(EVTHandler *ctx,
       curProc->scheduleTime = curTime;
       timeradd(&curProc->nextAwake,
          &curProc->timeStep, &curProc->nextAwake);
-      pqueue_insert(curProc->queue, curProc);
+      tq_insert(curProc->queue, curProc);
    } else {
-      if (curProc != &ctx->null_evt) {
-         free(curProc);
-      }
+      evt_sched_release(ctx, curProc);
    }
 
    return 1;
 }
 
-int evt_process_fd_event(EVTHandler *ctx, struct EventCB **evtCurr, int event,
+/* Runs one fd callback.  The callback may add or remove descriptors, which
+ * can free evt or reallocate the fd table, so the slot is looked up again
+ * by fd before removing the callback.  The pool hands a freed EventCB
+ * straight back to the next registration, so the generation is compared
+ * too, otherwise a callback that closed and re-registered its fd would have
+ * the new registration removed.
+ */
+int evt_process_fd_event(EVTHandler *ctx, struct EventCB *evt, int event,
       int stepping)
 {
    int keep = EVENT_KEEP;
+   int fd;
+   uint32_t gen;
+   struct EventCB **slot;
 
-   if (!evtCurr || !*evtCurr)
+   if (!evt)
       return 1;
 
-   if (!stepping && (*evtCurr)->pausable &&
-         (ctx->break_on_next || (*evtCurr)->breakpoint[event])) {
+   if (!stepping && evt->pausable &&
+         (ctx->break_on_next || evt->breakpoint[event])) {
       if (--ctx->steps_to_break <= 0) {
-         ctx->next_fd_event = *evtCurr;
+         ctx->next_fd_event = evt;
          ctx->next_fd_event_evt = event;
          edbg_breakpoint(ctx);
          return 0;
       }
    }
 
-   if ((*evtCurr)->cb[event]) {
-      (*evtCurr)->counts[event]++;
-      keep = (*(*evtCurr)->cb[event])((*evtCurr)->fd, event,
-                        (*evtCurr)->arg[event]);
+   fd = evt->fd;
+   gen = evt->gen;
+   if (evt->cb[event]) {
+      evt->counts[event]++;
+      keep = (*evt->cb[event])(fd, event, evt->arg[event]);
       ctx->fd_event_counter++;
    }
 
-   if (EVENT_REMOVE == keep)
-      EVT_remove_internal(ctx, evtCurr, event);
+   slot = evt_fd_slot(ctx, fd);
+   if (EVENT_REMOVE == keep && slot && *slot == evt && evt->gen == gen)
+      EVT_remove_internal(ctx, slot, event);
 
    return 1;
 }
@@ -740,30 +1223,400 @@ struct EVT_select_cb_args {
    fd_set *eventSetPtrs[EVENT_MAX];
    int maxFd;
    struct timeval *mono_to;
+#ifdef __linux__
+   int epollFd;
+   int pollOnly;                 // Always-ready fds exist, don't block
+   struct epoll_event epollEvents[EPOLL_BATCH_SIZE];
+#endif
 };
 
-static int select_event_loop_cb(struct EventTimer *et,
-    struct timeval *nextAwake, void *opaque)
+// Shortens the block time so the debugger's monotonic queue gets serviced
+static struct timeval *evt_block_timeout(struct EVT_select_cb_args *args,
+      struct timeval *nextAwake, struct timeval *diff)
 {
-   struct EVT_select_cb_args *args = (struct EVT_select_cb_args*)opaque;
-   struct timeval *to = nextAwake, now, diff;
+   struct timeval *to = nextAwake, now;
 
    if (args->mono_to) {
       ET_default_monotonic(NULL, &now);
       if (timercmp(&now, args->mono_to, >=))
-         diff.tv_sec = diff.tv_usec = 0;
+         diff->tv_sec = diff->tv_usec = 0;
       else
-         timersub(args->mono_to, &now, &diff);
+         timersub(args->mono_to, &now, diff);
 
-      if (!to || timercmp(&diff, to, <))
-         to = &diff;
+      if (!to || timercmp(diff, to, <))
+         to = diff;
    }
 
+   return to;
+}
+
+static int select_event_loop_cb(struct EventTimer *et,
+    struct timeval *nextAwake, void *opaque)
+{
+   struct EVT_select_cb_args *args = (struct EVT_select_cb_args*)opaque;
+   struct timeval diff, *to;
+
+   to = evt_block_timeout(args, nextAwake, &diff);
+
    return select(args->maxFd, args->eventSetPtrs[EVENT_FD_READ],
                   args->eventSetPtrs[EVENT_FD_WRITE],
                   args->eventSetPtrs[EVENT_FD_ERROR], to);
 }
 
+#ifdef __linux__
+static int epoll_event_loop_cb(struct EventTimer *et,
+    struct timeval *nextAwake, void *opaque)
+{
+   struct EVT_select_cb_args *args = (struct EVT_select_cb_args*)opaque;
+   struct timeval diff, *to;
+   int timeout = -1;
+
+   to = evt_block_timeout(args, nextAwake, &diff);
+
+   // Round up so we never wake before a timed event is due
+   if (to) {
+      if (to->tv_sec >= INT32_MAX / 1000)
+         timeout = INT32_MAX;
+      else if (to->tv_sec < 0)
+         timeout = 0;
+      else
+         timeout = to->tv_sec * 1000 + (to->tv_usec + 999) / 1000;
+   }
+   if (args->pollOnly)
+      timeout = 0;
+
+   return epoll_wait(args->epollFd, args->epollEvents, EPOLL_BATCH_SIZE,
+         timeout);
+}
+
+/* Dispatches the descriptors returned by epoll_wait.  The EventCB is looked
+ * up again before each callback because earlier callbacks may have removed it
+ * or grown the fd table.
+ *
+ * @return 0 if a breakpoint stopped processing, otherwise 1
+ */
+static int evt_dispatch_epoll(EVTHandler *ctx, struct EVT_select_cb_args *args,
+      int nready, int fd_paused, int *real_event)
+{
+   int i, event, fd;
+   struct EventCB *evt;
+
+   for (i = 0; i < nready; i++) {
+      fd = args->epollEvents[i].data.fd;
+      for (event = 0; event < EVENT_MAX; event++) {
+         if (!(args->epollEvents[i].events & epoll_ready_flags[event]))
+            continue;
+
+         if (fd < 0 || fd >= ctx->fdTableSize)
+            continue;
+         evt = ctx->fdTable[fd];
+         if (!evt || !evt->cb[event])
+            continue;
+         if (fd_paused && !EVT_UNBLOCKED(evt, event))
+            continue;
+
+         if (!evt_process_fd_event(ctx, evt, event, 0))
+            return 0;
+         *real_event = 1;
+      }
+   }
+
+   return 1;
+}
+
+/* Dispatches the descriptors epoll refused to watch, which are ready on
+ * every iteration just as select() reports them.
+ *
+ * @return 0 if a breakpoint stopped processing, otherwise 1
+ */
+static int evt_dispatch_always_ready(EVTHandler *ctx, int fd_paused,
+      int *real_event)
+{
+   int fd, event;
+   struct EventCB *evt;
+
+   for (fd = 0; fd < ctx->fdTableSize && ctx->alwaysReadyCnt; fd++) {
+      for (event = 0; event < EVENT_MAX; event++) {
+         evt = ctx->fdTable[fd];
+         if (!evt || !evt->alwaysReady || !evt->cb[event])
+            continue;
+         if (fd_paused && !EVT_UNBLOCKED(evt, event))
+            continue;
+
+         if (!evt_process_fd_event(ctx, evt, event, 0))
+            return 0;
+         *real_event = 1;
+      }
+   }
+
+   return 1;
+}
+#endif
+
+void *EVT_loop_hook_add(EVTHandler *ctx, EVT_loop_hook_cb cb, void *arg)
+{
+   struct EVTLoopHook *hook, **itr;
+
+   hook = (struct EVTLoopHook*)malloc(sizeof(*hook));
+   if (!hook)
+      return NULL;
+
+   hook->cb = cb;
+   hook->arg = arg;
+   hook->next = NULL;
+
+   // Hooks run in registration order
+   for (itr = &ctx->loopHooks; *itr; itr = &(*itr)->next)
+      ;
+   *itr = hook;
+
+   return hook;
+}
+
+void EVT_loop_hook_remove(EVTHandler *ctx, void *hookId)
+{
+   struct EVTLoopHook **itr, *hook;
+
+   for (itr = &ctx->loopHooks; *itr; itr = &(*itr)->next) {
+      if (*itr == hookId) {
+         hook = *itr;
+         *itr = hook->next;
+         free(hook);
+         return;
+      }
+   }
+}
+
+static void evt_post_wake(struct EVTPostQueue *q)
+{
+   uint64_t val = 1;
+
+   if (__atomic_exchange_n(&q->signalled, 1, __ATOMIC_SEQ_CST))
+      return;
+
+   // A full pipe or a saturated eventfd already means a wakeup is pending
+   if (write(q->writeFd, &val, q->readFd == q->writeFd ? sizeof(val) : 1) < 0
+         && errno != EAGAIN)
+      DBG_print(DBG_LEVEL_WARN, "Failed to wake event loop: %s\n",
+            strerror(errno));
+}
+
+static void evt_post_push(struct EVTPostQueue *q, struct EVTPostNode *node)
+{
+   struct EVTPostNode *prev;
+
+   __atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+   prev = __atomic_exchange_n(&q->head, node, __ATOMIC_ACQ_REL);
+   __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+// Returns the oldest node, or NULL if the queue is empty.  *busy is set when
+// a producer has claimed head but not yet linked its node.
+static struct EVTPostNode *evt_post_pop(struct EVTPostQueue *q, int *busy)
+{
+   struct EVTPostNode *tail = q->tail;
+   struct EVTPostNode *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+   *busy = 0;
+   if (tail == &q->stub) {
+      if (!next) {
+         *busy = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) != tail;
+         return NULL;
+      }
+      q->tail = tail = next;
+      next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+   }
+
+   if (next) {
+      q->tail = next;
+      return tail;
+   }
+
+   if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) {
+      *busy = 1;
+      return NULL;
+   }
+
+   // tail is the only node; put the stub behind it so it can be popped
+   evt_post_push(q, &q->stub);
+   next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+   if (next) {
+      q->tail = next;
+      return tail;
+   }
+
+   *busy = 1;
+   return NULL;
+}
+
+static int evt_post_read_cb(int fd, char type, void *arg)
+{
+   EVTHandler *ctx = (EVTHandler*)arg;
+   struct EVTPostQueue *q = ctx->postQueue;
+   struct EVTPostNode *node;
+   char drain[64];
+   int count, busy = 0;
+
+   while (read(fd, drain, sizeof(drain)) > 0 && q->readFd != q->writeFd)
+      ;
+
+   // Clear the flag before popping so a post that races the drain below
+   // either gets popped now or writes a fresh wakeup.
+   __atomic_store_n(&q->signalled, 0, __ATOMIC_SEQ_CST);
+
+   for (count = 0; count < EVT_POST_BATCH; count++) {
+      node = evt_post_pop(q, &busy);
+      if (!node)
+         break;
+
+      if (node->msg_cb)
+         node->msg_cb(node->arg, node->msg, node->len);
+      else
+         node->cb(node->arg);
+      free(node);
+   }
+
+   // Come back on the next iteration for a full batch, or for a producer
+   // that was preempted mid-push, rather than blocking the loop here.
+   if (count == EVT_POST_BATCH || busy)
+      evt_post_wake(q);
+
+   return EVENT_KEEP;
+}
+
+static void evt_post_init(EVTHandler *ctx)
+{
+   struct EVTPostQueue *q;
+   int fds[2];
+
+   q = (struct EVTPostQueue*)malloc(sizeof(*q));
+   if (!q)
+      return;
+   memset(q, 0, sizeof(*q));
+   q->head = q->tail = &q->stub;
+
+#ifdef __linux__
+   fds[0] = fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if (fds[0] < 0) {
+#else
+   {
+#endif
+      if (pipe(fds) < 0) {
+         DBG_print(DBG_LEVEL_WARN, "Failed to create post fd: %s\n",
+               strerror(errno));
+         free(q);
+         return;
+      }
+      fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+      fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+      fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+      fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+   }
+   q->readFd = fds[0];
+   q->writeFd = fds[1];
+
+   ctx->postQueue = q;
+   EVT_fd_add(ctx, q->readFd, EVENT_FD_READ, &evt_post_read_cb, ctx);
+   EVT_fd_set_name(ctx, q->readFd, "Post queue");
+}
+
+static void evt_post_cleanup(EVTHandler *ctx)
+{
+   struct EVTPostQueue *q = ctx->postQueue;
+   struct EVTPostNode *node;
+   int busy;
+
+   if (!q)
+      return;
+
+   EVT_fd_remove(ctx, q->readFd, EVENT_FD_READ);
+   while ((node = evt_post_pop(q, &busy)))
+      free(node);
+   close(q->readFd);
+   if (q->writeFd != q->readFd)
+      close(q->writeFd);
+   ctx->postQueue = NULL;
+   free(q);
+}
+
+static int evt_post_node(EVTHandler *ctx, struct EVTPostNode *node)
+{
+   struct EVTPostQueue *q = ctx ? ctx->postQueue : NULL;
+
+   if (!q) {
+      free(node);
+      return -1;
+   }
+
+   evt_post_push(q, node);
+   evt_post_wake(q);
+
+   return 0;
+}
+
+int EVT_post(EVTHandler *ctx, EVT_post_cb cb, void *arg)
+{
+   struct EVTPostNode *node;
+
+   if (!cb)
+      return -1;
+
+   node = (struct EVTPostNode*)malloc(sizeof(*node));
+   if (!node)
+      return -1;
+   node->cb = cb;
+   node->msg_cb = NULL;
+   node->arg = arg;
+   node->len = 0;
+
+   return evt_post_node(ctx, node);
+}
+
+int EVT_post_msg(EVTHandler *ctx, EVT_post_msg_cb cb, void *arg,
+      const struct iovec *iov, int iovcnt)
+{
+   struct EVTPostNode *node;
+   size_t len = 0;
+   int i;
+
+   if (!cb || iovcnt < 0 || (iovcnt && !iov))
+      return -1;
+   for (i = 0; i < iovcnt; i++) {
+      if (iov[i].iov_len && !iov[i].iov_base)
+         return -1;
+      len += iov[i].iov_len;
+   }
+
+   node = (struct EVTPostNode*)malloc(sizeof(*node) + len);
+   if (!node)
+      return -1;
+   node->cb = NULL;
+   node->msg_cb = cb;
+   node->arg = arg;
+   node->len = 0;
+   for (i = 0; i < iovcnt; i++) {
+      memcpy(node->msg + node->len, iov[i].iov_base, iov[i].iov_len);
+      node->len += iov[i].iov_len;
+   }
+
+   return evt_post_node(ctx, node);
+}
+
+char EVT_loop_running(EVTHandler *ctx)
+{
+   return ctx && ctx->inLoop;
+}
+
+static void evt_run_loop_hooks(EVTHandler *ctx)
+{
+   struct EVTLoopHook *hook, *next;
+
+   for (hook = ctx->loopHooks; hook; hook = next) {
+      next = hook->next;
+      hook->cb(hook->arg);
+   }
+}
+
 char EVT_start_loop(EVTHandler *ctx)
 {
    fd_set eventSets[EVENT_MAX];
@@ -771,17 +1624,18 @@ char EVT_start_loop(EVTHandler *ctx)
    int i;
    int retval;
    int event, fd;
-   struct EventCB **evtCurr;
    int startEvent = EVENT_FD_READ;
    int startFd = 0;
-   struct timeval curTime, *nextAwake;
+   struct timeval curTime, *nextAwake, wakeTime, monoWake;
    ScheduleCB *curProc;
    int time_paused = 0;
    int fd_paused = 0;
    int real_event;
+   char result = 0;
 
    ctx->break_on_next = ctx->initialDebuggerState == EDBG_STOPPED;
    edbg_init(ctx);
+   ctx->inLoop = 1;
 
    while(ctx->keepGoing) {
       real_event = 0;
@@ -794,7 +1648,7 @@ char EVT_start_loop(EVTHandler *ctx)
          real_event = 1;
       }
       if (ctx->dbg_step && ctx->next_fd_event) {
-         evt_process_fd_event(ctx, &ctx->next_fd_event,
+         evt_process_fd_event(ctx, ctx->next_fd_event,
                ctx->next_fd_event_evt, 1);
          ctx->next_fd_event = NULL;
          ctx->debuggerState = EDBG_ENABLED;
@@ -802,9 +1656,17 @@ char EVT_start_loop(EVTHandler *ctx)
       }
       ctx->dbg_step = 0;
 
+      // Let deferred work (e.g., queued datagrams) finish before blocking
+      evt_run_loop_hooks(ctx);
+
       time_paused = fd_paused = ctx->next_timed_event || ctx->next_fd_event;
 
-      for (i = 0; i < EVENT_MAX; i++) {
+      if (ctx->backend == EVT_BACKEND_EPOLL && ctx->epollPaused != fd_paused) {
+         ctx->epollPaused = fd_paused;
+         evt_sync_all_fds(ctx);
+      }
+
+      for (i = 0; ctx->backend == EVT_BACKEND_SELECT && i < EVENT_MAX; i++) {
          if (ctx->eventCnt[i] > 0) {
             args.eventSetPtrs[i] = &eventSets[i];
             if (fd_paused)
@@ -820,49 +1682,73 @@ char EVT_start_loop(EVTHandler *ctx)
 
       args.maxFd = ctx->maxFd + 1;
       args.mono_to = NULL;
+#ifdef __linux__
+      args.epollFd = ctx->epollFd;
+      args.pollOnly = ctx->alwaysReadyCnt > 0;
+#endif
 
-      curProc = pqueue_peek(ctx->queue);
-      if (!time_paused && curProc)
-         nextAwake = &curProc->nextAwake;
-      else
-         nextAwake = NULL;
+      nextAwake = NULL;
+      if (!time_paused) {
+         ctx->evt_timer->get_monotonic_time(ctx->evt_timer, &curTime);
+         if (tq_next_awake(&ctx->queue, &curTime, &wakeTime))
+            nextAwake = &wakeTime;
+      }
 
-      curProc = pqueue_peek(ctx->dbg_queue);
-      if (curProc)
-         args.mono_to = &curProc->nextAwake;
+      ET_default_monotonic(NULL, &curTime);
+      if (tq_next_awake(&ctx->dbg_queue, &curTime, &monoWake))
+         args.mono_to = &monoWake;
       
       // Call blocking function of event timer
-      retval = ctx->evt_timer->block(ctx->evt_timer, nextAwake, time_paused,
-                     &select_event_loop_cb, &args);
+#ifdef __linux__
+      if (ctx->backend == EVT_BACKEND_EPOLL)
+         retval = ctx->evt_timer->block(ctx->evt_timer, nextAwake,
+                     time_paused, &epoll_event_loop_cb, &args);
+      else
+#endif
+         retval = ctx->evt_timer->block(ctx->evt_timer, nextAwake,
+                     time_paused, &select_event_loop_cb, &args);
 
       // Process Timed Events
-      while (!time_paused && (curProc = pqueue_peek(ctx->queue))) {
+      while (!time_paused) {
          ctx->evt_timer->get_monotonic_time(ctx->evt_timer, &curTime);
+         curProc = tq_peek(&ctx->queue, &curTime);
 
-         if (timercmp(&curProc->nextAwake, &curTime, >)) {
+         if (!curProc || timercmp(&curProc->nextAwake, &curTime, >)) {
             // Event is not yet ready
             break;
          }
-         pqueue_pop(ctx->queue);
+         tq_pop(&ctx->queue);
          curProc->pos = SIZE_MAX;
          if (!evt_process_timed_event(ctx, curProc, curTime, 0))
             goto next_loop_iteration;
          real_event = 1;
       }
 
-      while ((curProc = pqueue_peek(ctx->dbg_queue))) {
+      while (1) {
          ET_default_monotonic(NULL, &curTime);
+         curProc = tq_peek(&ctx->dbg_queue, &curTime);
 
-         if (timercmp(&curProc->nextAwake, &curTime, >)) {
+         if (!curProc || timercmp(&curProc->nextAwake, &curTime, >)) {
             // Event is not yet ready
             break;
          }
          curProc->pos = SIZE_MAX;
-         pqueue_pop(ctx->dbg_queue);
+         tq_pop(&ctx->dbg_queue);
          evt_process_timed_event(ctx, curProc, curTime, 1);
       }
 
       /* Process FD events */
+#ifdef __linux__
+      if (ctx->backend == EVT_BACKEND_EPOLL && ctx->alwaysReadyCnt &&
+            !evt_dispatch_always_ready(ctx, fd_paused, &real_event))
+         goto next_loop_iteration;
+
+      if (retval > 0 && ctx->backend == EVT_BACKEND_EPOLL) {
+         if (!evt_dispatch_epoll(ctx, &args, retval, fd_paused, &real_event))
+            goto next_loop_iteration;
+      }
+      else
+#endif
       if (retval > 0) {
          event = startEvent;
          startFd = (startFd + 1) % args.maxFd;
@@ -873,14 +1759,11 @@ char EVT_start_loop(EVTHandler *ctx)
                do {
                   if (FD_ISSET(fd, args.eventSetPtrs[event])) {
                      retval--;
-                     for(evtCurr = &ctx->events[fd % ctx->hashSize];
-                           *evtCurr; evtCurr = &(*evtCurr)->next) {
-                        if ((*evtCurr)->fd != fd)
-                           continue;
-                        if (!evt_process_fd_event(ctx, evtCurr, event, 0))
+                     if (fd < ctx->fdTableSize && ctx->fdTable[fd]) {
+                        if (!evt_process_fd_event(ctx, ctx->fdTable[fd],
+                                 event, 0))
                            goto next_loop_iteration;
                         real_event = 1;
-                        break;
                      }
                   }
                   fd = (fd + 1) % args.maxFd;
@@ -903,11 +1786,13 @@ char EVT_start_loop(EVTHandler *ctx)
             if (!EVT_clean_fdsets(ctx)) {
                errno = EBADF;
                perror("Unrecoverable error in EVT_loop");
-               return -1;
+               result = -1;
+               break;
             }
          } else {
             perror("Unrecoverable error in EVT_loop");
-            return -1;
+            result = -1;
+            break;
          }
       }
 
@@ -918,7 +1803,10 @@ next_loop_iteration:
          edbg_report_state(ctx, ctx->full_dump_format);
    }
 
-   return 0;
+   ctx->inLoop = 0;
+   evt_run_loop_hooks(ctx);
+
+   return result;
 }
 
 /**
@@ -937,7 +1825,7 @@ void *EVT_sched_add(EVTHandler *handler, struct timeval time,
 {
    ScheduleCB *newSchedCB;
 
-   newSchedCB = malloc(sizeof(ScheduleCB));
+   newSchedCB = (ScheduleCB*)MPOOL_alloc(handler->schedPool);
    if (!newSchedCB){
      return NULL;
    }
@@ -947,16 +1835,16 @@ void *EVT_sched_add(EVTHandler *handler, struct timeval time,
    timeradd(&newSchedCB->scheduleTime, &time, &newSchedCB->nextAwake);
    newSchedCB->callback = cb;
    newSchedCB->arg = arg;
-   newSchedCB->queue = handler->queue;
-   newSchedCB->name[0] = 0;
+   newSchedCB->queue = &handler->queue;
+   newSchedCB->name = NULL;
    newSchedCB->breakpoint = 0;
    newSchedCB->count = 0;
 
-   if (0 == pqueue_insert(newSchedCB->queue, newSchedCB)){
+   if (0 == tq_insert(newSchedCB->queue, newSchedCB)){
      return newSchedCB;
    }
 
-   free(newSchedCB);
+   evt_sched_release(handler, newSchedCB);
    return NULL;
 }
 
@@ -977,7 +1865,7 @@ void *EVT_sched_add_with_timestep(EVTHandler *handler, struct timeval time,
 {
    ScheduleCB *newSchedCB;
 
-   newSchedCB = malloc(sizeof(ScheduleCB));
+   newSchedCB = (ScheduleCB*)MPOOL_alloc(handler->schedPool);
    if (!newSchedCB)
       return NULL;
 
@@ -986,29 +1874,19 @@ void *EVT_sched_add_with_timestep(EVTHandler *handler, struct timeval time,
    timeradd(&newSchedCB->scheduleTime, &time, &newSchedCB->nextAwake);
    newSchedCB->callback = cb;
    newSchedCB->arg = arg;
-   newSchedCB->queue = handler->queue;
-   newSchedCB->name[0] = 0;
+   newSchedCB->queue = &handler->queue;
+   newSchedCB->name = NULL;
    newSchedCB->breakpoint = 0;
+   newSchedCB->count = 0;
 
-   if (0 == pqueue_insert(newSchedCB->queue, newSchedCB)){
+   if (0 == tq_insert(newSchedCB->queue, newSchedCB)){
       return newSchedCB;
    }
 
-   free(newSchedCB);
+   evt_sched_release(handler, newSchedCB);
    return NULL;
 }
 
-struct timeval EVT_sched_remaining(EVTHandler *handler, void *eventId)
-{
-   ScheduleCB *evt = (ScheduleCB*)eventId;
-   struct timeval now, result;
-
-   handler->evt_timer->get_monotonic_time(handler->evt_timer, &now);
-   timersub(&evt->nextAwake, &now, &result);
-
-   return result;
-}
-
 /**
  * Remove a scheduled event.
  *
@@ -1029,14 +1907,12 @@ void *EVT_sched_remove(EVTHandler *handler, void *eventId)
 
    if (SIZE_MAX == evt->pos) {
       result = evt->arg;
-      if (evt != &handler->null_evt)
-         free(evt);
+      evt_sched_release(handler, evt);
    }
-   else if (0 == pqueue_remove(evt->queue, eventId)) {
+   else if (0 == tq_remove(evt->queue, evt)) {
       evt->pos = SIZE_MAX;
       result = evt->arg;
-      if (evt != &handler->null_evt)
-         free(evt);
+      evt_sched_release(handler, evt);
    }
 
    return result;
@@ -1060,7 +1936,7 @@ char EVT_sched_update(EVTHandler *handler, void *eventId, struct timeval time)
       return 1;
    }
 
-   if (evt->queue == handler->queue)
+   if (evt->queue == &handler->queue)
       handler->evt_timer->get_monotonic_time(handler->evt_timer,
             &evt->scheduleTime);
    else
@@ -1068,7 +1944,7 @@ char EVT_sched_update(EVTHandler *handler, void *eventId, struct timeval time)
 
    timeradd(&evt->scheduleTime, &time, &evt->nextAwake);
    evt->timeStep = time;
-   pqueue_change_priority(evt->queue, evt->nextAwake, evt);
+   tq_change(evt->queue, evt);
 
    return 0;
 }
@@ -1091,11 +1967,11 @@ char EVT_sched_move_to_mono(EVTHandler *handler, void *eventId)
       return 1;
    }
 
-   pqueue_remove(evt->queue, eventId);
+   tq_remove(evt->queue, evt);
    ET_default_monotonic(NULL, &evt->scheduleTime);
    timeradd(&evt->scheduleTime, &evt->timeStep, &evt->nextAwake);
-   evt->queue = handler->dbg_queue;
-   pqueue_insert(evt->queue, evt);
+   evt->queue = &handler->dbg_queue;
+   tq_insert(evt->queue, evt);
 
    return 0;
 }
@@ -1121,7 +1997,7 @@ char EVT_sched_update_partial_credit(EVTHandler *handler, void *eventId,
 
    timeradd(&evt->scheduleTime, &time, &evt->nextAwake);
 
-   if (evt->queue == handler->queue)
+   if (evt->queue == &handler->queue)
       handler->evt_timer->get_monotonic_time(handler->evt_timer, &now);
    else
       ET_default_monotonic(NULL, &now);
@@ -1130,7 +2006,7 @@ char EVT_sched_update_partial_credit(EVTHandler *handler, void *eventId,
       evt->nextAwake = now;
 
    evt->timeStep = time;
-   pqueue_change_priority(evt->queue, evt->nextAwake, evt);
+   tq_change(evt->queue, evt);
 
    return 0;
 }
@@ -1140,10 +2016,11 @@ void EVT_sched_set_name(void *eventId, const char *fmt, ...)
    va_list ap;
    ScheduleCB *evt = (ScheduleCB*)eventId;
 
+   free(evt->name);
    va_start(ap, fmt);
-   vsnprintf(evt->name, sizeof(evt->name), fmt, ap);
+   if (vasprintf(&evt->name, fmt, ap) < 0)
+      evt->name = NULL;
    va_end(ap);
-   evt->name[sizeof(evt->name) - 1] = 0;
 }
 
 void EVT_fd_set_name(EVTHandler *ctx, int fd, const char *fmt, ...)
@@ -1151,13 +2028,14 @@ void EVT_fd_set_name(EVTHandler *ctx, int fd, const char *fmt, ...)
    va_list ap;
    struct EventCB *curr;
 
-   for (curr = ctx->events[fd % ctx->hashSize]; curr; curr = curr->next) {
-      if (curr->fd == fd) {
-         va_start(ap, fmt);
-         vsnprintf(curr->name, sizeof(curr->name), fmt, ap);
-         va_end(ap);
-         curr->name[sizeof(curr->name) - 1] = 0;
-      }
+   struct EventCB **slot = evt_fd_slot(ctx, fd);
+
+   if (slot && (curr = *slot)) {
+      free(curr->name);
+      va_start(ap, fmt);
+      if (vasprintf(&curr->name, fmt, ap) < 0)
+         curr->name = NULL;
+      va_end(ap);
    }
 }
 
@@ -1338,6 +2216,24 @@ static int edbg_dump_cb(void *arg)
    return EVENT_KEEP;
 }
 
+struct EDBGTimedEventSearch {
+   void *id;
+   void *callback;
+   ScheduleCB *found;
+};
+
+static void edbg_find_timed_event(void *evt, void *arg)
+{
+   struct EDBGTimedEventSearch *find = (struct EDBGTimedEventSearch*)arg;
+   ScheduleCB *sched = (ScheduleCB*)evt;
+
+   if (find->found)
+      return;
+   if ((find->id && find->id == evt) ||
+         (find->callback && find->callback == (void*)sched->callback))
+      find->found = sched;
+}
+
 static int edbg_client_msg(struct ZMQLClient *client, const void *data,
       size_t dataLen, void *arg)
 {
@@ -1347,7 +2243,7 @@ static int edbg_client_msg(struct ZMQLClient *client, const void *data,
    int steps;
    void *id;
    ScheduleCB *evt;
-   size_t i;
+   struct EDBGTimedEventSearch find;
 
    if (json_get_string_prop(data, dataLen, "command", &cmd) < 0)
       return 0;
@@ -1415,22 +2311,23 @@ static int edbg_client_msg(struct ZMQLClient *client, const void *data,
    }
    else if (!strcasecmp(cmd, "set_timed_breakpoint") || 
             !strcasecmp(cmd, "clear_timed_breakpoint") ) {
-      evt = NULL;
+      find.id = NULL;
+      find.callback = NULL;
+      find.found = NULL;
       if (json_get_ptr_prop(data, dataLen, "id", &id) >= 0) {
-         for (i = 1; !evt && i <=  pqueue_size(ctx->queue); i++)
-            if (ctx->queue->d[i] == id)
-               evt = id;
+         find.id = id;
+         tq_foreach(&ctx->queue, &edbg_find_timed_event, &find);
       }
       else if (json_get_string_prop(data, dataLen, "function", &func) >= 0) {
          if (func) {
-            id = dlsym(RTLD_DEFAULT, func);
+            find.callback = dlsym(RTLD_DEFAULT, func);
             free(func);
-            for (i = 1; id && !evt && i <=  pqueue_size(ctx->queue); i++)
-               if ( ((ScheduleCB*)ctx->queue->d[i])->callback == id)
-                  evt = ctx->queue->d[i];
+            if (find.callback)
+               tq_foreach(&ctx->queue, &edbg_find_timed_event, &find);
          }
       }
 
+      evt = find.found;
       if (evt) {
          if (!strcasecmp(cmd, "set_timed_breakpoint"))
             evt->breakpoint = 1;
@@ -1535,7 +2432,7 @@ static void edbg_report_timed_event(struct IPCBuffer *json, ScheduleCB *data,
          "      \"name\":\"%s\",\n"
          "      \"function\":\"%s\",\n",
          (uintptr_t)data,
-         data->name[0] ? data->name : get_function_name((void *)data->callback),
+         data->name ? data->name : get_function_name((void *)data->callback),
          get_function_name((void *)data->callback));
 
    ipc_printf_buffer(json,
@@ -1555,24 +2452,38 @@ static void edbg_report_timed_event(struct IPCBuffer *json, ScheduleCB *data,
          data->timeStep.tv_usec, (uintptr_t)data->arg, data->count);
 }
 
+struct EDBGTimedEventReport {
+   struct IPCBuffer *json;
+   struct timeval *cur_time;
+   int first;
+};
+
+static void edbg_report_queued_event(void *evt, void *arg)
+{
+   struct EDBGTimedEventReport *rpt = (struct EDBGTimedEventReport*)arg;
+
+   edbg_report_timed_event(rpt->json, (ScheduleCB *)evt, rpt->cur_time,
+         rpt->first);
+   rpt->first = 0;
+}
+
 static void edbg_report_timed_events(struct IPCBuffer *json, EVTHandler *ctx,
          struct timeval *cur_time)
 {
-   size_t i;
-   int first = 1;
+   struct EDBGTimedEventReport rpt;
+
+   rpt.json = json;
+   rpt.cur_time = cur_time;
+   rpt.first = 1;
 
    ipc_printf_buffer(json, "  \"timed_events\": [\n");
 
    if (ctx->next_timed_event) {
-      edbg_report_timed_event(json, ctx->next_timed_event, cur_time, first);
-      first = 0;
+      edbg_report_timed_event(json, ctx->next_timed_event, cur_time, 1);
+      rpt.first = 0;
    }
 
-   for (i = 1; i <=  pqueue_size(ctx->queue); i++) {
-      edbg_report_timed_event(json, (ScheduleCB *)ctx->queue->d[i],
-            cur_time, first);
-      first = 0;
-   }
+   tq_foreach(&ctx->queue, &edbg_report_queued_event, &rpt);
    ipc_printf_buffer(json, "\n  ],\n");
 }
 
@@ -1598,7 +2509,7 @@ static void edbg_report_fd_event(struct IPCBuffer *json, struct EventCB *data,
          "      \"name\":\"%s\",\n"
          "      \"filename\":\"%s\",\n"
          "      \"arg_pointer\":%"PRIdPTR",\n",
-         (uintptr_t)data, data->name[0] ? data->name : filename,
+         (uintptr_t)data, data->name ? data->name : filename,
          filename, (uintptr_t)data->arg);
 
    if (data->cb[EVENT_FD_READ])
@@ -1640,8 +2551,8 @@ static void edbg_report_fd_events(struct IPCBuffer *json, EVTHandler *ctx)
 
    ipc_printf_buffer(json, "  \"fd_events\": [\n");
 
-   for (i = 0; i < ctx->hashSize; i++)
-      for (curr = ctx->events[i]; curr; curr = curr->next) {
+   for (i = 0; i < ctx->fdTableSize; i++)
+      if ((curr = ctx->fdTable[i])) {
          edbg_report_fd_event(json, curr, first);
          first = 0;
       }
@@ -1651,6 +2562,18 @@ static void edbg_report_fd_events(struct IPCBuffer *json, EVTHandler *ctx)
    ipc_printf_buffer(json, "  ],\n");
 }
 
+static void edbg_report_pool(struct IPCBuffer *json, const char *name,
+      struct MemPool *pool)
+{
+   struct MemPoolStats stats;
+
+   MPOOL_get_stats(pool, &stats);
+   ipc_printf_buffer(json,
+         "  \"%s\": { \"live\":%zu, \"peak\":%zu, \"free\":%zu, "
+         "\"slabs\":%zu },\n",
+         name, stats.live, stats.peak, stats.free, stats.slabs);
+}
+
 static void edbg_report_state(EVTHandler *ctx, uint8_t full_format)
 {
    struct timeval curr_time;
@@ -1670,6 +2593,8 @@ static void edbg_report_state(EVTHandler *ctx, uint8_t full_format)
          ctx->loop_counter, 
          ctx->debuggerState == EDBG_STOPPED ? "stopped" : "running",
          ctx->dbgPort, ctx->timed_event_counter, ctx->fd_event_counter);
+   edbg_report_pool(ctx->dbgBuffer, "timed_event_pool", ctx->schedPool);
+   edbg_report_pool(ctx->dbgBuffer, "fd_event_pool", ctx->fdPool);
 
    if (ctx->debuggerStateCB)
       ctx->debuggerStateCB(ctx->dbgBuffer, ctx->debuggerStateArg);
@@ -1706,20 +2631,12 @@ void EVT_set_debugger_port(EVTHandler *handler, int port)
 void evt_fd_set_pausable(EVTHandler *ctx, int fd, char pausable)
 {
    struct EventCB *curr;
-   int event;
 
-   for (curr = ctx->events[fd % ctx->hashSize]; curr; curr = curr->next) {
-      if (curr->fd == fd) {
-         curr->pausable = pausable;
+   struct EventCB **slot = evt_fd_slot(ctx, fd);
 
-         for (event = 0; event < EVENT_MAX; event++) {
-            if (curr->cb[event] &&
-                      (!curr->pausable || !curr->breakpoint[event]) )
-               FD_SET(fd, &ctx->blockedSet[event]);
-            else
-               FD_CLR(fd, &ctx->blockedSet[event]);
-         }
-      }
+   if (slot && (curr = *slot)) {
+      curr->pausable = pausable;
+      evt_sync_fd(ctx, curr);
    }
 }
 
@@ -1728,16 +2645,11 @@ void evt_fd_set_paused(EVTHandler *ctx, int fd, char paused)
    struct EventCB *curr;
    int event;
 
-   for (curr = ctx->events[fd % ctx->hashSize]; curr; curr = curr->next) {
-      if (curr->fd == fd) {
-         for (event = 0; event < EVENT_MAX; event++) {
-            curr->breakpoint[event] = paused;
-            if (curr->cb[event] &&
-                      (!curr->pausable || !curr->breakpoint[event]) )
-               FD_SET(fd, &ctx->blockedSet[event]);
-            else
-               FD_CLR(fd, &ctx->blockedSet[event]);
-         }
-      }
+   struct EventCB **slot = evt_fd_slot(ctx, fd);
+
+   if (slot && (curr = *slot)) {
+      for (event = 0; event < EVENT_MAX; event++)
+         curr->breakpoint[event] = paused;
+      evt_sync_fd(ctx, curr);
    }
 }
@@ -26,6 +26,7 @@
 
 #include <time.h>
 #include <sys/select.h>
+#include <sys/uio.h>
 
 #include "priorityQueue.h"
 #include "ipc.h"
@@ -57,6 +58,27 @@ enum EVTDebuggerState {
 };
 
 
+/// The mechanism used to wait for file descriptor events
+enum EVTBackend {
+   /// Use the preferred backend for the platform (epoll on Linux)
+   EVT_BACKEND_DEFAULT = 0,
+   /// select(2).  Limited to FD_SETSIZE descriptors.
+   EVT_BACKEND_SELECT = 1,
+   /// epoll(7).  Only available on Linux, falls back to select elsewhere.
+   EVT_BACKEND_EPOLL = 2,
+};
+
+/// The data structure used to order timed events
+enum EVTScheduler {
+   /// Use the default scheduler (the binary heap)
+   EVT_SCHED_DEFAULT = 0,
+   /// Binary heap.  O(log n) insert and cancel.
+   EVT_SCHED_HEAP = 1,
+   /// Hierarchical timer wheel with 1 ms ticks.  O(1) insert and cancel,
+   /// better suited to many short-lived timers such as command timeouts.
+   EVT_SCHED_WHEEL = 2,
+};
+
 // A callback for a file descriptor event
 typedef int (*EVT_fd_cb)(int fd, char type, void *arg);
 
@@ -75,6 +97,50 @@ typedef struct EventState EVTHandler;
  */
 EVTHandler *EVT_create_handler(EVT_debug_state_cb debug_cb, void *arg);
 
+/**
+ * Create an event handler that waits for file descriptor events using a
+ * specific backend.  The LIBPROC_EVT_BACKEND environment variable
+ * ("select" or "epoll") overrides EVT_BACKEND_DEFAULT.
+ *
+ * @param arg Context parameter passed to debugging related functions.
+ * @param backend The file descriptor backend to use.
+ *
+ * @return The event handler.
+ */
+EVTHandler *EVT_create_handler_with_backend(EVT_debug_state_cb debug_cb,
+      void *arg, enum EVTBackend backend);
+
+/**
+ * Retrieve the file descriptor backend used by an event handler.
+ *
+ * @param handler The event handler.
+ *
+ * @return EVT_BACKEND_SELECT or EVT_BACKEND_EPOLL.
+ */
+enum EVTBackend EVT_get_backend(EVTHandler *handler);
+
+/**
+ * Select the data structure used to store timed events.  Events that are
+ * already scheduled are moved to the new structure.  The default can also
+ * be changed with the LIBPROC_EVT_SCHEDULER environment variable ("heap"
+ * or "wheel").
+ *
+ * @param handler The event handler.
+ * @param sched The scheduler to use.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int EVT_set_scheduler(EVTHandler *handler, enum EVTScheduler sched);
+
+/**
+ * Retrieve the data structure used to store timed events.
+ *
+ * @param handler The event handler.
+ *
+ * @return EVT_SCHED_HEAP or EVT_SCHED_WHEEL.
+ */
+enum EVTScheduler EVT_get_scheduler(EVTHandler *handler);
+
 /**
  * Free an event handler.
  *
@@ -254,6 +320,92 @@ char EVT_start_loop(EVTHandler *handler);
  */
 void EVT_exit_loop(EVTHandler *handler);
 
+/**
+ * Callback type for loop hooks.
+ *
+ * @param arg The argument passed to EVT_loop_hook_add.
+ */
+typedef void (*EVT_loop_hook_cb)(void *arg);
+
+/**
+ * Registers a callback that runs once per event loop iteration, just before
+ * the loop blocks waiting for the next event, and once more when the loop
+ * exits.  Used to batch work generated by several callbacks.
+ *
+ * @param handler The event handler.
+ * @param cb The hook callback.
+ * @param arg The callback argument.
+ *
+ * @return An identifier for EVT_loop_hook_remove, or NULL on failure.
+ */
+void *EVT_loop_hook_add(EVTHandler *handler, EVT_loop_hook_cb cb, void *arg);
+
+/**
+ * Removes a loop hook.
+ *
+ * @param handler The event handler.
+ * @param hook The identifier returned by EVT_loop_hook_add.
+ */
+void EVT_loop_hook_remove(EVTHandler *handler, void *hook);
+
+/**
+ * Callback type for EVT_post.
+ *
+ * @param arg The argument passed to EVT_post.
+ */
+typedef void (*EVT_post_cb)(void *arg);
+
+/**
+ * Callback type for EVT_post_msg.
+ *
+ * @param arg The argument passed to EVT_post_msg.
+ * @param msg The loop's copy of the message.  Only valid during the callback.
+ * @param len The length of the message.
+ */
+typedef void (*EVT_post_msg_cb)(void *arg, void *msg, size_t len);
+
+/**
+ * Queues a callback to run on the handler's event loop thread.  Unlike the
+ * rest of this API it may be called from any thread, which makes it the way
+ * to hand work to a loop running on another thread (including EVT_exit_loop
+ * and EVT_sched_add calls).  Posting never blocks: callbacks are pushed onto
+ * a lock-free queue and the loop is woken through an eventfd, or a pipe
+ * where eventfd is unavailable.  Callbacks run in the order they were posted
+ * by a given thread.  Callbacks still queued when the handler is freed are
+ * dropped without being run.
+ *
+ * @param handler The event handler whose loop runs the callback.
+ * @param cb The callback.
+ * @param arg The callback argument.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int EVT_post(EVTHandler *handler, EVT_post_cb cb, void *arg);
+
+/**
+ * Like EVT_post, but also copies a message that is handed to the callback
+ * on the loop thread, so the sender does not need to keep it alive.  The
+ * message is gathered from an iovec straight into the queued node, so a
+ * header and a payload can be posted without first staging them together.
+ *
+ * @param handler The event handler whose loop runs the callback.
+ * @param cb The callback.
+ * @param arg The callback argument.
+ * @param iov The pieces of the message to copy, in order.
+ * @param iovcnt The number of entries in iov.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int EVT_post_msg(EVTHandler *handler, EVT_post_msg_cb cb, void *arg,
+      const struct iovec *iov, int iovcnt);
+
+/**
+ * Returns non-zero while EVT_start_loop is running on the handler.
+ *
+ * @param handler The event handler.
+ */
+char EVT_loop_running(EVTHandler *handler);
+
 /**
  * Get the system's current absolute GMT time.
  *
@@ -42,9 +42,23 @@
 #include <stdarg.h>
 #include "proclib.h"
 #include "cmd-pkt.h"
+#include "xdr.h"
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
+#include "hashtable.h"
 
 #define WAIT_MS (5 * 1000)
 
+// Messages this long or longer are sent scatter-gather when they carry
+//  opaque fields of at least IPC_IOV_REF_MIN bytes
+#define IPC_IOV_MIN_LEN 2048
+#define IPC_IOV_REF_MIN 512
+#define IPC_IOV_MAX 16
+// Room for everything in a scatter-gather message that is not referenced
+#define IPC_IOV_HDR_LEN 1024
+
 // List of custom services for use if /etc/services lookup fails
 static struct ServiceNames {
    char *name;
@@ -74,13 +88,36 @@ static struct ServiceNames {
    { NULL, 0 },
 };
 
-struct IPCBuffer {
-   size_t allocLen, dataLen;
+#define IPC_CHUNK_SIZE 4096
+#define IPC_WRITE_IOV_MAX 64
+
+// One segment of an IPCBuffer.  Readable bytes are [start, end) and owned
+//  chunks can be appended to in [end, cap).  Borrowed chunks point at
+//  caller memory that is released through freeCb once consumed.
+struct IPCBufferChunk {
+   struct IPCBufferChunk *next;
    char *data;
+   size_t start, end, cap;
+   ipc_buffer_free_cb freeCb;
+   void *freeArg;
+   char owned;
+   char inlineData[];
+};
+
+struct IPCBuffer {
+   struct IPCBufferChunk *head, *tail;
+   size_t dataLen;
 };
 
 // gets socket by service name
+static int socket_init_internal(int port, int reuseport);
+
 int socket_named_init(const char * service)
+{
+   return socket_named_init_reuseport(service, 0);
+}
+
+int socket_named_init_reuseport(const char * service, int reuseport)
 {
    // look up the port number for the service
    uint32_t portNum = 0;
@@ -91,7 +128,7 @@ int socket_named_init(const char * service)
    // Acquire the socket file descriptor if the lookup succeeds
    if (portNum != -1) {
       DBG_print(DBG_LEVEL_INFO, "Binding socket on port %u\n", portNum);
-      fd = socket_init(portNum);
+      fd = socket_init_internal(portNum, reuseport);
    } else {
       DBG_print(DBG_LEVEL_WARN, "Failed to look up %s port number\n", service);
    }
@@ -101,6 +138,16 @@ int socket_named_init(const char * service)
 
 // gets socket by port number
 int socket_init(int port)
+{
+   return socket_init_internal(port, 0);
+}
+
+int socket_init_reuseport(int port)
+{
+   return socket_init_internal(port, 1);
+}
+
+static int socket_init_internal(int port, int reuseport)
 {
    struct sockaddr_in addr;
    int fd;
@@ -125,6 +172,13 @@ int socket_init(int port)
       // Set option to share the port if it's already in use
       int option = 1;
       ERR_WARN(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option)), "set socket options");
+#ifdef SO_REUSEPORT
+      // Let several sockets bind the port, with the kernel spreading
+      //  incoming datagrams across them
+      if (reuseport)
+         ERR_WARN(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &option,
+                  sizeof(option)), "set SO_REUSEPORT");
+#endif
 
       ERR_WARN(bind(fd, (const struct sockaddr *)&addr, sizeof(addr)),
             "Failed to bind socket on port %d\n", port);
@@ -206,10 +260,20 @@ int socket_named_write(int fd, void * buf, size_t bufSize, const char * name)
 // writes data on a socket to destination socket address
 int socket_write(int fd, void * buf, size_t bufSize, struct sockaddr_in * dest)
 {
-   size_t size;
-
-   ERR_WARN(size = sendto(fd, buf, bufSize, 0, (const struct sockaddr *)dest,
-      sizeof(struct sockaddr_in)), "socket_write - sendto\n");
+   ssize_t size;
+   int err;
+
+   size = sendto(fd, buf, bufSize, 0, (const struct sockaddr *)dest,
+      sizeof(struct sockaddr_in));
+
+   // Callers look at errno to tell a full socket from a real failure, so
+   //  keep it intact, and don't report the full socket
+   if (size < 0) {
+      err = errno;
+      if (err != EAGAIN && err != EWOULDBLOCK)
+         ERRNO_WARN("socket_write - sendto\n");
+      errno = err;
+   }
 
    return size;
 }
@@ -220,116 +284,352 @@ int socket_close(int fd)
    return close(fd);
 }
 
-// returns the multicast address associated with a system service
-uint16_t socket_multicast_port_by_name(const char * service)
+#ifndef _PATH_SERVICES
+#define _PATH_SERVICES "/etc/services"
+#endif
+#define SERVICE_HASH_SIZE 257
+#define SERVICE_CHECK_SECS 1
+
+// One name known to the service cache.  Aliases get their own entry so
+//  they can be found by name, but only canonical names are indexed by port.
+struct ServiceCacheEntry {
+   char *name;
+   int port;
+   struct in_addr multicast_addr;
+   uint16_t multicast_port;
+   struct ServiceCacheEntry *next;
+};
+
+// Merged view of the udp services in /etc/services and serverNameList,
+//  hashed by name and by port.  Rebuilt when the file changes.
+static struct ServiceCache {
+   pthread_mutex_t lock;
+   struct HashTable *byName, *byPort;
+   struct ServiceCacheEntry *entries;
+   int loaded;
+   time_t nextCheck;
+   struct stat fileStat;
+   char *path;                      // Overrides _PATH_SERVICES when set
+} serviceCache = { PTHREAD_MUTEX_INITIALIZER };
+
+static size_t service_name_hash_func(void *key)
+{
+   const unsigned char *str = (const unsigned char*)key;
+   size_t hash = 5381;
+
+   while (*str)
+      hash = hash * 33 + *str++;
+
+   return hash;
+}
+
+static int service_name_cmp_key(void *key1, void *key2)
+{
+   return 0 == strcmp((const char*)key1, (const char*)key2);
+}
+
+static void *service_name_key_for_data(void *data)
+{
+   return ((struct ServiceCacheEntry*)data)->name;
+}
+
+static size_t service_port_hash_func(void *key)
+{
+   return (uintptr_t)key;
+}
+
+static int service_port_cmp_key(void *key1, void *key2)
+{
+   return key1 == key2;
+}
+
+static void *service_port_key_for_data(void *data)
+{
+   return (void*)(uintptr_t)((struct ServiceCacheEntry*)data)->port;
+}
+
+// Adds a name to the cache.  The first entry for a name or port wins, which
+//  matches getservbyname / getservbyport reading the file top to bottom.
+static struct ServiceCacheEntry *service_cache_add(const char *name, int port,
+      int canonical)
+{
+   struct ServiceCacheEntry *entry;
+
+   entry = malloc(sizeof(*entry));
+   if (!entry)
+      return NULL;
+   memset(entry, 0, sizeof(*entry));
+   entry->name = strdup(name);
+   if (!entry->name) {
+      free(entry);
+      return NULL;
+   }
+   entry->port = port;
+   entry->next = serviceCache.entries;
+   serviceCache.entries = entry;
+
+   HASH_add_data(serviceCache.byName, entry);
+   if (canonical)
+      HASH_add_data(serviceCache.byPort, entry);
+
+   return entry;
+}
+
+static void service_cache_clear(void)
+{
+   struct ServiceCacheEntry *entry;
+
+   if (serviceCache.byName)
+      HASH_free_table(serviceCache.byName);
+   if (serviceCache.byPort)
+      HASH_free_table(serviceCache.byPort);
+   serviceCache.byName = serviceCache.byPort = NULL;
+
+   while ((entry = serviceCache.entries)) {
+      serviceCache.entries = entry->next;
+      free(entry->name);
+      free(entry);
+   }
+   serviceCache.loaded = 0;
+}
+
+// Parses the udp entries out of the services file
+static void service_cache_load_file(FILE *file)
+{
+   char line[512], *save, *tok, *name, *proto;
+   int port;
+
+   while (fgets(line, sizeof(line), file)) {
+      if ((tok = strchr(line, '#')))
+         *tok = 0;
+
+      name = strtok_r(line, " \t\r\n", &save);
+      tok = strtok_r(NULL, " \t\r\n", &save);
+      if (!name || !tok)
+         continue;
+      proto = strchr(tok, '/');
+      if (!proto || strcmp(proto + 1, "udp"))
+         continue;
+      *proto = 0;
+      port = atoi(tok);
+      if (port <= 0 || port > 0xFFFF)
+         continue;
+
+      service_cache_add(name, port, 1);
+      while ((tok = strtok_r(NULL, " \t\r\n", &save)))
+         service_cache_add(tok, port, 0);
+   }
+}
+
+// Reloads the cache if it's empty or the services file changed.  The file
+//  is stat'd at most once every SERVICE_CHECK_SECS.  Call with lock held.
+static void service_cache_refresh(void)
 {
-   // Look up in the /etc/services file for the port number
    struct ServiceNames *curr;
+   struct ServiceCacheEntry *entry;
+   struct timespec now;
+   struct stat st;
+   const char *path = serviceCache.path ? serviceCache.path : _PATH_SERVICES;
+   FILE *file;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   if (serviceCache.loaded && now.tv_sec < serviceCache.nextCheck)
+      return;
+   serviceCache.nextCheck = now.tv_sec + SERVICE_CHECK_SECS;
+
+   if (stat(path, &st) < 0)
+      memset(&st, 0, sizeof(st));
+   if (serviceCache.loaded && st.st_ino == serviceCache.fileStat.st_ino &&
+         st.st_size == serviceCache.fileStat.st_size &&
+         st.st_mtime == serviceCache.fileStat.st_mtime)
+      return;
+
+   service_cache_clear();
+   serviceCache.byName = HASH_create_table(SERVICE_HASH_SIZE,
+         &service_name_hash_func, &service_name_cmp_key,
+         &service_name_key_for_data);
+   serviceCache.byPort = HASH_create_table(SERVICE_HASH_SIZE,
+         &service_port_hash_func, &service_port_cmp_key,
+         &service_port_key_for_data);
+   if (!serviceCache.byName || !serviceCache.byPort) {
+      service_cache_clear();
+      return;
+   }
+
+   if ((file = fopen(path, "r"))) {
+      service_cache_load_file(file);
+      fclose(file);
+   }
 
+   // The internal list fills in anything the file doesn't define, and is
+   //  the only source of multicast groups
    for (curr = serverNameList; curr->name; curr++) {
-      // look for a matching service name
-      if (!strcmp(curr->name, service)) {
-         return curr->multicast_port;
-      }
+      entry = HASH_find_key(serviceCache.byName, curr->name);
+      if (!entry)
+         entry = service_cache_add(curr->name, curr->port, 1);
+      if (!entry)
+         continue;
+      if (!curr->multicast_addr.s_addr)
+         inet_aton(curr->multicast_ip, &curr->multicast_addr);
+      entry->multicast_addr = curr->multicast_addr;
+      entry->multicast_port = curr->multicast_port;
    }
 
-   // convert port number to host order
+   serviceCache.fileStat = st;
+   serviceCache.loaded = 1;
+}
+
+static struct ServiceCacheEntry *service_cache_find_name(const char *service)
+{
+   service_cache_refresh();
+   if (!serviceCache.loaded)
+      return NULL;
+
+   return HASH_find_key(serviceCache.byName, (void*)service);
+}
+
+static void service_cache_invalidate_locked(void)
+{
+   serviceCache.nextCheck = 0;
+   serviceCache.fileStat.st_ino = 0;
+   serviceCache.fileStat.st_mtime = 0;
+}
+
+void socket_service_cache_invalidate(void)
+{
+   pthread_mutex_lock(&serviceCache.lock);
+   service_cache_invalidate_locked();
+   pthread_mutex_unlock(&serviceCache.lock);
+}
+
+int socket_service_cache_set_file(const char *path)
+{
+   char *copy = NULL;
+
+   if (path && !(copy = strdup(path)))
+      return -1;
+
+   pthread_mutex_lock(&serviceCache.lock);
+   free(serviceCache.path);
+   serviceCache.path = copy;
+   service_cache_invalidate_locked();
+   pthread_mutex_unlock(&serviceCache.lock);
+
    return 0;
 }
 
+// returns the multicast address associated with a system service
+uint16_t socket_multicast_port_by_name(const char * service)
+{
+   struct ServiceCacheEntry *entry;
+   uint16_t port = 0;
+
+   if (!service)
+      return 0;
+
+   pthread_mutex_lock(&serviceCache.lock);
+   if ((entry = service_cache_find_name(service)))
+      port = entry->multicast_port;
+   pthread_mutex_unlock(&serviceCache.lock);
+
+   return port;
+}
+
 // returns the multicast address associated with a system service
 struct in_addr socket_multicast_addr_by_name(const char * service)
 {
-   // Look up in the /etc/services file for the port number
-   struct ServiceNames *curr;
+   struct ServiceCacheEntry *entry;
    struct in_addr res = { 0 };
 
-   for (curr = serverNameList; curr->name; curr++) {
-      // look for a matching service name
-      if (!strcmp(curr->name, service)) {
-         if (!curr->multicast_addr.s_addr)
-            inet_aton(curr->multicast_ip, &curr->multicast_addr);
+   if (!service)
+      return res;
 
-         return curr->multicast_addr;
-      }
-   }
+   pthread_mutex_lock(&serviceCache.lock);
+   if ((entry = service_cache_find_name(service)))
+      res = entry->multicast_addr;
+   pthread_mutex_unlock(&serviceCache.lock);
 
-   // convert port number to host order
    return res;
 }
 
+// Resolves one name with the cache lock held
+static int service_port_by_name_locked(const char * service)
+{
+   struct ServiceCacheEntry *entry;
+   int port;
+
+   if ((entry = service_cache_find_name(service)))
+      return entry->port;
+
+   port = atol(service);
+   if (port > 0)
+      return port;
+
+   DBG_print(DBG_LEVEL_WARN,
+      "socket_get_addr_by_name - service '%s' lookup failed\n", service);
+
+   return -1;
+}
+
 // creates socket address by name
 int socket_get_addr_by_name(const char * service)
 {
-   // Look up in the /etc/services file for the port number
-   struct servent * serviceEntry = getservbyname(service, "udp");
-   struct ServiceNames *curr;
    int port;
 
-   // if lookup failed, use the internal list
-   if (serviceEntry == 0) {
-      for (curr = serverNameList; curr->name; curr++) {
-         // look for a matching service name
-         if (!strcmp(curr->name, service)) {
-            return curr->port;
-         }
-      }
+   if (!service)
+      return -1;
 
-      port = atol(service);
-      if (port > 0)
-         return port;
+   pthread_mutex_lock(&serviceCache.lock);
+   port = service_port_by_name_locked(service);
+   pthread_mutex_unlock(&serviceCache.lock);
 
-      DBG_print(DBG_LEVEL_WARN,
-         "socket_get_addr_by_name - service '%s' lookup failed\n", service);
+   return port;
+}
 
-      return -1;
+int socket_get_addrs_by_name(const char * const * services, int *ports,
+      int count)
+{
+   int i, found = 0;
+
+   if (!services || !ports)
+      return 0;
+
+   pthread_mutex_lock(&serviceCache.lock);
+   for (i = 0; i < count; i++) {
+      ports[i] = services[i] ? service_port_by_name_locked(services[i]) : -1;
+      if (ports[i] > 0)
+         found++;
    }
+   pthread_mutex_unlock(&serviceCache.lock);
 
-   // convert port number to host order
-   return ntohs(serviceEntry->s_port);
+   return found;
 }
 
 // gets service name by socket address
 int socket_get_name_by_addr(struct sockaddr_in * addr, char * buf, size_t bufSize)
 {
-   // Look up in the /etc/services file for the name corresponding to the port
-   struct servent *serviceEntry = getservbyport(addr->sin_port, "udp");
-   struct ServiceNames *curr;
-   char *name = NULL;
-   int nameLen = 0;
-   int portNum = 0;
-
-   // If lookup in /etc/services failed, try the internal list
-   if (serviceEntry == NULL)
-   {
-      // convert the port number to host (human-readable) order for comparison
-      portNum = ntohs(addr->sin_port);
-
-      for (curr = serverNameList; curr->name; curr++) {
-         // look for a matching port number
-         if (curr->port == portNum) {
-            name = curr->name;
-            break;
-         }
-      }
-   } else {
-      name = serviceEntry->s_name;
-   }
+   struct ServiceCacheEntry *entry = NULL;
+   int nameLen = -1;
+
+   pthread_mutex_lock(&serviceCache.lock);
+   service_cache_refresh();
+   if (serviceCache.loaded)
+      entry = HASH_find_key(serviceCache.byPort,
+            (void*)(uintptr_t)ntohs(addr->sin_port));
 
    // Check if lookup failed altogether
-   if (!name) {
+   if (!entry) {
       DBG_print(DBG_LEVEL_WARN, "service on port %d lookup failed\n", ntohs(addr->sin_port));
-      return -1;
    }
-
    // Ensure that buffer is large enough for name + null byte
-   if ((nameLen = strlen(name)) >= bufSize) {
+   else if ((nameLen = strlen(entry->name)) >= bufSize) {
       DBG_print(DBG_LEVEL_WARN,
-         "service lookup buffer too small for storing %s\n", name);
-      return -1;
+         "service lookup buffer too small for storing %s\n", entry->name);
+      nameLen = -1;
    } else {
-      strcpy(buf, name);
+      strcpy(buf, entry->name);
    }
+   pthread_mutex_unlock(&serviceCache.lock);
 
    return nameLen;
 }
@@ -511,6 +811,89 @@ int socket_resolve_host(const char *host, struct in_addr *addr)
    return 1;
 }
 
+static struct IPCBufferChunk *ipc_chunk_alloc(size_t cap)
+{
+   struct IPCBufferChunk *chunk;
+
+   if (cap < IPC_CHUNK_SIZE)
+      cap = IPC_CHUNK_SIZE;
+
+   chunk = malloc(sizeof(*chunk) + cap);
+   if (!chunk)
+      return NULL;
+
+   memset(chunk, 0, sizeof(*chunk));
+   chunk->data = chunk->inlineData;
+   chunk->cap = cap;
+   chunk->owned = 1;
+
+   return chunk;
+}
+
+static void ipc_chunk_free(struct IPCBufferChunk *chunk)
+{
+   if (chunk->freeCb)
+      chunk->freeCb(chunk->data, chunk->freeArg);
+   free(chunk);
+}
+
+static void ipc_chunk_link(struct IPCBuffer *buffer,
+      struct IPCBufferChunk *chunk)
+{
+   if (buffer->tail)
+      buffer->tail->next = chunk;
+   else
+      buffer->head = chunk;
+   buffer->tail = chunk;
+}
+
+// Returns an owned tail chunk with at least min bytes free, if it exists
+//  or can be allocated.  min is a hint for the size of a new chunk.
+static struct IPCBufferChunk *ipc_writable_tail(struct IPCBuffer *buffer,
+      size_t min)
+{
+   struct IPCBufferChunk *chunk = buffer->tail;
+
+   if (chunk && chunk->owned && chunk->cap - chunk->end >= min)
+      return chunk;
+
+   chunk = ipc_chunk_alloc(min);
+   if (chunk)
+      ipc_chunk_link(buffer, chunk);
+   return chunk;
+}
+
+// Copies the buffer into one owned chunk with room to grow, so that the
+//  data can be handed to a parser as a single run.  The spare capacity
+//  makes repeated calls while a large message trickles in amortized linear.
+static const char *ipc_buffer_flatten(struct IPCBuffer *buffer)
+{
+   struct IPCBufferChunk *chunk, *next, *flat;
+   size_t off = 0;
+
+   chunk = buffer->head;
+   if (!chunk)
+      return NULL;
+   if (chunk->end - chunk->start == buffer->dataLen)
+      return chunk->data + chunk->start;
+
+   flat = ipc_chunk_alloc(buffer->dataLen * 2);
+   if (!flat)
+      return NULL;
+
+   for (; chunk; chunk = next) {
+      next = chunk->next;
+      memcpy(flat->data + off, chunk->data + chunk->start,
+            chunk->end - chunk->start);
+      off += chunk->end - chunk->start;
+      ipc_chunk_free(chunk);
+   }
+   flat->end = off;
+   buffer->head = buffer->tail = flat;
+
+   return flat->data;
+}
+
 struct IPCBuffer *ipc_alloc_buffer(void)
 {
    struct IPCBuffer *result;
@@ -526,6 +909,7 @@ struct IPCBuffer *ipc_alloc_buffer(void)
 void ipc_destroy_buffer(struct IPCBuffer **goner)
 {
    struct IPCBuffer *buffer;
+   struct IPCBufferChunk *chunk;
 
    if (!goner)
       return;
@@ -534,30 +918,115 @@ void ipc_destroy_buffer(struct IPCBuffer **goner)
    if (!buffer)
       return;
 
-   if (buffer->data)
-      free(buffer->data);
+   while ((chunk = buffer->head)) {
+      buffer->head = chunk->next;
+      ipc_chunk_free(chunk);
+   }
    free(buffer);
 }
 
 void ipc_reset_buffer(struct IPCBuffer *buffer)
 {
    if (buffer)
-      buffer->dataLen = 0;
+      ipc_consume_buffer(buffer, buffer->dataLen);
+}
+
+void ipc_consume_buffer(struct IPCBuffer *buffer, size_t len)
+{
+   struct IPCBufferChunk *chunk;
+   size_t avail;
+
+   if (!buffer)
+      return;
+   if (len > buffer->dataLen)
+      len = buffer->dataLen;
+   buffer->dataLen -= len;
+
+   while ((chunk = buffer->head)) {
+      avail = chunk->end - chunk->start;
+      if (len < avail) {
+         chunk->start += len;
+         break;
+      }
+      len -= avail;
+
+      // Keep the last owned chunk around for the next append
+      if (!chunk->next && chunk->owned) {
+         chunk->start = chunk->end = 0;
+         break;
+      }
+      buffer->head = chunk->next;
+      if (!buffer->head)
+         buffer->tail = NULL;
+      ipc_chunk_free(chunk);
+   }
+}
+
+int ipc_buffer_iov(struct IPCBuffer *buffer, size_t offset,
+      struct iovec *iov, int iovcnt)
+{
+   struct IPCBufferChunk *chunk;
+   size_t avail;
+   int cnt = 0;
+
+   if (!buffer)
+      return 0;
+
+   for (chunk = buffer->head; chunk && cnt < iovcnt; chunk = chunk->next) {
+      avail = chunk->end - chunk->start;
+      if (offset >= avail) {
+         offset -= avail;
+         continue;
+      }
+      iov[cnt].iov_base = chunk->data + chunk->start + offset;
+      iov[cnt].iov_len = avail - offset;
+      offset = 0;
+      cnt++;
+   }
+
+   return cnt;
+}
+
+// Writes buffered bytes starting at offset with a single writev
+static ssize_t ipc_writev_from(int fd, struct IPCBuffer *buffer, size_t offset)
+{
+   struct iovec iov[IPC_WRITE_IOV_MAX];
+   int cnt;
+
+   cnt = ipc_buffer_iov(buffer, offset, iov, IPC_WRITE_IOV_MAX);
+   if (cnt <= 0)
+      return 0;
+
+   return writev(fd, iov, cnt);
+}
+
+ssize_t ipc_writev_buffer(int fd, struct IPCBuffer *buffer)
+{
+   ssize_t written;
+
+   if (!buffer || !buffer->dataLen)
+      return 0;
+
+   written = ipc_writev_from(fd, buffer, 0);
+   if (written > 0)
+      ipc_consume_buffer(buffer, written);
+
+   return written;
 }
 
 int ipc_write_buffer_sync(int fd, struct IPCBuffer *buffer)
 {
    size_t sent = 0;
-   int written;
+   ssize_t written;
 
-   if (!buffer || !buffer->dataLen || !buffer->data)
+   if (!buffer || !buffer->dataLen)
       return 0;
 
    while (sent < buffer->dataLen) {
-      written = write(fd, &buffer->data[sent], buffer->dataLen - sent);
-      if (written < 0 && errno != EAGAIN)
+      written = ipc_writev_from(fd, buffer, sent);
+      if (written < 0 && errno != EAGAIN && errno != EINTR)
          return -1;
-      else
+      else if (written > 0)
          sent += written;
    }
 
@@ -566,31 +1035,55 @@ int ipc_write_buffer_sync(int fd, struct IPCBuffer *buffer)
 
 int ipc_append_buffer(struct IPCBuffer *buffer, const void *data, int len)
 {
+   struct IPCBufferChunk *chunk;
+   const char *src = (const char*)data;
+   size_t space, left;
+
    if (!buffer || len <= 0)
       return 0;
 
-   if (!buffer->data) {
-      buffer->allocLen = 1024;
-      buffer->data = malloc(buffer->allocLen);
-      if (!buffer->data)
+   for (left = len; left > 0; left -= space, src += space) {
+      chunk = ipc_writable_tail(buffer, 1);
+      if (!chunk)
          return -1;
+      space = chunk->cap - chunk->end;
+      if (space > left)
+         space = left;
+      memcpy(chunk->data + chunk->end, src, space);
+      chunk->end += space;
+      buffer->dataLen += space;
    }
 
-   if (len >= (buffer->allocLen - buffer->dataLen)) {
-      while (len >= (buffer->allocLen - buffer->dataLen))
-         buffer->allocLen *= 2;
+   return len;
+}
 
-      buffer->data = realloc(buffer->data, buffer->allocLen);
-      if (!buffer->data) {
-         buffer->allocLen = 0;
-         return -1;
-      }
+int ipc_append_buffer_ref(struct IPCBuffer *buffer, const void *data,
+      size_t len, ipc_buffer_free_cb freeCb, void *arg)
+{
+   struct IPCBufferChunk *chunk;
+
+   if (!buffer || !len) {
+      if (freeCb)
+         freeCb((void*)data, arg);
+      return 0;
    }
 
-   if (len >= (buffer->allocLen - buffer->dataLen))
+   chunk = malloc(sizeof(*chunk));
+   if (!chunk)
       return -1;
+   memset(chunk, 0, sizeof(*chunk));
+   chunk->data = (char*)data;
+   chunk->end = chunk->cap = len;
+   chunk->freeCb = freeCb;
+   chunk->freeArg = arg;
+
+   // Drop an empty reusable chunk rather than leave it stranded at the head
+   if (buffer->head && !buffer->dataLen) {
+      ipc_chunk_free(buffer->head);
+      buffer->head = buffer->tail = NULL;
+   }
 
-   memcpy(&buffer->data[buffer->dataLen], data, len);
+   ipc_chunk_link(buffer, chunk);
    buffer->dataLen += len;
 
    return len;
@@ -598,50 +1091,42 @@ int ipc_append_buffer(struct IPCBuffer *buffer, const void *data, int len)
 
 int ipc_printf_buffer(struct IPCBuffer *buffer, const char *fmt, ...)
 {
+   struct IPCBufferChunk *chunk;
    int len;
    va_list ap;
 
    if (!buffer)
       return 0;
-   if (!buffer->data) {
-      buffer->allocLen = 1024;
-      buffer->data = malloc(buffer->allocLen);
-      if (!buffer->data)
-         return -1;
-   }
+
+   chunk = ipc_writable_tail(buffer, 1);
+   if (!chunk)
+      return -1;
 
    va_start(ap, fmt);
-   len = vsnprintf(&buffer->data[buffer->dataLen],
-         buffer->allocLen - buffer->dataLen, fmt, ap);
+   len = vsnprintf(chunk->data + chunk->end, chunk->cap - chunk->end, fmt, ap);
    va_end(ap);
    if (len < 0)
       return -1;
    if (len == 0)
       return 0;
 
-   // If the string didn't fit grow the buffer and try again
-   if (len >= (buffer->allocLen - buffer->dataLen)) {
-      while (len >= (buffer->allocLen - buffer->dataLen))
-         buffer->allocLen *= 2;
-
-      buffer->data = realloc(buffer->data, buffer->allocLen);
-      if (!buffer->data) {
-         buffer->allocLen = 0;
+   // If the string didn't fit, format it again into a chunk that has room
+   if (len >= chunk->cap - chunk->end) {
+      chunk = ipc_writable_tail(buffer, len + 1);
+      if (!chunk)
          return -1;
-      }
 
       va_start(ap, fmt);
-      len = vsnprintf(&buffer->data[buffer->dataLen],
-         buffer->allocLen - buffer->dataLen, fmt, ap);
+      len = vsnprintf(chunk->data + chunk->end, chunk->cap - chunk->end,
+            fmt, ap);
       va_end(ap);
       if (len < 0)
          return -1;
-      if (len == 0)
-         return 0;
-      if (len >= (buffer->allocLen - buffer->dataLen))
+      if (len >= chunk->cap - chunk->end)
          return -1;
    }
 
+   chunk->end += len;
    buffer->dataLen += len;
 
    return len;
@@ -649,25 +1134,22 @@ int ipc_printf_buffer(struct IPCBuffer *buffer, const char *fmt, ...)
 
 int ipc_process_buffer(struct IPCBuffer *buffer, ipc_buffer_cb cb, void *arg)
 {
-   size_t consumed = 0, len, i;
+   size_t consumed = 0, len;
+   const char *data;
 
-   if (!cb || !buffer || !buffer->data || 0 == buffer->dataLen)
+   if (!cb || !buffer || 0 == buffer->dataLen)
+      return 0;
+
+   data = ipc_buffer_flatten(buffer);
+   if (!data)
       return 0;
 
    do {
-      len = cb(&buffer->data[consumed], buffer->dataLen - consumed, arg);
+      len = cb(&data[consumed], buffer->dataLen - consumed, arg);
       consumed += len;
    } while (len > 0);
 
-   if (consumed > 0) {
-      if (consumed == buffer->dataLen)
-         ipc_reset_buffer(buffer);
-      else {
-         for (i = 0; i < (buffer->dataLen - consumed); i++)
-            buffer->data[i] = buffer->data[i + consumed];
-         buffer->dataLen -= consumed;
-      }
-   }
+   ipc_consume_buffer(buffer, consumed);
 
    return consumed;
 }
@@ -698,6 +1180,50 @@ static int ipc_blocking_command(char *txbuff, size_t txlen,
    return CMD_resolve_callback(NULL, cb, arg, cb_type, rxbuff, rxlen);
 }
 
+/* Returns a buffer of len bytes to encode a message into.  With a process
+ * the buffer is reserved in its transmit queue, otherwise it is malloc'd.
+ */
+static char *ipc_encode_buffer(ProcessData *proc, size_t len)
+{
+   if (proc)
+      return proc_tx_reserve(proc, len);
+
+   return malloc(len);
+}
+
+static void ipc_release_buffer(ProcessData *proc, char *buff)
+{
+   if (!proc)
+      free(buff);
+}
+
+/* Sends a large message that carries big opaque fields with sendmsg,
+ * referencing those fields where they are instead of copying them.  Returns
+ * -1 when the message should go through the transmit queue instead.
+ */
+static int ipc_send_iov(ProcessData *proc, void *msg, uint32_t type,
+      size_t len, struct sockaddr_in *dest)
+{
+   char hdr[IPC_IOV_HDR_LEN];
+   struct iovec iov[IPC_IOV_MAX];
+   struct XDR_IOVec vec;
+
+   if (len < IPC_IOV_MIN_LEN)
+      return -1;
+
+   vec.buff = hdr;
+   vec.buffLen = sizeof(hdr);
+   vec.iov = iov;
+   vec.iovMax = IPC_IOV_MAX;
+   vec.refMin = IPC_IOV_REF_MIN;
+   if (XDR_struct_encode_iov(msg, type, &vec) < 0 || vec.iovCount < 2 ||
+         vec.len != len)
+      return -1;
+
+   proc_tx_sendv(proc, proc->cmdFd, iov, vec.iovCount, vec.len, dest);
+   return 0;
+}
+
 static int IPC_command_internal(ProcessData *proc, uint32_t command,
       void *params,
       uint32_t param_type,
@@ -709,39 +1235,36 @@ static int IPC_command_internal(ProcessData *proc, uint32_t command,
    char *buff;
    size_t len;
    int res;
-   size_t buff_len = 1024;
     //steps to encode the command
 
    cmd.cmd = command;
    cmd.ipcref = next_cmd_ref++;
    cmd.parameters.type = param_type;
    cmd.parameters.data = params;
-   buff = malloc(buff_len);
+   if (XDR_struct_encoded_size(&cmd, IPC_TYPES_COMMAND, &len) < 0)
+      return -1;
 
-   if (IPC_Command_encode(&cmd, buff, &len, buff_len, NULL) < 0) {
-      if (len > buff_len) {
+   if (!proc || ipc_send_iov(proc, &cmd, IPC_TYPES_COMMAND, len, &dest) < 0) {
+      buff = ipc_encode_buffer(proc, len);
+      if (!buff)
+         return -1;
+
+      if (IPC_Command_encode(&cmd, buff, &len, len, NULL) < 0) {
+         ipc_release_buffer(proc, buff);
+         return -1;
+      }
+
+      if (!proc) {
+         res = ipc_blocking_command(buff, len, dest, cb, arg, cb_type,
+               timeout);
          free(buff);
-         buff_len = len;
-         buff = malloc(buff_len);
-         if (!buff)
-            return -1;
-         if (IPC_Command_encode(&cmd, buff, &len, len, NULL) < 0) {
-            free(buff);
-            return -1;
-         }
+         return res;
       }
-      else
-         return -1;
-   }
+       //before this, find address 
 
-   if (!proc) {
-      res = ipc_blocking_command(buff, len, dest, cb, arg, cb_type, timeout);
-      free(buff);
-      return res;
+      proc_tx_commit(proc, proc->cmdFd, len, &dest);
    }
-    //before this, find address 
 
-   PROC_cmd_raw_sockaddr(proc, buff, len, &dest);
    if (cb)
       CMD_add_response_cb(proc, cmd.ipcref, dest, cb, arg,
             cb_type, timeout);
@@ -834,32 +1357,50 @@ void IPC_response(struct ProcessData *proc, struct IPC_Command *cmd,
    struct IPC_Response resp;
    char *buff;
    size_t len;
-   size_t buff_len = 1024;
 
-   buff = malloc(buff_len);
    resp.cmd = IPC_CMDS_RESPONSE;
    resp.ipcref = cmd->ipcref;
    resp.result = IPC_RESULTCODE_SUCCESS;
    resp.data.type = param_type;
    resp.data.data = params;
 
-   if (IPC_Response_encode(&resp, buff, &len, buff_len, NULL) < 0) {
-      if (len > buff_len) {
-         free(buff);
-         buff_len = len;
-         buff = malloc(buff_len);
-         if (!buff)
-            return;
-         if (IPC_Response_encode(&resp, buff, &len, buff_len, NULL) < 0) {
-            free(buff);
-            return;
-         }
-      }
-      else
-         return;
-   }
+   if (XDR_struct_encoded_size(&resp, IPC_TYPES_RESPONSE, &len) < 0)
+      return;
+   if (ipc_send_iov(proc, &resp, IPC_TYPES_RESPONSE, len, dest) == 0)
+      return;
 
-   PROC_cmd_raw_sockaddr(proc, buff, len, dest);
+   buff = proc_tx_reserve(proc, len);
+   if (!buff)
+      return;
+   if (IPC_Response_encode(&resp, buff, &len, len, NULL) < 0)
+      return;
+
+   proc_tx_commit(proc, proc->cmdFd, len, dest);
+}
+
+void IPC_response_encoded(struct ProcessData *proc, struct IPC_Command *cmd,
+      const char *data, size_t dataLen, struct sockaddr_in *dest)
+{
+   struct IPC_ResponseHeader hdr;
+   char *buff;
+   size_t len = 0, max;
+
+   hdr.cmd = IPC_CMDS_RESPONSE;
+   hdr.ipcref = cmd->ipcref;
+   hdr.result = IPC_RESULTCODE_SUCCESS;
+
+   if (XDR_struct_encoded_size(&hdr, IPC_TYPES_RESPONSE_HDR, &max) < 0)
+      return;
+   max += dataLen;
+
+   buff = proc_tx_reserve(proc, max);
+   if (!buff)
+      return;
+   if (IPC_ResponseHeader_encode(&hdr, buff, &len, max, NULL) < 0)
+      return;
+   memcpy(buff + len, data, dataLen);
+
+   proc_tx_commit(proc, proc->cmdFd, len + dataLen, dest);
 }
 
 void IPC_error(struct ProcessData *proc, struct IPC_Command *cmd,
@@ -870,17 +1411,17 @@ void IPC_error(struct ProcessData *proc, struct IPC_Command *cmd,
    size_t len;
    size_t buff_len = 128;
 
-   buff = malloc(buff_len);
+   buff = proc_tx_reserve(proc, buff_len);
+   if (!buff)
+      return;
    resp.cmd = IPC_CMDS_RESPONSE;
    resp.ipcref = cmd->ipcref;
    resp.result = err_code;
    resp.data.type = IPC_TYPES_VOID;
    resp.data.data = NULL;
 
-   if (IPC_Response_encode(&resp, buff, &len, buff_len, NULL) < 0) {
-      free(buff);
+   if (IPC_Response_encode(&resp, buff, &len, buff_len, NULL) < 0)
       return;
-   }
 
-   PROC_cmd_raw_sockaddr(proc, buff, len, dest);
+   proc_tx_commit(proc, proc->cmdFd, len, dest);
 }
@@ -50,6 +50,19 @@ extern "C" {
  */
 int socket_named_init(const char * service);
 
+/**
+ * Like socket_named_init, but optionally sets SO_REUSEPORT before binding
+ * so that other sockets may bind the same port.
+ *
+ * @param   service Name of the service to open the UDP port of.
+ * @param   reuseport Non-zero to set SO_REUSEPORT.
+ *
+ * @return  A socket file descriptor.
+ *
+ * @retval  -1  On error.
+ */
+int socket_named_init_reuseport(const char * service, int reuseport);
+
 /**
  * Initializes a UDP socket on the specified port.
  *
@@ -61,6 +74,19 @@ int socket_named_init(const char * service);
  */
 int socket_init(int port);
 
+/**
+ * Initializes a UDP socket on the specified port with SO_REUSEPORT set, so
+ * that several sockets can share the port.  On Linux the kernel spreads
+ * incoming datagrams across them by source address.
+ *
+ * @param   port Host order port number to open socket on.
+ *
+ * @return  A socket file descriptor.
+ *
+ * @retval  -1  On error.
+ */
+int socket_init_reuseport(int port);
+
 /**
  * Initializes a listening TCP socket on the specified port.
  *
@@ -110,7 +136,7 @@ int socket_named_write(int fd, void * buf, size_t bufSize, const char * name);
  *
  * @return  Number of bytes written.
  *
- * @retval  -1  On error.
+ * @retval  -1  On error, with errno set.
  */
 int socket_write(int fd, void * buf, size_t bufSize, struct sockaddr_in * dest);
 
@@ -137,6 +163,37 @@ int socket_close(int fd);
  */
 int socket_get_addr_by_name(const char * service);
 
+/**
+ * Looks up many udp services by name at once.  Names are resolved from an
+ *    in-process cache of /etc/services and the internal service list, so
+ *    this costs one lock acquisition rather than a file parse per name.
+ *
+ * @param   services Names of the services to look up
+ * @param   ports    Receives each service's port in host order, or -1
+ * @param   count    Number of entries in services and ports
+ *
+ * @return  The number of services that were resolved.
+ */
+int socket_get_addrs_by_name(const char * const * services, int *ports,
+      int count);
+
+/**
+ * Forces the service name cache to be reloaded on the next lookup.  The
+ *    cache already reloads itself when /etc/services changes; this is for
+ *    callers that need the change to be seen immediately.
+ */
+void socket_service_cache_invalidate(void);
+
+/**
+ * Points the service name cache at another services file, mainly for
+ *    testing.  The cache is reloaded from it on the next lookup.
+ *
+ * @param   path  The file to read, or NULL to go back to /etc/services
+ *
+ * @return  0 on success, -1 if the path could not be copied.
+ */
+int socket_service_cache_set_file(const char *path);
+
 /**
  * Looks up a system service by name and returns the associated multicast
  *    source address.
@@ -203,8 +260,19 @@ int socket_send_packet_and_read_xdr(const char *dstAddr,
   */
 int socket_resolve_host(const char *host, struct in_addr *addr);
 
-// Structure to use for buffering output prior to sending to a socket
+// Structure to use for buffering output prior to sending to a socket.
+//  The buffer is a chain of fixed-size chunks, so appending never moves
+//  existing data and consuming from the front is O(1).
 struct IPCBuffer;
+struct iovec;
+
+/**
+  * Called when a buffer is done with memory added by ipc_append_buffer_ref.
+  *
+  * @param data The pointer originally passed to ipc_append_buffer_ref
+  * @param arg The opaque argument passed to ipc_append_buffer_ref
+  */
+typedef void (*ipc_buffer_free_cb)(void *data, void *arg);
 
 /**
   * Allocates a new IPCBuffer
@@ -264,6 +332,59 @@ int ipc_printf_buffer(struct IPCBuffer *buffer, const char *fmt, ...)
   */
 int ipc_append_buffer(struct IPCBuffer *buffer, const void *data, int len);
 
+/**
+  * Appends caller-owned memory to an IPC buffer without copying it.  The
+  * memory must remain valid and unchanged until freeCb is called, which
+  * happens once the bytes are consumed, or the buffer is reset or destroyed.
+  *
+  * @param buffer The buffer to add the data to
+  * @param data The data to append
+  * @param len The size of the data to append
+  * @param freeCb Function called to release data, or NULL if nothing
+  *               needs to be done
+  * @param arg Opaque argument passed to freeCb
+  *
+  * @return The number of bytes added to the buffer, or -1 on error.  freeCb
+  *         is not called when an error is returned.
+  */
+int ipc_append_buffer_ref(struct IPCBuffer *buffer, const void *data,
+      size_t len, ipc_buffer_free_cb freeCb, void *arg);
+
+/**
+  * Removes bytes from the front of the buffer.  Runs in time proportional to
+  * the number of chunks released, not the number of bytes.
+  *
+  * @param buffer The buffer to consume from
+  * @param len The number of bytes to remove.  Clamped to the buffer size.
+  */
+void ipc_consume_buffer(struct IPCBuffer *buffer, size_t len);
+
+/**
+  * Fills an iovec array with the buffer's contents, without copying.  The
+  * entries are valid until the buffer is next modified.
+  *
+  * @param buffer The buffer to describe
+  * @param offset The number of leading bytes to skip
+  * @param iov The array to fill
+  * @param iovcnt The number of entries available in iov
+  *
+  * @return The number of entries filled in
+  */
+int ipc_buffer_iov(struct IPCBuffer *buffer, size_t offset,
+      struct iovec *iov, int iovcnt);
+
+/**
+  * Writes as much of the buffer as the file descriptor accepts with a single
+  * writev, and consumes the bytes written.  Suitable for non-blocking
+  * sockets driven by EVENT_FD_WRITE.
+  *
+  * @param fd The file descriptor to write to
+  * @param buffer The data to send
+  *
+  * @return The number of bytes written, or -1 on error with errno set
+  */
+ssize_t ipc_writev_buffer(int fd, struct IPCBuffer *buffer);
+
 /**
   * Returns the number of bytes in the buffer.
   *
@@ -277,7 +398,9 @@ typedef size_t (*ipc_buffer_cb)(const char *data, size_t dataLen, void *arg);
 /**
   * This function processes data contained in a buffer via a callback function.
   * The buffer is processed until the callback indicates there is nothing else
-  * that can be processed.
+  * that can be processed.  The callback always sees the unconsumed data as
+  * one contiguous run; chunks are merged into a single growable chunk
+  * when needed.
   *
   * @param buffer The buffer to process data from
   * @param cb The callback function to use to process the data.  The function
@@ -305,6 +428,11 @@ extern int IPC_command(struct ProcessData*, uint32_t command, void *params,
       enum IPC_CB_TYPE cb_type, unsigned int timeout);
 extern void IPC_response(struct ProcessData *proc, struct IPC_Command *cmd,
       uint32_t param_type, void *params, struct sockaddr_in *dest);
+// Sends a successful response whose payload is an already encoded union
+//  (type followed by structure), as built by CMD_struct_to_opaque_struct
+extern void IPC_response_encoded(struct ProcessData *proc,
+      struct IPC_Command *cmd, const char *data, size_t dataLen,
+      struct sockaddr_in *dest);
 extern void IPC_error(struct ProcessData *proc, struct IPC_Command *cmd,
       uint32_t error_code, struct sockaddr_in *dest);
 
@@ -0,0 +1,279 @@
+/*
+ * Copyright PolySat, California Polytechnic State University, San Luis Obispo. cubesat@calpoly.edu
+ * This file is part of libproc, a PolySat library.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "memPool.h"
+
+// Records are aligned for any type the event loop stores in them
+#define MPOOL_ALIGN 16
+
+// A released record, linked through its first bytes
+struct MemPoolFree {
+   struct MemPoolFree *next;
+};
+
+// Header at the start of every slab
+struct MemPoolSlab {
+   struct MemPoolSlab *next;
+};
+
+struct MemPool {
+   size_t objSize;
+   size_t perSlab;
+   struct MemPoolSlab *slabs;
+   struct MemPoolFree *freeList;
+   struct MemPoolStats stats;
+};
+
+// Offset of the first record, keeping records aligned within the slab
+#define MPOOL_SLAB_HDR \
+   ((sizeof(struct MemPoolSlab) + MPOOL_ALIGN - 1) & ~(size_t)(MPOOL_ALIGN - 1))
+
+struct MemPool *MPOOL_create(size_t objSize, size_t perSlab)
+{
+   struct MemPool *pool;
+
+   if (!objSize || !perSlab)
+      return NULL;
+
+   pool = (struct MemPool*)malloc(sizeof(*pool));
+   if (!pool)
+      return NULL;
+
+   memset(pool, 0, sizeof(*pool));
+   if (objSize < sizeof(struct MemPoolFree))
+      objSize = sizeof(struct MemPoolFree);
+   pool->objSize = (objSize + MPOOL_ALIGN - 1) & ~(size_t)(MPOOL_ALIGN - 1);
+   pool->perSlab = perSlab;
+
+   return pool;
+}
+
+void MPOOL_free_pool(struct MemPool *pool)
+{
+   struct MemPoolSlab *slab;
+
+   if (!pool)
+      return;
+
+   while ((slab = pool->slabs)) {
+      pool->slabs = slab->next;
+      free(slab);
+   }
+   free(pool);
+}
+
+// Allocates another slab and threads its records onto the free list
+static int mpool_grow(struct MemPool *pool)
+{
+   struct MemPoolSlab *slab;
+   struct MemPoolFree *obj;
+   uint8_t *base;
+   size_t i;
+
+   slab = (struct MemPoolSlab*)malloc(MPOOL_SLAB_HDR +
+         pool->objSize * pool->perSlab);
+   if (!slab)
+      return -1;
+
+   slab->next = pool->slabs;
+   pool->slabs = slab;
+   pool->stats.slabs++;
+
+   // Push in reverse so records are handed out in address order
+   base = (uint8_t*)slab + MPOOL_SLAB_HDR;
+   for (i = pool->perSlab; i > 0; i--) {
+      obj = (struct MemPoolFree*)(base + (i - 1) * pool->objSize);
+      obj->next = pool->freeList;
+      pool->freeList = obj;
+   }
+   pool->stats.free += pool->perSlab;
+
+   return 0;
+}
+
+void *MPOOL_alloc(struct MemPool *pool)
+{
+   struct MemPoolFree *obj;
+
+   if (!pool->freeList && mpool_grow(pool) < 0)
+      return NULL;
+
+   obj = pool->freeList;
+   pool->freeList = obj->next;
+   pool->stats.free--;
+   if (++pool->stats.live > pool->stats.peak)
+      pool->stats.peak = pool->stats.live;
+
+   return obj;
+}
+
+void MPOOL_release(struct MemPool *pool, void *obj)
+{
+   struct MemPoolFree *node = (struct MemPoolFree*)obj;
+
+   if (!obj)
+      return;
+
+   node->next = pool->freeList;
+   pool->freeList = node;
+   pool->stats.live--;
+   pool->stats.free++;
+}
+
+void MPOOL_get_stats(struct MemPool *pool, struct MemPoolStats *stats)
+{
+   if (pool)
+      *stats = pool->stats;
+   else
+      memset(stats, 0, sizeof(*stats));
+}
+
+// Header at the start of every arena chunk
+struct MemArenaChunk {
+   struct MemArenaChunk *next;
+   size_t size;
+   size_t used;
+};
+
+struct MemArena {
+   size_t chunkSize;
+   struct MemArenaChunk *chunks;
+   struct MemArenaStats stats;
+};
+
+#define MPOOL_CHUNK_HDR \
+   ((sizeof(struct MemArenaChunk) + MPOOL_ALIGN - 1) & \
+    ~(size_t)(MPOOL_ALIGN - 1))
+
+struct MemArena *MPOOL_arena_create(size_t chunkSize)
+{
+   struct MemArena *arena;
+
+   if (!chunkSize)
+      return NULL;
+
+   arena = (struct MemArena*)malloc(sizeof(*arena));
+   if (!arena)
+      return NULL;
+
+   memset(arena, 0, sizeof(*arena));
+   arena->chunkSize = chunkSize;
+
+   return arena;
+}
+
+// Frees every chunk after keep
+static void arena_trim(struct MemArena *arena, struct MemArenaChunk *keep)
+{
+   struct MemArenaChunk *chunk, *next;
+
+   chunk = keep ? keep->next : arena->chunks;
+   while (chunk) {
+      next = chunk->next;
+      free(chunk);
+      arena->stats.chunks--;
+      chunk = next;
+   }
+   if (keep)
+      keep->next = NULL;
+   else
+      arena->chunks = NULL;
+}
+
+void MPOOL_arena_free(struct MemArena *arena)
+{
+   if (!arena)
+      return;
+
+   arena_trim(arena, NULL);
+   free(arena);
+}
+
+void *MPOOL_arena_alloc(struct MemArena *arena, size_t size)
+{
+   struct MemArenaChunk *chunk = arena->chunks;
+   size_t chunkSize;
+   void *result;
+
+   // Sizes this close to SIZE_MAX would wrap to nothing when rounded up
+   if (size > SIZE_MAX - MPOOL_CHUNK_HDR - MPOOL_ALIGN)
+      return NULL;
+   size = (size + MPOOL_ALIGN - 1) & ~(size_t)(MPOOL_ALIGN - 1);
+   if (!chunk || chunk->size - chunk->used < size) {
+      chunkSize = arena->chunkSize;
+      if (size > chunkSize)
+         chunkSize = size;
+      chunk = (struct MemArenaChunk*)malloc(MPOOL_CHUNK_HDR + chunkSize);
+      if (!chunk)
+         return NULL;
+
+      chunk->size = chunkSize;
+      chunk->used = 0;
+      chunk->next = arena->chunks;
+      arena->chunks = chunk;
+      arena->stats.chunks++;
+   }
+
+   result = (uint8_t*)chunk + MPOOL_CHUNK_HDR + chunk->used;
+   chunk->used += size;
+   arena->stats.used += size;
+   if (arena->stats.used > arena->stats.peak)
+      arena->stats.peak = arena->stats.used;
+
+   return result;
+}
+
+void MPOOL_arena_reset(struct MemArena *arena)
+{
+   if (!arena)
+      return;
+
+   arena_trim(arena, arena->chunks);
+   if (arena->chunks)
+      arena->chunks->used = 0;
+   arena->stats.used = 0;
+   arena->stats.resets++;
+}
+
+int MPOOL_arena_owns(struct MemArena *arena, const void *ptr)
+{
+   struct MemArenaChunk *chunk;
+   const uint8_t *base;
+
+   if (!arena || !ptr)
+      return 0;
+
+   for (chunk = arena->chunks; chunk; chunk = chunk->next) {
+      base = (const uint8_t*)chunk + MPOOL_CHUNK_HDR;
+      if ((const uint8_t*)ptr >= base && (const uint8_t*)ptr < base + chunk->used)
+         return 1;
+   }
+
+   return 0;
+}
+
+void MPOOL_arena_get_stats(struct MemArena *arena,
+      struct MemArenaStats *stats)
+{
+   if (arena)
+      *stats = arena->stats;
+   else
+      memset(stats, 0, sizeof(*stats));
+}
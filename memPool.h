@@ -0,0 +1,124 @@
+/*
+ * Copyright PolySat, California Polytechnic State University, San Luis Obispo. cubesat@calpoly.edu
+ * This file is part of libproc, a PolySat library.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/**
+ * @file memPool.h Fixed-size object pool and bump arena.
+ *
+ * Hands out equally sized records carved from larger slabs and recycles
+ * released records through a free list, so short-lived records do not
+ * round-trip through malloc.  Slabs are only returned to the system when the
+ * pool is freed.
+ *
+ * The arena serves variable-sized allocations that all die together, such
+ * as one decoded message.  Nothing is released individually; the whole
+ * arena is reset at once.
+ */
+#ifndef MEMPOOL_H
+#define MEMPOOL_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct MemPool;
+
+/** Allocation counters for a pool */
+struct MemPoolStats {
+   size_t live;   // Records currently handed out
+   size_t peak;   // Highest value live has reached
+   size_t free;   // Records sitting on the free list
+   size_t slabs;  // Slabs allocated from the system
+};
+
+/**
+ * Creates a pool of fixed-size records.
+ *
+ * @param objSize The size of each record, in bytes.
+ * @param perSlab The number of records to allocate from the system at once.
+ *
+ * @return A pointer to the new pool, or NULL on failure.
+ */
+struct MemPool *MPOOL_create(size_t objSize, size_t perSlab);
+
+/**
+ * Frees the pool and every slab it owns, including records that were never
+ * released.
+ */
+void MPOOL_free_pool(struct MemPool *pool);
+
+/**
+ * Returns an uninitialized record, or NULL if a new slab could not be
+ * allocated.
+ */
+void *MPOOL_alloc(struct MemPool *pool);
+
+/** Returns a record obtained from MPOOL_alloc to the pool. */
+void MPOOL_release(struct MemPool *pool, void *obj);
+
+/** Fills stats with the pool's current allocation counters. */
+void MPOOL_get_stats(struct MemPool *pool, struct MemPoolStats *stats);
+
+struct MemArena;
+
+/** Allocation counters for an arena */
+struct MemArenaStats {
+   size_t used;     // Bytes handed out since the last reset
+   size_t peak;     // Highest value used has reached
+   size_t chunks;   // Chunks currently held
+   size_t resets;   // Number of MPOOL_arena_reset calls
+};
+
+/**
+ * Creates a bump arena.
+ *
+ * @param chunkSize The size of each chunk allocated from the system.
+ *                   Requests larger than this get a chunk of their own.
+ *
+ * @return A pointer to the new arena, or NULL on failure.
+ */
+struct MemArena *MPOOL_arena_create(size_t chunkSize);
+
+/** Frees the arena and every chunk it owns. */
+void MPOOL_arena_free(struct MemArena *arena);
+
+/**
+ * Returns size bytes of uninitialized, 16-byte aligned memory that stays
+ * valid until the next reset, or NULL if a new chunk could not be allocated
+ * or size is too large to round up.
+ */
+void *MPOOL_arena_alloc(struct MemArena *arena, size_t size);
+
+/**
+ * Releases everything allocated from the arena.  The most recent chunk is
+ * kept for reuse and the rest are returned to the system.
+ */
+void MPOOL_arena_reset(struct MemArena *arena);
+
+/** Returns non-zero if ptr was handed out by the arena since its last reset */
+int MPOOL_arena_owns(struct MemArena *arena, const void *ptr);
+
+/** Fills stats with the arena's current allocation counters. */
+void MPOOL_arena_get_stats(struct MemArena *arena,
+      struct MemArenaStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
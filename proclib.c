@@ -30,6 +30,8 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
@@ -42,14 +44,32 @@
 #include "watchdog_cmd.h"
 #include <time.h>
 #include "critical.h"
+#include "threadPool.h"
+#include "shmRing.h"
 #include <pthread.h>
 #include "ipc.h"
-
-#define READ_BUFF_MIN 4096
-#define READ_BUFF_MAX (READ_BUFF_MIN * 4)
+#include "hashtable.h"
+#ifdef __linux__
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#endif
+
+#define READ_BUFF_MAX 16384
+#define SPLICE_CHUNK 65536
+#define COPY_CHUNK 4096
 #define WATCHDOG_VALIDATE_SECS 30
+#define TX_QUEUE_MAX 64
+#define TX_ARENA_MIN 4096
+#define TX_ARENA_FLUSH (MAX_IP_PACKET_SIZE * 2)
+
+#define SIGNALFD_BATCH 16
+#define CHILD_HASH_SIZE 31
 
 static int signalWriteFD = -1;
+static ProcessData *signalProc = NULL;   // The process catching signals
+static int signalFD = -1;                // signalfd, or -1 if unsupported
+static sigset_t signalMask;              // Signals read from signalFD
 
 static int sigchld_handler(int, void*);
 static int setup_signal_fd(ProcessData *proc);
@@ -57,6 +77,8 @@ static int setup_signal_fd(ProcessData *proc);
 //When a socket is written to, this is the call back that is called
 static int socket_write_cb(int fd, char type, void * arg);
 
+static void passthrough_cancel(ProcChild *child, ChildStream *state);
+
 /* Structure which defines a signal callback */
 struct ProcSignalCB
 {
@@ -72,12 +94,12 @@ struct ProcSignalCB
 #define IGNORE_DATA_AFTER_WRITE 3
 
 /* Linked list to hold writes pending notification that the write will not
- * block
+ * block.  A NULL cb means the data is written by the queue itself, which
+ * lets consecutive buffers go out in a single writev.
  */
 struct ProcWriteNode {
    uint8_t *data;
    uint32_t len;
-   int fd;
    int freeMem;
    proc_nb_write_cb cb;
    void *arg;
@@ -85,6 +107,45 @@ struct ProcWriteNode {
    struct ProcWriteNode *next;
 };
 
+#define WRITE_QUEUE_HASH_SIZE 31
+#define WRITE_QUEUE_IOV_MAX 64
+
+// The pending writes for one fd, kept in the order they were queued
+struct ProcWriteQueue {
+   int fd;
+   struct ProcWriteNode *head, *tail;
+   uint32_t offset;           // Bytes of head already written
+   size_t queued;             // Unwritten bytes in the queue
+   size_t highWater, lowWater;
+   char aboveHigh;
+   char writing;              // The EVENT_FD_WRITE callback is registered
+   PROC_write_watermark_cb watermarkCb;
+   void *watermarkArg;
+   ProcessData *proc;
+};
+
+
+// A command socket shard: an extra SO_REUSEPORT socket on the command port
+//  with its own event loop, thread and transmit queue
+struct ProcCmdShard {
+   ProcessData *proc;
+   EVTHandler *evt;
+   struct ProcTxQueue *txQueue;
+   struct CMDShard *cmd;
+   int fd;
+   pthread_t thread;
+   char started;
+};
+
+struct ProcCmdShards {
+   void *startEvt;            // Starts the threads once the main loop runs
+   unsigned int count;
+   struct ProcCmdShard shard[];
+};
+
+// Set on shard threads, so PROC_evt and the transmit queue resolve to the
+//  shard's own loop
+static __thread struct ProcCmdShard *curShard = NULL;
 
 /** Returns the EVTHandler context for the process.  Needed to directly call
   * EVT_* functions.
@@ -93,9 +154,19 @@ EVTHandler *PROC_evt(ProcessData *proc)
 {
    if (!proc)
       return NULL;
+   if (curShard && curShard->proc == proc)
+      return curShard->evt;
    return proc->evtHandler;
 }
 
+// The transmit queue for the calling thread's loop
+static struct ProcTxQueue *proc_txq(ProcessData *proc)
+{
+   if (curShard && curShard->proc == proc)
+      return curShard->txQueue;
+   return proc->txQueue;
+}
+
 struct CSState *proc_get_cs_state(ProcessData *proc)
 {
    if (!proc)
@@ -103,7 +174,45 @@ struct CSState *proc_get_cs_state(ProcessData *proc)
    return &proc->criticalState;
 }
 
+// A datagram waiting in the transmit queue
+struct ProcTxMsg {
+   int fd;
+   size_t offset, len;
+   struct sockaddr_in dest;
+};
+
+// Datagrams collected during one event loop iteration, stored back to back
+//  in a reusable arena
+struct ProcTxQueue {
+   char *arena;
+   size_t arenaLen, arenaUsed;
+   struct ProcTxMsg msgs[TX_QUEUE_MAX];
+   int count;
+   void *hook;
+   struct ProcTxDefer *defer;    // Sockets that would block, by fd
+   pthread_t owner;              // The only thread that may use the queue
+};
+
+// Where threads other than a queue's owner encode their datagrams
+struct ProcTxScratch {
+   char *buff;
+   size_t len;
+};
+
+// The process whose queued datagrams go out when a handler calls exit()
+static ProcessData *exitFlushProc = NULL;
+
 static ProcessData *watchProc = NULL;
+static int proc_tx_init(ProcessData *proc);
+static void proc_tx_cleanup(ProcessData *proc);
+static struct ProcTxQueue *proc_tx_queue_create(ProcessData *proc,
+      EVTHandler *evt);
+static void proc_tx_queue_free(EVTHandler *evt, struct ProcTxQueue *q);
+static int proc_send_now(ProcessData *proc, int fd, void *data,
+      size_t dataLen, struct sockaddr_in *dest);
+static int proc_shards_init(ProcessData *proc, unsigned int count);
+static void write_queue_free(void *data);
+static void proc_shards_cleanup(ProcessData *proc);
 static int proc_cmd_sockaddr_internal(ProcessData *proc, int fd, unsigned char cmd, void *data, size_t dataLen, struct sockaddr_in *dest);
 int proc_cmd_sockaddr_raw_internal(ProcessData *proc, int fd, void *data,
       size_t dataLen, struct sockaddr_in *dest);
@@ -167,9 +276,16 @@ ProcessData *PROC_init(const char *procName, enum WatchdogMode wdMode)
    return PROC_init_xdr(procName, wdMode, NULL);
 }
 
-//Initializes a ProcessData object
 ProcessData *PROC_init_xdr(const char *procName, enum WatchdogMode wdMode,
       struct XDR_CommandHandlers *handlers)
+{
+   return PROC_init_xdr_sharded(procName, wdMode, handlers, 1);
+}
+
+//Initializes a ProcessData object
+ProcessData *PROC_init_xdr_sharded(const char *procName,
+      enum WatchdogMode wdMode, struct XDR_CommandHandlers *handlers,
+      unsigned int loops)
 {
    ProcessData *proc;
    char filepath[80];
@@ -266,7 +382,11 @@ ProcessData *PROC_init_xdr(const char *procName, enum WatchdogMode wdMode,
       }
    }
 
-   ERR_EXIT(proc->cmdFd = socket_named_init(procName),                 //Exit?
+#ifndef __linux__
+   // Other platforms don't balance datagrams across SO_REUSEPORT sockets
+   loops = 1;
+#endif
+   ERR_EXIT(proc->cmdFd = socket_named_init_reuseport(procName, loops > 1),  //Exit?
          "Failed to open socket for %s\n", procName);
 
    ERR_EXIT(proc->txFd = socket_init(0),                 //Exit?
@@ -274,6 +394,8 @@ ProcessData *PROC_init_xdr(const char *procName, enum WatchdogMode wdMode,
 
    // Initialize event handler and return it
    proc->evtHandler = EVT_create_handler(PROC_debugger_state, proc);
+   if (proc_tx_init(proc) < 0)
+      return NULL;
    EVT_set_debugger_port(proc->evtHandler, socket_get_addr_by_name(proc->name));
    //set up sigPipe to take signals. Signals will be treated as an event with cb 'signal_fd_cb'
    setup_signal_fd(proc);
@@ -291,6 +413,9 @@ ProcessData *PROC_init_xdr(const char *procName, enum WatchdogMode wdMode,
    //Event for when something (probably a command response) appears on the fd
    EVT_fd_add(proc->evtHandler, proc->txFd, EVENT_FD_READ, tx_cmd_handler_cb, proc);
    EVT_fd_set_name(proc->evtHandler, proc->txFd, "UDP Request Socket");
+   if (loops > 1 && proc_shards_init(proc, loops - 1) < 0)
+      DBG_print(DBG_LEVEL_WARN, "Failed to shard command socket, using "
+            "one event loop\n");
    //Set up SIGCHLD signal handler
    PROC_signal(proc, SIGCHLD, &sigchld_handler, proc);
 
@@ -321,10 +446,16 @@ void PROC_wd_enable(ProcessData *proc) {
 void PROC_cleanup(ProcessData *proc)
 {
    char filepath[80];
+   struct ProcChild *child;
 
    if (!proc) //Already clean
       return;
 
+   proc_shards_cleanup(proc);
+   TPOOL_free(proc->workers);
+   proc->workers = NULL;
+   PROC_set_local_transport(proc, 0);
+   proc_tx_cleanup(proc);
    cmd_cleanup_cb_state(proc->cmds, proc->evtHandler);
    critical_state_cleanup(&proc->criticalState);
 
@@ -340,6 +471,21 @@ void PROC_cleanup(ProcessData *proc)
    close(proc->txFd);
    ERRNO_WARN("close txFd error: ");
    signalWriteFD = -1;
+   if (signalProc == proc) {
+      signalProc = NULL;
+      if (signalFD >= 0) {
+         close(signalFD);
+         signalFD = -1;
+         pthread_sigmask(SIG_UNBLOCK, &signalMask, NULL);
+         sigemptyset(&signalMask);
+      }
+   }
+   for (child = proc->childHead; child; child = child->next)
+      if (child->pidfd >= 0)
+         close(child->pidfd);
+   HASH_free_table(proc->childHash);
+   HASH_extract(proc->writeQueues, &write_queue_free);
+   HASH_free_table(proc->writeQueues);
 
    if (proc->name) {
       //** Remove the .pid and .proc files **
@@ -371,6 +517,121 @@ void PROC_cleanup(ProcessData *proc)
    free(proc);
 }
 
+#if defined(__linux__) && defined(SYS_memfd_create)
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+// Maps cap bytes of memory twice, back-to-back, so that any run of up to
+//  cap bytes starting inside the first copy is contiguous
+static char *ring_map_mirrored(int cap)
+{
+   char *base;
+   int fd;
+
+   fd = syscall(SYS_memfd_create, "child-stream", MFD_CLOEXEC);
+   if (fd < 0)
+      return NULL;
+   if (ftruncate(fd, cap) < 0) {
+      close(fd);
+      return NULL;
+   }
+
+   base = mmap(NULL, 2 * cap, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (base == MAP_FAILED) {
+      close(fd);
+      return NULL;
+   }
+   if (mmap(base, cap, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+            fd, 0) == MAP_FAILED ||
+         mmap(base + cap, cap, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+            fd, 0) == MAP_FAILED) {
+      munmap(base, 2 * cap);
+      close(fd);
+      return NULL;
+   }
+
+   close(fd);
+   return base;
+}
+#endif
+
+static int ring_alloc(ChildStream *state)
+{
+   int cap = READ_BUFF_MAX;
+
+   state->head = state->buffLen = 0;
+#if defined(__linux__) && defined(SYS_memfd_create)
+   long page = sysconf(_SC_PAGESIZE);
+
+   if (page > 0)
+      cap = (cap + page - 1) / page * page;
+   state->buff = ring_map_mirrored(cap);
+   if (state->buff) {
+      state->mirrored = 1;
+      state->buffCap = cap;
+      return 1;
+   }
+#endif
+
+   state->mirrored = 0;
+   state->buff = malloc(cap);
+   if (!state->buff)
+      return 0;
+   state->buffCap = cap;
+   return 1;
+}
+
+static void ring_free(ChildStream *state)
+{
+   if (!state->buff)
+      return;
+
+#ifdef __linux__
+   if (state->mirrored)
+      munmap(state->buff, 2 * state->buffCap);
+   else
+#endif
+      free(state->buff);
+
+   state->buff = NULL;
+   state->buffCap = state->buffLen = state->head = 0;
+   state->mirrored = 0;
+   free(state->copy);
+   state->copy = NULL;
+}
+
+// Returns the contiguous free space following the buffered data.  Without
+//  a mirrored mapping the data never wraps, so it is moved to the front
+//  once per trip through the buffer rather than after every consume.
+static char *ring_tail(ChildStream *state, int *space)
+{
+   if (state->mirrored) {
+      *space = state->buffCap - state->buffLen;
+      return state->buff + (state->head + state->buffLen) % state->buffCap;
+   }
+
+   if (state->head > 0 && state->head + state->buffLen >= state->buffCap) {
+      memmove(state->buff, state->buff + state->head, state->buffLen);
+      state->head = 0;
+   }
+   *space = state->buffCap - state->head - state->buffLen;
+   return state->buff + state->head + state->buffLen;
+}
+
+static void ring_consume(ChildStream *state, int len)
+{
+   if (len >= state->buffLen) {
+      state->head = state->buffLen = 0;
+      return;
+   }
+
+   state->buffLen -= len;
+   state->head += len;
+   if (state->head >= state->buffCap)
+      state->head -= state->buffCap;
+}
+
 static void validate_pipe_flush(ProcChild *child)
 {
    struct ProcChild **curr;
@@ -393,16 +654,33 @@ static void validate_pipe_flush(ProcChild *child)
          // Found the parent; unlink and free the child
          *curr = child->next;
          child->next = NULL;
-         if (child->streamState[0].buff)
-            free(child->streamState[0].buff);
-         if (child->streamState[1].buff)
-            free(child->streamState[1].buff);
+         ring_free(&child->stream[0]);
+         ring_free(&child->stream[1]);
          free(child);
          break;
       }
    }
 }
 
+// Records a reaped child's exit and stops watching for it
+static void child_exited(ProcChild *child, int exitStatus,
+      struct rusage *rusage)
+{
+   ProcessData *proc = child->parentData;
+
+   HASH_remove_data(proc->childHash, child);
+   if (child->pidfd >= 0) {
+      EVT_fd_remove(proc->evtHandler, child->pidfd, EVENT_FD_READ);
+      close(child->pidfd);
+      child->pidfd = -1;
+   }
+
+   child->rusage = *rusage;
+   child->exitStatus = exitStatus;
+   child->state = CHILD_STATE_FLUSH_PIPES;
+   validate_pipe_flush(child);
+}
+
 static int sigchld_handler(int signum, void *param)
 {
    ProcessData *proc = (ProcessData*)param;
@@ -410,8 +688,10 @@ static int sigchld_handler(int signum, void *param)
    pid_t cpid;
    struct rusage rusage;
    int exitStatus;
-   struct ProcChild *curr, *tmp;
+   struct ProcChild *child;
 
+   // Reap everything, including children libproc didn't start.  Children
+   //  with a pidfd are normally reaped by child_pidfd_cb first.
    do {
       cpid = wait4(-1, &exitStatus, WNOHANG, &rusage);
       more = 0 < cpid;
@@ -420,30 +700,110 @@ static int sigchld_handler(int signum, void *param)
             ERRNO_WARN("Error with wait4");
       }
       else if (cpid > 0) {
-         for(curr = proc->childHead; curr; curr = tmp) {
-            // Use tmp for iteration in case child is deallocated
-            tmp = curr->next;
-            if (curr->procId != cpid || curr->state == CHILD_STATE_DONE)
-               continue;
-
-            curr->rusage = rusage;
-            curr->exitStatus = exitStatus;
-            curr->state = CHILD_STATE_FLUSH_PIPES;
-            validate_pipe_flush(curr);
-         }
+         child = (struct ProcChild*)HASH_find_key(proc->childHash,
+               (void*)(intptr_t)cpid);
+         if (child)
+            child_exited(child, exitStatus, &rusage);
       }
    } while(more);
    return EVENT_KEEP;
 }
 
+#if defined(__linux__) && defined(SYS_pidfd_open)
+static int child_pidfd_cb(int fd, char type, void *arg)
+{
+   ProcChild *child = (ProcChild*)arg;
+   struct rusage rusage;
+   int exitStatus;
+   pid_t cpid;
+
+   cpid = wait4(child->procId, &exitStatus, WNOHANG, &rusage);
+   if (cpid == 0)
+      return EVENT_KEEP;
+
+   if (cpid < 0) {
+      // Reaped by someone else; nothing more to learn from this fd
+      if (ECHILD != errno)
+         ERRNO_WARN("Error with wait4");
+      close(child->pidfd);
+      child->pidfd = -1;
+      return EVENT_REMOVE;
+   }
+
+   // May free the child.  child_exited already removed this callback and
+   //  closed the pidfd, and a restarted child may have been registered under
+   //  the same fd number, so leave the event table alone.
+   child_exited(child, exitStatus, &rusage);
+
+   return EVENT_KEEP;
+}
+#endif
+
+static size_t child_hash_func(void *key)
+{
+   return (size_t)(intptr_t)key;
+}
+
+static void *child_key_for_data(void *data)
+{
+   return (void*)(intptr_t)((ProcChild*)data)->procId;
+}
+
+static int child_cmp_key(void *key1, void *key2)
+{
+   return key1 == key2;
+}
+
+// Tracks a newly forked child, by pidfd where the kernel supports it
+static void child_track(ProcessData *proc, ProcChild *child)
+{
+   if (!proc->childHash)
+      proc->childHash = HASH_create_table(CHILD_HASH_SIZE, &child_hash_func,
+            &child_cmp_key, &child_key_for_data);
+   HASH_add_data(proc->childHash, child);
+
+#if defined(__linux__) && defined(SYS_pidfd_open)
+   child->pidfd = syscall(SYS_pidfd_open, child->procId, 0);
+   if (child->pidfd >= 0) {
+      EVT_fd_add(proc->evtHandler, child->pidfd, EVENT_FD_READ,
+            &child_pidfd_cb, child);
+      EVT_fd_set_name(proc->evtHandler, child->pidfd, "Child %d",
+            (int)child->procId);
+   }
+#endif
+}
+
+static void proc_signal_dispatch(ProcessData *proc, int signum)
+{
+   struct ProcSignalCB **curr, *sigTmp;
+   int keep;
+
+   for (curr = &proc->signalCBHead; *curr; ) {
+      sigTmp = *curr;
+
+      if (sigTmp->sigNum == signum) {
+         sigTmp->recvdCnt++;
+         //cb is assigned in PROC_signal
+         keep = (*sigTmp->cb)(signum, sigTmp->arg);
+
+         if (EVENT_REMOVE == keep) {
+            *curr = sigTmp->next;
+            free(sigTmp);
+         }
+         else
+            curr = &sigTmp->next;
+      }
+      else
+         curr = &sigTmp->next;
+   }
+}
+
 int signal_fd_cb(int fd, char type, void *arg)
 {
    ProcessData *proc = (ProcessData*)arg;
    int rd, signum;
    static char rdBuff[sizeof(signum)];
    static int rdLen = 0;
-   struct ProcSignalCB **curr, *sigTmp;
-   int keep;
 
    do {
       rd = read(proc->sigPipe[0], &rdBuff[rdLen], sizeof(rdBuff) - rdLen);
@@ -461,31 +821,68 @@ int signal_fd_cb(int fd, char type, void *arg)
       if (rdLen == sizeof(rdBuff)) {
          rdLen = 0;
          memcpy(&signum, rdBuff, sizeof(rdBuff));
+         proc_signal_dispatch(proc, signum);
+      }
+   } while(0);
 
-         for (curr = &proc->signalCBHead; *curr; ) {
-            sigTmp = *curr;
+   return EVENT_KEEP;
+}
 
-            if (sigTmp->sigNum == signum) {
-               sigTmp->recvdCnt++;
-               //cb is assigned in PROC_signal
-               keep = (*sigTmp->cb)(signum, sigTmp->arg);
+#ifdef __linux__
+// Drains every pending signal from the signalfd in batches
+static int signalfd_cb(int fd, char type, void *arg)
+{
+   ProcessData *proc = (ProcessData*)arg;
+   struct signalfd_siginfo info[SIGNALFD_BATCH];
+   ssize_t rd;
+   int i, cnt;
 
-               if (EVENT_REMOVE == keep) {
-                  *curr = sigTmp->next;
-                  free(sigTmp);
-               }
-               else
-                  curr = &sigTmp->next;
-            }
-            else
-               curr = &sigTmp->next;
-         }
+   do {
+      rd = read(fd, info, sizeof(info));
+      if (rd < 0) {
+         if (EAGAIN == errno)
+            break;
+         ERRNO_WARN("signalfd error, closing:");
+         return EVENT_REMOVE;
       }
-   } while(0);
+
+      cnt = rd / sizeof(info[0]);
+      for (i = 0; i < cnt; i++)
+         proc_signal_dispatch(proc, info[i].ssi_signo);
+   } while(cnt == SIGNALFD_BATCH);
 
    return EVENT_KEEP;
 }
 
+// Signals raised by a faulting thread can't be deferred to the loop
+static int signal_is_synchronous(int sigNum)
+{
+   return sigNum == SIGSEGV || sigNum == SIGBUS || sigNum == SIGILL ||
+      sigNum == SIGFPE || sigNum == SIGTRAP || sigNum == SIGSYS;
+}
+
+// Moves a signal onto the signalfd
+static int signalfd_add(int sigNum)
+{
+   sigset_t one;
+
+   if (signalFD < 0 || signal_is_synchronous(sigNum))
+      return -1;
+
+   sigaddset(&signalMask, sigNum);
+   if (signalfd(signalFD, &signalMask, 0) < 0) {
+      sigdelset(&signalMask, sigNum);
+      return -1;
+   }
+
+   sigemptyset(&one);
+   sigaddset(&one, sigNum);
+   pthread_sigmask(SIG_BLOCK, &one, NULL);
+
+   return 0;
+}
+#endif
+
 static void PROC_signal_handler(int sigNum, siginfo_t *si, void *p)
 {
    if (signalWriteFD != -1)
@@ -511,9 +908,25 @@ static int setup_signal_fd(ProcessData *proc)
       return -1;
 
    signalWriteFD = proc->sigPipe[1];
+   signalProc = proc;
    res = EVT_fd_add(proc->evtHandler, proc->sigPipe[0],
          EVENT_FD_READ, signal_fd_cb, proc);
    EVT_fd_set_name(proc->evtHandler, proc->sigPipe[0], "Signal Pipe");
+
+#ifdef __linux__
+   // Blocked signals are read in batches straight from the loop.  The pipe
+   //  stays as the path for signals delivered to a thread not blocking them.
+   sigemptyset(&signalMask);
+   signalFD = signalfd(-1, &signalMask, SFD_NONBLOCK | SFD_CLOEXEC);
+   if (signalFD >= 0) {
+      EVT_fd_add(proc->evtHandler, signalFD, EVENT_FD_READ, signalfd_cb,
+            proc);
+      EVT_fd_set_name(proc->evtHandler, signalFD, "Signal FD");
+   }
+   else
+      ERRNO_WARN("signalfd failed, using signal pipe");
+#endif
+
    return res;
 }
 
@@ -529,7 +942,7 @@ int PROC_signal(struct ProcessData *proc, int sigNum, PROC_signal_cb cb,
       return -1;
    }
 
-   if (proc->sigPipe[1] != signalWriteFD) {
+   if (proc != signalProc) {
       DBG_print(DBG_LEVEL_WARN, "Failed to add signal because a different ProcessData"
             " is already catching signals.");
       return -1;
@@ -550,10 +963,15 @@ int PROC_signal(struct ProcessData *proc, int sigNum, PROC_signal_cb cb,
    sigfillset(&sa.sa_mask); //Catch all signals
    sa.sa_flags = SA_SIGINFO;
    if (-1 == sigaction(sigNum, &sa, NULL)) {
+      proc->signalCBHead = curr->next;
       free(curr);
       return -1;
    }
 
+#ifdef __linux__
+   signalfd_add(sigNum);
+#endif
+
    return 0;
 }
 
@@ -756,6 +1174,10 @@ ProcChild *PROC_fork_child_fd(struct ProcessData *proc, int inFd_read, int inFd_
       // Move child into own group for signal isolation
       setpgrp();
 
+      // Don't pass the signals we read from a signalfd on blocked
+      if (signalFD >= 0)
+         sigprocmask(SIG_UNBLOCK, &signalMask, NULL);
+
       // Set memory limits it necessary
       if(mem_limit) {
          if(setrlimit(RLIMIT_AS, mem_limit) == -1) {
@@ -807,9 +1229,11 @@ ProcChild *PROC_fork_child_fd(struct ProcessData *proc, int inFd_read, int inFd_
    child->stdin_fd = inFd_write;
    child->stdout_fd = outFd_read;
    child->stderr_fd = errFd_read;
+   child->pidfd = -1;
 
    child->next = proc->childHead;
    proc->childHead = child;
+   child_track(proc, child);
 
    // Clean up and return the child
 err_cleanup:
@@ -857,10 +1281,12 @@ void CHLD_close_fd(ProcChild *child, int fd)
       change = 1;
    }
    if (fd == child->stdout_fd) {
+      passthrough_cancel(child, &child->stream[0]);
       child->stdout_fd = -1;
       change = 1;
    }
    if (fd == child->stderr_fd) {
+      passthrough_cancel(child, &child->stream[1]);
       child->stderr_fd = -1;
       change = 1;
    }
@@ -920,86 +1346,90 @@ char CHLD_death_notice(ProcChild *child, CHLD_death_cb_t deathCb, void *arg)
    return 0;
 }
 
-static void drain_buffer(ProcChild *child, BufferedStreamState *state,
+// Hands a reader registered without a view a malloc'd copy of the
+//  buffered bytes, which it may steal as it could before the ring
+static int drain_copy(ProcChild *child, ChildStream *state, int urgent)
+{
+   int drainLen;
+
+   if (!state->copy) {
+      state->copy = malloc(state->buffCap);
+      if (!state->copy)
+         return CHILD_BUFF_ERR;
+   }
+   // Either kind of ring keeps the buffered bytes contiguous from head
+   memcpy(state->copy, state->buff + state->head, state->buffLen);
+
+   drainLen = (*state->cb)(child, urgent, state->arg, state->copy,
+         state->buffLen);
+   if (drainLen == CHILD_BUFF_STEAL_BUFF) {
+      state->copy = NULL;
+      drainLen = CHILD_BUFF_CONSUME_ALL;
+   }
+
+   return drainLen;
+}
+
+static void drain_buffer(ProcChild *child, ChildStream *state,
       int urgent)
 {
    int drainLen = 1;
-   int i;
 
    if (!state || !state->cb)
       return;
 
-  while (drainLen > 0 && state->buffLen > 0) {
-      drainLen = (*state->cb)(child, urgent, state->arg, state->buff,
-            state->buffLen);
+   while (drainLen > 0 && state->buffLen > 0) {
+      if (state->view)
+         drainLen = (*state->cb)(child, urgent, state->arg,
+               state->buff + state->head, state->buffLen);
+      else
+         drainLen = drain_copy(child, state, urgent);
       if (drainLen == CHILD_BUFF_ERR)
          break;
-      if (drainLen == CHILD_BUFF_STEAL_BUFF) {
-         state->buff = NULL;
-         state->buffLen = state->buffCap = 0;
-         break;
-      }
-      if (drainLen >= state->buffLen) {
-         state->buffLen = 0;
+      if (drainLen == CHILD_BUFF_CONSUME_ALL) {
+         ring_consume(state, state->buffLen);
          break;
       }
-
-      // Compress the buffer
-      state->buffLen -= drainLen;
-      for(i = 0; i < state->buffLen; i++)
-         state->buff[i] = state->buff[i + drainLen];
+      if (drainLen > 0)
+         ring_consume(state, drainLen);
    }
 }
 
 static int child_read_data(int fd, char type, void *arg)
 {
    ProcChild *child = (ProcChild*)arg;
-   BufferedStreamState *state = NULL;
-   int readLen;
+   ChildStream *state = NULL;
+   int readLen, space;
+   char *tail;
 
    if (fd == child->stdout_fd)
-      state = &child->streamState[0];
+      state = &child->stream[0];
    else if (fd ==  child->stderr_fd)
-      state = &child->streamState[1];
+      state = &child->stream[1];
    else {
       DBG_print(DBG_LEVEL_WARN, "child_read_data registered for wrong < fd,client>\n");
       return EVENT_REMOVE;
    }
 
-   // Is there any space left in the buffer?  If not, expand it
+   if (!state->buff && !ring_alloc(state)) {
+      DBG_print(DBG_LEVEL_WARN, "no memory for buffer; very bad!\n");
+      exit(1);
+   }
+
+   // Is there any space left in the ring?  If not, give the callback one
+   //  last chance to make room
    if (state->buffLen >= state->buffCap) {
-      if (state->buffCap >= READ_BUFF_MAX) {
-         drain_buffer(child, state, CHILD_BUFF_NOROOM);
-         if (state->buffLen >= state->buffCap) {
-            DBG_print(DBG_LEVEL_WARN, "Failed to drain buffer, dropping data!\n");
-            state->buffLen = 0;
-         }
-      }
-      if (!state->buff) {
-         state->buffCap = READ_BUFF_MIN;
-         state->buffLen = 0;
-         state->buff = malloc(state->buffCap);
-         if (!state->buff) {
-            DBG_print(DBG_LEVEL_WARN, "no memory for buffer; very bad!\n");
-            exit(1);
-         }
-      }
-      else if (state->buffLen >= state->buffCap &&
-            state->buffCap < READ_BUFF_MAX) {
-         state->buffCap *= 2;
-         if (state->buffCap > READ_BUFF_MAX)
-            state->buffCap = READ_BUFF_MAX;
-         state->buff = realloc(state->buff, state->buffCap);
-         if (!state->buff) {
-            DBG_print(DBG_LEVEL_WARN, "no memory for realloc buffer; very bad!\n");
-            exit(1);
-         }
+      drain_buffer(child, state, CHILD_BUFF_NOROOM);
+      if (state->buffLen >= state->buffCap) {
+         DBG_print(DBG_LEVEL_WARN, "Failed to drain buffer, dropping data!\n");
+         ring_consume(state, state->buffLen);
       }
    }
-   assert(state->buffLen < state->buffCap);
 
-   readLen = read(fd, &state->buff[state->buffLen],
-         state->buffCap - state->buffLen);
+   tail = ring_tail(state, &space);
+   assert(space > 0);
+
+   readLen = read(fd, tail, space);
 
    if (readLen > 0) {
       state->buffLen += readLen;
@@ -1010,11 +1440,7 @@ static int child_read_data(int fd, char type, void *arg)
       if (state->buffLen != 0) {
          DBG_print(DBG_LEVEL_WARN, "Not all bytes read from buffer when closed\n");
       }
-      if (state->buff) {
-         free(state->buff);
-         state->buff = NULL;
-         state->buffCap = state->buffLen = 0;
-      }
+      ring_free(state);
       CHLD_close_fd(child, fd);
       return EVENT_REMOVE;
    } else if (-1 == readLen && errno != EAGAIN) {
@@ -1026,195 +1452,1098 @@ static int child_read_data(int fd, char type, void *arg)
    return EVENT_KEEP;
 }
 
-char CHLD_stdout_reader(ProcChild *child, CHLD_buf_stream_cb_t cb, void *arg)
+// Writes out the bytes left in the stream's ring by a short write.
+//  Returns 0 once they are all written, 1 if outFd is still full, or -1 on
+//  error.
+static int passthrough_flush(ChildStream *state)
 {
-   int res;
-
-   if (!child)
-      return 0;
-   if (child->stdout_fd < 0)
-      return 0;
-   if (!child->parentData)
-      return 1;
+   ssize_t res;
 
-   child->streamState[0].cb = cb;
-   child->streamState[0].arg = arg;
+   while (state->buffLen > 0) {
+      // A mirrored ring is contiguous from head, a plain one never wraps
+      res = write(state->passthroughFd, state->buff + state->head,
+            state->buffLen);
+      if (res < 0) {
+         if (errno == EINTR)
+            continue;
+         if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 1;
+         return -1;
+      }
+      ring_consume(state, res);
+   }
 
-   res = EVT_fd_add(child->parentData->evtHandler, child->stdout_fd,
-         EVENT_FD_READ, child_read_data, child);
-   EVT_fd_set_name(child->parentData->evtHandler, child->stdout_fd,
-         "child %u stdout reader", child->procId);
-   return res;
+   return 0;
 }
 
-char CHLD_stderr_reader(ProcChild *child, CHLD_buf_stream_cb_t cb, void *arg)
+// Copies one chunk from fd to outFd through a stack buffer.  If outFd fills
+//  partway through, the rest is kept in the stream's ring and the stream is
+//  marked blocked.
+static int passthrough_copy(int fd, ChildStream *state)
 {
-   int res;
-
-   if (!child)
-      return 0;
-   if (child->stderr_fd < 0)
-      return 0;
-   if (!child->parentData)
-      return 1;
-
-   child->streamState[1].cb = cb;
-   child->streamState[1].arg = arg;
+   char buff[COPY_CHUNK];
+   int readLen, written = 0, res, space;
+
+   readLen = read(fd, buff, sizeof(buff));
+   if (readLen <= 0)
+      return readLen;
+
+   while (written < readLen) {
+      res = write(state->passthroughFd, buff + written, readLen - written);
+      if (res >= 0) {
+         written += res;
+         continue;
+      }
+      if (errno == EINTR)
+         continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+         return -1;
 
-   res = EVT_fd_add(child->parentData->evtHandler, child->stderr_fd,
-         EVENT_FD_READ, child_read_data, child);
-   EVT_fd_set_name(child->parentData->evtHandler, child->stderr_fd,
-         "child %u stderr reader", child->procId);
+      if (!state->buff && !ring_alloc(state))
+         return -1;
+      memcpy(ring_tail(state, &space), buff + written, readLen - written);
+      state->buffLen += readLen - written;
+      state->blocked = 1;
+      break;
+   }
 
-   return res;
+   return readLen;
 }
 
-struct MsgData {
-   ProcessData *proc;
-   char *data;
-   size_t dataLen;
-   struct sockaddr_in dest;
-};
+static int passthrough_writable(int fd, char type, void *arg);
+static int child_passthrough_data(int fd, char type, void *arg);
 
-int socket_write_cb(int fd, char type, void * arg)
+// Returns the other stream if it is also waiting on fd
+static ChildStream *passthrough_sharing(ProcChild *child,
+      ChildStream *state, int fd)
 {
-   // by default, should remove the event
-   int retval = EVENT_REMOVE;
-   struct MsgData *msg = (struct MsgData *)arg;
+   ChildStream *other = state == &child->stream[0] ?
+      &child->stream[1] : &child->stream[0];
 
-   errno = 0;
-   socket_write(fd, msg->data, msg->dataLen, &(msg->dest));
+   if (other->blocked && other->passthroughFd == fd)
+      return other;
+   return NULL;
+}
 
-   if (errno == 0) {
-      free(msg->data);
-      free(msg);
-   } else if (errno == EAGAIN) {
-      // if for some reason it's still trying to block, keep the event
-      retval = EVENT_KEEP;
-   }
+// Stops reading the child until outFd drains.  Both streams may forward to
+//  the same fd, in which case they share one write event.
+static int passthrough_block(ProcChild *child, ChildStream *state)
+{
+   if (passthrough_sharing(child, state, state->passthroughFd))
+      return 1;
 
-   return retval;
+   return EVT_fd_add(child->parentData->evtHandler, state->passthroughFd,
+         EVENT_FD_WRITE, passthrough_writable, child);
 }
 
-int PROC_loopback_cmd(struct ProcessData *proc,
-            int cmdNum, void *data, size_t dataLen)
+// Forgets that a closing stream was waiting on its destination
+static void passthrough_cancel(ProcChild *child, ChildStream *state)
 {
-   return CMD_loopback_cmd(proc->cmds, proc->cmdFd, cmdNum, data, dataLen);
+   if (!state->blocked)
+      return;
+
+   state->blocked = 0;
+   if (child->parentData &&
+         !passthrough_sharing(child, state, state->passthroughFd))
+      EVT_fd_remove(child->parentData->evtHandler, state->passthroughFd,
+            EVENT_FD_WRITE);
 }
 
-int PROC_multi_cmd(ProcessData *proc, unsigned char cmd, void *data,
-   size_t dataLen)
+// Resumes reading each stream blocked on fd once its pending bytes are out
+static int passthrough_writable(int fd, char type, void *arg)
 {
-   uint16_t port = socket_multicast_port_by_name(proc->name);
-   int retval = 0;
-   struct sockaddr_in addr;
+   ProcChild *child = (ProcChild*)arg;
+   ChildStream *state;
+   int i, childFd, res, keep = 0;
+   int closing[2] = { -1, -1 };
+
+   for (i = 0; i < 2; i++) {
+      state = &child->stream[i];
+      childFd = i ? child->stderr_fd : child->stdout_fd;
+      if (!state->blocked || state->passthroughFd != fd || childFd < 0)
+         continue;
+
+      if ((res = passthrough_flush(state)) > 0) {
+         keep = 1;
+         continue;
+      }
 
-   memset((char*)&addr, 0, sizeof(addr));
-   addr.sin_addr = socket_multicast_addr_by_name(proc->name);
+      state->blocked = 0;
+      if (res < 0) {
+         ERRNO_WARN("Error forwarding child output, closing");
+         closing[i] = childFd;
+      }
+      else if (!EVT_fd_add(child->parentData->evtHandler, childFd,
+               EVENT_FD_READ, child_passthrough_data, child))
+         closing[i] = childFd;
+   }
 
-   if (port > 0 && addr.sin_addr.s_addr) {
+   // Closing the last fd frees the child, so it is not touched afterwards
+   for (i = 0; i < 2; i++)
+      if (closing[i] >= 0)
+         CHLD_close_fd(child, closing[i]);
+
+   return keep ? EVENT_KEEP : EVENT_REMOVE;
+}
+
+static int child_passthrough_data(int fd, char type, void *arg)
+{
+   ProcChild *child = (ProcChild*)arg;
+   ChildStream *state = NULL;
+   ssize_t len = -1;
+
+   if (fd == child->stdout_fd)
+      state = &child->stream[0];
+   else if (fd ==  child->stderr_fd)
+      state = &child->stream[1];
+   else {
+      DBG_print(DBG_LEVEL_WARN, "child_passthrough_data registered for wrong < fd,client>\n");
+      return EVENT_REMOVE;
+   }
+
+#ifdef __linux__
+   if (state->passthrough == CHLD_PASSTHROUGH_SPLICE) {
+      len = splice(fd, NULL, state->passthroughFd, NULL, SPLICE_CHUNK,
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      // The destination can't be spliced to (e.g., O_APPEND files)
+      if (len < 0 && errno == EINVAL) {
+         state->passthrough = CHLD_PASSTHROUGH_COPY;
+         return EVENT_KEEP;
+      }
+      // The child's pipe was readable, so the destination is full
+      if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+         state->blocked = 1;
+   }
+   else
+#endif
+      len = passthrough_copy(fd, state);
+
+   if (state->blocked) {
+      if (passthrough_block(child, state))
+         return EVENT_REMOVE;
+      state->blocked = 0;
+      ERRNO_WARN("Can't wait for child output destination, closing");
+      CHLD_close_fd(child, fd);
+      return EVENT_REMOVE;
+   }
+
+   if (len == 0) {
+      CHLD_close_fd(child, fd);
+      return EVENT_REMOVE;
+   }
+   if (len < 0 && errno != EAGAIN && errno != EINTR) {
+      ERRNO_WARN("Error forwarding child output, closing");
+      CHLD_close_fd(child, fd);
+      return EVENT_REMOVE;
+   }
+
+   return EVENT_KEEP;
+}
+
+static char child_passthrough(ProcChild *child, int fd,
+      ChildStream *state, int outFd, const char *name)
+{
+   int res;
+
+   if (fd < 0 || outFd < 0)
+      return 0;
+   if (!child->parentData)
+      return 1;
+
+#ifdef __linux__
+   state->passthrough = CHLD_PASSTHROUGH_SPLICE;
+#else
+   state->passthrough = CHLD_PASSTHROUGH_COPY;
+#endif
+   state->passthroughFd = outFd;
+
+   res = EVT_fd_add(child->parentData->evtHandler, fd,
+         EVENT_FD_READ, child_passthrough_data, child);
+   EVT_fd_set_name(child->parentData->evtHandler, fd,
+         "child %u %s passthrough", child->procId, name);
+
+   return res;
+}
+
+char CHLD_stdout_splice(ProcChild *child, int outFd)
+{
+   if (!child)
+      return 0;
+
+   return child_passthrough(child, child->stdout_fd, &child->stream[0],
+         outFd, "stdout");
+}
+
+char CHLD_stderr_splice(ProcChild *child, int outFd)
+{
+   if (!child)
+      return 0;
+
+   return child_passthrough(child, child->stderr_fd, &child->stream[1],
+         outFd, "stderr");
+}
+
+static char child_reader(ProcChild *child, int fd, ChildStream *state,
+      CHLD_buf_stream_cb_t cb, void *arg, char view, const char *name)
+{
+   int res;
+
+   if (fd < 0)
+      return 0;
+   if (!child->parentData)
+      return 1;
+
+   state->cb = cb;
+   state->arg = arg;
+   state->view = view;
+
+   res = EVT_fd_add(child->parentData->evtHandler, fd,
+         EVENT_FD_READ, child_read_data, child);
+   EVT_fd_set_name(child->parentData->evtHandler, fd,
+         "child %u %s reader", child->procId, name);
+   return res;
+}
+
+char CHLD_stdout_reader(ProcChild *child, CHLD_buf_stream_cb_t cb, void *arg)
+{
+   if (!child)
+      return 0;
+   return child_reader(child, child->stdout_fd, &child->stream[0], cb, arg,
+         0, "stdout");
+}
+
+char CHLD_stderr_reader(ProcChild *child, CHLD_buf_stream_cb_t cb, void *arg)
+{
+   if (!child)
+      return 0;
+   return child_reader(child, child->stderr_fd, &child->stream[1], cb, arg,
+         0, "stderr");
+}
+
+char CHLD_stdout_view_reader(ProcChild *child, CHLD_buf_stream_cb_t cb,
+      void *arg)
+{
+   if (!child)
+      return 0;
+   return child_reader(child, child->stdout_fd, &child->stream[0], cb, arg,
+         1, "stdout");
+}
+
+char CHLD_stderr_view_reader(ProcChild *child, CHLD_buf_stream_cb_t cb,
+      void *arg)
+{
+   if (!child)
+      return 0;
+   return child_reader(child, child->stderr_fd, &child->stream[1], cb, arg,
+         1, "stderr");
+}
+
+// A datagram waiting for its socket to become writable
+struct MsgData {
+   char *data;
+   size_t dataLen;
+   struct sockaddr_in dest;
+   struct MsgData *next;
+};
+
+// The datagrams for one socket that would have blocked.  Anything sent to
+//  the socket while the list is non-empty queues behind it, so datagrams
+//  leave in the order they were sent.
+struct ProcTxDefer {
+   int fd;
+   struct MsgData *head, *tail;
+   struct ProcTxQueue *q;
+   struct ProcTxDefer *next;
+};
+
+// Non-zero if the calling thread owns q.  The owner is the thread that
+//  created the queue until its loop starts, and the loop's thread after.
+static int proc_tx_owned(struct ProcTxQueue *q)
+{
+   return q && pthread_equal(__atomic_load_n(&q->owner, __ATOMIC_ACQUIRE),
+         pthread_self());
+}
+
+static struct ProcTxDefer *proc_tx_defer_find(struct ProcTxQueue *q, int fd)
+{
+   struct ProcTxDefer *defer;
+
+   for (defer = q ? q->defer : NULL; defer; defer = defer->next)
+      if (defer->fd == fd)
+         return defer;
+
+   return NULL;
+}
+
+static int proc_tx_same_dest(const struct sockaddr_in *a,
+      const struct sockaddr_in *b)
+{
+   return a->sin_addr.s_addr == b->sin_addr.s_addr &&
+      a->sin_port == b->sin_port;
+}
+
+// Returns non-zero if a datagram for dest is still queued or waiting on a
+//  blocked socket, so a shared memory ring would overtake it
+static int proc_tx_pending_to(struct ProcTxQueue *q, int fd,
+      const struct sockaddr_in *dest)
+{
+   struct ProcTxDefer *defer = proc_tx_defer_find(q, fd);
+   struct MsgData *msg;
+   int i;
+
+   for (i = 0; q && i < q->count; i++)
+      if (q->msgs[i].fd == fd && proc_tx_same_dest(&q->msgs[i].dest, dest))
+         return 1;
+   for (msg = defer ? defer->head : NULL; msg; msg = msg->next)
+      if (proc_tx_same_dest(&msg->dest, dest))
+         return 1;
+
+   return 0;
+}
+
+static void proc_tx_defer_free(struct ProcTxDefer *defer)
+{
+   struct ProcTxDefer **itr;
+   struct MsgData *msg;
+
+   for (itr = &defer->q->defer; *itr; itr = &(*itr)->next)
+      if (*itr == defer) {
+         *itr = defer->next;
+         break;
+      }
+
+   while ((msg = defer->head)) {
+      defer->head = msg->next;
+      free(msg->data);
+      free(msg);
+   }
+   free(defer);
+}
+
+int socket_write_cb(int fd, char type, void * arg)
+{
+   struct ProcTxDefer *defer = (struct ProcTxDefer *)arg;
+   struct MsgData *msg;
+
+   while ((msg = defer->head)) {
+      errno = 0;
+      socket_write(fd, msg->data, msg->dataLen, &(msg->dest));
+      // if for some reason it's still trying to block, keep the event
+      if (errno == EAGAIN)
+         return EVENT_KEEP;
+
+      // Sent, or failed for good.  Either way it's done.
+      defer->head = msg->next;
+      free(msg->data);
+      free(msg);
+   }
+
+   proc_tx_defer_free(defer);
+
+   return EVENT_REMOVE;
+}
+
+int PROC_loopback_cmd(struct ProcessData *proc,
+            int cmdNum, void *data, size_t dataLen)
+{
+   return CMD_loopback_cmd(proc->cmds, proc->cmdFd, cmdNum, data, dataLen);
+}
+
+int PROC_multi_cmd(ProcessData *proc, unsigned char cmd, void *data,
+   size_t dataLen)
+{
+   uint16_t port = socket_multicast_port_by_name(proc->name);
+   int retval = 0;
+   struct sockaddr_in addr;
+
+   memset((char*)&addr, 0, sizeof(addr));
+   addr.sin_addr = socket_multicast_addr_by_name(proc->name);
+
+   if (port > 0 && addr.sin_addr.s_addr) {
+      addr.sin_family = AF_INET;
+      addr.sin_port = htons(port);
+
+      // printf("Sending to %s / %d\n", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+
+      retval = PROC_cmd_sockaddr(proc, cmd, data, dataLen, &addr);
+   }
+
+   return retval;
+}
+
+static int proc_cmd_internal(ProcessData *proc, int fd, unsigned char cmd, void *data, size_t dataLen, const char *dest)
+{
+   int port = socket_get_addr_by_name(dest);
+   int retval = 0;
+
+   if (port > 0) {
+      struct sockaddr_in addr;
+
+      memset((char*)&addr, 0, sizeof(addr));
       addr.sin_family = AF_INET;
       addr.sin_port = htons(port);
+      addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+      retval = proc_cmd_sockaddr_internal(proc, fd, cmd, data, dataLen, &addr);
+   }
+
+   return retval;
+}
+
+int PROC_cmd(ProcessData *proc, unsigned char cmd, void *data, size_t dataLen, const char *dest)
+{
+   return proc_cmd_internal(proc, proc->cmdFd, cmd, data, dataLen, dest);
+}
+
+int PROC_cmd_secondary(ProcessData *proc, unsigned char cmd, void *data, size_t dataLen, const char *dest)
+{
+   return proc_cmd_internal(proc, proc->txFd, cmd, data, dataLen, dest);
+}
+
+int PROC_cmd_sockaddr(ProcessData *proc, unsigned char cmd, void *data, size_t dataLen, struct sockaddr_in *dest)
+{
+   return proc_cmd_sockaddr_internal(proc, proc->cmdFd, cmd, data, dataLen, dest);
+}
+
+int PROC_cmd_raw_sockaddr(ProcessData *proc, void *data, size_t dataLen,
+      struct sockaddr_in *dest)
+{
+   return proc_cmd_sockaddr_raw_internal(proc, proc->cmdFd, data, dataLen, dest);
+}
+
+int PROC_cmd_sockaddr_secondary(ProcessData *proc, unsigned char cmd, void *data, size_t dataLen, struct sockaddr_in *dest)
+{
+   return proc_cmd_sockaddr_internal(proc, proc->txFd, cmd, data, dataLen, dest);
+}
+
+/* Queues a malloc'd datagram until fd is writable.  Takes ownership of data.
+ * @return dataLen, or -1 if it couldn't be queued
+ */
+static int proc_tx_defer(ProcessData *proc, int fd, void *data,
+      size_t dataLen, struct sockaddr_in *dest)
+{
+   struct ProcTxQueue *q = proc_txq(proc);
+   struct ProcTxDefer *defer = proc_tx_defer_find(q, fd);
+   struct MsgData *msg = NULL;
+
+   if (q && !defer) {
+      defer = (struct ProcTxDefer*)malloc(sizeof(struct ProcTxDefer));
+      if (defer) {
+         memset(defer, 0, sizeof(struct ProcTxDefer));
+         defer->fd = fd;
+         defer->q = q;
+         if (EVT_fd_add(PROC_evt(proc), fd, EVENT_FD_WRITE, socket_write_cb,
+                  defer) > 0) {
+            defer->next = q->defer;
+            q->defer = defer;
+         }
+         else {
+            free(defer);
+            defer = NULL;
+         }
+      }
+   }
+
+   if (defer)
+      msg = (struct MsgData*)malloc(sizeof(struct MsgData));
+   if (!msg) {
+      free(data);
+      return -1;
+   }
+
+   msg->data = data;
+   msg->dataLen = dataLen;
+   msg->dest = *dest;
+   msg->next = NULL;
+   if (defer->tail)
+      defer->tail->next = msg;
+   else
+      defer->head = msg;
+   defer->tail = msg;
+
+   return dataLen;
+}
+
+// Header of a datagram handed from another thread to the queue's owner
+struct ProcTxForeign {
+   int fd;
+   struct sockaddr_in dest;
+};
+
+// Runs on the loop after another thread's send would have blocked
+static void proc_tx_foreign_cb(void *arg, void *msg, size_t len)
+{
+   ProcessData *proc = (ProcessData*)arg;
+   struct ProcTxForeign hdr;
+   char *copy;
+
+   memcpy(&hdr, msg, sizeof(hdr));
+   len -= sizeof(hdr);
+   copy = malloc(len);
+   if (!copy)
+      return;
+   memcpy(copy, (char*)msg + sizeof(hdr), len);
+   proc_send_now(proc, hdr.fd, copy, len, &hdr.dest);
+}
+
+/* Sends a datagram from a thread that doesn't own the transmit queue, so
+ * it can't look at the queue or the deferred datagrams.  If the socket
+ * would block the datagram is posted to the loop to wait there.
+ */
+static int proc_tx_send_foreign(ProcessData *proc, int fd, const void *data,
+      size_t dataLen, struct sockaddr_in *dest)
+{
+   struct ProcTxForeign hdr;
+   struct iovec iov[2];
+   int retval;
+
+   errno = 0;
+   retval = socket_write(fd, (void*)data, dataLen, dest);
+   if (retval >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+      return retval;
+
+   memset(&hdr, 0, sizeof(hdr));
+   hdr.fd = fd;
+   hdr.dest = *dest;
+   iov[0].iov_base = &hdr;
+   iov[0].iov_len = sizeof(hdr);
+   iov[1].iov_base = (void*)data;
+   iov[1].iov_len = dataLen;
+   if (EVT_post_msg(PROC_evt(proc), &proc_tx_foreign_cb, proc, iov, 2) < 0)
+      return -1;
+
+   return dataLen;
+}
+
+// Sends a malloc'd datagram immediately, retrying from the event loop if
+//  the socket would block.  Takes ownership of data.
+static int proc_send_now(ProcessData *proc, int fd, void *data,
+      size_t dataLen, struct sockaddr_in *dest)
+{
+   struct ProcTxQueue *q = proc_txq(proc);
+   int retval;
+
+   if (!proc_tx_owned(q)) {
+      retval = proc_tx_send_foreign(proc, fd, data, dataLen, dest);
+      free(data);
+      return retval;
+   }
+
+   // Earlier datagrams are still waiting for the socket
+   if (proc_tx_defer_find(q, fd))
+      return proc_tx_defer(proc, fd, data, dataLen, dest);
+
+   errno = 0;
+   retval = socket_write(fd, data, dataLen, dest);
+
+   // EAGAIN indicates the operation would block, so schedule a write for
+   //  when buffer is available
+   if (retval < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return proc_tx_defer(proc, fd, data, dataLen, dest);
+
+   free(data);
+
+   return retval;
+}
+
+// Hands a queued datagram that sendmmsg did not accept to the slow path
+static int proc_tx_send_one(ProcessData *proc, struct ProcTxMsg *msg)
+{
+   struct ProcTxQueue *q = proc_txq(proc);
+   char *copy = malloc(msg->len);
+
+   if (!copy)
+      return -1;
+   memcpy(copy, q->arena + msg->offset, msg->len);
+   return proc_send_now(proc, msg->fd, copy, msg->len, &msg->dest);
+}
+
+/* Sends everything in the calling loop's transmit queue.
+ * @param lastRes If not NULL, set to the send result of the last datagram
+ * @return The number of datagrams flushed
+ */
+static int proc_tx_flush(ProcessData *proc, int *lastRes)
+{
+   struct ProcTxQueue *q;
+   int i, sent = 0, last = 0;
+#ifdef __linux__
+   struct mmsghdr hdrs[TX_QUEUE_MAX];
+   struct iovec iov[TX_QUEUE_MAX];
+   int first, cnt, res;
+#endif
+
+   if (!proc || !(q = proc_txq(proc)) || !q->count || !proc_tx_owned(q))
+      return 0;
+
+#ifdef __linux__
+   memset(hdrs, 0, sizeof(hdrs[0]) * q->count);
+   for (i = 0; i < q->count; i++) {
+      iov[i].iov_base = q->arena + q->msgs[i].offset;
+      iov[i].iov_len = q->msgs[i].len;
+      hdrs[i].msg_hdr.msg_name = &q->msgs[i].dest;
+      hdrs[i].msg_hdr.msg_namelen = sizeof(q->msgs[i].dest);
+      hdrs[i].msg_hdr.msg_iov = &iov[i];
+      hdrs[i].msg_hdr.msg_iovlen = 1;
+   }
+
+   // Send each run of datagrams that share a socket with one system call
+   for (first = 0; first < q->count; first += cnt) {
+      for (cnt = 1; first + cnt < q->count &&
+            q->msgs[first + cnt].fd == q->msgs[first].fd; cnt++)
+         ;
+
+      for (i = first; i < first + cnt; ) {
+         // Once the socket backs up the rest of the run waits its turn
+         if (!proc_tx_defer_find(q, q->msgs[i].fd)) {
+            res = sendmmsg(q->msgs[i].fd, &hdrs[i], first + cnt - i, 0);
+            if (res > 0) {
+               sent += res;
+               i += res;
+               last = q->msgs[i - 1].len;
+               continue;
+            }
+         }
+         // The datagram at i failed; let the single send path report or
+         //  defer it, then carry on with the rest of the run
+         last = proc_tx_send_one(proc, &q->msgs[i]);
+         sent++;
+         i++;
+      }
+   }
+#else
+   for (i = 0; i < q->count; i++, sent++)
+      last = proc_tx_send_one(proc, &q->msgs[i]);
+#endif
+
+   q->count = 0;
+   q->arenaUsed = 0;
+   if (lastRes)
+      *lastRes = last;
+
+   return sent;
+}
+
+int PROC_cmd_flush(ProcessData *proc)
+{
+   return proc_tx_flush(proc, NULL);
+}
+
+static void proc_tx_atexit(void)
+{
+   if (exitFlushProc)
+      PROC_cmd_flush(exitFlushProc);
+}
+
+static pthread_key_t scratchKey;
+static pthread_once_t scratchOnce = PTHREAD_ONCE_INIT;
+
+static void proc_tx_scratch_free(void *arg)
+{
+   struct ProcTxScratch *scratch = (struct ProcTxScratch*)arg;
+
+   free(scratch->buff);
+   free(scratch);
+}
+
+static void proc_tx_scratch_key(void)
+{
+   pthread_key_create(&scratchKey, &proc_tx_scratch_free);
+}
+
+// Returns the calling thread's private encode buffer, grown to len
+static char *proc_tx_scratch(size_t len)
+{
+   struct ProcTxScratch *scratch;
+   char *buff;
+
+   pthread_once(&scratchOnce, &proc_tx_scratch_key);
+   scratch = (struct ProcTxScratch*)pthread_getspecific(scratchKey);
+   if (!scratch) {
+      scratch = (struct ProcTxScratch*)malloc(sizeof(*scratch));
+      if (!scratch)
+         return NULL;
+      memset(scratch, 0, sizeof(*scratch));
+      if (pthread_setspecific(scratchKey, scratch)) {
+         free(scratch);
+         return NULL;
+      }
+   }
+
+   if (len > scratch->len) {
+      buff = realloc(scratch->buff, len);
+      if (!buff)
+         return NULL;
+      scratch->buff = buff;
+      scratch->len = len;
+   }
+
+   return scratch->buff;
+}
+
+char *proc_tx_reserve(ProcessData *proc, size_t len)
+{
+   struct ProcTxQueue *q = proc_txq(proc);
+   size_t newLen;
+   char *arena;
+
+   if (!q)
+      return NULL;
+   if (!proc_tx_owned(q))
+      return proc_tx_scratch(len);
+
+   if (q->count >= TX_QUEUE_MAX ||
+         (q->arenaUsed && q->arenaUsed + len > TX_ARENA_FLUSH))
+      PROC_cmd_flush(proc);
+
+   if (q->arenaUsed + len > q->arenaLen) {
+      newLen = q->arenaLen ? q->arenaLen : TX_ARENA_MIN;
+      while (newLen < q->arenaUsed + len)
+         newLen *= 2;
+      arena = realloc(q->arena, newLen);
+      if (!arena)
+         return NULL;
+      q->arena = arena;
+      q->arenaLen = newLen;
+   }
+
+   return q->arena + q->arenaUsed;
+}
+
+int proc_tx_commit(ProcessData *proc, int fd, size_t len,
+      struct sockaddr_in *dest)
+{
+   struct ProcTxQueue *q = proc_txq(proc);
+   struct ProcTxMsg *msg;
+   struct iovec iov;
+   int res;
+
+   // Other threads encoded into their scratch buffer and send it directly
+   if (!proc_tx_owned(q))
+      return proc_tx_send_foreign(proc, fd, proc_tx_scratch(0), len, dest);
+
+   // Local destinations take the datagram straight from the arena, unless
+   //  earlier datagrams to them are still on their way over UDP
+   if (proc->localTx && fd == proc->cmdFd &&
+         !proc_tx_pending_to(q, fd, dest)) {
+      iov.iov_base = q->arena + q->arenaUsed;
+      iov.iov_len = len;
+      if (SHMR_sendv(proc->localTx, &iov, 1, len, dest) > 0)
+         return len;
+   }
+
+   msg = &q->msgs[q->count++];
+
+   msg->fd = fd;
+   msg->offset = q->arenaUsed;
+   msg->len = len;
+   msg->dest = *dest;
+   q->arenaUsed += len;
+
+   // Outside of the event loop nothing will flush for us, so send now and
+   //  report how it went
+   if (!EVT_loop_running(PROC_evt(proc)) && proc_tx_flush(proc, &res))
+      return res;
+
+   return len;
+}
 
-      // printf("Sending to %s / %d\n", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+int proc_tx_sendv(ProcessData *proc, int fd, const struct iovec *iov,
+      int iovcnt, size_t len, struct sockaddr_in *dest)
+{
+   struct ProcTxQueue *q = proc_txq(proc);
+   int owned = proc_tx_owned(q);
+   struct msghdr hdr;
+   char *copy;
+   ssize_t res;
+   int i;
+   size_t off;
 
-      retval = PROC_cmd_sockaddr(proc, cmd, data, dataLen, &addr);
+   if (owned) {
+      // Keep datagrams in the order they were produced
+      PROC_cmd_flush(proc);
+
+      if (proc->localTx && fd == proc->cmdFd &&
+            !proc_tx_pending_to(q, fd, dest) &&
+            SHMR_sendv(proc->localTx, iov, iovcnt, len, dest) > 0)
+         return len;
    }
 
-   return retval;
+   // A backed up socket takes the copy below and queues it behind the rest
+   if (!owned || !proc_tx_defer_find(q, fd)) {
+      memset(&hdr, 0, sizeof(hdr));
+      hdr.msg_name = dest;
+      hdr.msg_namelen = sizeof(*dest);
+      hdr.msg_iov = (struct iovec*)iov;
+      hdr.msg_iovlen = iovcnt;
+
+      res = sendmsg(fd, &hdr, MSG_DONTWAIT);
+      if (res >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+         return res;
+   }
+
+   // Let the single send path report the error or defer the write, which
+   //  needs a private copy of the datagram
+   copy = malloc(len);
+   if (!copy)
+      return -1;
+   for (i = 0, off = 0; i < iovcnt; off += iov[i].iov_len, i++)
+      memcpy(copy + off, iov[i].iov_base, iov[i].iov_len);
+
+   return proc_send_now(proc, fd, copy, len, dest);
 }
 
-static int proc_cmd_internal(ProcessData *proc, int fd, unsigned char cmd, void *data, size_t dataLen, const char *dest)
+static void proc_tx_loop_hook(void *arg)
 {
-   int port = socket_get_addr_by_name(dest);
-   int retval = 0;
+   ProcessData *proc = (ProcessData*)arg;
+   struct ProcTxQueue *q = proc_txq(proc);
 
-   if (port > 0) {
-      struct sockaddr_in addr;
+   // The first hook runs before any callback, so the loop's thread takes
+   //  over the queue before it can queue anything
+   if (q && EVT_loop_running(PROC_evt(proc)) && !proc_tx_owned(q))
+      __atomic_store_n(&q->owner, pthread_self(), __ATOMIC_RELEASE);
 
-      memset((char*)&addr, 0, sizeof(addr));
-      addr.sin_family = AF_INET;
-      addr.sin_port = htons(port);
-      addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   PROC_cmd_flush(proc);
+}
 
-      retval = proc_cmd_sockaddr_internal(proc, fd, cmd, data, dataLen, &addr);
+static struct ProcTxQueue *proc_tx_queue_create(ProcessData *proc,
+      EVTHandler *evt)
+{
+   struct ProcTxQueue *q;
+
+   q = (struct ProcTxQueue*)malloc(sizeof(struct ProcTxQueue));
+   if (!q)
+      return NULL;
+   memset(q, 0, sizeof(struct ProcTxQueue));
+   q->owner = pthread_self();
+
+   // The hook flushes whichever queue belongs to the loop it runs on
+   q->hook = EVT_loop_hook_add(evt, &proc_tx_loop_hook, proc);
+   if (!q->hook) {
+      free(q);
+      return NULL;
    }
 
-   return retval;
+   return q;
 }
 
-int PROC_cmd(ProcessData *proc, unsigned char cmd, void *data, size_t dataLen, const char *dest)
+static void proc_tx_queue_free(EVTHandler *evt, struct ProcTxQueue *q)
 {
-   return proc_cmd_internal(proc, proc->cmdFd, cmd, data, dataLen, dest);
+   if (!q)
+      return;
+
+   while (q->defer) {
+      EVT_fd_remove(evt, q->defer->fd, EVENT_FD_WRITE);
+      proc_tx_defer_free(q->defer);
+   }
+   EVT_loop_hook_remove(evt, q->hook);
+   free(q->arena);
+   free(q);
 }
 
-int PROC_cmd_secondary(ProcessData *proc, unsigned char cmd, void *data, size_t dataLen, const char *dest)
+static int proc_tx_init(ProcessData *proc)
 {
-   return proc_cmd_internal(proc, proc->txFd, cmd, data, dataLen, dest);
+   static char atexitSet = 0;
+
+   // Responses queued by a handler that calls exit() still go out
+   if (!atexitSet && !atexit(&proc_tx_atexit))
+      atexitSet = 1;
+   if (!exitFlushProc)
+      exitFlushProc = proc;
+
+   proc->txQueue = proc_tx_queue_create(proc, proc->evtHandler);
+
+   return proc->txQueue ? 0 : -1;
 }
 
-int PROC_cmd_sockaddr(ProcessData *proc, unsigned char cmd, void *data, size_t dataLen, struct sockaddr_in *dest)
+static void proc_tx_cleanup(ProcessData *proc)
 {
-   return proc_cmd_sockaddr_internal(proc, proc->cmdFd, cmd, data, dataLen, dest);
+   if (exitFlushProc == proc)
+      exitFlushProc = NULL;
+   if (!proc->txQueue)
+      return;
+
+   PROC_cmd_flush(proc);
+   proc_tx_queue_free(proc->evtHandler, proc->txQueue);
+   proc->txQueue = NULL;
 }
 
-int PROC_cmd_raw_sockaddr(ProcessData *proc, void *data, size_t dataLen,
-      struct sockaddr_in *dest)
+static void *proc_shard_main(void *arg)
 {
-   return proc_cmd_sockaddr_raw_internal(proc, proc->cmdFd, data, dataLen, dest);
+   struct ProcCmdShard *shard = (struct ProcCmdShard*)arg;
+
+   curShard = shard;
+   EVT_start_loop(shard->evt);
+   curShard = NULL;
+
+   return NULL;
 }
 
-int PROC_cmd_sockaddr_secondary(ProcessData *proc, unsigned char cmd, void *data, size_t dataLen, struct sockaddr_in *dest)
+static void proc_shard_exit(void *arg)
 {
-   return proc_cmd_sockaddr_internal(proc, proc->txFd, cmd, data, dataLen, dest);
+   EVT_exit_loop((EVTHandler*)arg);
 }
 
-int proc_cmd_sockaddr_raw_internal(ProcessData *proc, int fd, void *data,
-      size_t dataLen, struct sockaddr_in *dest)
+// Closes a shard's socket so the kernel stops routing datagrams to it
+static void proc_shard_close(struct ProcCmdShard *shard)
 {
-   int retval = 0;
-   struct MsgData *msg = (struct MsgData*)malloc(sizeof(struct MsgData));
+   if (shard->fd < 0)
+      return;
 
-   // create buffer large enough to fit data + command
-   msg->data = data;
-   msg->dataLen = dataLen;
+   EVT_fd_remove(shard->evt, shard->fd, EVENT_FD_READ);
+   close(shard->fd);
+   shard->fd = -1;
+}
 
-   // send the data
-   errno = 0;
-   retval = socket_write(fd, (void*)(msg->data), msg->dataLen, dest);
+static int proc_shards_start(void *arg)
+{
+   ProcessData *proc = (ProcessData*)arg;
+   struct ProcCmdShards *shards = proc->shards;
+   struct ProcCmdShard *shard;
+   sigset_t all, prev;
+   unsigned int i;
+
+   shards->startEvt = NULL;
+
+   // Leave signal delivery to the main thread
+   sigfillset(&all);
+   pthread_sigmask(SIG_BLOCK, &all, &prev);
+   for (i = 0; i < shards->count; i++) {
+      shard = &shards->shard[i];
+      if (pthread_create(&shard->thread, NULL, &proc_shard_main, shard)) {
+         ERRNO_WARN("Failed to start command shard thread\n");
+         proc_shard_close(shard);
+         continue;
+      }
+      shard->started = 1;
+   }
+   pthread_sigmask(SIG_SETMASK, &prev, NULL);
 
-   // If it executed error free, it succeeded!
-   if (errno == 0) {
-      // free temporary data
-      free(msg->data);
-      free(msg);
-   } else if (errno == EAGAIN) {
-      // EAGAIN indicates the operation would block
-      // DBG("Socket is going to block, FYI!\n");
-      msg->proc = proc;
-      msg->dest = *dest;
-      // schedule a write for when buffer is available
-      EVT_fd_add(PROC_evt(proc), fd, EVENT_FD_WRITE, socket_write_cb,
-            (void*)msg);
-      retval = msg->dataLen;
+   return EVENT_REMOVE;
+}
+
+static int proc_shards_init(ProcessData *proc, unsigned int count)
+{
+   struct ProcCmdShards *shards;
+   struct ProcCmdShard *shard;
+   struct sockaddr_in addr;
+   socklen_t addrLen = sizeof(addr);
+   unsigned int i;
+
+   // Bind the same port as the main socket, even if it was ephemeral
+   if (getsockname(proc->cmdFd, (struct sockaddr*)&addr, &addrLen) < 0)
+      return -1;
+
+   shards = (struct ProcCmdShards*)malloc(sizeof(*shards) +
+         count * sizeof(struct ProcCmdShard));
+   if (!shards)
+      return -1;
+   memset(shards, 0, sizeof(*shards) + count * sizeof(struct ProcCmdShard));
+   proc->shards = shards;
+
+   for (i = 0; i < count; i++) {
+      shard = &shards->shard[i];
+      shard->proc = proc;
+      shard->fd = -1;
+      shards->count++;
+
+      shard->evt = EVT_create_handler(NULL, NULL);
+      if (!shard->evt)
+         goto fail;
+      EVT_set_initial_debugger_state(shard->evt, EDBG_DISABLED);
+
+      shard->txQueue = proc_tx_queue_create(proc, shard->evt);
+      shard->cmd = cmd_shard_create(proc->cmds);
+      shard->fd = socket_init_reuseport(ntohs(addr.sin_port));
+      if (!shard->txQueue || !shard->cmd || shard->fd < 0)
+         goto fail;
+
+      EVT_fd_add(shard->evt, shard->fd, EVENT_FD_READ, &cmd_shard_handler_cb,
+            shard->cmd);
+      EVT_fd_set_name(shard->evt, shard->fd, "UDP Command Socket (shard %u)",
+            i + 1);
    }
 
-   return retval;
+   shards->startEvt = EVT_sched_add(proc->evtHandler, EVT_ms2tv(0),
+         &proc_shards_start, proc);
+   if (!shards->startEvt)
+      goto fail;
+
+   return 0;
+
+fail:
+   proc_shards_cleanup(proc);
+   return -1;
+}
+
+static void proc_shards_cleanup(ProcessData *proc)
+{
+   struct ProcCmdShards *shards = proc->shards;
+   struct ProcCmdShard *shard;
+   unsigned int i;
+
+   if (!shards)
+      return;
+
+   if (shards->startEvt)
+      EVT_sched_remove(proc->evtHandler, shards->startEvt);
+
+   for (i = 0; i < shards->count; i++) {
+      shard = &shards->shard[i];
+      if (shard->started) {
+         EVT_post(shard->evt, &proc_shard_exit, shard->evt);
+         pthread_join(shard->thread, NULL);
+      }
+   }
+
+   // Anything the shards forwarded that the main loop hasn't run yet is
+   //  dropped along with the main loop
+   for (i = 0; i < shards->count; i++) {
+      shard = &shards->shard[i];
+      proc_shard_close(shard);
+      proc_tx_queue_free(shard->evt, shard->txQueue);
+      cmd_shard_free(shard->cmd);
+      EVT_free_handler(shard->evt);
+   }
+
+   free(shards);
+   proc->shards = NULL;
+}
+
+int proc_cmd_sockaddr_raw_internal(ProcessData *proc, int fd, void *data,
+      size_t dataLen, struct sockaddr_in *dest)
+{
+   char *buff = proc_tx_reserve(proc, dataLen);
+
+   if (!buff)
+      return proc_send_now(proc, fd, data, dataLen, dest);
+
+   memcpy(buff, data, dataLen);
+   free(data);
+
+   return proc_tx_commit(proc, fd, dataLen, dest);
 }
 
 int proc_cmd_sockaddr_internal(ProcessData *proc, int fd, unsigned char cmd, void *data, size_t dataLen, struct sockaddr_in *dest)
 {
    char *d;
 
-   // create buffer large enough to fit data + command
-   d = (char*)malloc(dataLen+1);
+   // reserve space large enough to fit data + command
+   d = proc_tx_reserve(proc, dataLen + 1);
+   if (!d) {
+      d = (char*)malloc(dataLen + 1);
+      if (!d)
+         return -1;
+      d[0] = cmd;
+      memcpy(d+1, data, dataLen);
+      return proc_send_now(proc, fd, d, dataLen + 1, dest);
+   }
 
    // set first byte of data to be the command
    d[0] = cmd;
 
    // copy the data/arguments into the buffer
    memcpy(d+1, data, dataLen);
-   return proc_cmd_sockaddr_raw_internal(proc, fd, d, dataLen + 1, dest);
+   return proc_tx_commit(proc, fd, dataLen + 1, dest);
 }
 
 int PROC_set_cmd_handler(struct ProcessData *proc,
@@ -1234,192 +2563,440 @@ int PROC_set_multicast_handler(struct ProcessData *proc, const char *service,
    return 0;
 }
 
-static int write_event_callback(int fd, char type, void *arg)
+// Runs on the main loop with each datagram read from a shared memory ring
+static void proc_local_rx_cb(void *arg, void *data, size_t len,
+      struct sockaddr_in *src)
 {
-   struct ProcessData *proc = (struct ProcessData*)arg;
-   struct ProcWriteNode **curr, *tx;
+   ProcessData *proc = (ProcessData*)arg;
 
-   // Find the next write node for this fd
-   for (curr = &proc->writeListHead; *curr && (*curr)->fd != fd;
-         curr = &((*curr)->next))
-      ;
+   cmd_handle_packet(proc, proc->cmdFd, data, len, src);
+}
 
-   // If we were called by mistake (no node on the write list), remove
-   // ourselves
-   if (!*curr)
-      return EVENT_REMOVE;
+int PROC_set_local_transport(struct ProcessData *proc, int enable)
+{
+   struct sockaddr_in addr;
+   socklen_t addrLen = sizeof(addr);
 
-   // We can finally perform the write
-   tx = *curr;
-   (tx->cb)(fd, tx->data, tx->len, tx->arg);
+   if (!proc)
+      return -1;
 
-   // Cleanup
-   *curr = tx->next;
-   if (tx->freeMem)
-      free(tx->data);
-   free(tx);
+   if (!enable) {
+      SHMR_free(proc->localTx);
+      proc->localTx = NULL;
+      return 0;
+   }
+   if (proc->localTx)
+      return 0;
 
-   // Check to see if there are more packets to transmit out this fd
-   while (*curr && (*curr)->fd != fd)
-         curr = &((*curr)->next);
+   // Rings are found by the port the command socket is bound to
+   if (getsockname(proc->cmdFd, (struct sockaddr*)&addr, &addrLen) < 0)
+      return -1;
+   proc->localTx = SHMR_create(proc->evtHandler, ntohs(addr.sin_port),
+         &proc_local_rx_cb, proc);
 
-   if (!*curr)
-      return EVENT_REMOVE;
+   return proc->localTx ? 0 : -1;
+}
 
-   return EVENT_KEEP;
+int PROC_get_local_transport_stats(struct ProcessData *proc,
+      struct SHMRStats *stats)
+{
+   if (!proc || !proc->localTx)
+      return -1;
+
+   SHMR_get_stats(proc->localTx, stats);
+   return 0;
+}
+
+int PROC_set_cmd_batch_size(struct ProcessData *proc, unsigned int size)
+{
+   return cmd_set_rx_batch_size(proc->cmds, size);
+}
+
+int PROC_set_data_req_deadline(struct ProcessData *proc, unsigned int ms)
+{
+   return cmd_set_data_req_deadline(proc->cmds, ms);
+}
+
+int PROC_publish_telemetry(struct ProcessData *proc, uint32_t type,
+      unsigned int periodMs, uint32_t flags)
+{
+   return cmd_publish_telemetry(proc->cmds, type, periodMs, flags);
+}
+
+int PROC_publish_telemetry_now(struct ProcessData *proc, uint32_t type)
+{
+   return cmd_publish_telemetry_now(proc->cmds, type);
+}
+
+int PROC_unpublish_telemetry(struct ProcessData *proc, uint32_t type)
+{
+   return cmd_unpublish_telemetry(proc->cmds, type);
+}
+
+int PROC_subscribe_telemetry(struct ProcessData *proc, const char *service,
+      uint32_t type, MCAST_telemetry_handler_t handler, void *arg)
+{
+   return cmd_subscribe_telemetry(proc->cmds, proc->evtHandler, service,
+      type, handler, arg);
+}
+
+int PROC_unsubscribe_telemetry(struct ProcessData *proc, const char *service,
+      uint32_t type)
+{
+   return cmd_unsubscribe_telemetry(proc->cmds, service, type,
+      proc->evtHandler);
+}
+
+static size_t write_queue_hash_func(void *key)
+{
+   return (size_t)(intptr_t)key;
+}
+
+static void *write_queue_key_for_data(void *data)
+{
+   return (void*)(intptr_t)((struct ProcWriteQueue*)data)->fd;
+}
+
+static int write_queue_cmp_key(void *key1, void *key2)
+{
+   return key1 == key2;
+}
+
+static struct ProcWriteQueue *write_queue_find(ProcessData *proc, int fd)
+{
+   return (struct ProcWriteQueue*)HASH_find_key(proc->writeQueues,
+         (void*)(intptr_t)fd);
+}
+
+static struct ProcWriteQueue *write_queue_get(ProcessData *proc, int fd)
+{
+   struct ProcWriteQueue *q = write_queue_find(proc, fd);
+
+   if (q)
+      return q;
+
+   if (!proc->writeQueues) {
+      proc->writeQueues = HASH_create_table(WRITE_QUEUE_HASH_SIZE,
+            &write_queue_hash_func, &write_queue_cmp_key,
+            &write_queue_key_for_data);
+      if (!proc->writeQueues)
+         return NULL;
+   }
+
+   q = (struct ProcWriteQueue*)malloc(sizeof(*q));
+   if (!q)
+      return NULL;
+   memset(q, 0, sizeof(*q));
+   q->fd = fd;
+   q->proc = proc;
+
+   if (HASH_add_data(proc->writeQueues, q) < 0) {
+      free(q);
+      return NULL;
+   }
+
+   return q;
+}
+
+static void write_node_free(struct ProcWriteNode *node)
+{
+   if (node->freeMem)
+      free(node->data);
+   free(node);
+}
+
+// Frees a queue once it holds nothing and has no watermarks to remember
+static void write_queue_release(struct ProcWriteQueue *q)
+{
+   if (q->head || q->writing || q->watermarkCb)
+      return;
+
+   HASH_remove_data(q->proc->writeQueues, q);
+   free(q);
+}
+
+static void write_queue_pop(struct ProcWriteQueue *q)
+{
+   struct ProcWriteNode *node = q->head;
+
+   q->queued -= node->len - q->offset;
+   q->offset = 0;
+   q->head = node->next;
+   if (!q->head)
+      q->tail = NULL;
+   write_node_free(node);
+}
+
+/* Writes as much of the leading run of plain buffers as the fd accepts.
+ *
+ * @return 1 if everything in the run was written, 0 if the fd is full
+ */
+static int write_queue_flush_run(struct ProcWriteQueue *q)
+{
+   struct iovec iov[WRITE_QUEUE_IOV_MAX];
+   struct ProcWriteNode *node;
+   ssize_t written;
+   size_t total;
+   int cnt;
+
+   while (q->head && !q->head->cb) {
+      total = 0;
+      for (cnt = 0, node = q->head; node && !node->cb &&
+            cnt < WRITE_QUEUE_IOV_MAX; cnt++, node = node->next) {
+         iov[cnt].iov_base = node->data + (cnt ? 0 : q->offset);
+         iov[cnt].iov_len = node->len - (cnt ? 0 : q->offset);
+         total += iov[cnt].iov_len;
+      }
+
+      written = writev(q->fd, iov, cnt);
+      if (written < 0) {
+         if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0;
+         // Nothing more will get through; drop what we tried to send
+         ERRNO_WARN("Failed to write queued data\n");
+         while (cnt--)
+            write_queue_pop(q);
+         continue;
+      }
+
+      // Retire whole buffers and remember how far into the next one we got
+      while (q->head && !q->head->cb &&
+            (size_t)written >= q->head->len - q->offset) {
+         written -= q->head->len - q->offset;
+         write_queue_pop(q);
+      }
+      if (written) {
+         q->offset += written;
+         q->queued -= written;
+      }
+
+      // A short write means the fd is full
+      if (q->head && !q->head->cb && q->offset)
+         return 0;
+   }
+
+   return 1;
 }
 
-static void proc_write_callback(int fd, uint8_t *data, uint32_t len, void *arg)
+static int write_event_callback(int fd, char type, void *arg)
 {
-   if(write(fd, data, len) < len) {
-      ERRNO_WARN("Failed to write callback\n");
+   struct ProcWriteQueue *q = (struct ProcWriteQueue*)arg;
+   struct ProcWriteNode *node;
+   int full = 0;
+
+   while (q->head && !full) {
+      if (!q->head->cb) {
+         full = !write_queue_flush_run(q);
+         continue;
+      }
+
+      // A caller-supplied writer gets the data once the fd is writable
+      node = q->head;
+      (node->cb)(fd, node->data, node->len, node->arg);
+      write_queue_pop(q);
    }
+
+   if (q->aboveHigh && q->queued <= q->lowWater) {
+      q->aboveHigh = 0;
+      if (q->watermarkCb)
+         q->watermarkCb(q->proc, fd, 0, q->watermarkArg);
+   }
+
+   if (q->head)
+      return EVENT_KEEP;
+
+   q->writing = 0;
+   write_queue_release(q);
+
+   return EVENT_REMOVE;
 }
 
 int PROC_nonblocking_write(struct ProcessData *proc, int fd, uint8_t *data, uint32_t len, int memoryOptions)
 {
-   return PROC_nonblocking_write_callback(proc, fd, data, len,
-         &proc_write_callback, NULL, memoryOptions);
+   return PROC_nonblocking_write_callback(proc, fd, data, len, NULL, NULL,
+         memoryOptions);
 }
 
 int PROC_nonblocking_write_callback(struct ProcessData *proc, int fd, uint8_t *data, uint32_t len, proc_nb_write_cb cb, void *arg, int memoryOptions)
 {
    struct ProcWriteNode *newNode;
-   struct ProcWriteNode **curr;
-   int writePending = 0;
+   struct ProcWriteQueue *q;
+
+   q = write_queue_get(proc, fd);
+   if (!q)
+      return -1;
 
    newNode = malloc(sizeof(*newNode));
-   if (!newNode)
+   if (!newNode) {
+      write_queue_release(q);
       return -1;
+   }
 
    // Set up memory management
    newNode->freeMem = 1;
    if (memoryOptions == IGNORE_DATA_AFTER_WRITE)
       newNode->freeMem = 0;
 
-   newNode->data = NULL;
-   newNode->len = 0;
+   newNode->data = data;
+   newNode->len = len;
    // Make a copy of the data, if requested
    if (memoryOptions == COPY_DATA_TO_WRITE) {
       newNode->data = malloc(len);
       if (!newNode->data) {
          free(newNode);
+         write_queue_release(q);
          return -1;
       }
       memcpy(newNode->data, data, len);
-      newNode->len = len;
    }
 
-   newNode->fd = fd;
    newNode->next = NULL;
    newNode->cb = cb;
    newNode->arg = arg;
 
-   // Find the tail of the list and determine if there is a
-   // write pending for this fd
-   for (curr = &proc->writeListHead; *curr; curr = &((*curr)->next))
-      if ((*curr)->fd == newNode->fd)
-         writePending = 1;
-
-   *curr = newNode;
-
    // Register the write callback
-   if (!writePending) {
-      if (EVT_fd_add(proc->evtHandler, newNode->fd, EVENT_FD_WRITE,
-               &write_event_callback, proc) < 0) {
-         *curr = NULL;
-         if (newNode->freeMem && newNode->data)
-            free(newNode->data);
-         free(newNode);
+   if (!q->writing) {
+      if (!EVT_fd_add(proc->evtHandler, fd, EVENT_FD_WRITE,
+               &write_event_callback, q)) {
+         write_node_free(newNode);
+         write_queue_release(q);
          return -1;
       }
+      q->writing = 1;
+   }
+
+   if (q->tail)
+      q->tail->next = newNode;
+   else
+      q->head = newNode;
+   q->tail = newNode;
+   q->queued += len;
+
+   if (!q->aboveHigh && q->highWater && q->queued >= q->highWater) {
+      q->aboveHigh = 1;
+      if (q->watermarkCb)
+         q->watermarkCb(proc, fd, 1, q->watermarkArg);
    }
 
    // Success
    return 0;
 }
 
+int PROC_set_write_watermarks(struct ProcessData *proc, int fd,
+      size_t high, size_t low, PROC_write_watermark_cb cb, void *arg)
+{
+   struct ProcWriteQueue *q;
+
+   if (high && low > high)
+      return -1;
+
+   if (!cb) {
+      q = write_queue_find(proc, fd);
+      if (q) {
+         q->watermarkCb = NULL;
+         q->highWater = q->lowWater = 0;
+         q->aboveHigh = 0;
+         write_queue_release(q);
+      }
+      return 0;
+   }
+
+   q = write_queue_get(proc, fd);
+   if (!q)
+      return -1;
+
+   q->highWater = high;
+   q->lowWater = low;
+   q->watermarkCb = cb;
+   q->watermarkArg = arg;
+
+   return 0;
+}
+
+size_t PROC_write_queued(struct ProcessData *proc, int fd)
+{
+   struct ProcWriteQueue *q = write_queue_find(proc, fd);
+
+   return q ? q->queued : 0;
+}
+
+static void write_queue_free(void *data)
+{
+   struct ProcWriteQueue *q = (struct ProcWriteQueue*)data;
+
+   while (q->head)
+      write_queue_pop(q);
+   free(q);
+}
+
+// Workers start at PROC_WORKER_THREADS and grow with the load
+#define PROC_WORKER_THREADS 1
+#define PROC_WORKER_MAX_THREADS 64
+#define PROC_WORKER_QUEUE 1024
+#define PROC_WORKER_STACK 0x80000
+
 struct thread_data{
-   int write_fd;
-   int read_fd;
-   pthread_t thread;
-   int (*fcn)(void *arg);
-   void *fcn_arg;
    int (*cb_fcn)(void *arg, int retval);
    void *cb_arg;
-   int retval;
 };
 
-void *thread_main(void *arg)
+struct ThreadPool *PROC_thread_pool(ProcessData *proc)
 {
-   struct thread_data *data = (struct thread_data *)arg;
+   if (proc->workers)
+      return proc->workers;
 
-   data->retval = data->fcn(data->fcn_arg);
-
-   //write data to trigger callback in event loop
-   char letter = 'q';
-   if(write(data->write_fd, &letter, sizeof(letter)) < sizeof(letter)) {
-      ERRNO_WARN("Failed to write callback\n");
-   }
+   proc->workers = TPOOL_create(PROC_evt(proc), PROC_WORKER_THREADS,
+         PROC_WORKER_QUEUE, PROC_WORKER_STACK);
+   if (proc->workers && TPOOL_set_max_threads(proc->workers,
+            proc->maxWorkers ? proc->maxWorkers : PROC_WORKER_MAX_THREADS))
+      DBG_print(DBG_LEVEL_WARN, "Failed to set worker thread limit\n");
 
-   pthread_exit(data);
+   return proc->workers;
 }
 
-static int thread_cb(int fd, char type, void *data)
+int PROC_set_worker_threads(ProcessData *proc, unsigned int maxThreads)
 {
-   struct thread_data *ret = (struct thread_data *)data;
+   if (!proc)
+      return -1;
 
-   //join thread
-   pthread_join(ret->thread, (void **)&ret);
+   proc->maxWorkers = maxThreads;
+   if (!proc->workers)
+      return 0;
 
-   ret->cb_fcn(ret->cb_arg, ret->retval);
+   return TPOOL_set_max_threads(proc->workers,
+         maxThreads ? maxThreads : PROC_WORKER_MAX_THREADS);
+}
 
-   //clean up pipe
-   close(ret->read_fd);
-   close(ret->write_fd);
-   free(ret);
+static void thread_cb(void *arg, int retval, int cancelled)
+{
+   struct thread_data *data = (struct thread_data *)arg;
 
-   return EVENT_REMOVE;
+   if (data->cb_fcn)
+      data->cb_fcn(data->cb_arg, retval);
+   free(data);
 }
 
 int thread_function(ProcessData *proc, void *fcn_ptr, void *arg, void *cb_fcn,
 void *cb_arg)
 {
-   //wrap data needed for thread in struct
-   struct thread_data *data = malloc(sizeof(struct thread_data));
-   data->cb_fcn = cb_fcn;
-   data->cb_arg = cb_arg;
-   pthread_attr_t attr;
-
-   //create pipe
-   int fd[2];
-   if(pipe(fd)) {
-      ERRNO_WARN("Error creating pipe");
-      goto cleanup;
-   }
-   data->write_fd = fd[1];
-   data->read_fd = fd[0];
+   struct ThreadPool *pool = PROC_thread_pool(proc);
+   struct thread_data *data;
 
-   //wrap info for function to thread in struct
-   data->fcn = fcn_ptr;
-   data->fcn_arg = arg;
+   if (!pool)
+      return 1;
 
-   if (pthread_attr_init(&attr) != 0)
-      goto cleanup;
- 
-   if (pthread_attr_setstacksize(&attr, 0x80000) != 0)
-      goto cleanup;
+   data = malloc(sizeof(struct thread_data));
+   if (!data)
+      return 1;
+   data->cb_fcn = cb_fcn;
+   data->cb_arg = cb_arg;
 
-   if(pthread_create(&data->thread, &attr, thread_main, data)){
-      //error creating thread
-      goto cleanup;
+   if (!TPOOL_submit(pool, TPOOL_PRI_NORMAL, (TPOOL_work_cb)fcn_ptr, arg,
+            &thread_cb, data)) {
+      DBG_print(DBG_LEVEL_WARN, "Worker queue full, dropping job\n");
+      free(data);
+      return 1;
    }
 
-   //register pipe read with event loop
-   EVT_fd_add(PROC_evt(proc), data->read_fd, EVENT_FD_READ, &thread_cb, data);
-
    return 0;
-cleanup:
-   free(data);
-   return 1;
 }
@@ -64,7 +64,13 @@ typedef struct ProcessData {
    int sigPipe[2];
    struct ProcSignalCB *signalCBHead;
    struct ProcChild *childHead;
-   struct ProcWriteNode *writeListHead;
+   struct HashTable *childHash;
+   struct HashTable *writeQueues;
+   struct ProcTxQueue *txQueue;
+   struct ThreadPool *workers;
+   unsigned int maxWorkers;         // Worker thread cap, 0 for the default
+   struct ProcCmdShards *shards;
+   struct SHMRTransport *localTx;
    char *name;
    int cmdPort;
    void *callbackContext;
@@ -74,7 +80,8 @@ typedef struct ProcessData {
 } ProcessData;
 
 /** Returns the EVTHandler context for the process.  Needed to directly call
-  * EVT_* functions.
+  * EVT_* functions.  When called from a command shard's thread (see
+  * PROC_init_xdr_sharded) it returns that shard's event loop.
   **/
 EVTHandler *PROC_evt(ProcessData *proc);
 
@@ -105,6 +112,38 @@ ProcessData *PROC_init_xdr(const char *procName, enum WatchdogMode wdMode,
       struct XDR_CommandHandlers *handlers);
 ProcessData *PROC_init(const char *procName, enum WatchdogMode wdMode);
 
+/**
+ * Like PROC_init_xdr, but spreads incoming commands across several event
+ * loops.  The main loop is the one returned by PROC_evt and run by
+ * EVT_start_loop as usual.  Each of the other (loops - 1) loops binds its own
+ * SO_REUSEPORT socket on the command port and runs on its own thread, so
+ * the kernel balances senders across cores.  The threads start once the
+ * main loop starts.
+ *
+ * XDR commands flagged CMD_XDR_THREAD_SAFE with CMD_set_xdr_cmd_flags run on
+ * the shard that received them.  Such handlers may reply with IPC_response
+ * or IPC_error and may use PROC_evt, which returns the shard's own loop, but
+ * must hand anything else in ProcessData to the main loop with EVT_post.
+ * Every other datagram (legacy commands, responses and loop-affine XDR
+ * handlers) is forwarded to the main loop and handled there as before.
+ * Handlers and their flags should be set before the main loop starts.
+ *
+ * Sharding needs SO_REUSEPORT load balancing and is only available on
+ * Linux; elsewhere, or if it can't be set up, a single loop is used.
+ *
+ * @param procName The unique process name.
+ * @param wdMode Software watchdog mode.
+ * @param handlers An array, terminated with an all-zero entry, of XDR
+ *                  command handlers to register with the CMD system
+ * @param loops The total number of event loops, including the main loop.
+ *
+ * @retval Initialzed ProcessData struct on success
+ * @retval Null		Error
+ */
+ProcessData *PROC_init_xdr_sharded(const char *procName,
+      enum WatchdogMode wdMode, struct XDR_CommandHandlers *handlers,
+      unsigned int loops);
+
 /**
  * Registers the process with the software watchdog.
  * Note: If the process was initialized with WD_ENABLE, this step is redundant.
@@ -143,6 +182,34 @@ int PROC_cmd(ProcessData *proc, unsigned char cmd, void *data, size_t dataLen, c
 int PROC_cmd_raw_sockaddr(ProcessData *proc, void *data, size_t dataLen,
       struct sockaddr_in *dest);
 
+/**
+ * Datagrams sent with the PROC_cmd and IPC_command/IPC_response families
+ * from inside the event loop are queued and sent together, with one
+ * sendmmsg per socket, just before the loop next blocks.  Outside of the
+ * event loop they are sent immediately.  This forces any queued datagrams
+ * out now, for callers that can't wait for the end of the loop iteration.
+ *
+ * Each loop's queue belongs to the thread running that loop.  Datagrams
+ * sent from any other thread, such as a thread_function worker, skip the
+ * queue and go out immediately, and this call does nothing there.
+ *
+ * @param proc    The process object.
+ *
+ * @return The number of datagrams flushed.
+ */
+int PROC_cmd_flush(ProcessData *proc);
+
+// Reserve space for, and then queue, a datagram in the transmit queue.
+//  Used by the IPC encoders to avoid a per-message allocation.
+char *proc_tx_reserve(ProcessData *proc, size_t len);
+int proc_tx_commit(ProcessData *proc, int fd, size_t len,
+      struct sockaddr_in *dest);
+// Sends a datagram gathered from iov right away, after anything already
+//  queued.  The iovecs only need to stay valid for the duration of the call.
+struct iovec;
+int proc_tx_sendv(ProcessData *proc, int fd, const struct iovec *iov,
+      int iovcnt, size_t len, struct sockaddr_in *dest);
+
 /**
  * Sends an CMD message over the process' secondary IPC socket to the
  *  named service.  All responses get ignored.  The secondary socket
@@ -225,7 +292,10 @@ void PROC_cleanup(ProcessData *proc);
 /** Signal callback **/
 typedef int (*PROC_signal_cb)(int sig, void *p);
 
-/** Register a signal handler
+/** Register a signal handler.  The callback runs in the event loop.  On
+ * Linux asynchronous signals are blocked and read from a signalfd, so
+ * threads started by the process should leave them blocked; a thread that
+ * unblocks one still has it delivered through the loop.
  * @param ctx The event state
  * @param sigNum The signal number
  * @param cb The signal callback
@@ -251,13 +321,125 @@ int PROC_set_cmd_handler(struct ProcessData *proc,
  * @param port The port number the command is sent over.  Pass 0 to use
  *              the service's default port.
  * @param cmdNum The command number to replace.  Use a negative value to
- *                   register for all commands.
+ *                   register for all commands except published telemetry,
+ *                   which only reaches PROC_subscribe_telemetry callbacks.
  * @param handler The function pointer of the new command handler
  * @param arg The opaque value to pass back into the callback
  */
 int PROC_set_multicast_handler(struct ProcessData *proc, const char *service,
       int cmdNum, MCAST_handler_t handler, void *arg);
 
+/** Sets the number of datagrams read from the command and multicast sockets
+ * each time the event loop finds them readable.  Larger batches cut the
+ * number of loop iterations under bursty load at the cost of
+ * MAX_IP_PACKET_SIZE bytes of receive buffer per datagram.  The receive
+ * ring starts with one slot and doubles up to this size only when a wakeup
+ * fills it, so sockets that don't see bursts keep a single buffer.
+ * @param proc The process state
+ * @param size Datagrams per wakeup, between 1 and CMD_MAX_RX_BATCH.
+ *              Defaults to CMD_DEFAULT_RX_BATCH.
+ * @return 0 on success, -1 if the size is out of range
+ */
+int PROC_set_cmd_batch_size(struct ProcessData *proc, unsigned int size);
+
+/** Sets how long a DATA_REQ command waits for its populators.  Populators
+ * may call back after returning, including from worker threads; the
+ * response is sent when all of them have finished or the deadline passes.
+ * Types still outstanding at the deadline are reported with a
+ * POPULATOR_ERROR of IPC_RESULTCODE_TIMEOUT.
+ *
+ * A populator must call its callback at most once, from any thread, and
+ * may skip it entirely.  The callback argument is an opaque handle, not a
+ * pointer, and stays safe to use forever: calls that arrive after the
+ * response was sent, or after PROC_cleanup, are ignored.
+ * @param proc The process state
+ * @param ms Deadline in milliseconds, or 0 to report only the populators
+ *              that called back before returning.
+ *              Defaults to CMD_DEFAULT_DATA_REQ_DEADLINE_MS.
+ * @return 0 on success, -1 on error
+ */
+int PROC_set_data_req_deadline(struct ProcessData *proc, unsigned int ms);
+
+struct SHMRStats;
+
+/** Enables or disables the shared memory transport (see shmRing.h), which
+ * is disabled by default.  While enabled, datagrams sent from the command
+ * socket to a loopback address go through a ring shared with the
+ * destination process whenever that process has the transport enabled too,
+ * and over UDP otherwise.  A datagram only takes the ring once nothing
+ * earlier to the same destination is still queued for UDP.  When the ring
+ * fills, that datagram and every later one to the destination go over UDP
+ * until the receiver has emptied the ring, so no ring record overtakes
+ * them.  The receiver may still handle those UDP datagrams before the
+ * records left in the ring, and ring records sent after the switch back
+ * before UDP datagrams it hasn't read yet, so enable the transport only
+ * between processes that don't rely on ordering.  Commands arriving
+ * through a ring are handled exactly like those read from the command
+ * socket.
+ * @param proc The process state
+ * @param enable Non-zero to enable the transport
+ * @return 0 on success, -1 if the transport could not be started
+ */
+int PROC_set_local_transport(struct ProcessData *proc, int enable);
+
+/** Fills stats with the shared memory transport's counters.
+ * @return 0 on success, -1 if the transport is not enabled
+ */
+int PROC_get_local_transport_stats(struct ProcessData *proc,
+      struct SHMRStats *stats);
+
+/** Publishes a type to the process's multicast group.  Each publication
+ * runs the type's populator once, encodes the result once and sends one
+ * TELEMETRY datagram, however many processes are subscribed.  Calling this
+ * again for the same type replaces its period and flags.  A populator that
+ * hasn't called back within the period, or CMD_DEFAULT_DATA_REQ_DEADLINE_MS
+ * for a period of 0, is abandoned as described at
+ * PROC_set_data_req_deadline.
+ * @param proc The process state
+ * @param type An XDR type with a registered populator
+ * @param periodMs Milliseconds between publications, or 0 to only publish
+ *              from PROC_publish_telemetry_now
+ * @param flags CMD_PUBLISH_ON_CHANGE to skip values equal to the last one
+ *              sent, or 0
+ * @return 0 on success, -1 if the type has no populator
+ */
+int PROC_publish_telemetry(struct ProcessData *proc, uint32_t type,
+      unsigned int periodMs, uint32_t flags);
+
+/** Publishes a type registered with PROC_publish_telemetry immediately,
+ * even if its value has not changed.
+ * @return 0 on success, -1 if the type is not published
+ */
+int PROC_publish_telemetry_now(struct ProcessData *proc, uint32_t type);
+
+/** Stops publishing a type.
+ * @return 0 on success, -1 if the type is not published
+ */
+int PROC_unpublish_telemetry(struct ProcessData *proc, uint32_t type);
+
+/** Registers a typed callback for telemetry a service publishes with
+ * PROC_publish_telemetry.  The callback receives the decoded structure,
+ * which is only valid for the duration of the call.
+ * @param proc The process state
+ * @param service The name of the publishing service
+ * @param type The XDR type to receive, or 0 for every published type
+ * @param handler The callback
+ * @param arg The opaque value to pass back into the callback
+ * @return 0 on success, -1 if the service's multicast group could not be
+ *         joined or memory could not be allocated
+ */
+int PROC_subscribe_telemetry(struct ProcessData *proc, const char *service,
+      uint32_t type, MCAST_telemetry_handler_t handler, void *arg);
+
+/** Removes the callbacks registered for a service's type.
+ * @param proc The process state
+ * @param service The name of the publishing service
+ * @param type The type passed to PROC_subscribe_telemetry
+ * @return 0 on success, -1 if no callback was registered for the type
+ */
+int PROC_unsubscribe_telemetry(struct ProcessData *proc, const char *service,
+      uint32_t type);
+
 /**
  * Returns the process' assigned UDP port id
  *
@@ -272,7 +454,9 @@ int PROC_udp_id(ProcessData *proc);
 #define IGNORE_DATA_AFTER_WRITE 3
 
 /** Perform a nonblocking write on a fd.  This method queues the data
- *  for transmission when a write won't block and returns immediately
+ *  for transmission when a write won't block and returns immediately.
+ *  Each fd has its own queue; buffers queued back to back are sent with a
+ *  single writev, and a partial write resumes where it left off.
  * @param proc The process state
  * @param fd The file descriptor to write the data to
  * @param data A pointer to the data to write
@@ -292,6 +476,36 @@ typedef void (*proc_nb_write_cb)(int fd, uint8_t *data, uint32_t len, void *arg)
  */
 int PROC_nonblocking_write_callback(struct ProcessData *proc, int fd, uint8_t *data, uint32_t len, proc_nb_write_cb cb, void *arg, int memoryOptions);
 
+/** Called when an fd's write queue crosses its high watermark, and again
+ *  once it drains back down to the low watermark.
+ * @param proc The process state
+ * @param fd The file descriptor the queue belongs to
+ * @param above 1 when the high watermark was reached, 0 when the queue
+ *  drained to the low watermark
+ * @param arg The opaque parameter passed to PROC_set_write_watermarks
+ */
+typedef void (*PROC_write_watermark_cb)(struct ProcessData *proc, int fd,
+      int above, void *arg);
+
+/** Sets backpressure watermarks on an fd's nonblocking write queue.  The
+ *  settings last until they are cleared by passing a NULL callback.
+ * @param proc The process state
+ * @param fd The file descriptor
+ * @param high Queued bytes at which cb is called with above set
+ * @param low Queued bytes at or below which cb is called with above clear
+ * @param cb The watermark callback, or NULL to clear the watermarks
+ * @param arg The opaque parameter passed into the callback cb
+ * @return 0 on success, -1 on failure
+ */
+int PROC_set_write_watermarks(struct ProcessData *proc, int fd,
+      size_t high, size_t low, PROC_write_watermark_cb cb, void *arg);
+
+/** Returns the number of bytes waiting in an fd's nonblocking write queue.
+ * @param proc The process state
+ * @param fd The file descriptor
+ */
+size_t PROC_write_queued(struct ProcessData *proc, int fd);
+
 /** Reads a process' critical state from critical state storage.  This
  *    storage is checksumed and redundant for higher reliability.  It can
  *    hold no more than 224 bytes of state data.
@@ -319,6 +533,7 @@ int PROC_save_critical_state(ProcessData *proc, void *state, int len);
 #define CHILD_STATE_DONE 4
 #define CHILD_BUFF_ERR -2
 #define CHILD_BUFF_STEAL_BUFF -3
+#define CHILD_BUFF_CONSUME_ALL -4
 #define CHILD_BUFF_NORM 0
 #define CHILD_BUFF_CLOSING 1
 #define CHILD_BUFF_NOROOM 2
@@ -327,6 +542,20 @@ struct ProcChild;
 
 typedef void (*CHLD_death_cb_t)(struct ProcChild *child, void *arg);
 
+/** Callback invoked with buffered child output.  Return the number of
+ *    bytes consumed; the remainder is presented again after more data
+ *    arrives.  CHILD_BUFF_ERR stops draining for this read.
+ *
+ *    Callbacks registered with CHLD_stdout_reader / CHLD_stderr_reader get
+ *    a malloc'd buffer, which they may keep by returning
+ *    CHILD_BUFF_STEAL_BUFF and freeing it later.
+ *
+ *    Callbacks registered with CHLD_stdout_view_reader /
+ *    CHLD_stderr_view_reader get a view of the oldest unconsumed bytes in
+ *    the stream's ring buffer, which is only valid for the duration of the
+ *    call and must never be freed, so the bytes are never copied.  They
+ *    return CHILD_BUFF_CONSUME_ALL to discard the whole view.
+ **/
 typedef int (*CHLD_buf_stream_cb_t)(struct ProcChild *child, int lastchance,
       void *arg, char *buff, int len);
 
@@ -338,18 +567,42 @@ typedef struct BufferedStreamState {
    int buffLen, buffCap;
 } BufferedStreamState;
 
+#define CHLD_PASSTHROUGH_NONE 0
+#define CHLD_PASSTHROUGH_SPLICE 1
+#define CHLD_PASSTHROUGH_COPY 2
+
+/** Ring buffer and passthrough state of a child's stdout or stderr **/
+typedef struct ChildStream {
+   CHLD_buf_stream_cb_t cb;
+   void *arg;
+   char *buff;             // Ring storage, mapped twice back-to-back on Linux
+   int buffLen, buffCap;
+   int head;               // Offset of the oldest unconsumed byte
+   char mirrored;          // Storage is a double mapping rather than malloc
+   char view;              // cb takes ring views rather than malloc'd copies
+   char passthrough;       // CHLD_PASSTHROUGH_* mode
+   char blocked;           // Waiting for passthroughFd to become writable
+   int passthroughFd;      // Destination for passthrough output
+   char *copy;             // Malloc'd copy of the view handed to a non-view cb
+} ChildStream;
+
 typedef struct ProcChild {
    struct ProcessData *parentData;
    pid_t procId;
    struct rusage rusage;
    int exitStatus, state;
    int stdin_fd, stdout_fd, stderr_fd;
-   BufferedStreamState streamState[2];
+   BufferedStreamState streamState[2];  // Unused, superseded by stream
 
    CHLD_death_cb_t deathCb;
    void *deathArg;
 
    struct ProcChild *next;
+
+   // Only proclib allocates children, so fields can be added after here
+   //  without moving the ones callers already know about
+   int pidfd;                 // Exit notification fd, or -1
+   ChildStream stream[2];
 } ProcChild;
 
 /**
@@ -442,16 +695,65 @@ char CHLD_death_notice(ProcChild *child, CHLD_death_cb_t deathCb, void *arg);
 char CHLD_stdout_reader(ProcChild *child, CHLD_buf_stream_cb_t, void *arg);
 char CHLD_stderr_reader(ProcChild *child, CHLD_buf_stream_cb_t, void *arg);
 
+/**
+  * Like CHLD_stdout_reader / CHLD_stderr_reader, but the callback is handed
+  *  views straight into the stream's ring buffer rather than malloc'd
+  *  copies.  See CHLD_buf_stream_cb_t.
+  **/
+char CHLD_stdout_view_reader(ProcChild *child, CHLD_buf_stream_cb_t,
+      void *arg);
+char CHLD_stderr_view_reader(ProcChild *child, CHLD_buf_stream_cb_t,
+      void *arg);
+
+/**
+  * Sends the child's stdout (or stderr) directly to another file descriptor
+  *  without passing it through a user-space buffer.  On Linux the data is
+  *  moved with splice(); if the destination does not support that (or on
+  *  other platforms) it falls back to a read / write copy.  outFd may be a
+  *  file, pipe, or socket.  It remains owned by the caller and may be
+  *  non-blocking: when it fills, reading from the child pauses until it
+  *  becomes writable again, so a slow consumer throttles the child.  The
+  *  child's fd is closed when the child closes its end.  Mutually exclusive
+  *  with the readers for the same stream.
+  *
+  * @param child The child whose output to forward
+  * @param outFd The descriptor that receives the output
+  * @returns Non-zero on success
+  **/
+char CHLD_stdout_splice(ProcChild *child, int outFd);
+char CHLD_stderr_splice(ProcChild *child, int outFd);
+
 
 /*
-* Runs the specified function in a different thread
+* Runs the specified function on one of the process' worker threads.  A
+* worker is added whenever the others are busy, up to the limit set with
+* PROC_set_worker_threads, so one blocking job doesn't hold up the rest.
 * @param proc The process data pointer
 * @param fcn_ptr Pointer to the function that will be run
 * @param arg Opaque argument that will be passed to the function
+* @param cb_fcn Called in the event loop with cb_arg and the function's
+*         return value once it finishes
+* @return 0 on success, 1 if the job could not be queued
 */
 int thread_function(ProcessData *proc, void *fcn_ptr, void *arg, void *cb_fcn,
 void *cb_arg);
 
+/**
+ * Returns the process' worker thread pool, starting it on first use.  Use it
+ * directly for priorities and cancellation; see threadPool.h.
+ */
+struct ThreadPool *PROC_thread_pool(ProcessData *proc);
+
+/**
+ * Sets the most worker threads thread_function may run at once.  Jobs
+ * beyond that wait in the pool's queue.
+ *
+ * @param proc       The process data pointer
+ * @param maxThreads The thread cap, or 0 for the default
+ * @return 0 on success, -1 on failure
+ */
+int PROC_set_worker_threads(ProcessData *proc, unsigned int maxThreads);
+
 #ifdef __cplusplus
 }
 
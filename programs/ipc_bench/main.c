@@ -0,0 +1,204 @@
+/**
+ * Benchmark of the shared memory ring transport against UDP loopback for
+ * commands between two processes on the same host.  A child process named
+ * test1 echoes every command back; the parent, test2, measures round trip
+ * latency with one command in flight and throughput with a window of
+ * commands in flight, once over each transport.  Commands are XDR
+ * proc-status commands carrying an opaque payload, answered through
+ * IPC_response like any other XDR command.
+ *
+ * Usage: ipc_bench [round trips] [payload bytes] [window]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <proclib.h>
+#include <shmRing.h>
+#include <cmd-pkt.h>
+
+#define DEFAULT_ROUND_TRIPS 100000
+#define DEFAULT_PAYLOAD 64
+#define DEFAULT_WINDOW 32
+#define MAX_PAYLOAD 8192
+#define TIMEOUT_MS 1000
+#define SERVER "test1"
+#define CLIENT "test2"
+
+static ProcessData *proc;
+static struct sockaddr_in server;
+static char payload[MAX_PAYLOAD];
+static struct IPC_OpaqueStruct param = { DEFAULT_PAYLOAD, payload };
+
+// The runs made against each transport, in order, from one event loop
+static struct BenchRun {
+   const char *name;
+   long count;
+   int window;
+   double secs;
+} runs[] = {
+   { "warmup", 0, 0, 0 },
+   { "latency", 0, 1, 0 },
+   { "throughput", 0, 0, 0 },
+};
+#define RUN_COUNT (sizeof(runs) / sizeof(runs[0]))
+
+static unsigned int current;
+static long sent, received, lastReceived;
+static double started;
+
+static double now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void echo_cb(struct ProcessData *proc, struct IPC_Command *cmd,
+      struct sockaddr_in *src, void *arg, int fd)
+{
+   IPC_response(proc, cmd, cmd->parameters.type, cmd->parameters.data, src);
+}
+
+static void pong_cb(struct ProcessData *proc, int timeout, void *arg,
+      char *resp, size_t len, enum IPC_CB_TYPE cb_type);
+
+static void ping(void)
+{
+   sent++;
+   IPC_command(proc, IPC_CMDS_STATUS, &param, IPC_TYPES_OPAQUE_STRUCT,
+         server, &pong_cb, NULL, IPC_CB_TYPE_RAW, TIMEOUT_MS);
+}
+
+// Starts the current run, or leaves the loop once they are all done
+static void start_run(void)
+{
+   if (current >= RUN_COUNT) {
+      EVT_exit_loop(PROC_evt(proc));
+      return;
+   }
+
+   sent = received = 0;
+   lastReceived = -1;
+   started = now();
+   while (sent < runs[current].window && sent < runs[current].count)
+      ping();
+}
+
+static void pong_cb(struct ProcessData *proc, int timeout, void *arg,
+      char *resp, size_t len, enum IPC_CB_TYPE cb_type)
+{
+   if (timeout || current >= RUN_COUNT)
+      return;
+
+   if (++received >= runs[current].count) {
+      runs[current++].secs = now() - started;
+      start_run();
+   }
+   else if (sent < runs[current].count)
+      ping();
+}
+
+// Gives up on a run that lost datagrams
+static int stall_cb(void *arg)
+{
+   if (current < RUN_COUNT && received == lastReceived) {
+      printf("  %s stalled after %ld of %ld responses\n", runs[current].name,
+            received, runs[current].count);
+      EVT_exit_loop(PROC_evt(proc));
+   }
+   lastReceived = received;
+
+   return EVENT_KEEP;
+}
+
+static int serve(int local)
+{
+   struct XDR_CommandHandlers handlers[] = {
+      { IPC_CMDS_STATUS, &echo_cb, NULL, 0 },
+      { 0, NULL, NULL, 0 }
+   };
+
+   proc = PROC_init_xdr(SERVER, WD_DISABLED, handlers);
+   if (!proc)
+      return 1;
+   if (local)
+      PROC_set_local_transport(proc, 1);
+   EVT_start_loop(PROC_evt(proc));
+   PROC_cleanup(proc);
+
+   return 0;
+}
+
+static void bench(const char *name, int local, long count, int window)
+{
+   struct SHMRStats stats;
+   pid_t child;
+
+   child = fork();
+   if (child == 0)
+      exit(serve(local));
+
+   proc = PROC_init_xdr(CLIENT, WD_DISABLED, NULL);
+   if (local)
+      PROC_set_local_transport(proc, 1);
+   // Give the server time to bind its sockets
+   usleep(200000);
+
+   runs[0].count = runs[0].window = runs[2].window = window;
+   runs[1].count = runs[2].count = count;
+   current = 0;
+   EVT_sched_add(PROC_evt(proc), EVT_ms2tv(TIMEOUT_MS), &stall_cb, NULL);
+   start_run();
+   EVT_start_loop(PROC_evt(proc));
+
+   printf("%s\n", name);
+   if (current >= RUN_COUNT) {
+      printf("  latency     %8.2f us per round trip\n",
+            runs[1].secs * 1e6 / count);
+      printf("  throughput  %8.0f round trips/s with %d in flight\n",
+            count / runs[2].secs, window);
+   }
+   if (!PROC_get_local_transport_stats(proc, &stats))
+      printf("  ring        %llu sent, %llu received, %llu full, "
+            "%llu doorbells\n", (unsigned long long)stats.sent,
+            (unsigned long long)stats.received,
+            (unsigned long long)stats.full,
+            (unsigned long long)stats.doorbells);
+
+   PROC_cleanup(proc);
+   kill(child, SIGTERM);
+   waitpid(child, NULL, 0);
+}
+
+int main(int argc, char **argv)
+{
+   long count = DEFAULT_ROUND_TRIPS;
+   int window = DEFAULT_WINDOW;
+
+   if (argc > 1)
+      count = atol(argv[1]);
+   if (argc > 2)
+      param.length = atoi(argv[2]);
+   if (argc > 3)
+      window = atoi(argv[3]);
+   if (count <= 0 || window <= 0 || param.length < 0 ||
+         param.length > MAX_PAYLOAD) {
+      printf("Usage: %s [round trips] [payload bytes <= %d] [window]\n",
+            argv[0], MAX_PAYLOAD);
+      return 1;
+   }
+   memset(payload, 0x5a, sizeof(payload));
+   server.sin_family = AF_INET;
+   server.sin_port = htons(socket_get_addr_by_name(SERVER));
+   server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+   printf("%ld round trips of %d byte payloads\n", count, param.length);
+   bench("UDP loopback", 0, count, window);
+   bench("Shared memory ring", 1, count, window);
+
+   return 0;
+}
@@ -0,0 +1,139 @@
+/**
+ * Benchmark of the compiled XDR struct codecs against the table-driven
+ * field walk, run over the types defined in cmd-pkt.xp.
+ *
+ * Usage: xdr_bench [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <xdr.h>
+#include <cmd-pkt.h>
+
+#define DEFAULT_ITERATIONS 1000000
+#define BUFF_LEN 2048
+
+typedef int (*bench_encoder)(void *src, char *dst, size_t *used,
+      size_t max, uint32_t type, void *arg);
+typedef int (*bench_decoder)(char *src, void *dst, size_t *used,
+      size_t max, void *arg);
+
+static double now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double time_encode(bench_encoder enc, void *src, uint32_t type,
+      void *fields, long iterations, char *buff, size_t *len)
+{
+   double start = now();
+   long i;
+
+   for (i = 0; i < iterations; i++)
+      enc(src, buff, len, BUFF_LEN, type, fields);
+
+   return (now() - start) * 1e9 / iterations;
+}
+
+// Decodes into dst, releasing anything a previous iteration allocated
+static double time_decode(bench_decoder dec, struct XDR_StructDefinition *def,
+      char *buff, size_t len, long iterations)
+{
+   double start = now();
+   void *dst;
+   size_t used;
+   long i;
+
+   for (i = 0; i < iterations; i++) {
+      dst = def->allocator(def);
+      dec(buff, dst, &used, len, def->arg);
+      def->deallocator(&dst, def);
+   }
+
+   return (now() - start) * 1e9 / iterations;
+}
+
+static void bench_type(const char *name, uint32_t type, void *src,
+      long iterations)
+{
+   struct XDR_StructDefinition *def = XDR_definition_for_type(type);
+   char table_buff[BUFF_LEN], comp_buff[BUFF_LEN];
+   size_t table_len = 0, comp_len = 0;
+   double table_enc, comp_enc, table_dec, comp_dec;
+
+   if (!def) {
+      printf("%-14s not registered\n", name);
+      return;
+   }
+
+   table_enc = time_encode(&XDR_table_struct_encoder, src, type, def->arg,
+         iterations, table_buff, &table_len);
+   comp_enc = time_encode(&XDR_struct_encoder, src, type, def->arg,
+         iterations, comp_buff, &comp_len);
+   if (table_len != comp_len || memcmp(table_buff, comp_buff, table_len)) {
+      printf("%-14s encodings differ!\n", name);
+      return;
+   }
+
+   table_dec = time_decode(&XDR_table_struct_decoder, def, table_buff,
+         table_len, iterations);
+   comp_dec = time_decode(&XDR_struct_decoder, def, table_buff,
+         table_len, iterations);
+
+   printf("%-14s %5lu bytes  encode %7.1f -> %7.1f ns  "
+         "decode %7.1f -> %7.1f ns\n", name, (unsigned long)table_len,
+         table_enc, comp_enc, table_dec, comp_dec);
+}
+
+int main(int argc, char **argv)
+{
+   long iterations = DEFAULT_ITERATIONS;
+   struct IPC_Heartbeat beat;
+   struct IPC_HeartbeatExt ext;
+   struct IPC_Command cmd;
+   struct IPC_DataReq req;
+   struct IPC_PopulatorError err;
+   uint32_t reqs[16];
+   int i;
+
+   if (argc > 1)
+      iterations = atol(argv[1]);
+   if (iterations <= 0)
+      iterations = DEFAULT_ITERATIONS;
+
+   beat.commands = 123456789012ULL;
+   beat.responses = 42;
+   beat.heartbeats = 7;
+   ext.rx_wakeups = 99;
+   ext.rx_batch_max = 8;
+   ext.in_flight = 3;
+   ext.in_flight_max = 17;
+   ext.data_req_cache_hits = 5;
+   ext.data_req_cache_misses = 1;
+
+   for (i = 0; i < 16; i++)
+      reqs[i] = IPC_TYPES_HEARTBEAT;
+   req.length = 16;
+   req.reqs = reqs;
+
+   err.type = IPC_TYPES_HEARTBEAT;
+   err.error = IPC_RESULTCODE_UNSUPPORTED;
+
+   cmd.cmd = IPC_CMDS_DATA_REQ;
+   cmd.ipcref = 1234;
+   cmd.parameters.type = IPC_TYPES_HEARTBEAT;
+   cmd.parameters.data = &beat;
+
+   printf("%ld iterations, table-driven -> compiled\n", iterations);
+   bench_type("Heartbeat", IPC_TYPES_HEARTBEAT, &beat, iterations);
+   bench_type("HeartbeatExt", IPC_TYPES_HEARTBEAT_EXT, &ext, iterations);
+   bench_type("PopulatorError", IPC_TYPES_POPULATOR_ERROR, &err, iterations);
+   bench_type("DataReq", IPC_TYPES_DATAREQ, &req, iterations);
+   bench_type("Command", IPC_TYPES_COMMAND, &cmd, iterations);
+
+   return 0;
+}
@@ -0,0 +1,781 @@
+/*
+ * Copyright PolySat, California Polytechnic State University, San Luis Obispo. cubesat@calpoly.edu
+ * This file is part of libproc, a PolySat library.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include "shmRing.h"
+#include "debug.h"
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#if defined(__linux__) && defined(SYS_memfd_create)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+#include "hashtable.h"
+
+#ifndef MFD_ALLOW_SEALING
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS 1033
+#define F_GET_SEALS 1034
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#endif
+
+#define SHMR_MAGIC 0x53484d52
+#define SHMR_VERSION 1
+#define SHMR_PEER_HASH_SIZE 37
+/// Most peers, connected or remembered as absent, kept per transport
+#define SHMR_MAX_PEERS 64
+/// Seals a ring's memfd must carry so neither side can resize it under
+///  the other's mapping
+#define SHMR_SEALS (F_SEAL_SHRINK | F_SEAL_GROW)
+/// Datagrams dispatched per doorbell before letting other events run
+#define SHMR_DRAIN_MAX 256
+#define SHMR_ALIGN(x) (((x) + 7) & ~(size_t)7)
+
+// Start of the shared mapping.  head is only written by the sender and tail
+//  only by the receiver, so each gets its own cache line.
+struct SHMRHeader {
+   uint32_t magic;
+   uint32_t cap;
+   uint64_t head __attribute__((aligned(64)));
+   uint64_t tail __attribute__((aligned(64)));
+   uint32_t waiting __attribute__((aligned(64)));   // Receiver is asleep
+};
+
+// Precedes each datagram in the ring.  Records are 8 byte aligned.
+struct SHMRRecord {
+   uint32_t len;
+   uint16_t srcPort;
+   uint16_t reserved;
+};
+
+// Sent along with the ring's memfd and doorbell when connecting
+struct SHMRHello {
+   uint32_t magic;
+   uint32_t version;
+   uint32_t cap;
+};
+
+// A ring mapping: one header page followed by the data mapped twice in a
+//  row, so a record that runs past the end continues at the start
+struct SHMRMap {
+   struct SHMRHeader *hdr;
+   char *data;
+   size_t page, cap;
+};
+
+// An outbound ring to the process listening on a local port.  A peer
+//  without a socket remembers a port that had no listener.
+struct SHMRPeer {
+   struct SHMRTransport *tr;
+   uint16_t port;
+   int sock;
+   int doorbell;
+   int watched;
+   int overflowed;         // Sending over UDP until the ring empties
+   time_t retry;
+   struct SHMRMap map;
+};
+
+// An inbound ring from another process
+struct SHMRConn {
+   struct SHMRTransport *tr;
+   int sock;
+   int doorbell;
+   struct SHMRMap map;
+   struct SHMRConn *next;
+};
+
+struct SHMRTransport {
+   EVTHandler *evt;
+   uint16_t port;
+   int listenFd;
+   SHMR_rx_cb cb;
+   void *arg;
+   pthread_mutex_t lock;            // Guards peers and writes to their rings
+   struct HashTable *peers;
+   int peerCnt;
+   struct SHMRConn *conns;
+   char *rxBuf;                     // Datagram copied out of a ring
+   struct SHMRStats stats;
+   int dispatching;                 // Calls to cb in progress
+   char closing;                    // SHMR_free waits for cb to return
+};
+
+static void shmr_destroy(struct SHMRTransport *tr);
+
+static socklen_t shmr_sockaddr(uint16_t port, struct sockaddr_un *addr)
+{
+   int len;
+
+   // Abstract names need no cleanup and vanish with the listener
+   memset(addr, 0, sizeof(*addr));
+   addr->sun_family = AF_UNIX;
+   len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1,
+         "libproc-shm-%u", port);
+
+   return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+// Rings are only exchanged with processes running as the same user
+static int shmr_same_user(int sock)
+{
+   struct ucred cred;
+   socklen_t len = sizeof(cred);
+
+   return getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+      cred.uid == geteuid();
+}
+
+static time_t shmr_now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec;
+}
+
+static int shmr_map(int fd, size_t cap, struct SHMRMap *map)
+{
+   long page = sysconf(_SC_PAGESIZE);
+   char *base;
+
+   map->page = page > 0 ? page : 4096;
+   map->cap = cap;
+   base = mmap(NULL, map->page + 2 * cap, PROT_NONE,
+         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (base == MAP_FAILED)
+      return -1;
+   if (mmap(base, map->page + cap, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+         mmap(base + map->page + cap, cap, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_FIXED, fd, map->page) == MAP_FAILED) {
+      munmap(base, map->page + 2 * cap);
+      return -1;
+   }
+
+   map->hdr = (struct SHMRHeader*)base;
+   map->data = base + map->page;
+   return 0;
+}
+
+static void shmr_unmap(struct SHMRMap *map)
+{
+   if (map->hdr)
+      munmap(map->hdr, map->page + 2 * map->cap);
+   map->hdr = NULL;
+}
+
+static void shmr_ring_doorbell(int fd)
+{
+   uint64_t one = 1;
+
+   if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+      DBG_print(DBG_LEVEL_WARN, "Failed to ring shared memory doorbell\n");
+}
+
+static size_t shmr_peer_hash_func(void *key)
+{
+   return (uintptr_t)key;
+}
+
+static void *shmr_peer_key_for_data(void *data)
+{
+   return (void*)(uintptr_t)((struct SHMRPeer*)data)->port;
+}
+
+static int shmr_peer_cmp_key(void *key1, void *key2)
+{
+   return key1 == key2;
+}
+
+static void shmr_peer_close(struct SHMRPeer *peer)
+{
+   if (peer->sock >= 0) {
+      if (peer->watched)
+         EVT_fd_remove(peer->tr->evt, peer->sock, EVENT_FD_READ);
+      close(peer->sock);
+   }
+   if (peer->doorbell >= 0)
+      close(peer->doorbell);
+   shmr_unmap(&peer->map);
+   free(peer);
+}
+
+// The listener never writes to a connection, so any readiness means the
+//  receiving process has gone away
+static int shmr_peer_sock_cb(int fd, char type, void *arg)
+{
+   struct SHMRPeer *peer = (struct SHMRPeer*)arg;
+   struct SHMRTransport *tr = peer->tr;
+   char buff[64];
+
+   if (recv(fd, buff, sizeof(buff), MSG_DONTWAIT) < 0 && errno == EAGAIN)
+      return EVENT_KEEP;
+
+   pthread_mutex_lock(&tr->lock);
+   HASH_remove_key(tr->peers, (void*)(uintptr_t)peer->port);
+   tr->peerCnt--;
+   pthread_mutex_unlock(&tr->lock);
+
+   shmr_peer_close(peer);
+   return EVENT_REMOVE;
+}
+
+static int shmr_watch_peer(void *data, void *arg)
+{
+   struct SHMRPeer *peer = (struct SHMRPeer*)data;
+
+   if (peer->sock >= 0 && !peer->watched) {
+      EVT_fd_add(peer->tr->evt, peer->sock, EVENT_FD_READ,
+            &shmr_peer_sock_cb, peer);
+      EVT_fd_set_name(peer->tr->evt, peer->sock, "Shared Memory Peer");
+      peer->watched = 1;
+   }
+
+   return 0;
+}
+
+// Runs on the loop after a send connected to a new peer, possibly from
+//  another thread, to notice when that peer exits
+static void shmr_watch_peers(void *arg)
+{
+   struct SHMRTransport *tr = (struct SHMRTransport*)arg;
+
+   pthread_mutex_lock(&tr->lock);
+   HASH_iterate_arg_table(tr->peers, &shmr_watch_peer, NULL);
+   pthread_mutex_unlock(&tr->lock);
+}
+
+// Creates a ring and hands it to the process listening on port.  Called
+//  with the lock held.
+static int shmr_peer_connect(struct SHMRTransport *tr, struct SHMRPeer *peer)
+{
+   struct sockaddr_un addr;
+   socklen_t addrLen = shmr_sockaddr(peer->port, &addr);
+   struct SHMRHello hello;
+   struct msghdr msg;
+   struct cmsghdr *cmsg;
+   struct iovec iov;
+   char ctrl[CMSG_SPACE(2 * sizeof(int))];
+   int fds[2], memfd = -1;
+   size_t page;
+
+   peer->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+         0);
+   if (peer->sock < 0)
+      return -1;
+   if (connect(peer->sock, (struct sockaddr*)&addr, addrLen) < 0 ||
+         !shmr_same_user(peer->sock))
+      goto fail;
+
+   page = sysconf(_SC_PAGESIZE) > 0 ? sysconf(_SC_PAGESIZE) : 4096;
+   memfd = syscall(SYS_memfd_create, "libproc-ring",
+         MFD_CLOEXEC | MFD_ALLOW_SEALING);
+   if (memfd < 0 || ftruncate(memfd, page + SHMR_RING_SIZE) < 0 ||
+         fcntl(memfd, F_ADD_SEALS, SHMR_SEALS | F_SEAL_SEAL) < 0 ||
+         shmr_map(memfd, SHMR_RING_SIZE, &peer->map) < 0)
+      goto fail;
+   peer->map.hdr->magic = SHMR_MAGIC;
+   peer->map.hdr->cap = SHMR_RING_SIZE;
+   // The receiver has not drained anything yet, so the first send wakes it
+   peer->map.hdr->waiting = 1;
+
+   peer->doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if (peer->doorbell < 0)
+      goto fail;
+
+   hello.magic = SHMR_MAGIC;
+   hello.version = SHMR_VERSION;
+   hello.cap = SHMR_RING_SIZE;
+   iov.iov_base = &hello;
+   iov.iov_len = sizeof(hello);
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = ctrl;
+   msg.msg_controllen = sizeof(ctrl);
+   cmsg = CMSG_FIRSTHDR(&msg);
+   cmsg->cmsg_level = SOL_SOCKET;
+   cmsg->cmsg_type = SCM_RIGHTS;
+   cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+   fds[0] = memfd;
+   fds[1] = peer->doorbell;
+   memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+   if (sendmsg(peer->sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+      goto fail;
+
+   close(memfd);
+   if (EVT_post(tr->evt, &shmr_watch_peers, tr) < 0)
+      DBG_print(DBG_LEVEL_WARN, "Failed to watch shared memory peer\n");
+   return 0;
+
+fail:
+   if (memfd >= 0)
+      close(memfd);
+   if (peer->doorbell >= 0)
+      close(peer->doorbell);
+   shmr_unmap(&peer->map);
+   close(peer->sock);
+   peer->sock = peer->doorbell = -1;
+   return -1;
+}
+
+// Forgets a port that had no listener once it is due for a retry anyway
+static int shmr_peer_expire(void *data, void *arg)
+{
+   struct SHMRPeer *peer = (struct SHMRPeer*)data;
+
+   if (peer->sock >= 0 || *(time_t*)arg < peer->retry)
+      return 0;
+
+   peer->tr->peerCnt--;
+   shmr_peer_close(peer);
+   return 1;
+}
+
+// Returns a connected peer for port, or NULL if the datagram should go over
+//  UDP.  Called with the lock held.
+static struct SHMRPeer *shmr_peer_get(struct SHMRTransport *tr, uint16_t port)
+{
+   struct SHMRPeer *peer;
+   time_t now;
+
+   peer = HASH_find_key(tr->peers, (void*)(uintptr_t)port);
+   if (peer && peer->sock >= 0)
+      return peer;
+
+   now = shmr_now();
+   if (peer && now < peer->retry)
+      return NULL;
+
+   if (!peer) {
+      if (tr->peerCnt >= SHMR_MAX_PEERS)
+         HASH_iterate_arg_table(tr->peers, &shmr_peer_expire, &now);
+      if (tr->peerCnt >= SHMR_MAX_PEERS)
+         return NULL;
+
+      peer = (struct SHMRPeer*)malloc(sizeof(*peer));
+      if (!peer)
+         return NULL;
+      memset(peer, 0, sizeof(*peer));
+      peer->tr = tr;
+      peer->port = port;
+      peer->sock = peer->doorbell = -1;
+      HASH_add_data(tr->peers, peer);
+      tr->peerCnt++;
+   }
+
+   if (shmr_peer_connect(tr, peer) < 0) {
+      peer->retry = now + SHMR_RETRY_SECS;
+      return NULL;
+   }
+
+   return peer;
+}
+
+int SHMR_sendv(struct SHMRTransport *tr, const struct iovec *iov,
+      int iovcnt, size_t len, const struct sockaddr_in *dest)
+{
+   struct SHMRPeer *peer;
+   struct SHMRHeader *hdr;
+   struct SHMRRecord *rec;
+   uint64_t head, tail;
+   size_t need = sizeof(*rec) + SHMR_ALIGN(len);
+   char *dst;
+   int i;
+
+   if (!tr || !dest || (ntohl(dest->sin_addr.s_addr) >> 24) != 127 ||
+         len > SHMR_MAX_DATAGRAM || need > SHMR_RING_SIZE)
+      return 0;
+
+   pthread_mutex_lock(&tr->lock);
+   peer = shmr_peer_get(tr, ntohs(dest->sin_port));
+   if (!peer) {
+      pthread_mutex_unlock(&tr->lock);
+      return 0;
+   }
+
+   hdr = peer->map.hdr;
+   head = hdr->head;
+   tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+   // Once a datagram has gone over UDP, the ring only takes more after the
+   //  receiver has read everything in it, so nothing newer overtakes it
+   if (head == tail)
+      peer->overflowed = 0;
+   if (peer->overflowed || need > peer->map.cap - (head - tail)) {
+      peer->overflowed = 1;
+      tr->stats.full++;
+      pthread_mutex_unlock(&tr->lock);
+      return 0;
+   }
+
+   rec = (struct SHMRRecord*)(peer->map.data + (head & (peer->map.cap - 1)));
+   rec->len = len;
+   rec->srcPort = tr->port;
+   rec->reserved = 0;
+   dst = (char*)(rec + 1);
+   for (i = 0; i < iovcnt; dst += iov[i].iov_len, i++)
+      memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+
+   // Publishing head before checking waiting pairs with the receiver
+   //  setting waiting before checking head, so one of them sees the other
+   __atomic_store_n(&hdr->head, head + need, __ATOMIC_SEQ_CST);
+   if (__atomic_exchange_n(&hdr->waiting, 0, __ATOMIC_SEQ_CST)) {
+      shmr_ring_doorbell(peer->doorbell);
+      tr->stats.doorbells++;
+   }
+   tr->stats.sent++;
+   pthread_mutex_unlock(&tr->lock);
+
+   return len;
+}
+
+static void shmr_conn_close(struct SHMRConn *conn)
+{
+   struct SHMRTransport *tr = conn->tr;
+   struct SHMRConn **itr;
+
+   for (itr = &tr->conns; *itr; itr = &(*itr)->next)
+      if (*itr == conn) {
+         *itr = conn->next;
+         break;
+      }
+
+   if (conn->doorbell >= 0) {
+      EVT_fd_remove(tr->evt, conn->doorbell, EVENT_FD_READ);
+      close(conn->doorbell);
+   }
+   EVT_fd_remove(tr->evt, conn->sock, EVENT_FD_READ);
+   close(conn->sock);
+   shmr_unmap(&conn->map);
+   free(conn);
+}
+
+// Dispatches the datagrams waiting in an inbound ring.  Each one is copied
+//  out before it is checked or dispatched, since the sender can still
+//  write to the ring.
+static int shmr_conn_drain(struct SHMRConn *conn)
+{
+   struct SHMRTransport *tr = conn->tr;
+   struct SHMRHeader *hdr = conn->map.hdr;
+   struct SHMRRecord *rec;
+   struct sockaddr_in src;
+   uint64_t head, tail = hdr->tail;
+   size_t cap = conn->map.cap, need;
+   uint32_t len;
+   int cnt = 0;
+
+   memset(&src, 0, sizeof(src));
+   src.sin_family = AF_INET;
+   src.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+   for (;;) {
+      head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+      while (tail != head) {
+         // Leave the rest for another pass so other events get a turn
+         if (cnt++ >= SHMR_DRAIN_MAX) {
+            shmr_ring_doorbell(conn->doorbell);
+            return EVENT_KEEP;
+         }
+
+         rec = (struct SHMRRecord*)(conn->map.data + (tail & (cap - 1)));
+         len = __atomic_load_n(&rec->len, __ATOMIC_RELAXED);
+         need = sizeof(*rec) + SHMR_ALIGN(len);
+         if (len > SHMR_MAX_DATAGRAM || need > cap || need > head - tail) {
+            DBG_print(DBG_LEVEL_WARN, "Dropping corrupt shared memory ring\n");
+            shmr_conn_close(conn);
+            return EVENT_KEEP;
+         }
+         src.sin_port = htons(__atomic_load_n(&rec->srcPort,
+                  __ATOMIC_RELAXED));
+         memcpy(tr->rxBuf, rec + 1, len);
+
+         // The copy is all that's needed, so free the space right away
+         tail += need;
+         __atomic_store_n(&hdr->tail, tail, __ATOMIC_RELEASE);
+
+         tr->stats.received++;
+         tr->dispatching++;
+         tr->cb(tr->arg, tr->rxBuf, len, &src);
+         tr->dispatching--;
+
+         // The callback freed the transport, taking conn with it
+         if (tr->closing) {
+            if (!tr->dispatching)
+               shmr_destroy(tr);
+            return EVENT_KEEP;
+         }
+      }
+
+      __atomic_store_n(&hdr->waiting, 1, __ATOMIC_SEQ_CST);
+      if (__atomic_load_n(&hdr->head, __ATOMIC_SEQ_CST) == tail)
+         return EVENT_KEEP;
+      __atomic_store_n(&hdr->waiting, 0, __ATOMIC_RELAXED);
+   }
+}
+
+static int shmr_conn_doorbell_cb(int fd, char type, void *arg)
+{
+   uint64_t cnt;
+
+   if (read(fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+      return EVENT_KEEP;
+
+   return shmr_conn_drain((struct SHMRConn*)arg);
+}
+
+// Maps the ring a sender passed along with its hello
+static int shmr_conn_attach(struct SHMRConn *conn, struct SHMRHello *hello,
+      int memfd, int doorbell)
+{
+   struct SHMRTransport *tr = conn->tr;
+   struct stat st;
+   long page = sysconf(_SC_PAGESIZE);
+   int seals;
+
+   if (page <= 0)
+      page = 4096;
+   // Without the seals the sender could shrink the file and fault us
+   seals = fcntl(memfd, F_GET_SEALS);
+   if (seals < 0 || (seals & SHMR_SEALS) != SHMR_SEALS) {
+      DBG_print(DBG_LEVEL_WARN, "Refusing unsealed shared memory ring\n");
+      return -1;
+   }
+   if (hello->magic != SHMR_MAGIC || hello->version != SHMR_VERSION ||
+         hello->cap < page || (hello->cap & (hello->cap - 1)) ||
+         fstat(memfd, &st) < 0 || st.st_size != page + hello->cap ||
+         shmr_map(memfd, hello->cap, &conn->map) < 0)
+      return -1;
+   if (conn->map.hdr->magic != SHMR_MAGIC ||
+         conn->map.hdr->cap != hello->cap) {
+      shmr_unmap(&conn->map);
+      return -1;
+   }
+
+   conn->doorbell = doorbell;
+   EVT_fd_add(tr->evt, doorbell, EVENT_FD_READ, &shmr_conn_doorbell_cb, conn);
+   EVT_fd_set_name(tr->evt, doorbell, "Shared Memory Ring");
+
+   return 0;
+}
+
+static int shmr_conn_sock_cb(int fd, char type, void *arg)
+{
+   struct SHMRConn *conn = (struct SHMRConn*)arg;
+   struct SHMRHello hello;
+   struct msghdr msg;
+   struct cmsghdr *cmsg;
+   struct iovec iov;
+   char ctrl[CMSG_SPACE(2 * sizeof(int))];
+   int fds[2] = { -1, -1 };
+   ssize_t res;
+
+   iov.iov_base = &hello;
+   iov.iov_len = sizeof(hello);
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = ctrl;
+   msg.msg_controllen = sizeof(ctrl);
+
+   res = recvmsg(fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+   if (res < 0 && (errno == EAGAIN || errno == EINTR))
+      return EVENT_KEEP;
+
+   for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(sizeof(fds)))
+         memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+   // Anything but a single hello, including the sender closing, ends it
+   if (res != sizeof(hello) || fds[0] < 0 || conn->doorbell >= 0 ||
+         shmr_conn_attach(conn, &hello, fds[0], fds[1]) < 0) {
+      if (fds[0] >= 0)
+         close(fds[0]);
+      if (fds[1] >= 0 && fds[1] != conn->doorbell)
+         close(fds[1]);
+      shmr_conn_close(conn);
+      return EVENT_KEEP;
+   }
+
+   close(fds[0]);
+   return EVENT_KEEP;
+}
+
+static int shmr_listen_cb(int fd, char type, void *arg)
+{
+   struct SHMRTransport *tr = (struct SHMRTransport*)arg;
+   struct SHMRConn *conn;
+   int sock;
+
+   while ((sock = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+      if (!shmr_same_user(sock)) {
+         DBG_print(DBG_LEVEL_WARN, "Refusing shared memory ring from "
+               "another user\n");
+         close(sock);
+         continue;
+      }
+      conn = (struct SHMRConn*)malloc(sizeof(*conn));
+      if (!conn) {
+         close(sock);
+         continue;
+      }
+      memset(conn, 0, sizeof(*conn));
+      conn->tr = tr;
+      conn->sock = sock;
+      conn->doorbell = -1;
+      conn->next = tr->conns;
+      tr->conns = conn;
+
+      EVT_fd_add(tr->evt, sock, EVENT_FD_READ, &shmr_conn_sock_cb, conn);
+      EVT_fd_set_name(tr->evt, sock, "Shared Memory Connection");
+   }
+
+   return EVENT_KEEP;
+}
+
+struct SHMRTransport *SHMR_create(EVTHandler *evt, uint16_t port,
+      SHMR_rx_cb cb, void *arg)
+{
+   struct SHMRTransport *tr;
+   struct sockaddr_un addr;
+   socklen_t addrLen = shmr_sockaddr(port, &addr);
+
+   if (!evt || !port || !cb)
+      return NULL;
+
+   tr = (struct SHMRTransport*)malloc(sizeof(*tr));
+   if (!tr)
+      return NULL;
+   memset(tr, 0, sizeof(*tr));
+   tr->evt = evt;
+   tr->port = port;
+   tr->cb = cb;
+   tr->arg = arg;
+
+   tr->peers = HASH_create_table(SHMR_PEER_HASH_SIZE, &shmr_peer_hash_func,
+         &shmr_peer_cmp_key, &shmr_peer_key_for_data);
+   tr->rxBuf = (char*)malloc(SHMR_MAX_DATAGRAM);
+   tr->listenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK |
+         SOCK_CLOEXEC, 0);
+   if (!tr->peers || !tr->rxBuf || tr->listenFd < 0 ||
+         bind(tr->listenFd, (struct sockaddr*)&addr, addrLen) < 0 ||
+         listen(tr->listenFd, SOMAXCONN) < 0) {
+      DBG_print(DBG_LEVEL_WARN, "Shared memory transport unavailable for "
+            "port %u: %s\n", port, strerror(errno));
+      if (tr->listenFd >= 0)
+         close(tr->listenFd);
+      if (tr->peers)
+         HASH_free_table(tr->peers);
+      free(tr->rxBuf);
+      free(tr);
+      return NULL;
+   }
+   pthread_mutex_init(&tr->lock, NULL);
+
+   EVT_fd_add(evt, tr->listenFd, EVENT_FD_READ, &shmr_listen_cb, tr);
+   EVT_fd_set_name(evt, tr->listenFd, "Shared Memory Listener");
+
+   return tr;
+}
+
+static void shmr_peer_extract(void *data)
+{
+   shmr_peer_close((struct SHMRPeer*)data);
+}
+
+static void shmr_destroy(struct SHMRTransport *tr)
+{
+   EVT_fd_remove(tr->evt, tr->listenFd, EVENT_FD_READ);
+   close(tr->listenFd);
+   while (tr->conns)
+      shmr_conn_close(tr->conns);
+
+   HASH_extract(tr->peers, &shmr_peer_extract);
+   HASH_free_table(tr->peers);
+   pthread_mutex_destroy(&tr->lock);
+   free(tr->rxBuf);
+   free(tr);
+}
+
+void SHMR_free(struct SHMRTransport *tr)
+{
+   if (!tr)
+      return;
+
+   // Freed by a datagram's handler, so the drain still holds the ring.  It
+   //  tears everything down once the handler returns.
+   if (tr->dispatching) {
+      tr->closing = 1;
+      return;
+   }
+
+   shmr_destroy(tr);
+}
+
+void SHMR_get_stats(struct SHMRTransport *tr, struct SHMRStats *stats)
+{
+   if (!tr || !stats)
+      return;
+
+   pthread_mutex_lock(&tr->lock);
+   *stats = tr->stats;
+   pthread_mutex_unlock(&tr->lock);
+}
+
+#else
+
+struct SHMRTransport *SHMR_create(EVTHandler *evt, uint16_t port,
+      SHMR_rx_cb cb, void *arg)
+{
+   return NULL;
+}
+
+void SHMR_free(struct SHMRTransport *tr)
+{
+}
+
+int SHMR_sendv(struct SHMRTransport *tr, const struct iovec *iov,
+      int iovcnt, size_t len, const struct sockaddr_in *dest)
+{
+   return 0;
+}
+
+void SHMR_get_stats(struct SHMRTransport *tr, struct SHMRStats *stats)
+{
+   if (stats)
+      memset(stats, 0, sizeof(*stats));
+}
+
+#endif
@@ -0,0 +1,116 @@
+/*
+ * Copyright PolySat, California Polytechnic State University, San Luis Obispo. cubesat@calpoly.edu
+ * This file is part of libproc, a PolySat library.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/**
+ * @file shmRing.h Shared memory transport between processes on one host.
+ *
+ * Each process listens on an abstract unix socket named after its command
+ * port.  The first time a process sends to a local port it creates a
+ * memfd-backed single producer ring and an eventfd doorbell, and hands both
+ * to the listener over that socket.  Datagrams are then copied straight into
+ * the receiver's mapping; the doorbell is only rung while the receiver is
+ * asleep.  A sender falls back to UDP whenever no listener answers or the
+ * ring is full, and once a ring has been full it keeps using UDP for that
+ * peer until the receiver has emptied the ring.  Rings are only exchanged between processes running as the
+ * same user, and the memfd must be sealed against resizing.  Only
+ * available on Linux.
+ */
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include "events.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct SHMRTransport;
+
+/** Bytes of datagram space in each ring, a power of two */
+#define SHMR_RING_SIZE (256 * 1024)
+/** Largest datagram a ring carries, the most UDP could carry anyway */
+#define SHMR_MAX_DATAGRAM 65536
+/** Seconds before retrying a local port that had no listener */
+#define SHMR_RETRY_SECS 1
+
+/**
+ * Receives one datagram read from a ring, on the event loop thread.
+ *
+ * @param arg  The arg given to SHMR_create.
+ * @param data The datagram.  Only valid during the callback.
+ * @param len  The length of the datagram.
+ * @param src  The loopback address and port the datagram was sent from.
+ */
+typedef void (*SHMR_rx_cb)(void *arg, void *data, size_t len,
+      struct sockaddr_in *src);
+
+/** Counters for a transport */
+struct SHMRStats {
+   uint64_t sent;            // Datagrams written to a peer's ring
+   uint64_t received;        // Datagrams read from inbound rings
+   uint64_t full;            // Sends left to UDP because a ring was full,
+                             //  or had been and is not yet empty
+   uint64_t doorbells;       // Wakeups written to peers' eventfds
+};
+
+/**
+ * Starts listening for rings from other processes.
+ *
+ * @param evt  The event loop that receives and dispatches datagrams.
+ * @param port The UDP port, in host order, the process receives commands on.
+ * @param cb   Called with each datagram received.
+ * @param arg  Passed to cb.
+ *
+ * @return The transport, or NULL if it could not be created.
+ */
+struct SHMRTransport *SHMR_create(EVTHandler *evt, uint16_t port,
+      SHMR_rx_cb cb, void *arg);
+
+/**
+ * Closes every ring, inbound and outbound, and frees the transport.
+ * May be called from the receive callback, in which case no further
+ * datagrams are delivered and the transport is freed once it returns.
+ */
+void SHMR_free(struct SHMRTransport *tr);
+
+/**
+ * Sends a datagram through the destination's ring.  Safe to call from any
+ * thread.
+ *
+ * @param tr      The transport.  Replies go to the port it listens for.
+ * @param iov     The pieces of the datagram.
+ * @param iovcnt  The number of pieces.
+ * @param len     The total length of the datagram.
+ * @param dest    The destination.  Only loopback addresses are considered.
+ *
+ * @return len if the datagram was written to a ring, or 0 if the caller
+ *         should send it over UDP instead.
+ */
+int SHMR_sendv(struct SHMRTransport *tr, const struct iovec *iov,
+      int iovcnt, size_t len, const struct sockaddr_in *dest);
+
+/** Fills stats with the transport's counters. */
+void SHMR_get_stats(struct SHMRTransport *tr, struct SHMRStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
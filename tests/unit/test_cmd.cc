@@ -0,0 +1,1035 @@
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../../events.h"
+#include "../../proclib.h"
+#include "../../cmd.h"
+#include "../../cmd-pkt.h"
+#include "../../ipc.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+#define CMD_TEST_PORT 52004
+
+#define SHARD_CMD_AFFINE (IPC_CMD_BASE + 200)
+#define SHARD_CMD_SAFE (IPC_CMD_BASE + 201)
+#define BATCH_CMD (IPC_CMD_BASE + 202)
+#define MCAST_XDR_CMD (IPC_CMD_BASE + 203)
+#define SHARD_SENDERS 32
+
+struct ShardState {
+   ProcessData *proc;
+   pthread_t mainThread;
+   int affine;             // Loop-affine commands handled, on any thread
+   int affineOffMain;      // Loop-affine commands handled off the main loop
+   int safe;
+   int safeOffMain;
+   int socks[SHARD_SENDERS];
+};
+
+static struct ShardState shardState;
+
+static void shard_affine_handler(ProcessData *proc, struct IPC_Command *cmd,
+      struct sockaddr_in *src, void *arg, int fd)
+{
+   struct ShardState *state = (struct ShardState*)arg;
+
+   if (!pthread_equal(pthread_self(), state->mainThread))
+      __atomic_fetch_add(&state->affineOffMain, 1, __ATOMIC_RELAXED);
+   __atomic_fetch_add(&state->affine, 1, __ATOMIC_RELAXED);
+}
+
+static void shard_safe_handler(ProcessData *proc, struct IPC_Command *cmd,
+      struct sockaddr_in *src, void *arg, int fd)
+{
+   struct ShardState *state = (struct ShardState*)arg;
+
+   if (!pthread_equal(pthread_self(), state->mainThread))
+      __atomic_fetch_add(&state->safeOffMain, 1, __ATOMIC_RELAXED);
+   __atomic_fetch_add(&state->safe, 1, __ATOMIC_RELAXED);
+}
+
+static struct CMD_XDRCommandInfo shardCmds[] = {
+   { SHARD_CMD_AFFINE, IPC_TYPES_VOID, "shard-affine", "", NULL, NULL },
+   { SHARD_CMD_SAFE, IPC_TYPES_VOID, "shard-safe", "", NULL, NULL },
+   { BATCH_CMD, IPC_TYPES_VOID, "batch", "", NULL, NULL },
+   { 0, 0, NULL, NULL, NULL, NULL }
+};
+
+static void shard_send(int sock, uint32_t num)
+{
+   struct sockaddr_in dest;
+   struct IPC_Command cmd;
+   char buff[64];
+   size_t len = 0;
+
+   memset(&dest, 0, sizeof(dest));
+   dest.sin_family = AF_INET;
+   dest.sin_port = htons(CMD_TEST_PORT);
+   dest.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+   cmd.cmd = num;
+   cmd.ipcref = 1;
+   cmd.parameters.type = IPC_TYPES_VOID;
+   cmd.parameters.data = NULL;
+   ASSERT_GE(IPC_Command_encode(&cmd, buff, &len, sizeof(buff), NULL), 0);
+   EXPECT_EQ((ssize_t)len, sendto(sock, buff, len, 0,
+            (struct sockaddr*)&dest, sizeof(dest)));
+}
+
+// Sends both commands from many source ports so the kernel spreads them
+//  across the shards
+static int shard_send_all(void *arg)
+{
+   struct ShardState *state = (struct ShardState*)arg;
+   int i;
+
+   for (i = 0; i < SHARD_SENDERS; i++) {
+      state->socks[i] = socket(AF_INET, SOCK_DGRAM, 0);
+      EXPECT_GE(state->socks[i], 0);
+      shard_send(state->socks[i], SHARD_CMD_AFFINE);
+      shard_send(state->socks[i], SHARD_CMD_SAFE);
+   }
+
+   return EVENT_REMOVE;
+}
+
+static int shard_check_done(void *arg)
+{
+   struct ShardState *state = (struct ShardState*)arg;
+
+   if (__atomic_load_n(&state->affine, __ATOMIC_RELAXED) < SHARD_SENDERS ||
+         __atomic_load_n(&state->safe, __ATOMIC_RELAXED) < SHARD_SENDERS)
+      return EVENT_KEEP;
+
+   EVT_exit_loop(PROC_evt(state->proc));
+   return EVENT_REMOVE;
+}
+
+static int shard_timeout(void *arg)
+{
+   struct ShardState *state = (struct ShardState*)arg;
+
+   EVT_exit_loop(PROC_evt(state->proc));
+   return EVENT_REMOVE;
+}
+
+// Test commands a shard can't run itself are handed to the main loop
+TEST(TestCmdShards, LoopAffineRunsOnMainLoop) {
+   struct ShardState *state = &shardState;
+   struct XDR_CommandHandlers handlers[] = {
+      { SHARD_CMD_AFFINE, &shard_affine_handler, state },
+      { SHARD_CMD_SAFE, &shard_safe_handler, state },
+      { 0, NULL, NULL }
+   };
+   int i;
+
+   memset(state, 0, sizeof(*state));
+   CMD_register_commands(shardCmds, 1);
+   CMD_set_xdr_cmd_flags(SHARD_CMD_SAFE, CMD_XDR_THREAD_SAFE);
+   state->mainThread = pthread_self();
+   state->proc = PROC_init_xdr_sharded("test2", WD_DISABLED, handlers, 4);
+   ASSERT_TRUE(state->proc != NULL);
+
+   EVT_sched_add(PROC_evt(state->proc), EVT_ms2tv(0), &shard_send_all,
+         state);
+   EVT_sched_add_with_timestep(PROC_evt(state->proc), EVT_ms2tv(10),
+         EVT_ms2tv(10), &shard_check_done, state);
+   EVT_sched_add(PROC_evt(state->proc), EVT_ms2tv(2000), &shard_timeout,
+         state);
+   EVT_start_loop(PROC_evt(state->proc));
+   PROC_cleanup(state->proc);
+
+   for (i = 0; i < SHARD_SENDERS; i++)
+      close(state->socks[i]);
+
+   EXPECT_EQ(SHARD_SENDERS, state->affine);
+   EXPECT_EQ(0, state->affineOffMain);
+   EXPECT_EQ(SHARD_SENDERS, state->safe);
+   // Make sure the shards actually received traffic to forward
+   EXPECT_LT(0, state->safeOffMain);
+}
+
+#define BATCH_SENT 20
+
+struct BatchState {
+   ProcessData *proc;
+   int handled;
+   uint64_t wakeups;
+   uint64_t batchMax;
+};
+
+static struct BatchState batchState;
+
+static void batch_response(ProcessData *proc, int timeout, void *arg,
+      char *buff, size_t len, enum IPC_CB_TYPE type)
+{
+   struct BatchState *state = (struct BatchState*)arg;
+   struct IPC_Response *resp = (struct IPC_Response*)buff;
+   struct IPC_HeartbeatExt *beats;
+
+   EVT_exit_loop(PROC_evt(state->proc));
+   ASSERT_FALSE(timeout);
+   ASSERT_EQ((uint32_t)IPC_RESULTCODE_SUCCESS, resp->result);
+   ASSERT_EQ((uint32_t)IPC_TYPES_HEARTBEAT_EXT, resp->data.type);
+   beats = (struct IPC_HeartbeatExt*)resp->data.data;
+   state->wakeups = beats->rx_wakeups;
+   state->batchMax = beats->rx_batch_max;
+}
+
+static int batch_timeout(void *arg)
+{
+   struct BatchState *state = (struct BatchState*)arg;
+
+   EVT_exit_loop(PROC_evt(state->proc));
+   return EVENT_REMOVE;
+}
+
+// Asks for the heartbeat counters once every queued command has been seen
+static void batch_handler(ProcessData *proc, struct IPC_Command *cmd,
+      struct sockaddr_in *src, void *arg, int fd)
+{
+   struct BatchState *state = (struct BatchState*)arg;
+   struct sockaddr_in dest;
+   struct IPC_DataReq req;
+   uint32_t type = IPC_TYPES_HEARTBEAT_EXT;
+
+   if (++state->handled != BATCH_SENT)
+      return;
+
+   memset(&dest, 0, sizeof(dest));
+   dest.sin_family = AF_INET;
+   dest.sin_port = htons(CMD_TEST_PORT);
+   dest.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   req.length = 1;
+   req.reqs = &type;
+   EXPECT_EQ(0, IPC_command(proc, IPC_CMDS_DATA_REQ, &req,
+            IPC_TYPES_DATAREQ, dest, &batch_response, state,
+            IPC_CB_TYPE_COOKED, 1000));
+}
+
+// Test a backlog of datagrams is drained in batches that grow up to the
+//  configured size, and that none are lost along the way
+TEST(TestCmdBatch, BatchedReceive) {
+   struct BatchState *state = &batchState;
+   struct XDR_CommandHandlers handlers[] = {
+      { BATCH_CMD, &batch_handler, state },
+      { 0, NULL, NULL }
+   };
+   int sock, i;
+
+   memset(state, 0, sizeof(*state));
+   CMD_register_commands(shardCmds, 1);
+   state->proc = PROC_init_xdr("test2", WD_DISABLED, handlers);
+   ASSERT_TRUE(state->proc != NULL);
+   EXPECT_EQ(-1, PROC_set_cmd_batch_size(state->proc, 0));
+   EXPECT_EQ(-1, PROC_set_cmd_batch_size(state->proc, CMD_MAX_RX_BATCH + 1));
+   ASSERT_EQ(0, PROC_set_cmd_batch_size(state->proc, 8));
+
+   // Queue everything before the loop first looks at the socket
+   sock = socket(AF_INET, SOCK_DGRAM, 0);
+   ASSERT_GE(sock, 0);
+   for (i = 0; i < BATCH_SENT; i++)
+      shard_send(sock, BATCH_CMD);
+
+   EVT_sched_add(PROC_evt(state->proc), EVT_ms2tv(2000), &batch_timeout,
+         state);
+   EVT_start_loop(PROC_evt(state->proc));
+   PROC_cleanup(state->proc);
+   close(sock);
+
+   EXPECT_EQ(BATCH_SENT, state->handled);
+   // The ring grows 1, 2, 4, then reads 8 at a time
+   EXPECT_EQ(8u, state->batchMax);
+   EXPECT_GE(7u, state->wakeups);
+}
+
+#define RESP_PEER_PORT 52990
+#define RESP_CMDS 200
+#define RESP_TIMEOUT_MS 300
+
+struct RespState {
+   ProcessData *proc;
+   int peer, impostor;
+   int received;
+   int answered[RESP_CMDS];
+   int timedOut[RESP_CMDS];
+   int done;
+   uint64_t inFlight, inFlightMax;
+};
+
+static struct RespState respState;
+
+static void resp_reply(int sock, uint32_t ipcref, struct sockaddr_in *to)
+{
+   struct IPC_Response resp;
+   char buff[64];
+   size_t len = 0;
+
+   resp.cmd = IPC_CMDS_RESPONSE;
+   resp.ipcref = ipcref;
+   resp.result = IPC_RESULTCODE_SUCCESS;
+   resp.data.type = IPC_TYPES_VOID;
+   resp.data.data = NULL;
+   ASSERT_GE(IPC_Response_encode(&resp, buff, &len, sizeof(buff), NULL), 0);
+   sendto(sock, buff, len, 0, (struct sockaddr*)to, sizeof(*to));
+}
+
+/* Plays the remote end.  Every command first gets a response with the
+ * right ipcref from the wrong port, which must be ignored, and every other
+ * command then gets the real response.
+ */
+static int resp_peer(int fd, char type, void *arg)
+{
+   struct RespState *state = (struct RespState*)arg;
+   struct sockaddr_in from;
+   socklen_t fromLen = sizeof(from);
+   struct IPC_Command cmd;
+   char buff[256];
+   ssize_t len;
+   size_t used = 0;
+
+   len = recvfrom(fd, buff, sizeof(buff), 0, (struct sockaddr*)&from,
+         &fromLen);
+   if (len <= 0 || IPC_Command_decode(buff, &cmd, &used, len, NULL) < 0)
+      return EVENT_KEEP;
+
+   resp_reply(state->impostor, cmd.ipcref, &from);
+   if (!(state->received++ % 2))
+      resp_reply(state->peer, cmd.ipcref, &from);
+   XDR_free_union(&cmd.parameters);
+
+   return EVENT_KEEP;
+}
+
+static void resp_heartbeat(ProcessData *proc, int timeout, void *arg,
+      char *buff, size_t len, enum IPC_CB_TYPE type)
+{
+   struct RespState *state = (struct RespState*)arg;
+   struct IPC_Response *resp = (struct IPC_Response*)buff;
+   struct IPC_HeartbeatExt *beats;
+
+   EVT_exit_loop(PROC_evt(state->proc));
+   ASSERT_FALSE(timeout);
+   ASSERT_EQ((uint32_t)IPC_TYPES_HEARTBEAT_EXT, resp->data.type);
+   beats = (struct IPC_HeartbeatExt*)resp->data.data;
+   state->inFlight = beats->in_flight;
+   state->inFlightMax = beats->in_flight_max;
+}
+
+// Once every command is settled, asks for the heartbeat counters
+static void resp_cb(ProcessData *proc, int timeout, void *arg,
+      char *buff, size_t len, enum IPC_CB_TYPE type)
+{
+   struct RespState *state = &respState;
+   int idx = (int)(intptr_t)arg;
+   struct sockaddr_in dest;
+   struct IPC_DataReq req;
+   uint32_t beatType = IPC_TYPES_HEARTBEAT_EXT;
+
+   if (timeout)
+      state->timedOut[idx]++;
+   else
+      state->answered[idx]++;
+   if (++state->done != RESP_CMDS)
+      return;
+
+   memset(&dest, 0, sizeof(dest));
+   dest.sin_family = AF_INET;
+   dest.sin_port = htons(CMD_TEST_PORT);
+   dest.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   req.length = 1;
+   req.reqs = &beatType;
+   EXPECT_EQ(0, IPC_command(proc, IPC_CMDS_DATA_REQ, &req,
+            IPC_TYPES_DATAREQ, dest, &resp_heartbeat, state,
+            IPC_CB_TYPE_COOKED, 1000));
+}
+
+static int resp_send_all(void *arg)
+{
+   struct RespState *state = (struct RespState*)arg;
+   struct sockaddr_in dest;
+   int i;
+
+   memset(&dest, 0, sizeof(dest));
+   dest.sin_family = AF_INET;
+   dest.sin_port = htons(RESP_PEER_PORT);
+   dest.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+   for (i = 0; i < RESP_CMDS; i++)
+      EXPECT_EQ(0, IPC_command(state->proc, BATCH_CMD, NULL, IPC_TYPES_VOID,
+               dest, &resp_cb, (void*)(intptr_t)i, IPC_CB_TYPE_COOKED,
+               RESP_TIMEOUT_MS));
+
+   return EVENT_REMOVE;
+}
+
+static int resp_timeout(void *arg)
+{
+   struct RespState *state = (struct RespState*)arg;
+
+   EVT_exit_loop(PROC_evt(state->proc));
+   return EVENT_REMOVE;
+}
+
+// Test many outstanding commands are each matched to their own response by
+//  ipcref and host, and that the rest time out exactly once
+TEST(TestCmdResponses, MatchedOnRefAndHost) {
+   struct RespState *state = &respState;
+   struct sockaddr_in addr;
+   int i;
+
+   memset(state, 0, sizeof(*state));
+   state->proc = PROC_init_xdr("test2", WD_DISABLED, NULL);
+   ASSERT_TRUE(state->proc != NULL);
+   state->peer = socket(AF_INET, SOCK_DGRAM, 0);
+   state->impostor = socket(AF_INET, SOCK_DGRAM, 0);
+   ASSERT_GE(state->peer, 0);
+   ASSERT_GE(state->impostor, 0);
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons(RESP_PEER_PORT);
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   ASSERT_EQ(0, bind(state->peer, (struct sockaddr*)&addr, sizeof(addr)));
+
+   EVT_fd_add(PROC_evt(state->proc), state->peer, EVENT_FD_READ,
+         &resp_peer, state);
+   EVT_sched_add(PROC_evt(state->proc), EVT_ms2tv(0), &resp_send_all, state);
+   EVT_sched_add(PROC_evt(state->proc), EVT_ms2tv(3000), &resp_timeout,
+         state);
+   EVT_start_loop(PROC_evt(state->proc));
+   EVT_fd_remove(PROC_evt(state->proc), state->peer, EVENT_FD_READ);
+   PROC_cleanup(state->proc);
+   close(state->peer);
+   close(state->impostor);
+
+   ASSERT_EQ(RESP_CMDS, state->received);
+   ASSERT_EQ(RESP_CMDS, state->done);
+   for (i = 0; i < RESP_CMDS; i++) {
+      EXPECT_EQ(i % 2 ? 0 : 1, state->answered[i]) << "command " << i;
+      EXPECT_EQ(i % 2 ? 1 : 0, state->timedOut[i]) << "command " << i;
+   }
+   // Only the heartbeat request itself was outstanding when it was read
+   EXPECT_EQ(1u, state->inFlight);
+   EXPECT_EQ((uint64_t)RESP_CMDS, state->inFlightMax);
+}
+
+#define SNAP_MAX_AGE_MS 300
+#define SNAP_TICK_MS 50
+#define SNAP_REQUESTS 8
+
+enum SnapAction { SNAP_IDLE, SNAP_SEND, SNAP_FAIL, SNAP_HEARTBEAT, SNAP_DONE };
+
+// One action per tick.  The snapshot taken on the first send expires before
+//  the tick 9 send, and the one taken then before the tick 17 send.
+static const enum SnapAction snapScript[] = {
+   SNAP_SEND, SNAP_SEND, SNAP_SEND, SNAP_IDLE, SNAP_IDLE, SNAP_IDLE,
+   SNAP_IDLE, SNAP_IDLE, SNAP_IDLE, SNAP_SEND, SNAP_SEND, SNAP_IDLE,
+   SNAP_IDLE, SNAP_IDLE, SNAP_IDLE, SNAP_IDLE, SNAP_IDLE, SNAP_FAIL,
+   SNAP_SEND, SNAP_HEARTBEAT, SNAP_DONE
+};
+
+struct SnapState {
+   ProcessData *proc;
+   int tick;
+   int calls;
+   int fail;
+   int sent;
+   int responses;
+   uint32_t results[SNAP_REQUESTS];
+   uint32_t values[SNAP_REQUESTS];
+   uint64_t hits, misses;
+};
+
+static struct SnapState snapState;
+
+// Reports how many times it has run, so a cached answer is easy to spot
+static void snap_populator(void *arg, XDR_tx_struct cb, void *cb_arg)
+{
+   struct SnapState *state = (struct SnapState*)arg;
+   struct IPC_PopulatorError val;
+
+   state->calls++;
+   if (state->fail) {
+      state->fail = 0;
+      cb(NULL, cb_arg, IPC_RESULTCODE_ALLOCATION_ERR);
+      return;
+   }
+
+   val.type = 7;
+   val.error = state->calls;
+   cb(&val, cb_arg, IPC_RESULTCODE_SUCCESS);
+}
+
+static void snap_response(ProcessData *proc, int timeout, void *arg,
+      char *buff, size_t len, enum IPC_CB_TYPE type)
+{
+   struct SnapState *state = &snapState;
+   struct IPC_Response *resp = (struct IPC_Response*)buff;
+   struct IPC_PopulatorError *val;
+   struct IPC_HeartbeatExt *beats;
+   int idx = (int)(intptr_t)arg;
+
+   ASSERT_FALSE(timeout);
+   ASSERT_LT(idx, SNAP_REQUESTS);
+   state->responses++;
+   state->results[idx] = resp->result;
+   if (resp->result != IPC_RESULTCODE_SUCCESS)
+      return;
+
+   if (resp->data.type == IPC_TYPES_POPULATOR_ERROR) {
+      val = (struct IPC_PopulatorError*)resp->data.data;
+      state->values[idx] = val->error;
+   }
+   else if (resp->data.type == IPC_TYPES_HEARTBEAT_EXT) {
+      beats = (struct IPC_HeartbeatExt*)resp->data.data;
+      state->hits = beats->data_req_cache_hits;
+      state->misses = beats->data_req_cache_misses;
+   }
+}
+
+static void snap_send(struct SnapState *state, uint32_t type)
+{
+   struct sockaddr_in dest;
+   struct IPC_DataReq req;
+
+   memset(&dest, 0, sizeof(dest));
+   dest.sin_family = AF_INET;
+   dest.sin_port = htons(CMD_TEST_PORT);
+   dest.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   req.length = 1;
+   req.reqs = &type;
+
+   ASSERT_LT(state->sent, SNAP_REQUESTS);
+   EXPECT_EQ(0, IPC_command(state->proc, IPC_CMDS_DATA_REQ, &req,
+            IPC_TYPES_DATAREQ, dest, &snap_response,
+            (void*)(intptr_t)state->sent++, IPC_CB_TYPE_COOKED, 1000));
+}
+
+static int snap_tick(void *arg)
+{
+   struct SnapState *state = (struct SnapState*)arg;
+
+   switch (snapScript[state->tick++]) {
+      case SNAP_FAIL:
+         state->fail = 1;
+         snap_send(state, IPC_TYPES_POPULATOR_ERROR);
+         break;
+      case SNAP_SEND:
+         snap_send(state, IPC_TYPES_POPULATOR_ERROR);
+         break;
+      case SNAP_HEARTBEAT:
+         snap_send(state, IPC_TYPES_HEARTBEAT_EXT);
+         break;
+      case SNAP_DONE:
+         EVT_exit_loop(PROC_evt(state->proc));
+         return EVENT_REMOVE;
+      default:
+         break;
+   }
+
+   return EVENT_KEEP;
+}
+
+// Test cached populators answer from the snapshot until it ages out, and
+//  that a failed populate is never cached
+TEST(TestDataReqCache, SnapshotAgesOut) {
+   struct SnapState *state = &snapState;
+   const uint32_t ok = IPC_RESULTCODE_SUCCESS;
+   int i;
+
+   memset(state, 0, sizeof(*state));
+   state->proc = PROC_init_xdr("test2", WD_DISABLED, NULL);
+   ASSERT_TRUE(state->proc != NULL);
+   XDR_register_populator_cached(&snap_populator, state,
+         IPC_TYPES_POPULATOR_ERROR, SNAP_MAX_AGE_MS);
+
+   EVT_sched_add_with_timestep(PROC_evt(state->proc), EVT_ms2tv(0),
+         EVT_ms2tv(SNAP_TICK_MS), &snap_tick, state);
+   EVT_start_loop(PROC_evt(state->proc));
+   PROC_cleanup(state->proc);
+   XDR_register_populator(NULL, NULL, IPC_TYPES_POPULATOR_ERROR);
+
+   ASSERT_EQ(SNAP_REQUESTS, state->responses);
+   for (i = 0; i < SNAP_REQUESTS; i++)
+      if (i != 5)
+         EXPECT_EQ(ok, state->results[i]) << "request " << i;
+   EXPECT_NE(ok, state->results[5]);
+
+   // Populated on requests 0, 3, 5 and 6; the rest were snapshot hits
+   EXPECT_EQ(4, state->calls);
+   EXPECT_EQ(1u, state->values[0]);
+   EXPECT_EQ(1u, state->values[1]);
+   EXPECT_EQ(1u, state->values[2]);
+   EXPECT_EQ(2u, state->values[3]);
+   EXPECT_EQ(2u, state->values[4]);
+   EXPECT_EQ(4u, state->values[6]);
+   EXPECT_EQ(3u, state->hits);
+   EXPECT_EQ(4u, state->misses);
+}
+
+
+#define FLIGHT_REQUESTS 4
+#define FLIGHT_DELAY_MS 50
+
+struct FlightState {
+   ProcessData *proc;
+   int calls;
+   int fail;
+   XDR_tx_struct cb;
+   void *cbArg;
+   int sent;
+   int responses;
+   int callsAfterFirst;
+   uint32_t results[2 * FLIGHT_REQUESTS];
+   uint32_t values[2 * FLIGHT_REQUESTS];
+};
+
+static struct FlightState flightState;
+
+static void flight_response(ProcessData *proc, int timeout, void *arg,
+      char *buff, size_t len, enum IPC_CB_TYPE type);
+
+static int flight_deliver(void *arg)
+{
+   struct FlightState *state = (struct FlightState*)arg;
+   struct IPC_PopulatorError val;
+
+   val.type = 7;
+   val.error = state->calls;
+   if (state->fail)
+      state->cb(NULL, state->cbArg, IPC_RESULTCODE_ALLOCATION_ERR);
+   else
+      state->cb(&val, state->cbArg, IPC_RESULTCODE_SUCCESS);
+
+   return EVENT_REMOVE;
+}
+
+// Answers a while after being asked, so requests pile up meanwhile
+static void flight_populator(void *arg, XDR_tx_struct cb, void *cb_arg)
+{
+   struct FlightState *state = (struct FlightState*)arg;
+
+   state->calls++;
+   state->cb = cb;
+   state->cbArg = cb_arg;
+   EVT_sched_add(PROC_evt(state->proc), EVT_ms2tv(FLIGHT_DELAY_MS),
+         &flight_deliver, state);
+}
+
+// Sends a burst of requests that all miss the cache at once
+static int flight_send(void *arg)
+{
+   struct FlightState *state = (struct FlightState*)arg;
+   struct sockaddr_in dest;
+   struct IPC_DataReq req;
+   uint32_t type = IPC_TYPES_POPULATOR_ERROR;
+   int i;
+
+   memset(&dest, 0, sizeof(dest));
+   dest.sin_family = AF_INET;
+   dest.sin_port = htons(CMD_TEST_PORT);
+   dest.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   req.length = 1;
+   req.reqs = &type;
+
+   for (i = 0; i < FLIGHT_REQUESTS; i++)
+      EXPECT_EQ(0, IPC_command(state->proc, IPC_CMDS_DATA_REQ, &req,
+               IPC_TYPES_DATAREQ, dest, &flight_response,
+               (void*)(intptr_t)state->sent++, IPC_CB_TYPE_COOKED, 1000));
+
+   return EVENT_REMOVE;
+}
+
+// Starts a second, succeeding burst once the first has been answered
+static void flight_response(ProcessData *proc, int timeout, void *arg,
+      char *buff, size_t len, enum IPC_CB_TYPE type)
+{
+   struct FlightState *state = &flightState;
+   struct IPC_Response *resp = (struct IPC_Response*)buff;
+   int idx = (int)(intptr_t)arg;
+
+   ASSERT_FALSE(timeout);
+   state->results[idx] = resp->result;
+   if (resp->result == IPC_RESULTCODE_SUCCESS &&
+         resp->data.type == IPC_TYPES_POPULATOR_ERROR)
+      state->values[idx] =
+         ((struct IPC_PopulatorError*)resp->data.data)->error;
+
+   if (++state->responses == FLIGHT_REQUESTS) {
+      state->callsAfterFirst = state->calls;
+      state->fail = 0;
+      EVT_sched_add(PROC_evt(state->proc), EVT_ms2tv(0), &flight_send,
+            state);
+   }
+   else if (state->responses == 2 * FLIGHT_REQUESTS)
+      EVT_exit_loop(PROC_evt(state->proc));
+}
+
+static int flight_timeout(void *arg)
+{
+   struct FlightState *state = (struct FlightState*)arg;
+
+   EVT_exit_loop(PROC_evt(state->proc));
+   return EVENT_REMOVE;
+}
+
+// Test concurrent misses share one populate, whether it fails or succeeds
+TEST(TestDataReqCache, MissesShareOnePopulate) {
+   struct FlightState *state = &flightState;
+   int i;
+
+   memset(state, 0, sizeof(*state));
+   state->proc = PROC_init_xdr("test2", WD_DISABLED, NULL);
+   ASSERT_TRUE(state->proc != NULL);
+   XDR_register_populator_cached(&flight_populator, state,
+         IPC_TYPES_POPULATOR_ERROR, 1);
+
+   state->fail = 1;
+   EVT_sched_add(PROC_evt(state->proc), EVT_ms2tv(0), &flight_send, state);
+   EVT_sched_add(PROC_evt(state->proc), EVT_ms2tv(2000), &flight_timeout,
+         state);
+   EVT_start_loop(PROC_evt(state->proc));
+   PROC_cleanup(state->proc);
+   XDR_register_populator(NULL, NULL, IPC_TYPES_POPULATOR_ERROR);
+
+   ASSERT_EQ(2 * FLIGHT_REQUESTS, state->responses);
+   EXPECT_EQ(1, state->callsAfterFirst);
+   for (i = 0; i < FLIGHT_REQUESTS; i++)
+      EXPECT_EQ((uint32_t)IPC_RESULTCODE_ALLOCATION_ERR, state->results[i])
+         << "request " << i;
+
+   // The failure wasn't cached, so the second burst populated again
+   EXPECT_EQ(2, state->calls);
+   for (i = FLIGHT_REQUESTS; i < 2 * FLIGHT_REQUESTS; i++) {
+      EXPECT_EQ((uint32_t)IPC_RESULTCODE_SUCCESS, state->results[i])
+         << "request " << i;
+      EXPECT_EQ(2u, state->values[i]) << "request " << i;
+   }
+}
+
+
+#define FANIN_DEADLINE_MS 150
+#define FANIN_WORKER_VALUE 42
+
+struct FanInState {
+   ProcessData *proc;
+   pthread_t worker;
+   int workerStarted;
+   XDR_tx_struct workerCb, lostCb;
+   void *workerArg, *lostArg;
+   struct timeval sentAt;
+   long elapsedMs;
+   int responses;
+   uint32_t result;
+   int heartbeats;
+   int workerValues;
+   int timeouts;
+   int other;
+};
+
+static struct FanInState fanInState;
+
+static void *fanin_worker(void *arg)
+{
+   struct FanInState *state = (struct FanInState*)arg;
+   struct IPC_PopulatorError val;
+
+   usleep(20000);
+   val.type = IPC_TYPES_VOID;
+   val.error = FANIN_WORKER_VALUE;
+   state->workerCb(&val, state->workerArg, IPC_RESULTCODE_SUCCESS);
+
+   return NULL;
+}
+
+// Answers from a worker thread after returning
+static void fanin_thread_populator(void *arg, XDR_tx_struct cb, void *cb_arg)
+{
+   struct FanInState *state = (struct FanInState*)arg;
+
+   state->workerCb = cb;
+   state->workerArg = cb_arg;
+   state->workerStarted = !pthread_create(&state->worker, NULL,
+         &fanin_worker, state);
+}
+
+// Never answers, until the test calls back long after the deadline
+static void fanin_lost_populator(void *arg, XDR_tx_struct cb, void *cb_arg)
+{
+   struct FanInState *state = (struct FanInState*)arg;
+
+   state->lostCb = cb;
+   state->lostArg = cb_arg;
+}
+
+static void fanin_struct(uint32_t type, struct XDR_StructDefinition *def,
+      char *buff, size_t len, void *arg, int arg2, const char *parent)
+{
+   struct FanInState *state = (struct FanInState*)arg;
+   struct IPC_PopulatorError err;
+   size_t used = 0;
+
+   if (type == IPC_TYPES_HEARTBEAT) {
+      state->heartbeats++;
+      return;
+   }
+   if (type != IPC_TYPES_POPULATOR_ERROR ||
+         def->decoder(buff, &err, &used, len, def->arg) < 0) {
+      state->other++;
+      return;
+   }
+
+   if (err.type == IPC_TYPES_VOID && err.error == FANIN_WORKER_VALUE)
+      state->workerValues++;
+   else if (err.type == IPC_TYPES_DATAREQ &&
+         err.error == IPC_RESULTCODE_TIMEOUT)
+      state->timeouts++;
+   else
+      state->other++;
+}
+
+static int fanin_exit(void *arg)
+{
+   struct FanInState *state = (struct FanInState*)arg;
+
+   EVT_exit_loop(PROC_evt(state->proc));
+   return EVENT_REMOVE;
+}
+
+// Walks the raw response; decoding a struct array isn't supported
+static void fanin_response(ProcessData *proc, int timeout, void *arg,
+      char *buff, size_t len, enum IPC_CB_TYPE type)
+{
+   struct FanInState *state = &fanInState;
+   struct IPC_ResponseHeader hdr;
+   struct IPC_PopulatorError late;
+   struct timeval now;
+   size_t used = 0;
+
+   ASSERT_FALSE(timeout);
+   gettimeofday(&now, NULL);
+   state->elapsedMs = (now.tv_sec - state->sentAt.tv_sec) * 1000 +
+      (now.tv_usec - state->sentAt.tv_usec) / 1000;
+   state->responses++;
+
+   ASSERT_LE(0, IPC_ResponseHeader_decode(buff, &hdr, &used, len, NULL));
+   state->result = hdr.result;
+   CMD_iterate_structs(buff + used, len - used, &fanin_struct, state, 0);
+
+   // A populator calling back after the response must be ignored
+   if (state->lostCb) {
+      late.type = IPC_TYPES_VOID;
+      late.error = 0;
+      state->lostCb(&late, state->lostArg, IPC_RESULTCODE_SUCCESS);
+   }
+   EVT_sched_add(PROC_evt(state->proc), EVT_ms2tv(50), &fanin_exit, state);
+}
+
+static int fanin_send(void *arg)
+{
+   struct FanInState *state = (struct FanInState*)arg;
+   struct sockaddr_in dest;
+   struct IPC_DataReq req;
+   uint32_t types[3] = { IPC_TYPES_HEARTBEAT, IPC_TYPES_POPULATOR_ERROR,
+      IPC_TYPES_DATAREQ };
+
+   memset(&dest, 0, sizeof(dest));
+   dest.sin_family = AF_INET;
+   dest.sin_port = htons(CMD_TEST_PORT);
+   dest.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   req.length = 3;
+   req.reqs = types;
+
+   gettimeofday(&state->sentAt, NULL);
+   EXPECT_EQ(0, IPC_command(state->proc, IPC_CMDS_DATA_REQ, &req,
+            IPC_TYPES_DATAREQ, dest, &fanin_response, NULL,
+            IPC_CB_TYPE_RAW, 2000));
+
+   return EVENT_REMOVE;
+}
+
+// Test one request fans in an inline, a worker thread and a lost populator,
+//  answering at the deadline with the lost one reported as a timeout
+TEST(TestDataReqFanIn, DeadlineReportsOutstanding) {
+   struct FanInState *state = &fanInState;
+
+   memset(state, 0, sizeof(*state));
+   state->proc = PROC_init_xdr("test2", WD_DISABLED, NULL);
+   ASSERT_TRUE(state->proc != NULL);
+   ASSERT_EQ(0, PROC_set_data_req_deadline(state->proc, FANIN_DEADLINE_MS));
+   XDR_register_populator(&fanin_thread_populator, state,
+         IPC_TYPES_POPULATOR_ERROR);
+   XDR_register_populator(&fanin_lost_populator, state, IPC_TYPES_DATAREQ);
+
+   EVT_sched_add(PROC_evt(state->proc), EVT_ms2tv(0), &fanin_send, state);
+   EVT_sched_add(PROC_evt(state->proc), EVT_ms2tv(3000), &fanin_exit, state);
+   EVT_start_loop(PROC_evt(state->proc));
+   if (state->workerStarted)
+      pthread_join(state->worker, NULL);
+   PROC_cleanup(state->proc);
+   XDR_register_populator(NULL, NULL, IPC_TYPES_POPULATOR_ERROR);
+   XDR_register_populator(NULL, NULL, IPC_TYPES_DATAREQ);
+
+   ASSERT_EQ(1, state->responses);
+   EXPECT_EQ((uint32_t)IPC_RESULTCODE_SUCCESS, state->result);
+   EXPECT_EQ(1, state->workerStarted);
+   EXPECT_EQ(1, state->heartbeats);
+   EXPECT_EQ(1, state->workerValues);
+   EXPECT_EQ(1, state->timeouts);
+   EXPECT_EQ(0, state->other);
+   EXPECT_LE(FANIN_DEADLINE_MS - 10, state->elapsedMs);
+   EXPECT_GT(1000, state->elapsedMs);
+}
+
+
+#define TELM_PERIOD_MS 20
+
+struct TelmState {
+   ProcessData *proc;
+   uint32_t value;
+   int step;
+   int calls;
+   int received;
+   uint32_t values[8];
+   int all;
+   int heartbeats;
+   int legacy;
+   int bad;
+};
+
+static void telm_populator(void *arg, XDR_tx_struct cb, void *cb_arg)
+{
+   struct TelmState *state = (struct TelmState*)arg;
+   struct IPC_PopulatorError val;
+
+   state->calls++;
+   val.type = IPC_TYPES_VOID;
+   val.error = state->value;
+   cb(&val, cb_arg, IPC_RESULTCODE_SUCCESS);
+}
+
+static void telm_handler(void *arg, uint32_t type, void *data,
+      struct sockaddr_in *from)
+{
+   struct TelmState *state = (struct TelmState*)arg;
+   struct IPC_PopulatorError *val = (struct IPC_PopulatorError*)data;
+
+   if (type != IPC_TYPES_POPULATOR_ERROR || !val || !from ||
+         state->received >= 8) {
+      state->bad++;
+      return;
+   }
+   state->values[state->received++] = val->error;
+}
+
+static void telm_all_handler(void *arg, uint32_t type, void *data,
+      struct sockaddr_in *from)
+{
+   ((struct TelmState*)arg)->all++;
+}
+
+static void telm_heartbeat_handler(void *arg, uint32_t type, void *data,
+      struct sockaddr_in *from)
+{
+   ((struct TelmState*)arg)->heartbeats++;
+}
+
+static void telm_legacy_handler(void *arg, int socket, unsigned char cmd,
+      void *data, size_t dataLen, struct sockaddr_in *from)
+{
+   ((struct TelmState*)arg)->legacy++;
+}
+
+// Steps through a change, a forced publication and unpublishing
+static int telm_step(void *arg)
+{
+   struct TelmState *state = (struct TelmState*)arg;
+
+   struct sockaddr_in addr;
+   uint32_t *word;
+
+   switch (state->step++) {
+      case 0:
+         state->value = 2;
+
+         // Any other XDR datagram still reaches the wildcard handler
+         memset(&addr, 0, sizeof(addr));
+         addr.sin_family = AF_INET;
+         addr.sin_addr = socket_multicast_addr_by_name("test2");
+         addr.sin_port = htons(socket_multicast_port_by_name("test2"));
+         word = (uint32_t*)malloc(sizeof(*word));
+         *word = htonl(MCAST_XDR_CMD);
+         EXPECT_LT(0, PROC_cmd_raw_sockaddr(state->proc, word, sizeof(*word),
+                  &addr));
+         return EVENT_KEEP;
+      case 1:
+         EXPECT_EQ(0, PROC_publish_telemetry_now(state->proc,
+                  IPC_TYPES_POPULATOR_ERROR));
+         return EVENT_KEEP;
+      case 2:
+         EXPECT_EQ(0, PROC_unpublish_telemetry(state->proc,
+                  IPC_TYPES_POPULATOR_ERROR));
+         state->value = 3;
+         return EVENT_KEEP;
+   }
+
+   EVT_exit_loop(PROC_evt(state->proc));
+   return EVENT_REMOVE;
+}
+
+// Test published values reach typed and wildcard subscribers, unchanged
+//  values are skipped and nothing arrives after unpublishing.  Wildcard
+//  legacy multicast handlers see other XDR datagrams but not the telemetry.
+TEST(TestTelemetry, PublishSubscribe) {
+   struct TelmState state;
+
+   memset(&state, 0, sizeof(state));
+   state.value = 1;
+   state.proc = PROC_init_xdr("test2", WD_DISABLED, NULL);
+   ASSERT_TRUE(state.proc != NULL);
+   XDR_register_populator(&telm_populator, &state,
+         IPC_TYPES_POPULATOR_ERROR);
+
+   EXPECT_EQ(-1, PROC_publish_telemetry(state.proc, IPC_TYPES_VOID, 0, 0));
+   EXPECT_EQ(-1, PROC_publish_telemetry_now(state.proc, IPC_TYPES_VOID));
+   ASSERT_EQ(0, PROC_subscribe_telemetry(state.proc, "test2",
+            IPC_TYPES_POPULATOR_ERROR, &telm_handler, &state));
+   ASSERT_EQ(0, PROC_subscribe_telemetry(state.proc, "test2", 0,
+            &telm_all_handler, &state));
+   ASSERT_EQ(0, PROC_subscribe_telemetry(state.proc, "test2",
+            IPC_TYPES_HEARTBEAT, &telm_heartbeat_handler, &state));
+   ASSERT_EQ(0, PROC_set_multicast_handler(state.proc, "test2", -1,
+            &telm_legacy_handler, &state));
+   ASSERT_EQ(0, PROC_publish_telemetry(state.proc,
+            IPC_TYPES_POPULATOR_ERROR, TELM_PERIOD_MS, CMD_PUBLISH_ON_CHANGE));
+
+   EVT_sched_add(PROC_evt(state.proc), EVT_ms2tv(150), &telm_step, &state);
+   EVT_start_loop(PROC_evt(state.proc));
+
+   EXPECT_EQ(0, PROC_unsubscribe_telemetry(state.proc, "test2",
+            IPC_TYPES_HEARTBEAT));
+   EXPECT_EQ(-1, PROC_unsubscribe_telemetry(state.proc, "test2",
+            IPC_TYPES_HEARTBEAT));
+   PROC_cleanup(state.proc);
+   XDR_register_populator(NULL, NULL, IPC_TYPES_POPULATOR_ERROR);
+
+   // One populate per period, however many subscribers there are
+   EXPECT_LE(10, state.calls);
+   EXPECT_GE(40, state.calls);
+
+   EXPECT_EQ(0, state.bad);
+   ASSERT_EQ(3, state.received);
+   EXPECT_EQ(1u, state.values[0]);
+   EXPECT_EQ(2u, state.values[1]);
+   EXPECT_EQ(2u, state.values[2]);
+   EXPECT_EQ(3, state.all);
+   EXPECT_EQ(0, state.heartbeats);
+   EXPECT_EQ(1, state.legacy);
+}
+}
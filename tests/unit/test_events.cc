@@ -1,5 +1,9 @@
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "../../events.h"
 #include "../../eventTimer.h"
 #include "../../proclib.h"
@@ -133,5 +137,408 @@ TEST_F(TestEvents, SignalHandler) {
    EXPECT_EQ(data.count, SIGALRM);
 }
 
+struct PipeData {
+   int count;
+   EVTHandler *evt;
+};
+
+int pipe_reader(int fd, char type, void *arg) {
+   struct PipeData *data = (struct PipeData *)arg;
+   char buff[16];
+
+   EXPECT_EQ(EVENT_FD_READ, type);
+   EXPECT_EQ(1, read(fd, buff, sizeof(buff)));
+   data->count++;
+   EVT_exit_loop(data->evt);
+   return EVENT_REMOVE;
+}
+
+int pipe_writer(void *arg) {
+   EXPECT_EQ(1, write(*(int*)arg, "x", 1));
+   return EVENT_REMOVE;
+}
+
+static void run_pipe_test(enum EVTBackend backend, int readFd, int writeFd) {
+   struct PipeData data;
+
+   data.count = 0;
+   data.evt = EVT_create_handler_with_backend(NULL, NULL, backend);
+   ASSERT_TRUE(data.evt != NULL);
+   EXPECT_EQ(backend, EVT_get_backend(data.evt));
+
+   EXPECT_EQ(1, EVT_fd_add(data.evt, readFd, EVENT_FD_READ, pipe_reader,
+            &data));
+   EVT_sched_add(data.evt, EVT_ms2tv(50), pipe_writer, &writeFd);
+   EVT_start_loop(data.evt);
+
+   EXPECT_EQ(1, data.count);
+   EVT_free_handler(data.evt);
+}
+
+// Test fd dispatch through both backends
+TEST(TestEventBackends, PipeRead) {
+   int fds[2];
+
+   ASSERT_EQ(0, pipe(fds));
+   run_pipe_test(EVT_BACKEND_SELECT, fds[0], fds[1]);
+   run_pipe_test(EVT_BACKEND_EPOLL, fds[0], fds[1]);
+   close(fds[0]);
+   close(fds[1]);
+}
+
+// Test that epoll handles descriptors select() can't
+TEST(TestEventBackends, EpollLargeFd) {
+   int fds[2], bigFd = FD_SETSIZE + 10;
+   struct rlimit lim;
+
+   ASSERT_EQ(0, getrlimit(RLIMIT_NOFILE, &lim));
+   if (lim.rlim_cur <= (rlim_t)bigFd) {
+      lim.rlim_cur = bigFd + 1;
+      if (lim.rlim_max < lim.rlim_cur || setrlimit(RLIMIT_NOFILE, &lim))
+         return;
+   }
+
+   ASSERT_EQ(0, pipe(fds));
+   ASSERT_EQ(bigFd, dup2(fds[0], bigFd));
+   run_pipe_test(EVT_BACKEND_EPOLL, bigFd, fds[1]);
+   close(bigFd);
+   close(fds[0]);
+   close(fds[1]);
+}
+
+int file_reader(int fd, char type, void *arg) {
+   struct PipeData *data = (struct PipeData *)arg;
+   char buff[16];
+
+   data->count++;
+   // Regular files stay readable at EOF, just like select() reports them
+   if (read(fd, buff, sizeof(buff)) == 0) {
+      EVT_exit_loop(data->evt);
+      return EVENT_REMOVE;
+   }
+   return EVENT_KEEP;
 }
 
+// Test that epoll dispatches regular files, which it can't watch
+TEST(TestEventBackends, EpollRegularFile) {
+   struct PipeData data;
+   char path[] = "/tmp/libproc-evt-XXXXXX";
+   int fd;
+
+   fd = mkstemp(path);
+   ASSERT_TRUE(fd >= 0);
+   unlink(path);
+   ASSERT_EQ(5, write(fd, "hello", 5));
+   ASSERT_EQ(0, lseek(fd, 0, SEEK_SET));
+
+   data.count = 0;
+   data.evt = EVT_create_handler_with_backend(NULL, NULL, EVT_BACKEND_EPOLL);
+   ASSERT_TRUE(data.evt != NULL);
+
+   EXPECT_EQ(1, EVT_fd_add(data.evt, fd, EVENT_FD_READ, file_reader, &data));
+   EVT_start_loop(data.evt);
+
+   EXPECT_EQ(2, data.count);
+   EVT_free_handler(data.evt);
+   close(fd);
+}
+
+struct ReuseData {
+   EVTHandler *evt;
+   int count;
+   int next[2];
+};
+
+int reuse_second(int fd, char type, void *arg) {
+   struct ReuseData *data = (struct ReuseData *)arg;
+   char buff[16];
+
+   EXPECT_EQ(1, read(fd, buff, sizeof(buff)));
+   data->count++;
+   EVT_exit_loop(data->evt);
+   return EVENT_REMOVE;
+}
+
+int reuse_first(int fd, char type, void *arg) {
+   struct ReuseData *data = (struct ReuseData *)arg;
+   char buff[16];
+
+   EXPECT_EQ(1, read(fd, buff, sizeof(buff)));
+   data->count++;
+   // Replace the descriptor under the same number and re-register it
+   EVT_fd_remove(data->evt, fd, EVENT_FD_READ);
+   EXPECT_EQ(fd, dup2(data->next[0], fd));
+   EXPECT_EQ(1, EVT_fd_add(data->evt, fd, EVENT_FD_READ, reuse_second,
+            data));
+   EXPECT_EQ(1, write(data->next[1], "y", 1));
+   return EVENT_REMOVE;
+}
+
+int reuse_timeout(void *arg) {
+   EVT_exit_loop((EVTHandler *)arg);
+   return EVENT_REMOVE;
+}
+
+// Test that a stale EVENT_REMOVE doesn't drop a re-registered descriptor
+static void run_reuse_test(enum EVTBackend backend) {
+   struct ReuseData data;
+   int fds[2];
+
+   ASSERT_EQ(0, pipe(fds));
+   ASSERT_EQ(0, pipe(data.next));
+   data.count = 0;
+   data.evt = EVT_create_handler_with_backend(NULL, NULL, backend);
+   ASSERT_TRUE(data.evt != NULL);
+
+   EXPECT_EQ(1, EVT_fd_add(data.evt, fds[0], EVENT_FD_READ, reuse_first,
+            &data));
+   EXPECT_EQ(1, write(fds[1], "x", 1));
+   EVT_sched_add(data.evt, EVT_ms2tv(1000), reuse_timeout, data.evt);
+   EVT_start_loop(data.evt);
+
+   EXPECT_EQ(2, data.count);
+   EVT_free_handler(data.evt);
+   close(fds[0]);
+   close(fds[1]);
+   close(data.next[0]);
+   close(data.next[1]);
+}
+
+TEST(TestEventBackends, ReRegisterInCallback) {
+   run_reuse_test(EVT_BACKEND_SELECT);
+   run_reuse_test(EVT_BACKEND_EPOLL);
+}
+
+// Test a rejected fd reports 0, so !EVT_fd_add() catches it
+TEST(TestEventBackends, BadFdReturnsZero) {
+   EVTHandler *evt;
+   int backend;
+
+   for (backend = EVT_BACKEND_SELECT; backend <= EVT_BACKEND_EPOLL;
+         backend++) {
+      evt = EVT_create_handler_with_backend(NULL, NULL,
+            (enum EVTBackend)backend);
+      ASSERT_TRUE(evt != NULL);
+      EXPECT_EQ(0, EVT_fd_add(evt, -1, EVENT_FD_READ, pipe_reader, NULL));
+      EXPECT_EQ(0, EVT_fd_add_with_cleanup(evt, -5, EVENT_FD_WRITE,
+               pipe_reader, NULL, NULL));
+      EVT_free_handler(evt);
+   }
+}
+
+int grow_reader(int fd, char type, void *arg) {
+   struct PipeData *data = (struct PipeData *)arg;
+   char buff[16];
+   int i;
+
+   EXPECT_EQ(1, read(fd, buff, sizeof(buff)));
+   data->count++;
+   // Registering high descriptors reallocates the fd table mid-callback
+   for (i = 0; i < 4; i++)
+      EXPECT_EQ(1, EVT_fd_add(data->evt, 200 + i * 100, EVENT_FD_READ,
+               pipe_reader, data));
+   for (i = 0; i < 4; i++)
+      EVT_fd_remove(data->evt, 200 + i * 100, EVENT_FD_READ);
+   EVT_exit_loop(data->evt);
+   return EVENT_REMOVE;
+}
+
+// Test that a callback can grow the fd table and still remove itself
+TEST(TestEventBackends, FdTableGrowInCallback) {
+   struct PipeData data;
+   int fds[2];
+
+   ASSERT_EQ(0, pipe(fds));
+   data.count = 0;
+   data.evt = EVT_create_handler_with_backend(NULL, NULL, EVT_BACKEND_SELECT);
+   ASSERT_TRUE(data.evt != NULL);
+
+   EXPECT_EQ(1, EVT_fd_add(data.evt, fds[0], EVENT_FD_READ, grow_reader,
+            &data));
+   EVT_sched_add(data.evt, EVT_ms2tv(10), pipe_writer, &fds[1]);
+   EVT_start_loop(data.evt);
+   EXPECT_EQ(1, data.count);
+
+   // The reader removed itself, so re-adding must register a fresh callback
+   EXPECT_EQ(1, EVT_fd_add(data.evt, fds[0], EVENT_FD_READ, pipe_reader,
+            &data));
+   EVT_free_handler(data.evt);
+   close(fds[0]);
+   close(fds[1]);
+}
+
+struct HookState {
+   int hooks, timers;
+   EVTHandler *evt;
+};
+
+void count_hook(void *arg) {
+   struct HookState *st = (struct HookState *)arg;
+
+   EXPECT_EQ(st->hooks < 3, EVT_loop_running(st->evt) != 0);
+   st->hooks++;
+}
+
+int hook_timer(void *arg) {
+   struct HookState *st = (struct HookState *)arg;
+
+   // The hook has run once before each block so far
+   EXPECT_EQ(st->timers + 1, st->hooks);
+   if (++st->timers == 3) {
+      EVT_exit_loop(st->evt);
+      return EVENT_REMOVE;
+   }
+   return EVENT_KEEP;
+}
+
+// Test that loop hooks run before each block and once on exit
+TEST(TestEventBackends, LoopHooks) {
+   struct HookState st;
+   void *hook;
+
+   memset(&st, 0, sizeof(st));
+   st.evt = EVT_create_handler(NULL, NULL);
+   ASSERT_TRUE(st.evt != NULL);
+
+   hook = EVT_loop_hook_add(st.evt, count_hook, &st);
+   ASSERT_TRUE(hook != NULL);
+   EVT_sched_add(st.evt, EVT_ms2tv(5), hook_timer, &st);
+   EXPECT_FALSE(EVT_loop_running(st.evt));
+   EVT_start_loop(st.evt);
+
+   EXPECT_EQ(3, st.timers);
+   EXPECT_EQ(4, st.hooks);
+   EXPECT_FALSE(EVT_loop_running(st.evt));
+   EVT_loop_hook_remove(st.evt, hook);
+   EVT_free_handler(st.evt);
+}
+
+struct OrderState {
+   int last;
+   int count;
+   int expected;
+   EVTHandler *evt;
+};
+
+struct OrderEvent {
+   int id;
+   struct OrderState *state;
+};
+
+int order_handler(void *arg) {
+   struct OrderEvent *data = (struct OrderEvent *)arg;
+   struct OrderState *state = data->state;
+
+   EXPECT_LT(state->last, data->id);
+   state->last = data->id;
+   if (++state->count == state->expected)
+      EVT_exit_loop(state->evt);
+   return EVENT_REMOVE;
+}
+
+// Test the timer wheel fires events in order and cancels in place
+TEST(TestEventScheduler, WheelOrderAndCancel) {
+   struct OrderState state;
+   struct OrderEvent data[200];
+   void *ids[200];
+   int i;
+
+   state.evt = EVT_create_handler(NULL, NULL);
+   ASSERT_TRUE(state.evt != NULL);
+   state.last = -1;
+   state.count = 0;
+   state.expected = 100;
+
+   // Schedule on the heap and migrate, to exercise EVT_set_scheduler
+   for (i = 0; i < 200; i++) {
+      if (i == 100) {
+         EXPECT_EQ(0, EVT_set_scheduler(state.evt, EVT_SCHED_WHEEL));
+         EXPECT_EQ(EVT_SCHED_WHEEL, EVT_get_scheduler(state.evt));
+      }
+      data[i].id = i;
+      data[i].state = &state;
+      ids[i] = EVT_sched_add(state.evt, EVT_ms2tv(5 + i * 7),
+            order_handler, &data[i]);
+   }
+
+   // Cancel every odd event
+   for (i = 1; i < 200; i += 2)
+      EXPECT_EQ(&data[i], EVT_sched_remove(state.evt, ids[i]));
+
+   EVT_start_loop(state.evt);
+   EXPECT_EQ(100, state.count);
+   EXPECT_EQ(198, state.last);
+
+   EVT_free_handler(state.evt);
+}
+
+#define POST_THREADS 4
+#define POST_COUNT 10000
+
+struct PostState {
+   EVTHandler *evt;
+   int last[POST_THREADS];
+   int count;
+};
+
+void post_exit(void *arg) {
+   EVT_exit_loop((EVTHandler *)arg);
+}
+
+void post_handler(void *arg, void *msg, size_t len) {
+   struct PostState *state = (struct PostState *)arg;
+   int val[2];
+
+   ASSERT_EQ(sizeof(val), len);
+   memcpy(val, msg, sizeof(val));
+   // Each thread's posts arrive in order
+   EXPECT_EQ(state->last[val[0]] + 1, val[1]);
+   state->last[val[0]] = val[1];
+   if (++state->count == POST_THREADS * POST_COUNT)
+      EVT_post(state->evt, post_exit, state->evt);
+}
+
+struct PostThread {
+   struct PostState *state;
+   int id;
+};
+
+void *post_thread(void *arg) {
+   struct PostThread *thread = (struct PostThread *)arg;
+   int val[2];
+   struct iovec iov[2] = { { &val[0], sizeof(val[0]) },
+      { &val[1], sizeof(val[1]) } };
+
+   val[0] = thread->id;
+   for (val[1] = 1; val[1] <= POST_COUNT; val[1]++)
+      EXPECT_EQ(0, EVT_post_msg(thread->state->evt, post_handler,
+               thread->state, iov, 2));
+   return NULL;
+}
+
+// Test callbacks posted from several threads all run on the loop thread
+TEST(TestEventPost, MultipleProducers) {
+   struct PostState state;
+   struct PostThread args[POST_THREADS];
+   pthread_t threads[POST_THREADS];
+   int i;
+
+   memset(&state, 0, sizeof(state));
+   state.evt = EVT_create_handler(NULL, NULL);
+   ASSERT_TRUE(state.evt != NULL);
+
+   for (i = 0; i < POST_THREADS; i++) {
+      args[i].state = &state;
+      args[i].id = i;
+      ASSERT_EQ(0, pthread_create(&threads[i], NULL, post_thread, &args[i]));
+   }
+
+   EVT_start_loop(state.evt);
+   for (i = 0; i < POST_THREADS; i++)
+      pthread_join(threads[i], NULL);
+   EXPECT_EQ(POST_THREADS * POST_COUNT, state.count);
+
+   EVT_free_handler(state.evt);
+}
+
+}
@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include "../../ipc.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+struct ParseState {
+   size_t next;
+   size_t calls;
+};
+
+// Consumes one 4-byte big-endian counter per call
+static size_t parse_counter(const char *data, size_t len, void *arg)
+{
+   struct ParseState *state = (struct ParseState*)arg;
+   uint32_t val;
+
+   state->calls++;
+   if (len < sizeof(val))
+      return 0;
+   memcpy(&val, data, sizeof(val));
+   EXPECT_EQ(state->next, ntohl(val));
+   state->next++;
+   return sizeof(val);
+}
+
+static void count_free(void *data, void *arg)
+{
+   (*(int*)arg)++;
+}
+
+TEST(TestIPCBuffer, ProcessAcrossChunks) {
+   struct IPCBuffer *buff = ipc_alloc_buffer();
+   struct ParseState state = { 0, 0 };
+   uint32_t val;
+   size_t i;
+
+   ASSERT_TRUE(buff != NULL);
+
+   // Append in odd-sized pieces so values straddle chunk boundaries
+   for (i = 0; i < 10000; i++) {
+      val = htonl(i);
+      ipc_append_buffer(buff, &val, 3);
+      ipc_append_buffer(buff, ((char*)&val) + 3, 1);
+      if (i % 777 == 0)
+         ipc_process_buffer(buff, parse_counter, &state);
+   }
+   ipc_process_buffer(buff, parse_counter, &state);
+
+   EXPECT_EQ(10000u, state.next);
+   EXPECT_EQ(0u, ipc_buffer_size(buff));
+
+   ipc_destroy_buffer(&buff);
+   EXPECT_TRUE(buff == NULL);
+}
+
+TEST(TestIPCBuffer, ZeroCopyAppend) {
+   struct IPCBuffer *buff = ipc_alloc_buffer();
+   static const char ext[] = "borrowed";
+   struct iovec iov[4];
+   char out[64];
+   int frees = 0, fds[2], cnt;
+
+   ASSERT_TRUE(buff != NULL);
+   ASSERT_EQ(0, pipe(fds));
+
+   ipc_printf_buffer(buff, "head-%d-", 1);
+   EXPECT_EQ(8, ipc_append_buffer_ref(buff, ext, 8, count_free, &frees));
+   ipc_append_buffer(buff, "-tail", 5);
+   EXPECT_EQ(20u, ipc_buffer_size(buff));
+
+   cnt = ipc_buffer_iov(buff, 0, iov, 4);
+   EXPECT_EQ(3, cnt);
+   EXPECT_TRUE(iov[1].iov_base == ext);
+
+   // Consuming part of the borrowed chunk must not release it
+   ipc_consume_buffer(buff, 10);
+   EXPECT_EQ(0, frees);
+   EXPECT_EQ(10, ipc_writev_buffer(fds[1], buff));
+   EXPECT_EQ(1, frees);
+   EXPECT_EQ(0u, ipc_buffer_size(buff));
+
+   EXPECT_EQ(10, read(fds[0], out, sizeof(out)));
+   EXPECT_EQ(0, memcmp(out, "rowed-tail", 10));
+
+   ipc_append_buffer_ref(buff, ext, 8, count_free, &frees);
+   ipc_destroy_buffer(&buff);
+   EXPECT_EQ(2, frees);
+
+   close(fds[0]);
+   close(fds[1]);
+}
+
+static void write_services(const char *path, const char *contents)
+{
+   FILE *file = fopen(path, "w");
+
+   ASSERT_TRUE(file != NULL);
+   fputs(contents, file);
+   fclose(file);
+}
+
+static int port_to_name(int port, char *buff, size_t len)
+{
+   struct sockaddr_in addr;
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons(port);
+   return socket_get_name_by_addr(&addr, buff, len);
+}
+
+// Test the service cache follows its file, both on demand and by itself
+TEST(TestServiceCache, Invalidation) {
+   char path[] = "/tmp/libproc-servicesXXXXXX";
+   const char *names[] = { "svc-one", "svc-alias", "svc-tcp", "nope" };
+   int ports[4], fd, i;
+   char name[32];
+
+   fd = mkstemp(path);
+   ASSERT_GE(fd, 0);
+   close(fd);
+   write_services(path,
+         "svc-one 41000/udp svc-alias # comment\n"
+         "svc-tcp 41001/tcp\n"
+         "svc-dup 41002/udp\n"
+         "svc-dup 41003/udp\n"
+         "test1 41004/udp\n");
+   ASSERT_EQ(0, socket_service_cache_set_file(path));
+
+   EXPECT_EQ(41000, socket_get_addr_by_name("svc-one"));
+   EXPECT_EQ(41000, socket_get_addr_by_name("svc-alias"));
+   EXPECT_EQ(-1, socket_get_addr_by_name("svc-tcp"));
+   EXPECT_EQ(41002, socket_get_addr_by_name("svc-dup"));
+   EXPECT_EQ(7, port_to_name(41000, name, sizeof(name)));
+   EXPECT_STREQ("svc-one", name);
+
+   // The file wins, but multicast groups still come from the internal list
+   EXPECT_EQ(41004, socket_get_addr_by_name("test1"));
+   EXPECT_EQ(52003, socket_multicast_port_by_name("test1"));
+   EXPECT_EQ(52004, socket_get_addr_by_name("test2"));
+
+   EXPECT_EQ(2, socket_get_addrs_by_name(names, ports, 4));
+   EXPECT_EQ(41000, ports[0]);
+   EXPECT_EQ(41000, ports[1]);
+   EXPECT_EQ(-1, ports[2]);
+   EXPECT_EQ(-1, ports[3]);
+
+   // An explicit invalidation is seen on the very next lookup
+   write_services(path, "svc-one 41010/udp\n");
+   socket_service_cache_invalidate();
+   EXPECT_EQ(41010, socket_get_addr_by_name("svc-one"));
+   EXPECT_EQ(-1, socket_get_addr_by_name("svc-alias"));
+   EXPECT_EQ(-1, port_to_name(41000, name, sizeof(name)));
+   EXPECT_EQ(52003, socket_get_addr_by_name("test1"));
+
+   // Without one, the change is picked up within a couple of seconds
+   write_services(path, "svc-one 41020/udp\nsvc-new 41021/udp\n");
+   for (i = 0; i < 30 && socket_get_addr_by_name("svc-one") != 41020; i++)
+      usleep(100000);
+   EXPECT_EQ(41020, socket_get_addr_by_name("svc-one"));
+   EXPECT_EQ(41021, socket_get_addr_by_name("svc-new"));
+
+   EXPECT_EQ(0, socket_service_cache_set_file(NULL));
+   unlink(path);
+   EXPECT_EQ(52004, socket_get_addr_by_name("test2"));
+}
+
+}
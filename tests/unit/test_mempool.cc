@@ -0,0 +1,143 @@
+#include <string.h>
+#include <stdint.h>
+#include "../../memPool.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+#define POOL_RECORDS 10
+
+// Test records come from slabs, stay aligned and are recycled LIFO
+TEST(TestMemPool, RecyclesRecords) {
+   struct MemPool *pool = MPOOL_create(24, 4);
+   struct MemPoolStats stats;
+   unsigned char *recs[POOL_RECORDS];
+   int i, j;
+
+   ASSERT_TRUE(pool != NULL);
+   for (i = 0; i < POOL_RECORDS; i++) {
+      recs[i] = (unsigned char*)MPOOL_alloc(pool);
+      ASSERT_TRUE(recs[i] != NULL);
+      EXPECT_EQ(0u, (uintptr_t)recs[i] % 16);
+      memset(recs[i], i, 24);
+   }
+
+   // Filling each record in full must not have touched any other
+   for (i = 0; i < POOL_RECORDS; i++)
+      for (j = 0; j < 24; j++)
+         ASSERT_EQ(i, recs[i][j]);
+
+   MPOOL_get_stats(pool, &stats);
+   EXPECT_EQ(3u, stats.slabs);
+   EXPECT_EQ((size_t)POOL_RECORDS, stats.live);
+   EXPECT_EQ((size_t)POOL_RECORDS, stats.peak);
+   EXPECT_EQ(2u, stats.free);
+
+   for (i = 0; i < 5; i++)
+      MPOOL_release(pool, recs[i]);
+   MPOOL_release(pool, NULL);
+   MPOOL_get_stats(pool, &stats);
+   EXPECT_EQ(5u, stats.live);
+   EXPECT_EQ(7u, stats.free);
+
+   for (i = 4; i >= 0; i--)
+      EXPECT_EQ(recs[i], MPOOL_alloc(pool));
+   MPOOL_get_stats(pool, &stats);
+   EXPECT_EQ(3u, stats.slabs);
+   EXPECT_EQ((size_t)POOL_RECORDS, stats.peak);
+
+   MPOOL_free_pool(pool);
+}
+
+// Test records smaller than a free list link are padded out
+TEST(TestMemPool, TinyRecords) {
+   struct MemPool *pool = MPOOL_create(1, 8);
+   char *a, *b;
+
+   ASSERT_TRUE(pool != NULL);
+   a = (char*)MPOOL_alloc(pool);
+   b = (char*)MPOOL_alloc(pool);
+   ASSERT_TRUE(a && b);
+   EXPECT_LE((ptrdiff_t)sizeof(void*), b - a);
+
+   MPOOL_release(pool, a);
+   MPOOL_release(pool, b);
+   MPOOL_free_pool(pool);
+}
+
+TEST(TestMemPool, RejectsEmptySizes) {
+   EXPECT_TRUE(MPOOL_create(0, 4) == NULL);
+   EXPECT_TRUE(MPOOL_create(8, 0) == NULL);
+   EXPECT_TRUE(MPOOL_arena_create(0) == NULL);
+}
+
+// Test arena allocations are aligned, owned and released together
+TEST(TestMemArena, AllocAndReset) {
+   struct MemArena *arena = MPOOL_arena_create(256);
+   struct MemArenaStats stats;
+   unsigned char *ptrs[40];
+   size_t i, j;
+
+   ASSERT_TRUE(arena != NULL);
+   for (i = 0; i < 40; i++) {
+      ptrs[i] = (unsigned char*)MPOOL_arena_alloc(arena, i + 1);
+      ASSERT_TRUE(ptrs[i] != NULL);
+      EXPECT_EQ(0u, (uintptr_t)ptrs[i] % 16);
+      memset(ptrs[i], (int)i, i + 1);
+   }
+   for (i = 0; i < 40; i++) {
+      EXPECT_TRUE(MPOOL_arena_owns(arena, ptrs[i]));
+      for (j = 0; j <= i; j++)
+         ASSERT_EQ(i, ptrs[i][j]);
+   }
+
+   MPOOL_arena_get_stats(arena, &stats);
+   EXPECT_LT(1u, stats.chunks);
+   EXPECT_EQ(0u, stats.used % 16);
+   EXPECT_EQ(stats.used, stats.peak);
+
+   MPOOL_arena_reset(arena);
+   MPOOL_arena_get_stats(arena, &stats);
+   EXPECT_EQ(1u, stats.chunks);
+   EXPECT_EQ(0u, stats.used);
+   EXPECT_EQ(1u, stats.resets);
+   for (i = 0; i < 40; i++)
+      EXPECT_FALSE(MPOOL_arena_owns(arena, ptrs[i]));
+
+   // The kept chunk serves the next round
+   EXPECT_TRUE(MPOOL_arena_alloc(arena, 16) != NULL);
+   MPOOL_arena_get_stats(arena, &stats);
+   EXPECT_EQ(1u, stats.chunks);
+
+   MPOOL_arena_free(arena);
+}
+
+// Test a request larger than a chunk gets a chunk of its own
+TEST(TestMemArena, Oversized) {
+   struct MemArena *arena = MPOOL_arena_create(256);
+   struct MemArenaStats stats;
+   char *small, *big;
+
+   ASSERT_TRUE(arena != NULL);
+   small = (char*)MPOOL_arena_alloc(arena, 8);
+   big = (char*)MPOOL_arena_alloc(arena, 1000);
+   ASSERT_TRUE(small && big);
+   memset(big, 1, 1000);
+   EXPECT_TRUE(MPOOL_arena_owns(arena, big + 999));
+   EXPECT_FALSE(MPOOL_arena_owns(arena, small + 16));
+
+   MPOOL_arena_get_stats(arena, &stats);
+   EXPECT_EQ(2u, stats.chunks);
+   EXPECT_EQ(16u + 1008u, stats.used);
+
+   // Rounding these up would wrap around to a tiny allocation
+   EXPECT_TRUE(MPOOL_arena_alloc(arena, (size_t)-2) == NULL);
+   EXPECT_TRUE(MPOOL_arena_alloc(arena, SIZE_MAX - 8) == NULL);
+   MPOOL_arena_get_stats(arena, &stats);
+   EXPECT_EQ(2u, stats.chunks);
+   EXPECT_EQ(16u + 1008u, stats.used);
+
+   MPOOL_arena_free(arena);
+}
+
+}
@@ -0,0 +1,863 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include "../../events.h"
+#include "../../proclib.h"
+#include "gtest/gtest.h"
+
+// Loopback UDP sockets never fill up, since the kernel hands each datagram
+//  straight to the receiver, so sends on blockedFd fail with EAGAIN here
+static int blockedFd = -1;
+static int blockedSends;
+
+extern "C" ssize_t sendto(int fd, const void *buf, size_t len, int flags,
+      const struct sockaddr *addr, socklen_t addrLen)
+{
+   static ssize_t (*real)(int, const void *, size_t, int,
+         const struct sockaddr *, socklen_t);
+
+   if (fd >= 0 && fd == __atomic_load_n(&blockedFd, __ATOMIC_SEQ_CST)) {
+      __atomic_add_fetch(&blockedSends, 1, __ATOMIC_SEQ_CST);
+      errno = EAGAIN;
+      return -1;
+   }
+   if (!real)
+      real = (ssize_t (*)(int, const void *, size_t, int,
+               const struct sockaddr *, socklen_t))dlsym(RTLD_NEXT, "sendto");
+   return real(fd, buf, len, flags, addr, addrLen);
+}
+
+extern "C" int sendmmsg(int fd, struct mmsghdr *msgs, unsigned int cnt,
+      int flags)
+{
+   static int (*real)(int, struct mmsghdr *, unsigned int, int);
+
+   if (fd >= 0 && fd == __atomic_load_n(&blockedFd, __ATOMIC_SEQ_CST)) {
+      __atomic_add_fetch(&blockedSends, 1, __ATOMIC_SEQ_CST);
+      errno = EAGAIN;
+      return -1;
+   }
+   if (!real)
+      real = (int (*)(int, struct mmsghdr *, unsigned int, int))
+         dlsym(RTLD_NEXT, "sendmmsg");
+   return real(fd, msgs, cnt, flags);
+}
+
+namespace {
+
+#define WQ_BUFFERS 16
+#define WQ_BUFFER_LEN 50000
+#define WQ_TOTAL (WQ_BUFFERS * WQ_BUFFER_LEN)
+#define WQ_READ_CHUNK 3000
+
+struct WriteState {
+   ProcessData *proc;
+   int fds[2];
+   size_t received;
+   int bad;
+   int events[8];
+   int eventCnt;
+   size_t queuedAtEvent[8];
+};
+
+static unsigned char wq_byte(size_t offset)
+{
+   return (unsigned char)(offset % 251);
+}
+
+// Reads a little at a time so the writer keeps hitting a full socket and
+//  has to resume partway through a buffer
+static int wq_reader(int fd, char type, void *arg)
+{
+   struct WriteState *state = (struct WriteState*)arg;
+   unsigned char buff[WQ_READ_CHUNK];
+   ssize_t len, i;
+
+   len = read(fd, buff, sizeof(buff));
+   for (i = 0; i < len; i++)
+      if (buff[i] != wq_byte(state->received + i))
+         state->bad++;
+   if (len > 0)
+      state->received += len;
+
+   if (state->received >= WQ_TOTAL)
+      EVT_exit_loop(PROC_evt(state->proc));
+
+   return EVENT_KEEP;
+}
+
+static void wq_watermark(ProcessData *proc, int fd, int above, void *arg)
+{
+   struct WriteState *state = (struct WriteState*)arg;
+
+   EXPECT_EQ(state->fds[1], fd);
+   if (state->eventCnt < 8) {
+      state->queuedAtEvent[state->eventCnt] = PROC_write_queued(proc, fd);
+      state->events[state->eventCnt] = above;
+   }
+   state->eventCnt++;
+}
+
+static int wq_timeout(void *arg)
+{
+   EVT_exit_loop((EVTHandler*)arg);
+   return EVENT_REMOVE;
+}
+
+static void wq_setup(struct WriteState *state)
+{
+   memset(state, 0, sizeof(*state));
+   state->proc = PROC_init_xdr("test2", WD_DISABLED, NULL);
+   ASSERT_TRUE(state->proc != NULL);
+   ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, state->fds));
+   fcntl(state->fds[1], F_SETFL, fcntl(state->fds[1], F_GETFL) | O_NONBLOCK);
+   EVT_fd_add(PROC_evt(state->proc), state->fds[0], EVENT_FD_READ,
+         &wq_reader, state);
+   EVT_sched_add(PROC_evt(state->proc), EVT_ms2tv(5000), &wq_timeout,
+         PROC_evt(state->proc));
+}
+
+static void wq_queue_all(struct WriteState *state)
+{
+   unsigned char buff[WQ_BUFFER_LEN];
+   size_t off = 0;
+   int i, j;
+
+   for (i = 0; i < WQ_BUFFERS; i++) {
+      for (j = 0; j < WQ_BUFFER_LEN; j++, off++)
+         buff[j] = wq_byte(off);
+      ASSERT_EQ(0, PROC_nonblocking_write(state->proc, state->fds[1], buff,
+               WQ_BUFFER_LEN, COPY_DATA_TO_WRITE));
+   }
+}
+
+static void wq_teardown(struct WriteState *state)
+{
+   EVT_fd_remove(PROC_evt(state->proc), state->fds[0], EVENT_FD_READ);
+   PROC_cleanup(state->proc);
+   close(state->fds[0]);
+   close(state->fds[1]);
+}
+
+// Test data queued faster than the fd drains arrives whole and in order
+TEST(TestWriteQueue, PartialWritesResume) {
+   struct WriteState state;
+
+   wq_setup(&state);
+   wq_queue_all(&state);
+   EXPECT_EQ((size_t)WQ_TOTAL, PROC_write_queued(state.proc, state.fds[1]));
+
+   EVT_start_loop(PROC_evt(state.proc));
+
+   EXPECT_EQ((size_t)WQ_TOTAL, state.received);
+   EXPECT_EQ(0, state.bad);
+   EXPECT_EQ(0u, PROC_write_queued(state.proc, state.fds[1]));
+   wq_teardown(&state);
+}
+
+// Test the watermark callback fires once going up and once coming down
+TEST(TestWriteQueue, Watermarks) {
+   struct WriteState state;
+
+   wq_setup(&state);
+   EXPECT_EQ(-1, PROC_set_write_watermarks(state.proc, state.fds[1],
+            1000, 2000, &wq_watermark, &state));
+   ASSERT_EQ(0, PROC_set_write_watermarks(state.proc, state.fds[1],
+            4 * WQ_BUFFER_LEN, WQ_BUFFER_LEN, &wq_watermark, &state));
+   wq_queue_all(&state);
+
+   ASSERT_EQ(1, state.eventCnt);
+   EXPECT_EQ(1, state.events[0]);
+   EXPECT_EQ((size_t)4 * WQ_BUFFER_LEN, state.queuedAtEvent[0]);
+
+   EVT_start_loop(PROC_evt(state.proc));
+
+   EXPECT_EQ((size_t)WQ_TOTAL, state.received);
+   EXPECT_EQ(0, state.bad);
+   ASSERT_EQ(2, state.eventCnt);
+   EXPECT_EQ(0, state.events[1]);
+   EXPECT_GE((size_t)WQ_BUFFER_LEN, state.queuedAtEvent[1]);
+
+   EXPECT_EQ(0, PROC_set_write_watermarks(state.proc, state.fds[1], 0, 0,
+            NULL, NULL));
+   wq_teardown(&state);
+}
+
+
+#define PASS_LINES 200000
+#define PASS_STALL_MS 300
+
+struct PassState {
+   ProcessData *proc;
+   ProcChild *child;
+   int fds[2];
+   char *expect;
+   size_t total;
+   size_t received;
+   int bad;
+   int exited;
+   char mode;              // Passthrough mode the child finished in
+   struct timeval cpuAtStall;
+   long stallCpuMs;
+};
+
+// Builds the output of seq 1 PASS_LINES
+static void pass_expect(struct PassState *state)
+{
+   size_t off = 0;
+   int i;
+
+   state->expect = (char*)malloc(PASS_LINES * 8);
+   for (i = 1; i <= PASS_LINES; i++)
+      off += sprintf(state->expect + off, "%d\n", i);
+   state->total = off;
+}
+
+static void pass_check_done(struct PassState *state)
+{
+   if (state->exited && state->received >= state->total)
+      EVT_exit_loop(PROC_evt(state->proc));
+}
+
+static void pass_compare(struct PassState *state, const char *buff,
+      ssize_t len)
+{
+   if (len <= 0)
+      return;
+   if (state->received + len > state->total ||
+         memcmp(state->expect + state->received, buff, len))
+      state->bad++;
+   state->received += len;
+}
+
+static int pass_reader(int fd, char type, void *arg)
+{
+   struct PassState *state = (struct PassState*)arg;
+   char buff[8192];
+
+   pass_compare(state, buff, read(fd, buff, sizeof(buff)));
+   pass_check_done(state);
+
+   return EVENT_KEEP;
+}
+
+static void pass_death(ProcChild *child, void *arg)
+{
+   struct PassState *state = (struct PassState*)arg;
+
+   state->mode = child->stream[0].passthrough;
+   state->exited = 1;
+   pass_check_done(state);
+}
+
+static long pass_cpu_ms(void)
+{
+   struct rusage usage;
+
+   getrusage(RUSAGE_SELF, &usage);
+   return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000 +
+      (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000;
+}
+
+// Starts draining the destination once the stall is over
+static int pass_unstall(void *arg)
+{
+   struct PassState *state = (struct PassState*)arg;
+
+   state->stallCpuMs = pass_cpu_ms() - state->stallCpuMs;
+   EVT_fd_add(PROC_evt(state->proc), state->fds[0], EVENT_FD_READ,
+         &pass_reader, state);
+   return EVENT_REMOVE;
+}
+
+/* Forwards seq's output into a non-blocking socket.  With stall set, the
+ * socket isn't read for PASS_STALL_MS, so it fills and the passthrough has
+ * to wait for it.
+ */
+static void pass_run(struct PassState *state, int stall, char forceMode)
+{
+   memset(state, 0, sizeof(*state));
+   pass_expect(state);
+   state->proc = PROC_init_xdr("test2", WD_DISABLED, NULL);
+   ASSERT_TRUE(state->proc != NULL);
+   ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, state->fds));
+   fcntl(state->fds[1], F_SETFL, fcntl(state->fds[1], F_GETFL) | O_NONBLOCK);
+
+   state->child = PROC_fork_child(state->proc, "seq 1 %d", PASS_LINES);
+   ASSERT_TRUE(state->child != NULL);
+   CHLD_death_notice(state->child, &pass_death, state);
+   CHLD_close_stdin(state->child);
+   CHLD_ignore_stderr(state->child);
+   ASSERT_TRUE(CHLD_stdout_splice(state->child, state->fds[1]));
+   if (forceMode)
+      state->child->stream[0].passthrough = forceMode;
+
+   if (stall) {
+      state->stallCpuMs = pass_cpu_ms();
+      EVT_sched_add(PROC_evt(state->proc), EVT_ms2tv(PASS_STALL_MS),
+            &pass_unstall, state);
+   }
+   else
+      EVT_fd_add(PROC_evt(state->proc), state->fds[0], EVENT_FD_READ,
+            &pass_reader, state);
+   EVT_sched_add(PROC_evt(state->proc), EVT_ms2tv(10000), &wq_timeout,
+         PROC_evt(state->proc));
+   EVT_start_loop(PROC_evt(state->proc));
+
+   EXPECT_TRUE(state->exited);
+   EXPECT_EQ(state->total, state->received);
+   EXPECT_EQ(0, state->bad);
+
+   EVT_fd_remove(PROC_evt(state->proc), state->fds[0], EVENT_FD_READ);
+   PROC_cleanup(state->proc);
+   close(state->fds[0]);
+   close(state->fds[1]);
+   free(state->expect);
+}
+
+// Test child output spliced into a socket arrives whole and in order
+TEST(TestPassthrough, Splice) {
+   struct PassState state;
+
+   pass_run(&state, 0, 0);
+#ifdef __linux__
+   EXPECT_EQ(CHLD_PASSTHROUGH_SPLICE, state.mode);
+#endif
+}
+
+// Test a destination that can't be spliced to falls back to copying
+TEST(TestPassthrough, CopyFallback) {
+   char path[] = "/tmp/libproc-passXXXXXX";
+   struct PassState state;
+   ProcessData *proc;
+   ProcChild *child;
+   char *got;
+   int fd;
+
+   memset(&state, 0, sizeof(state));
+   pass_expect(&state);
+   fd = mkstemp(path);
+   ASSERT_GE(fd, 0);
+   close(fd);
+   unlink(path);
+   fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0600);
+   ASSERT_GE(fd, 0);
+   unlink(path);
+
+   proc = state.proc = PROC_init_xdr("test2", WD_DISABLED, NULL);
+   ASSERT_TRUE(proc != NULL);
+   child = PROC_fork_child(proc, "seq 1 %d", PASS_LINES);
+   ASSERT_TRUE(child != NULL);
+   CHLD_death_notice(child, &pass_death, &state);
+   CHLD_close_stdin(child);
+   CHLD_ignore_stderr(child);
+   ASSERT_TRUE(CHLD_stdout_splice(child, fd));
+   state.received = state.total;
+   EVT_sched_add(PROC_evt(proc), EVT_ms2tv(10000), &wq_timeout,
+         PROC_evt(proc));
+   EVT_start_loop(PROC_evt(proc));
+   PROC_cleanup(proc);
+
+   EXPECT_TRUE(state.exited);
+   EXPECT_EQ(CHLD_PASSTHROUGH_COPY, state.mode);
+   got = (char*)malloc(state.total + 1);
+   EXPECT_EQ((ssize_t)state.total, pread(fd, got, state.total + 1, 0));
+   EXPECT_EQ(0, memcmp(state.expect, got, state.total));
+
+   free(got);
+   free(state.expect);
+   close(fd);
+}
+
+// Test a stalled consumer pauses the splice rather than spinning the loop
+TEST(TestPassthrough, SlowConsumerSplice) {
+   struct PassState state;
+
+   pass_run(&state, 1, 0);
+   EXPECT_GT(PASS_STALL_MS / 3, state.stallCpuMs);
+}
+
+// Test a stalled consumer keeps the bytes a short write left behind
+TEST(TestPassthrough, SlowConsumerCopy) {
+   struct PassState state;
+
+   pass_run(&state, 1, CHLD_PASSTHROUGH_COPY);
+   EXPECT_GT(PASS_STALL_MS / 3, state.stallCpuMs);
+   EXPECT_EQ(CHLD_PASSTHROUGH_COPY, state.mode);
+}
+
+// Keeps every buffer, which only works if it came from malloc
+static int read_steal(ProcChild *child, int lastchance, void *arg,
+      char *buff, int len)
+{
+   struct PassState *state = (struct PassState*)arg;
+
+   pass_compare(state, buff, len);
+   free(buff);
+   return CHILD_BUFF_STEAL_BUFF;
+}
+
+// Consumes whole lines, leaving a partial one to be presented again
+static int read_lines(ProcChild *child, int lastchance, void *arg,
+      char *buff, int len)
+{
+   struct PassState *state = (struct PassState*)arg;
+   int used = len;
+
+   while (used > 0 && buff[used - 1] != '\n')
+      used--;
+   pass_compare(state, buff, used);
+   if (lastchance == CHILD_BUFF_CLOSING && used < len) {
+      state->bad++;
+      return CHILD_BUFF_CONSUME_ALL;
+   }
+   return used;
+}
+
+static void read_run(struct PassState *state, char view)
+{
+   memset(state, 0, sizeof(*state));
+   pass_expect(state);
+   state->proc = PROC_init_xdr("test2", WD_DISABLED, NULL);
+   ASSERT_TRUE(state->proc != NULL);
+
+   state->child = PROC_fork_child(state->proc, "seq 1 %d", PASS_LINES);
+   ASSERT_TRUE(state->child != NULL);
+   CHLD_death_notice(state->child, &pass_death, state);
+   CHLD_close_stdin(state->child);
+   CHLD_ignore_stderr(state->child);
+   if (view)
+      ASSERT_TRUE(CHLD_stdout_view_reader(state->child, &read_lines, state));
+   else
+      ASSERT_TRUE(CHLD_stdout_reader(state->child, &read_steal, state));
+   EVT_sched_add(PROC_evt(state->proc), EVT_ms2tv(10000), &wq_timeout,
+         PROC_evt(state->proc));
+   EVT_start_loop(PROC_evt(state->proc));
+
+   EXPECT_TRUE(state->exited);
+   EXPECT_EQ(state->total, state->received);
+   EXPECT_EQ(0, state->bad);
+
+   PROC_cleanup(state->proc);
+   free(state->expect);
+}
+
+// Test readers registered the old way can still steal their buffers
+TEST(TestChildReader, StealBuffer) {
+   struct PassState state;
+
+   read_run(&state, 0);
+}
+
+// Test view readers see partial lines again once the rest arrives
+TEST(TestChildReader, View) {
+   struct PassState state;
+
+   read_run(&state, 1);
+}
+
+
+struct SigState {
+   ProcessData *proc;
+   pthread_t mainThread;
+   int usr1, usr2;
+   int offThread;
+};
+
+static int sig_cb(int signum, void *arg)
+{
+   struct SigState *state = (struct SigState*)arg;
+
+   if (!pthread_equal(pthread_self(), state->mainThread))
+      state->offThread++;
+   if (signum == SIGUSR1)
+      state->usr1++;
+   else if (signum == SIGUSR2)
+      state->usr2++;
+
+   if (state->usr1 && state->usr2)
+      EVT_exit_loop(PROC_evt(state->proc));
+   return EVENT_KEEP;
+}
+
+static int sig_raise(void *arg)
+{
+   raise(SIGUSR1);
+   raise(SIGUSR2);
+   return EVENT_REMOVE;
+}
+
+// Test signals reach their handlers from the event loop, one per handler
+TEST(TestProcSignals, Delivered) {
+   struct SigState state;
+
+   memset(&state, 0, sizeof(state));
+   state.mainThread = pthread_self();
+   state.proc = PROC_init_xdr("test2", WD_DISABLED, NULL);
+   ASSERT_TRUE(state.proc != NULL);
+   ASSERT_EQ(0, PROC_signal(state.proc, SIGUSR1, &sig_cb, &state));
+   ASSERT_EQ(0, PROC_signal(state.proc, SIGUSR2, &sig_cb, &state));
+
+   EVT_sched_add(PROC_evt(state.proc), EVT_ms2tv(0), &sig_raise, NULL);
+   EVT_sched_add(PROC_evt(state.proc), EVT_ms2tv(2000), &wq_timeout,
+         PROC_evt(state.proc));
+   EVT_start_loop(PROC_evt(state.proc));
+   PROC_cleanup(state.proc);
+
+   EXPECT_EQ(1, state.usr1);
+   EXPECT_EQ(1, state.usr2);
+   EXPECT_EQ(0, state.offThread);
+}
+
+#define TXQ_CMD 0x7e
+#define TXQ_COUNT 15
+#define TXQ_WORKER_COUNT 2000
+
+struct TxqMsg {
+   uint32_t src;
+   uint32_t seq;
+};
+
+struct TxqState {
+   ProcessData *proc;
+   int fd;
+   struct sockaddr_in dest;
+   uint32_t next[2];
+   int bad;
+   int reads;
+   int expected;
+   int atFlush;
+   int beforeUnblock;
+   int workerBad;
+   uint32_t loopSeq;
+   pthread_t worker;
+};
+
+static int txq_send(struct TxqState *state, uint32_t src, uint32_t seq)
+{
+   struct TxqMsg msg;
+
+   msg.src = src;
+   msg.seq = seq;
+   return PROC_cmd_sockaddr(state->proc, TXQ_CMD, &msg, sizeof(msg),
+         &state->dest);
+}
+
+// Reads everything waiting on the receiving socket, checking each source's
+//  datagrams arrive in order
+static int txq_drain(struct TxqState *state)
+{
+   unsigned char buff[64];
+   struct TxqMsg msg;
+   ssize_t len;
+   int cnt = 0;
+
+   while ((len = recv(state->fd, buff, sizeof(buff), 0)) > 0) {
+      memcpy(&msg, buff + 1, sizeof(msg));
+      if (len != 1 + (ssize_t)sizeof(msg) || buff[0] != TXQ_CMD ||
+            msg.src > 1 || msg.seq != state->next[msg.src])
+         state->bad++;
+      else
+         state->next[msg.src]++;
+      cnt++;
+   }
+
+   return cnt;
+}
+
+static int txq_reader(int fd, char type, void *arg)
+{
+   struct TxqState *state = (struct TxqState*)arg;
+
+   state->reads++;
+   txq_drain(state);
+   if ((int)(state->next[0] + state->next[1]) >= state->expected)
+      EVT_exit_loop(PROC_evt(state->proc));
+
+   return EVENT_KEEP;
+}
+
+static void txq_setup(struct TxqState *state, int expected)
+{
+   socklen_t len = sizeof(state->dest);
+
+   memset(state, 0, sizeof(*state));
+   state->expected = expected;
+   state->proc = PROC_init_xdr("test2", WD_DISABLED, NULL);
+   ASSERT_TRUE(state->proc != NULL);
+
+   state->fd = socket(AF_INET, SOCK_DGRAM, 0);
+   ASSERT_LE(0, state->fd);
+   state->dest.sin_family = AF_INET;
+   state->dest.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   ASSERT_EQ(0, bind(state->fd, (struct sockaddr*)&state->dest, len));
+   ASSERT_EQ(0, getsockname(state->fd, (struct sockaddr*)&state->dest, &len));
+   fcntl(state->fd, F_SETFL, fcntl(state->fd, F_GETFL) | O_NONBLOCK);
+
+   EVT_sched_add(PROC_evt(state->proc), EVT_ms2tv(5000), &wq_timeout,
+         PROC_evt(state->proc));
+}
+
+static void txq_teardown(struct TxqState *state)
+{
+   __atomic_store_n(&blockedFd, -1, __ATOMIC_SEQ_CST);
+   EVT_fd_remove(PROC_evt(state->proc), state->fd, EVENT_FD_READ);
+   PROC_cleanup(state->proc);
+   close(state->fd);
+}
+
+static int txq_queue_burst(void *arg)
+{
+   struct TxqState *state = (struct TxqState*)arg;
+   int i;
+
+   for (i = 0; i < TXQ_COUNT; i++)
+      EXPECT_EQ(1 + (int)sizeof(struct TxqMsg), txq_send(state, 0, i));
+
+   // Nothing leaves until the loop iteration ends
+   EXPECT_EQ(0, txq_drain(state));
+   EVT_fd_add(PROC_evt(state->proc), state->fd, EVENT_FD_READ, &txq_reader,
+         state);
+
+   return EVENT_REMOVE;
+}
+
+// Test datagrams queued by a callback all go out, in order, when it returns
+TEST(TestTxQueue, QueuedUntilIterationEnds) {
+   struct TxqState state;
+
+   txq_setup(&state, TXQ_COUNT);
+   EVT_sched_add(PROC_evt(state.proc), EVT_ms2tv(0), &txq_queue_burst,
+         &state);
+   EVT_start_loop(PROC_evt(state.proc));
+
+   EXPECT_EQ((uint32_t)TXQ_COUNT, state.next[0]);
+   EXPECT_EQ(0, state.bad);
+   // One flush delivered the whole burst before the reader first ran
+   EXPECT_EQ(1, state.reads);
+   txq_teardown(&state);
+}
+
+static int txq_flush_now(void *arg)
+{
+   struct TxqState *state = (struct TxqState*)arg;
+   int i;
+
+   for (i = 0; i < 3; i++)
+      txq_send(state, 0, i);
+   EXPECT_EQ(3, PROC_cmd_flush(state->proc));
+   EXPECT_EQ(0, PROC_cmd_flush(state->proc));
+   state->atFlush = txq_drain(state);
+   EVT_exit_loop(PROC_evt(state->proc));
+
+   return EVENT_REMOVE;
+}
+
+// Test PROC_cmd_flush sends the queue without waiting for the loop
+TEST(TestTxQueue, FlushSendsImmediately) {
+   struct TxqState state;
+
+   txq_setup(&state, 3);
+   EVT_sched_add(PROC_evt(state.proc), EVT_ms2tv(0), &txq_flush_now, &state);
+   EVT_start_loop(PROC_evt(state.proc));
+
+   EXPECT_EQ(3, state.atFlush);
+   EXPECT_EQ(3u, state.next[0]);
+   EXPECT_EQ(0, state.bad);
+   txq_teardown(&state);
+}
+
+// Test sends outside the loop go out at once and report the send result
+TEST(TestTxQueue, OutsideLoopReturnsSendResult) {
+   struct TxqState state;
+   static char big[70000];
+
+   txq_setup(&state, 0);
+   EXPECT_EQ(1 + (int)sizeof(struct TxqMsg), txq_send(&state, 0, 0));
+   EXPECT_EQ(1, txq_drain(&state));
+
+   // Too big for a UDP datagram, so sendto fails
+   errno = 0;
+   EXPECT_EQ(-1, PROC_cmd_sockaddr(state.proc, TXQ_CMD, big, sizeof(big),
+            &state.dest));
+   EXPECT_EQ(EMSGSIZE, errno);
+   EXPECT_EQ(0, txq_drain(&state));
+
+   EXPECT_EQ(1 + (int)sizeof(struct TxqMsg), txq_send(&state, 0, 1));
+   EXPECT_EQ(1, txq_drain(&state));
+   EXPECT_EQ(2u, state.next[0]);
+   EXPECT_EQ(0, state.bad);
+   txq_teardown(&state);
+}
+
+static int txq_unblock(void *arg)
+{
+   struct TxqState *state = (struct TxqState*)arg;
+   int i;
+
+   state->beforeUnblock = txq_drain(state);
+   __atomic_store_n(&blockedFd, -1, __ATOMIC_SEQ_CST);
+
+   // The socket is free again, but these still queue behind the backlog
+   for (i = 10; i < TXQ_COUNT; i++)
+      txq_send(state, 0, i);
+
+   return EVENT_REMOVE;
+}
+
+static int txq_block(void *arg)
+{
+   struct TxqState *state = (struct TxqState*)arg;
+   int i;
+
+   __atomic_store_n(&blockedFd, state->proc->cmdFd, __ATOMIC_SEQ_CST);
+   for (i = 0; i < 5; i++)
+      txq_send(state, 0, i);
+   PROC_cmd_flush(state->proc);
+   for (; i < 10; i++)
+      txq_send(state, 0, i);
+   PROC_cmd_flush(state->proc);
+
+   EVT_fd_add(PROC_evt(state->proc), state->fd, EVENT_FD_READ, &txq_reader,
+         state);
+   EVT_sched_add(PROC_evt(state->proc), EVT_ms2tv(2), &txq_unblock, state);
+
+   return EVENT_REMOVE;
+}
+
+// Test datagrams deferred because the socket would block keep their order
+TEST(TestTxQueue, DeferredKeepOrder) {
+   struct TxqState state;
+
+   txq_setup(&state, TXQ_COUNT);
+   blockedSends = 0;
+   EVT_sched_add(PROC_evt(state.proc), EVT_ms2tv(0), &txq_block, &state);
+   EVT_start_loop(PROC_evt(state.proc));
+
+   EXPECT_LT(0, blockedSends);
+   EXPECT_EQ(0, state.beforeUnblock);
+   EXPECT_EQ((uint32_t)TXQ_COUNT, state.next[0]);
+   EXPECT_EQ(0, state.bad);
+   txq_teardown(&state);
+}
+
+static void *txq_worker(void *arg)
+{
+   struct TxqState *state = (struct TxqState*)arg;
+   uint32_t i;
+
+   for (i = 0; i < TXQ_WORKER_COUNT; i++) {
+      if (txq_send(state, 1, i) != 1 + (int)sizeof(struct TxqMsg))
+         __atomic_add_fetch(&state->workerBad, 1, __ATOMIC_SEQ_CST);
+      if (i % 16 == 15)
+         usleep(200);
+   }
+
+   return NULL;
+}
+
+static int txq_loop_sends(void *arg)
+{
+   struct TxqState *state = (struct TxqState*)arg;
+   int i;
+
+   if (!state->loopSeq) {
+      EVT_fd_add(PROC_evt(state->proc), state->fd, EVENT_FD_READ,
+            &txq_reader, state);
+      pthread_create(&state->worker, NULL, &txq_worker, state);
+   }
+
+   for (i = 0; i < 8 && state->loopSeq < TXQ_WORKER_COUNT; i++)
+      txq_send(state, 0, state->loopSeq++);
+
+   return state->loopSeq < TXQ_WORKER_COUNT ? EVENT_KEEP : EVENT_REMOVE;
+}
+
+// Test a worker thread can send while the loop is queueing its own sends
+TEST(TestTxQueue, WorkerSendsWhileLoopRuns) {
+   struct TxqState state;
+
+   txq_setup(&state, 2 * TXQ_WORKER_COUNT);
+   EVT_sched_add(PROC_evt(state.proc), EVT_ms2tv(1), &txq_loop_sends,
+         &state);
+   EVT_start_loop(PROC_evt(state.proc));
+   pthread_join(state.worker, NULL);
+
+   EXPECT_EQ(0, state.workerBad);
+   EXPECT_EQ((uint32_t)TXQ_WORKER_COUNT, state.next[0]);
+   EXPECT_EQ((uint32_t)TXQ_WORKER_COUNT, state.next[1]);
+   EXPECT_EQ(0, state.bad);
+   txq_teardown(&state);
+}
+
+#define EXIT_CHILDREN 6
+
+struct ExitState {
+   ProcessData *proc;
+   ProcChild *children[EXIT_CHILDREN];
+   int status[EXIT_CHILDREN];
+   int deaths;
+};
+
+static void exit_death(ProcChild *child, void *arg)
+{
+   struct ExitState *state = (struct ExitState*)arg;
+   int i;
+
+   for (i = 0; i < EXIT_CHILDREN; i++)
+      if (state->children[i] == child)
+         state->status[i] = child->exitStatus;
+   if (++state->deaths == EXIT_CHILDREN)
+      EVT_exit_loop(PROC_evt(state->proc));
+}
+
+// Test each child's exit is reported once, with its own status
+TEST(TestProcChildren, ExitsReportedSeparately) {
+   struct ExitState state;
+   ProcChild *child;
+   int i;
+
+   memset(&state, 0, sizeof(state));
+   state.proc = PROC_init_xdr("test2", WD_DISABLED, NULL);
+   ASSERT_TRUE(state.proc != NULL);
+
+   for (i = 0; i < EXIT_CHILDREN; i++) {
+      child = PROC_fork_child(state.proc, i % 2 ? "false" : "true");
+      ASSERT_TRUE(child != NULL);
+#if defined(__linux__) && defined(SYS_pidfd_open)
+      EXPECT_LE(0, child->pidfd);
+#endif
+      state.children[i] = child;
+      state.status[i] = -1;
+      CHLD_death_notice(child, &exit_death, &state);
+      CHLD_close_stdin(child);
+      CHLD_ignore_stdout(child);
+      CHLD_ignore_stderr(child);
+   }
+
+   EVT_sched_add(PROC_evt(state.proc), EVT_ms2tv(5000), &wq_timeout,
+         PROC_evt(state.proc));
+   EVT_start_loop(PROC_evt(state.proc));
+   PROC_cleanup(state.proc);
+
+   ASSERT_EQ(EXIT_CHILDREN, state.deaths);
+   for (i = 0; i < EXIT_CHILDREN; i++) {
+      ASSERT_TRUE(WIFEXITED(state.status[i])) << "child " << i;
+      EXPECT_EQ(i % 2, WEXITSTATUS(state.status[i])) << "child " << i;
+   }
+}
+
+}
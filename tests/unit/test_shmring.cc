@@ -0,0 +1,356 @@
+#include <string.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+#include "../../events.h"
+#include "../../shmRing.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+#define RING_PORT_A 47001
+#define RING_PORT_B 47002
+
+struct RingState {
+   EVTHandler *evt;
+   struct SHMRTransport *a, *b;
+   uint32_t next;          // Sequence number of the next datagram to send
+   uint32_t expect;        // Sequence number the receiver expects next
+   uint32_t target;
+   int bad;
+   int sendRes;
+   uint32_t probeAt;       // Sends once this many datagrams have arrived
+   int probeRes;
+   uint32_t freeAt;        // Frees the receiver once this many have arrived
+};
+
+// Datagrams carry their sequence number and a length that varies with it,
+//  so records land at every alignment and straddle the end of the ring
+static size_t ring_msg(uint32_t seq, char *buff)
+{
+   size_t len = sizeof(seq) + (seq * 37) % 1500;
+   size_t i;
+
+   memcpy(buff, &seq, sizeof(seq));
+   for (i = sizeof(seq); i < len; i++)
+      buff[i] = (char)(seq + i);
+
+   return len;
+}
+
+static int ring_send(struct RingState *state, uint32_t seq)
+{
+   struct sockaddr_in dest;
+   struct iovec iov[2];
+   char buff[1600];
+   size_t len = ring_msg(seq, buff);
+
+   memset(&dest, 0, sizeof(dest));
+   dest.sin_family = AF_INET;
+   dest.sin_port = htons(RING_PORT_B);
+   dest.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+   // Split the datagram to exercise the gather
+   iov[0].iov_base = buff;
+   iov[0].iov_len = len / 2;
+   iov[1].iov_base = buff + len / 2;
+   iov[1].iov_len = len - len / 2;
+
+   return SHMR_sendv(state->a, iov, 2, len, &dest);
+}
+
+static void ring_rx(void *arg, void *data, size_t len,
+      struct sockaddr_in *src)
+{
+   struct RingState *state = (struct RingState*)arg;
+   char buff[1600];
+
+   if (len != ring_msg(state->expect, buff) || memcmp(buff, data, len) ||
+         ntohs(src->sin_port) != RING_PORT_A)
+      state->bad++;
+   state->expect++;
+
+   if (state->expect == state->probeAt)
+      state->probeRes = ring_send(state, state->next);
+   if (state->expect == state->freeAt) {
+      SHMR_free(state->b);
+      state->b = NULL;
+      EVT_exit_loop(state->evt);
+   }
+   if (state->expect == state->target)
+      EVT_exit_loop(state->evt);
+}
+
+static int ring_timeout(void *arg)
+{
+   EVT_exit_loop((EVTHandler*)arg);
+   return EVENT_REMOVE;
+}
+
+static void ring_setup(struct RingState *state)
+{
+   memset(state, 0, sizeof(*state));
+   state->evt = EVT_create_handler(NULL, NULL);
+   ASSERT_TRUE(state->evt != NULL);
+   state->a = SHMR_create(state->evt, RING_PORT_A, &ring_rx, state);
+   state->b = SHMR_create(state->evt, RING_PORT_B, &ring_rx, state);
+   ASSERT_TRUE(state->a != NULL);
+   ASSERT_TRUE(state->b != NULL);
+   EVT_sched_add(state->evt, EVT_ms2tv(5000), &ring_timeout, state->evt);
+}
+
+static void ring_teardown(struct RingState *state)
+{
+   SHMR_free(state->a);
+   SHMR_free(state->b);
+   EVT_free_handler(state->evt);
+}
+
+// Keeps the ring topped up, leaving the rest for the next tick once full
+static int ring_pump(void *arg)
+{
+   struct RingState *state = (struct RingState*)arg;
+
+   while (state->next < state->target && ring_send(state, state->next) > 0)
+      state->next++;
+
+   return state->next < state->target ? EVENT_KEEP : EVENT_REMOVE;
+}
+
+// Test datagrams arrive intact and in order as the ring wraps many times
+TEST(TestShmRing, Wrap) {
+   struct RingState state;
+   struct SHMRStats stats;
+
+   ring_setup(&state);
+   state.target = 2000;
+   EVT_sched_add_with_timestep(state.evt, EVT_ms2tv(0), EVT_ms2tv(1),
+         &ring_pump, &state);
+   EVT_start_loop(state.evt);
+
+   EXPECT_EQ(state.target, state.expect);
+   EXPECT_EQ(0, state.bad);
+   SHMR_get_stats(state.a, &stats);
+   EXPECT_EQ(state.target, stats.sent);
+   SHMR_get_stats(state.b, &stats);
+   EXPECT_EQ(state.target, stats.received);
+   ring_teardown(&state);
+}
+
+// Test a full ring refuses the datagram and drains intact afterwards
+TEST(TestShmRing, Full) {
+   struct RingState state;
+   struct SHMRStats stats;
+
+   ring_setup(&state);
+   while (ring_send(&state, state.next) > 0)
+      state.next++;
+   SHMR_get_stats(state.a, &stats);
+   EXPECT_EQ(1u, stats.full);
+   EXPECT_EQ(state.next, stats.sent);
+   EXPECT_LT(100u, state.next);
+
+   state.target = state.next;
+   EVT_start_loop(state.evt);
+
+   EXPECT_EQ(state.target, state.expect);
+   EXPECT_EQ(0, state.bad);
+   EXPECT_LT(0, ring_send(&state, state.next));
+   ring_teardown(&state);
+}
+
+// Test the receive callback can free its own transport with datagrams
+//  still waiting in the ring
+TEST(TestShmRing, FreeFromCallback) {
+   struct RingState state;
+
+   ring_setup(&state);
+   for (state.next = 0; state.next < 10; state.next++)
+      ASSERT_LT(0, ring_send(&state, state.next));
+
+   state.freeAt = 3;
+   EVT_start_loop(state.evt);
+
+   EXPECT_EQ(3u, state.expect);
+   EXPECT_EQ(0, state.bad);
+   EXPECT_TRUE(state.b == NULL);
+   ring_teardown(&state);
+}
+
+// Test a sender that found the ring full stays off it until it empties,
+//  even once there is room again
+TEST(TestShmRing, FullUntilEmpty) {
+   struct RingState state;
+   struct SHMRStats stats;
+
+   ring_setup(&state);
+   while (ring_send(&state, state.next) > 0)
+      state.next++;
+
+   // Try again once the receiver has made room but not caught up
+   state.probeAt = 64;
+   state.probeRes = -1;
+   state.target = state.next;
+   EVT_start_loop(state.evt);
+
+   EXPECT_EQ(0, state.probeRes);
+   EXPECT_EQ(state.target, state.expect);
+   EXPECT_EQ(0, state.bad);
+   SHMR_get_stats(state.a, &stats);
+   EXPECT_EQ(2u, stats.full);
+   EXPECT_LT(0, ring_send(&state, state.next));
+   ring_teardown(&state);
+}
+
+static int ring_close_b(void *arg)
+{
+   struct RingState *state = (struct RingState*)arg;
+
+   SHMR_free(state->b);
+   state->b = NULL;
+   return EVENT_REMOVE;
+}
+
+static int ring_send_late(void *arg)
+{
+   struct RingState *state = (struct RingState*)arg;
+
+   state->sendRes = ring_send(state, state->next);
+   EVT_exit_loop(state->evt);
+   return EVENT_REMOVE;
+}
+
+// Test a sender notices the receiver going away and falls back to UDP
+TEST(TestShmRing, PeerExit) {
+   struct RingState state;
+
+   ring_setup(&state);
+   state.target = 100;
+   EXPECT_LT(0, ring_send(&state, state.next++));
+   EVT_sched_add(state.evt, EVT_ms2tv(50), &ring_close_b, &state);
+   EVT_sched_add(state.evt, EVT_ms2tv(150), &ring_send_late, &state);
+   EVT_start_loop(state.evt);
+
+   EXPECT_EQ(1u, state.expect);
+   EXPECT_EQ(0, state.sendRes);
+   ring_teardown(&state);
+}
+
+// Mirrors the ring header layout in shmRing.c
+struct RawHeader {
+   uint32_t magic;
+   uint32_t cap;
+   uint64_t head __attribute__((aligned(64)));
+   uint64_t tail __attribute__((aligned(64)));
+   uint32_t waiting __attribute__((aligned(64)));
+};
+
+struct RawHello {
+   uint32_t magic;
+   uint32_t version;
+   uint32_t cap;
+};
+
+#define RAW_MAGIC 0x53484d52
+#define RAW_CAP 65536
+
+// Hands the listener on RING_PORT_B a hand built ring holding one record
+//  of the given length, and returns the connected socket
+static int ring_raw_connect(uint32_t recLen, int seal)
+{
+   struct sockaddr_un addr;
+   struct RawHello hello = { RAW_MAGIC, 1, RAW_CAP };
+   struct RawHeader *hdr;
+   struct msghdr msg;
+   struct cmsghdr *cmsg;
+   struct iovec iov;
+   char ctrl[CMSG_SPACE(2 * sizeof(int))];
+   long page = sysconf(_SC_PAGESIZE);
+   int fds[2], sock, len;
+   uint64_t one = 1;
+   char *base;
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   len = snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1,
+         "libproc-shm-%u", RING_PORT_B);
+   sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+   EXPECT_EQ(0, connect(sock, (struct sockaddr*)&addr,
+            offsetof(struct sockaddr_un, sun_path) + 1 + len));
+
+   fds[0] = syscall(SYS_memfd_create, "test-ring", MFD_ALLOW_SEALING);
+   EXPECT_EQ(0, ftruncate(fds[0], page + RAW_CAP));
+   if (seal)
+      EXPECT_EQ(0, fcntl(fds[0], F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW));
+   base = (char*)mmap(NULL, page + RAW_CAP, PROT_READ | PROT_WRITE,
+         MAP_SHARED, fds[0], 0);
+   EXPECT_TRUE(base != MAP_FAILED);
+
+   hdr = (struct RawHeader*)base;
+   hdr->magic = RAW_MAGIC;
+   hdr->cap = RAW_CAP;
+   memcpy(base + page, &recLen, sizeof(recLen));
+   hdr->head = 8 + ((recLen + 7) & ~7u);
+   if (hdr->head > RAW_CAP)
+      hdr->head = 8;
+   munmap(base, page + RAW_CAP);
+
+   fds[1] = eventfd(0, 0);
+   iov.iov_base = &hello;
+   iov.iov_len = sizeof(hello);
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = ctrl;
+   msg.msg_controllen = sizeof(ctrl);
+   cmsg = CMSG_FIRSTHDR(&msg);
+   cmsg->cmsg_level = SOL_SOCKET;
+   cmsg->cmsg_type = SCM_RIGHTS;
+   cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+   memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+   EXPECT_EQ((ssize_t)sizeof(hello), sendmsg(sock, &msg, 0));
+   EXPECT_EQ((ssize_t)sizeof(one), write(fds[1], &one, sizeof(one)));
+
+   close(fds[0]);
+   close(fds[1]);
+   return sock;
+}
+
+static void ring_raw_run(uint32_t recLen, int seal)
+{
+   struct RingState state;
+   char buff[16];
+   int sock;
+
+   ring_setup(&state);
+   state.target = 1;
+   sock = ring_raw_connect(recLen, seal);
+   EVT_sched_add(state.evt, EVT_ms2tv(100), &ring_timeout, state.evt);
+   EVT_start_loop(state.evt);
+
+   // Nothing is delivered and the receiver hangs up
+   EXPECT_EQ(0u, state.expect);
+   EXPECT_EQ(0, recv(sock, buff, sizeof(buff), MSG_DONTWAIT));
+   close(sock);
+   ring_teardown(&state);
+}
+
+// Test a record longer than any datagram drops the ring
+TEST(TestShmRing, CorruptRecord) {
+   ring_raw_run(0x7fffffff, 1);
+   ring_raw_run(RAW_CAP, 1);
+}
+
+// Test a ring the sender could still resize is refused
+TEST(TestShmRing, Unsealed) {
+   ring_raw_run(16, 0);
+}
+
+}
@@ -0,0 +1,150 @@
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../../events.h"
+#include "../../threadPool.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+struct PoolData {
+   EVTHandler *evt;
+   pthread_t loopThread;
+   int started;            // Jobs that have begun, updated atomically
+   int release;            // Set once the blocking jobs may finish
+   int done;
+   int expected;
+   int cancelled;
+};
+
+// Blocks until every job in the batch is running at once, or 2s pass
+static int wait_for_all(void *arg)
+{
+   struct PoolData *data = (struct PoolData *)arg;
+   int i;
+
+   __atomic_add_fetch(&data->started, 1, __ATOMIC_SEQ_CST);
+   for (i = 0; i < 2000; i++) {
+      if (__atomic_load_n(&data->started, __ATOMIC_SEQ_CST) >=
+            data->expected)
+         return 1;
+      usleep(1000);
+   }
+   return 0;
+}
+
+static int wait_for_release(void *arg)
+{
+   struct PoolData *data = (struct PoolData *)arg;
+
+   __atomic_add_fetch(&data->started, 1, __ATOMIC_SEQ_CST);
+   while (!__atomic_load_n(&data->release, __ATOMIC_SEQ_CST))
+      usleep(1000);
+   return 7;
+}
+
+static void job_done(void *arg, int retval, int cancelled)
+{
+   struct PoolData *data = (struct PoolData *)arg;
+
+   EXPECT_TRUE(pthread_equal(data->loopThread, pthread_self()));
+   EXPECT_EQ(0, cancelled);
+   if (retval)
+      data->done++;
+   if (data->done == data->expected)
+      EVT_exit_loop(data->evt);
+}
+
+static void never_done(void *arg, int retval, int cancelled)
+{
+   ADD_FAILURE() << "cancelled job completed";
+}
+
+static int give_up(void *arg)
+{
+   EVT_exit_loop((EVTHandler *)arg);
+   return EVENT_REMOVE;
+}
+
+static void pool_data_init(struct PoolData *data, int expected)
+{
+   memset(data, 0, sizeof(*data));
+   data->evt = EVT_create_handler(NULL, NULL);
+   data->loopThread = pthread_self();
+   data->expected = expected;
+}
+
+// Test that the pool grows so jobs don't wait behind busy workers
+TEST(TestThreadPool, GrowsToCap) {
+   struct PoolData data;
+   struct ThreadPoolStats stats;
+   struct ThreadPool *pool;
+   int i;
+
+   pool_data_init(&data, 4);
+   ASSERT_TRUE(data.evt != NULL);
+   pool = TPOOL_create(data.evt, 1, 16, 0);
+   ASSERT_TRUE(pool != NULL);
+   EXPECT_EQ(0, TPOOL_set_max_threads(pool, 4));
+
+   for (i = 0; i < 4; i++)
+      EXPECT_NE(0u, TPOOL_submit(pool, TPOOL_PRI_NORMAL, &wait_for_all,
+               &data, &job_done, &data));
+   EVT_sched_add(data.evt, EVT_ms2tv(5000), &give_up, data.evt);
+   EVT_start_loop(data.evt);
+
+   EXPECT_EQ(4, data.done);
+   TPOOL_get_stats(pool, &stats);
+   EXPECT_EQ(4u, stats.threads);
+   EXPECT_EQ(4u, stats.completed);
+
+   TPOOL_free(pool);
+   EVT_free_handler(data.evt);
+}
+
+// Test that the cap holds extra jobs in the queue, and that queued jobs
+//  can be cancelled and the queue bound is enforced
+TEST(TestThreadPool, QueueAndCancel) {
+   struct PoolData data;
+   struct ThreadPoolStats stats;
+   struct ThreadPool *pool;
+   uint32_t queued;
+   int i;
+
+   pool_data_init(&data, 2);
+   ASSERT_TRUE(data.evt != NULL);
+   pool = TPOOL_create(data.evt, 1, 2, 0);
+   ASSERT_TRUE(pool != NULL);
+
+   EXPECT_NE(0u, TPOOL_submit(pool, TPOOL_PRI_NORMAL, &wait_for_release,
+            &data, &job_done, &data));
+   for (i = 0; i < 1000 &&
+         !__atomic_load_n(&data.started, __ATOMIC_SEQ_CST); i++)
+      usleep(1000);
+
+   queued = TPOOL_submit(pool, TPOOL_PRI_LOW, &wait_for_release, &data,
+         &never_done, &data);
+   EXPECT_NE(0u, queued);
+   EXPECT_NE(0u, TPOOL_submit(pool, TPOOL_PRI_HIGH, &wait_for_release,
+            &data, &job_done, &data));
+   EXPECT_EQ(0u, TPOOL_submit(pool, TPOOL_PRI_NORMAL, &wait_for_release,
+            &data, &job_done, &data));
+
+   TPOOL_get_stats(pool, &stats);
+   EXPECT_EQ(1u, stats.threads);
+   EXPECT_EQ(2u, stats.queued);
+   EXPECT_EQ(1u, stats.rejected);
+
+   EXPECT_EQ(0, TPOOL_cancel(pool, queued));
+   EXPECT_EQ(-1, TPOOL_cancel(pool, queued));
+
+   __atomic_store_n(&data.release, 1, __ATOMIC_SEQ_CST);
+   EVT_sched_add(data.evt, EVT_ms2tv(5000), &give_up, data.evt);
+   EVT_start_loop(data.evt);
+
+   EXPECT_EQ(2, data.done);
+   TPOOL_free(pool);
+   EVT_free_handler(data.evt);
+}
+
+}
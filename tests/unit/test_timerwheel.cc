@@ -0,0 +1,201 @@
+#include <string.h>
+#include <sys/time.h>
+#include "../../timerWheel.h"
+#include "../../priorityQueue.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+#define WHEEL_TIMERS 3000
+#define WHEEL_RES_US 1000
+
+struct WheelTimer {
+   struct timeval pri;
+   twheel_entry_t wheel;
+   size_t pos;
+   int queued;
+};
+
+static struct timeval wt_get_pri(void *a)
+{
+   return ((struct WheelTimer *)a)->pri;
+}
+
+static void wt_set_pri(void *a, struct timeval pri)
+{
+   ((struct WheelTimer *)a)->pri = pri;
+}
+
+static int wt_cmp_pri(struct timeval next, struct timeval curr)
+{
+   return timercmp(&next, &curr, >=);
+}
+
+static size_t wt_get_pos(void *a)
+{
+   return ((struct WheelTimer *)a)->pos;
+}
+
+static void wt_set_pos(void *a, size_t pos)
+{
+   ((struct WheelTimer *)a)->pos = pos;
+}
+
+static twheel_entry_t *wt_get_entry(void *a)
+{
+   return &((struct WheelTimer *)a)->wheel;
+}
+
+static void tv_add_us(struct timeval *tv, uint64_t us)
+{
+   uint64_t total = (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec + us;
+
+   tv->tv_sec = total / 1000000;
+   tv->tv_usec = total % 1000000;
+}
+
+static void wt_cancel(twheel_t *w, pqueue_t *q, struct WheelTimer *t)
+{
+   EXPECT_EQ(0, twheel_remove(w, t));
+   EXPECT_EQ(0, pqueue_remove(q, t));
+   EXPECT_EQ(-1, twheel_remove(w, t));
+   t->queued = 0;
+}
+
+// Test deadlines on every level and the overflow list fire in heap order
+TEST(TestTimerWheel, AllLevelsMatchHeap) {
+   static struct WheelTimer timers[WHEEL_TIMERS];
+   struct timeval now, next, base;
+   struct WheelTimer *t;
+   twheel_t *w;
+   pqueue_t *q;
+   uint64_t span, seed = 12345;
+   size_t fired = 0, pending = 0, levels[TWHEEL_LEVELS + 1];
+   int i, level, cancelledLate = 0;
+
+   w = twheel_init(WHEEL_RES_US, wt_get_pri, wt_get_entry);
+   q = pqueue_init(16, wt_cmp_pri, wt_get_pri, wt_set_pri, wt_get_pos,
+         wt_set_pos);
+   ASSERT_TRUE(w != NULL);
+   ASSERT_TRUE(q != NULL);
+
+   // Start away from a level boundary so every level carries a digit
+   base.tv_sec = 1000;
+   base.tv_usec = 123456;
+   twheel_advance(w, &base);
+   now = base;
+
+   // Spread deadlines so an equal share first lands on each wheel level
+   //  and on the overflow list, which starts 2^30 ticks out
+   memset(levels, 0, sizeof(levels));
+   for (i = 0; i < WHEEL_TIMERS; i++) {
+      t = &timers[i];
+      level = i % (TWHEEL_LEVELS + 1);
+      span = 1ULL << (TWHEEL_BITS * (level + 1));
+      seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+      t->pri = base;
+      tv_add_us(&t->pri, ((seed >> 16) % span + (span >> TWHEEL_BITS)) *
+            WHEEL_RES_US + (seed >> 8) % WHEEL_RES_US);
+      t->queued = 1;
+      ASSERT_EQ(0, twheel_insert(w, t));
+      ASSERT_EQ(0, pqueue_insert(q, t));
+      if (t->wheel.slot >= TWHEEL_LEVELS * TWHEEL_SLOTS)
+         levels[TWHEEL_LEVELS]++;
+      else
+         levels[t->wheel.slot / TWHEEL_SLOTS]++;
+   }
+   for (level = 0; level <= TWHEEL_LEVELS; level++)
+      EXPECT_LT(0u, levels[level]) << "nothing placed on level " << level;
+
+   // Cancel a third of the timers before any time passes
+   for (i = 0; i < WHEEL_TIMERS; i += 3)
+      wt_cancel(w, q, &timers[i]);
+   EXPECT_EQ(pqueue_size(q), twheel_size(w));
+
+   while (twheel_size(w)) {
+      ASSERT_EQ(1, twheel_next_wakeup(w, &next));
+      // The wheel may wake early but never after the earliest deadline
+      t = (struct WheelTimer *)pqueue_peek(q);
+      EXPECT_FALSE(timercmp(&next, &t->pri, >));
+      if (timercmp(&next, &now, >))
+         now = next;
+      twheel_advance(w, &now);
+
+      while ((t = (struct WheelTimer *)pqueue_peek(q)) &&
+            !timercmp(&t->pri, &now, >)) {
+         ASSERT_EQ(t, twheel_peek(w));
+         ASSERT_EQ(t, twheel_pop(w));
+         ASSERT_EQ(t, pqueue_pop(q));
+         EXPECT_TRUE(t->queued);
+         t->queued = 0;
+         fired++;
+
+         // Part way through cancel timers wherever they now sit
+         if (fired == 1000) {
+            for (i = 1; i < WHEEL_TIMERS; i += 3) {
+               if (timers[i].queued) {
+                  wt_cancel(w, q, &timers[i]);
+                  cancelledLate++;
+               }
+            }
+         }
+      }
+
+      // Nothing due may be held back, and nothing early may come out
+      t = (struct WheelTimer *)twheel_peek(w);
+      if (t)
+         EXPECT_TRUE(timercmp(&t->pri, &now, >));
+      ASSERT_EQ(pqueue_size(q), twheel_size(w));
+   }
+
+   for (i = 0; i < WHEEL_TIMERS; i++)
+      pending += timers[i].queued;
+   EXPECT_EQ(0u, pending);
+   EXPECT_LT(0, cancelledLate);
+   EXPECT_EQ((size_t)(WHEEL_TIMERS - WHEEL_TIMERS / 3 - cancelledLate),
+         fired);
+   EXPECT_EQ(0u, pqueue_size(q));
+
+   pqueue_free(q);
+   twheel_free(w);
+}
+
+// Test an empty wheel follows the clock backwards but a loaded one holds
+TEST(TestTimerWheel, BackwardsClock) {
+   struct WheelTimer t;
+   struct timeval now, next;
+   twheel_t *w;
+
+   w = twheel_init(WHEEL_RES_US, wt_get_pri, wt_get_entry);
+   ASSERT_TRUE(w != NULL);
+
+   now.tv_sec = 5000;
+   now.tv_usec = 0;
+   twheel_advance(w, &now);
+
+   // Empty, so stepping back an hour rebases the wheel
+   now.tv_sec -= 3600;
+   twheel_advance(w, &now);
+   t.pri = now;
+   tv_add_us(&t.pri, 5000);
+   ASSERT_EQ(0, twheel_insert(w, &t));
+   EXPECT_TRUE(twheel_peek(w) == NULL);
+   ASSERT_EQ(1, twheel_next_wakeup(w, &next));
+   EXPECT_TRUE(timercmp(&next, &now, >));
+   EXPECT_FALSE(timercmp(&next, &t.pri, >));
+
+   // Loaded, so stepping back further leaves the timer where it was
+   now.tv_sec -= 60;
+   twheel_advance(w, &now);
+   EXPECT_TRUE(twheel_peek(w) == NULL);
+   EXPECT_EQ(1u, twheel_size(w));
+
+   now = t.pri;
+   twheel_advance(w, &now);
+   EXPECT_EQ(&t, twheel_pop(w));
+   EXPECT_EQ(0u, twheel_size(w));
+
+   twheel_free(w);
+}
+
+}
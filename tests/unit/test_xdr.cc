@@ -0,0 +1,763 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include "../../xdr.h"
+#include "../../memPool.h"
+#include "../../cmd-pkt.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+#define SWAP_MAX_COUNT 96
+#define SWAP_MAX_OFFSET 8
+#define SWAP_BUFF_LEN (SWAP_MAX_COUNT * 8 + 2 * SWAP_MAX_OFFSET)
+
+static void fill_random(unsigned char *buff, size_t len, unsigned int *seed)
+{
+   size_t i;
+
+   for (i = 0; i < len; i++)
+      buff[i] = (unsigned char)rand_r(seed);
+}
+
+// Reverses the bytes of each element, independent of any kernel
+static void swap_reference(unsigned char *dst, const unsigned char *src,
+      size_t width, size_t count)
+{
+   size_t i, j;
+
+   for (i = 0; i < count; i++)
+      for (j = 0; j < width; j++)
+         dst[i * width + j] = src[i * width + width - 1 - j];
+}
+
+// Writes count values in big-endian wire order
+static void put_be(unsigned char *dst, const void *vals, size_t width,
+      size_t count)
+{
+   uint64_t val;
+   size_t i, j;
+
+   for (i = 0; i < count; i++) {
+      if (width == 4)
+         val = ((const uint32_t*)vals)[i];
+      else
+         val = ((const uint64_t*)vals)[i];
+      for (j = 0; j < width; j++)
+         dst[i * width + j] = (unsigned char)(val >> (8 * (width - 1 - j)));
+   }
+}
+
+static void check_kernel(enum XDR_SwapKernel kernel, size_t width)
+{
+   unsigned char src[SWAP_BUFF_LEN], got[SWAP_BUFF_LEN], want[SWAP_BUFF_LEN];
+   unsigned int seed = 1;
+   size_t count, srcOff, dstOff;
+
+   // Every length mod 32 several times over, at every alignment, with the
+   //  bytes around the output checked for stray writes
+   for (count = 0; count <= SWAP_MAX_COUNT; count++) {
+      for (srcOff = 0; srcOff < SWAP_MAX_OFFSET; srcOff++) {
+         for (dstOff = 0; dstOff < SWAP_MAX_OFFSET; dstOff++) {
+            fill_random(src, sizeof(src), &seed);
+            memset(got, 0xA5, sizeof(got));
+            memset(want, 0xA5, sizeof(want));
+
+            swap_reference(want + dstOff, src + srcOff, width, count);
+            ASSERT_EQ(0, XDR_swap_kernel(kernel, width, got + dstOff,
+                     src + srcOff, count));
+            ASSERT_EQ(0, memcmp(want, got, sizeof(got)))
+               << "kernel " << kernel << " width " << width
+               << " count " << count << " src offset " << srcOff
+               << " dst offset " << dstOff;
+         }
+      }
+   }
+}
+
+static void check_kernel_if_supported(enum XDR_SwapKernel kernel)
+{
+   unsigned char buff[8];
+
+   if (XDR_swap_kernel(kernel, 4, buff, buff, 0) < 0)
+      return;
+
+   check_kernel(kernel, 4);
+   check_kernel(kernel, 8);
+}
+
+// Test the scalar kernel against a plain byte reversal
+TEST(TestXDRSwap, Scalar) {
+   check_kernel(XDR_SWAP_SCALAR, 4);
+   check_kernel(XDR_SWAP_SCALAR, 8);
+}
+
+// Test the vector kernels, where available, give the scalar results
+TEST(TestXDRSwap, VectorMatchesScalar) {
+   check_kernel_if_supported(XDR_SWAP_SSE2);
+   check_kernel_if_supported(XDR_SWAP_AVX2);
+}
+
+TEST(TestXDRSwap, RejectsUnknownWidth) {
+   unsigned char buff[8];
+
+   EXPECT_EQ(-1, XDR_swap_kernel(XDR_SWAP_SCALAR, 2, buff, buff, 1));
+}
+
+// Test the array codecs round trip through unaligned wire buffers
+TEST(TestXDRSwap, ArrayCodecsUnaligned) {
+   char wire[SWAP_BUFF_LEN];
+   uint32_t vals32[SWAP_MAX_COUNT], *src32, *out32;
+   uint64_t vals64[SWAP_MAX_COUNT], *src64, *out64;
+   unsigned char want[SWAP_BUFF_LEN];
+   int32_t count;
+   size_t used, off;
+   int i;
+
+   for (i = 0; i < SWAP_MAX_COUNT; i++) {
+      vals32[i] = 0x01020304u * (i + 1);
+      vals64[i] = 0x0102030405060708ull * (i + 1);
+   }
+   src32 = vals32;
+   src64 = vals64;
+
+   for (count = 0; count <= SWAP_MAX_COUNT; count++) {
+      for (off = 1; off < SWAP_MAX_OFFSET; off += 2) {
+         ASSERT_EQ(0, XDR_encode_uint32_array(&src32, wire + off, &used,
+                  sizeof(wire) - off, &count));
+         ASSERT_EQ(count * 4u, used);
+         put_be(want, vals32, 4, count);
+         EXPECT_EQ(0, memcmp(want, wire + off, used));
+
+         out32 = NULL;
+         ASSERT_EQ(0, XDR_decode_uint32_array(wire + off, &out32, &used,
+                  sizeof(wire) - off, &count));
+         EXPECT_EQ(0, memcmp(vals32, out32, count * 4u));
+         free(out32);
+
+         ASSERT_EQ(0, XDR_encode_uint64_array(&src64, wire + off, &used,
+                  sizeof(wire) - off, &count));
+         ASSERT_EQ(count * 8u, used);
+         put_be(want, vals64, 8, count);
+         EXPECT_EQ(0, memcmp(want, wire + off, used));
+
+         out64 = NULL;
+         ASSERT_EQ(0, XDR_decode_uint64_array(wire + off, &out64, &used,
+                  sizeof(wire) - off, &count));
+         EXPECT_EQ(0, memcmp(vals64, out64, count * 8u));
+         free(out64);
+      }
+   }
+}
+
+
+#define SIZE_PAYLOAD 5000
+
+// Encodes a command carrying an opaque payload of the given length the
+//  regular way, checking the measured size against it
+static size_t size_check_flat(struct IPC_Command *cmd, char *flat,
+      size_t max)
+{
+   size_t len = 0, used = 0;
+
+   EXPECT_EQ(0, XDR_struct_encoded_size(cmd, IPC_TYPES_COMMAND, &len));
+   EXPECT_EQ(0, IPC_Command_encode(cmd, flat, &used, max, NULL));
+   EXPECT_EQ(used, len);
+
+   return used;
+}
+
+// Test the measured size is exactly what the encoders write, and that the
+//  iovec encoding carries the same bytes
+TEST(TestXDRSize, MatchesEncoding) {
+   static const size_t lens[] = { 0, 1, 3, 4, 100, SIZE_PAYLOAD };
+   char payload[SIZE_PAYLOAD], flat[SIZE_PAYLOAD + 64];
+   char joined[SIZE_PAYLOAD + 64], scratch[128];
+   struct IPC_OpaqueStruct op;
+   struct IPC_Command cmd;
+   struct iovec iov[8];
+   struct XDR_IOVec vec;
+   size_t flatLen, off, i;
+   int j, referenced;
+
+   for (i = 0; i < sizeof(payload); i++)
+      payload[i] = (char)(i * 7);
+
+   for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+      op.length = lens[i];
+      op.data = payload;
+      cmd.cmd = 42;
+      cmd.ipcref = 7;
+      cmd.parameters.type = IPC_TYPES_OPAQUE_STRUCT;
+      cmd.parameters.data = &op;
+      flatLen = size_check_flat(&cmd, flat, sizeof(flat));
+
+      memset(&vec, 0, sizeof(vec));
+      vec.buff = scratch;
+      vec.buffLen = sizeof(scratch);
+      vec.iov = iov;
+      vec.iovMax = 8;
+      vec.refMin = 1024;
+      ASSERT_EQ(0, XDR_struct_encode_iov(&cmd, IPC_TYPES_COMMAND, &vec));
+      ASSERT_EQ(flatLen, vec.len);
+
+      off = 0;
+      referenced = 0;
+      for (j = 0; j < vec.iovCount; j++) {
+         ASSERT_LE(off + iov[j].iov_len, sizeof(joined));
+         memcpy(joined + off, iov[j].iov_base, iov[j].iov_len);
+         off += iov[j].iov_len;
+         if (iov[j].iov_base == payload)
+            referenced = 1;
+      }
+      EXPECT_EQ(flatLen, off);
+      EXPECT_EQ(0, memcmp(flat, joined, flatLen)) << "length " << lens[i];
+      // Only the large payload is sent from the caller's memory
+      EXPECT_EQ(lens[i] >= vec.refMin, referenced) << "length " << lens[i];
+   }
+}
+
+// Test a union holding an unregistered type fails to measure
+TEST(TestXDRSize, UnknownUnionType) {
+   struct IPC_PopulatorError err = { 1, 2 };
+   struct IPC_Command cmd;
+   size_t len = 99;
+
+   cmd.cmd = 42;
+   cmd.ipcref = 7;
+   cmd.parameters.type = 0x7ffffff0;
+   cmd.parameters.data = &err;
+
+   EXPECT_EQ(-1, XDR_struct_encoded_size(&cmd, IPC_TYPES_COMMAND, &len));
+   EXPECT_EQ(0u, len);
+   len = 99;
+   EXPECT_EQ(-1, XDR_union_encoded_size(&cmd.parameters, &len));
+   EXPECT_EQ(0u, len);
+   EXPECT_EQ(-1, XDR_struct_encoded_size(&cmd, 0x7ffffff0, &len));
+}
+
+
+#define CODEC_TYPE 0x7e000001
+#define CODEC_BUFF_LEN 512
+
+// Scalar runs broken up by an opaque array and a union, so the compiled
+//  codec has several ops of each kind
+struct CodecStruct {
+   int32_t a;
+   uint32_t b;
+   uint64_t c;
+   double d;
+   float e;
+   int32_t len;
+   char *bytes;
+   uint32_t f;
+   int64_t g;
+   struct XDR_Union u;
+   uint32_t h;
+};
+
+#define CODEC_FIELD(funcs, field, lenField) \
+   { &funcs, offsetof(struct CodecStruct, field), #field, #field, NULL, \
+      NULL, NULL, 0, NULL, offsetof(struct CodecStruct, lenField) }
+
+static struct XDR_FieldDefinition codecFields[] = {
+   CODEC_FIELD(xdr_int32_functions, a, a),
+   CODEC_FIELD(xdr_uint32_functions, b, b),
+   CODEC_FIELD(xdr_uint64_functions, c, c),
+   CODEC_FIELD(xdr_double_functions, d, d),
+   CODEC_FIELD(xdr_float_functions, e, e),
+   CODEC_FIELD(xdr_int32_functions, len, len),
+   CODEC_FIELD(xdr_byte_arr_functions, bytes, len),
+   CODEC_FIELD(xdr_uint32_functions, f, f),
+   CODEC_FIELD(xdr_int64_functions, g, g),
+   CODEC_FIELD(xdr_union_functions, u, u),
+   CODEC_FIELD(xdr_uint32_functions, h, h),
+   { NULL, 0, NULL, NULL, NULL, NULL, NULL, 0, NULL, 0 }
+};
+
+static struct XDR_StructDefinition codecDef = {
+   CODEC_TYPE, sizeof(struct CodecStruct),
+   &XDR_struct_encoder, &XDR_struct_decoder, codecFields,
+   &XDR_malloc_allocator, &XDR_struct_free_deallocator, NULL, NULL, NULL
+};
+
+static void codec_fill(struct CodecStruct *val, struct IPC_PopulatorError *err,
+      char *bytes, unsigned int *seed)
+{
+   int i;
+
+   val->a = -(int32_t)rand_r(seed);
+   val->b = rand_r(seed);
+   val->c = ((uint64_t)rand_r(seed) << 33) | rand_r(seed);
+   val->d = rand_r(seed) / 3.0;
+   val->e = rand_r(seed) / 7.0f;
+   val->len = rand_r(seed) % 23;
+   for (i = 0; i < val->len; i++)
+      bytes[i] = (char)rand_r(seed);
+   val->bytes = bytes;
+   val->f = rand_r(seed);
+   val->g = -((int64_t)rand_r(seed) << 20);
+   err->type = rand_r(seed);
+   err->error = rand_r(seed);
+   val->u.type = IPC_TYPES_POPULATOR_ERROR;
+   val->u.data = err;
+   val->h = rand_r(seed);
+}
+
+static void codec_check_decoded(struct CodecStruct *want,
+      struct CodecStruct *got)
+{
+   struct IPC_PopulatorError *wantErr, *gotErr;
+
+   EXPECT_EQ(want->a, got->a);
+   EXPECT_EQ(want->b, got->b);
+   EXPECT_EQ(want->c, got->c);
+   EXPECT_EQ(want->d, got->d);
+   EXPECT_EQ(want->e, got->e);
+   ASSERT_EQ(want->len, got->len);
+   EXPECT_EQ(0, memcmp(want->bytes, got->bytes, want->len));
+   EXPECT_EQ(want->f, got->f);
+   EXPECT_EQ(want->g, got->g);
+   ASSERT_EQ(want->u.type, got->u.type);
+   wantErr = (struct IPC_PopulatorError*)want->u.data;
+   gotErr = (struct IPC_PopulatorError*)got->u.data;
+   ASSERT_TRUE(gotErr != NULL);
+   EXPECT_EQ(wantErr->type, gotErr->type);
+   EXPECT_EQ(wantErr->error, gotErr->error);
+   EXPECT_EQ(want->h, got->h);
+}
+
+// Test the compiled codec writes and reads exactly what the field table
+//  walk does
+TEST(TestXDRCodec, MatchesTableWalk) {
+   char tableBuff[CODEC_BUFF_LEN], compBuff[CODEC_BUFF_LEN], bytes[32];
+   struct IPC_PopulatorError err;
+   struct CodecStruct val;
+   struct CodecStruct *fromTable, *fromComp;
+   size_t tableLen, compLen, used;
+   unsigned int seed = 3;
+   int i;
+
+   XDR_register_struct(&codecDef);
+
+   for (i = 0; i < 200; i++) {
+      codec_fill(&val, &err, bytes, &seed);
+
+      tableLen = compLen = 0;
+      ASSERT_EQ(0, XDR_table_struct_encoder(&val, tableBuff, &tableLen,
+               sizeof(tableBuff), CODEC_TYPE, codecFields));
+      ASSERT_EQ(0, XDR_struct_encoder(&val, compBuff, &compLen,
+               sizeof(compBuff), CODEC_TYPE, codecFields));
+      ASSERT_EQ(tableLen, compLen);
+      ASSERT_EQ(0, memcmp(tableBuff, compBuff, tableLen)) << "value " << i;
+
+      fromTable = (struct CodecStruct*)codecDef.allocator(&codecDef);
+      fromComp = (struct CodecStruct*)codecDef.allocator(&codecDef);
+      ASSERT_EQ(0, XDR_table_struct_decoder(tableBuff, fromTable, &used,
+               tableLen, codecFields));
+      EXPECT_EQ(tableLen, used);
+      ASSERT_EQ(0, XDR_struct_decoder(tableBuff, fromComp, &used, tableLen,
+               codecFields));
+      EXPECT_EQ(tableLen, used);
+      codec_check_decoded(&val, fromTable);
+      codec_check_decoded(&val, fromComp);
+
+      codecDef.deallocator((void**)&fromTable, &codecDef);
+      codecDef.deallocator((void**)&fromComp, &codecDef);
+   }
+}
+
+// Test both paths reject every truncation of a valid encoding
+TEST(TestXDRCodec, TruncatedInput) {
+   char buff[CODEC_BUFF_LEN], bytes[32];
+   struct IPC_PopulatorError err;
+   struct CodecStruct val, *dst;
+   size_t len = 0, cut, used;
+   unsigned int seed = 5;
+
+   XDR_register_struct(&codecDef);
+   codec_fill(&val, &err, bytes, &seed);
+   ASSERT_EQ(0, XDR_struct_encoder(&val, buff, &len, sizeof(buff),
+            CODEC_TYPE, codecFields));
+
+   for (cut = 0; cut < len; cut++) {
+      dst = (struct CodecStruct*)codecDef.allocator(&codecDef);
+      EXPECT_GT(0, XDR_struct_decoder(buff, dst, &used, cut, codecFields))
+         << "cut at " << cut;
+      codecDef.deallocator((void**)&dst, &codecDef);
+
+      dst = (struct CodecStruct*)codecDef.allocator(&codecDef);
+      EXPECT_GT(0, XDR_table_struct_decoder(buff, dst, &used, cut,
+               codecFields)) << "cut at " << cut;
+      codecDef.deallocator((void**)&dst, &codecDef);
+
+      used = 0;
+      EXPECT_GT(0, XDR_struct_encoder(&val, buff + CODEC_BUFF_LEN / 2, &used,
+               cut, CODEC_TYPE, codecFields)) << "cut at " << cut;
+   }
+}
+
+
+#define BORROW_TYPE 0x7e000002
+#define BORROW_BYTES 40
+#define BORROW_BIG (64 * 1024)
+
+struct BorrowStruct {
+   int32_t len;
+   char *bytes;
+   char *name;
+};
+
+static struct XDR_FieldDefinition borrowFields[] = {
+   { &xdr_int32_functions, offsetof(struct BorrowStruct, len), "len", "len",
+      NULL, NULL, NULL, 0, NULL, 0 },
+   { &xdr_byte_arr_functions, offsetof(struct BorrowStruct, bytes), "bytes",
+      "bytes", NULL, NULL, NULL, 0, NULL, offsetof(struct BorrowStruct, len) },
+   { &xdr_string_arr_functions, offsetof(struct BorrowStruct, name), "name",
+      "name", NULL, NULL, NULL, 0, NULL, 0 },
+   { NULL, 0, NULL, NULL, NULL, NULL, NULL, 0, NULL, 0 }
+};
+
+static struct XDR_StructDefinition borrowDef = {
+   BORROW_TYPE, sizeof(struct BorrowStruct),
+   &XDR_struct_encoder, &XDR_struct_decoder, borrowFields,
+   &XDR_malloc_allocator, &XDR_struct_free_deallocator, NULL, NULL, NULL
+};
+
+// Encodes a BorrowStruct into a heap buffer, so that free() of a pointer
+//  into it is caught
+static char *borrow_encode(size_t bytesLen, const char *name, size_t *len)
+{
+   struct BorrowStruct val;
+   char *payload = (char*)malloc(bytesLen);
+   char *buff = (char*)malloc(bytesLen + strlen(name) + 16);
+   size_t i;
+
+   XDR_register_struct(&borrowDef);
+   for (i = 0; i < bytesLen; i++)
+      payload[i] = (char)i;
+   val.len = bytesLen;
+   val.bytes = payload;
+   val.name = (char*)name;
+
+   *len = 0;
+   EXPECT_EQ(0, XDR_struct_encoder(&val, buff, len,
+            bytesLen + strlen(name) + 16, BORROW_TYPE, borrowFields));
+   free(payload);
+
+   return buff;
+}
+
+static struct BorrowStruct *borrow_decode(char *buff, size_t len,
+      uint32_t flags)
+{
+   struct BorrowStruct *dst;
+   uint32_t prev;
+   size_t used;
+
+   dst = (struct BorrowStruct*)borrowDef.allocator(&borrowDef);
+   prev = XDR_set_decode_flags(flags);
+   EXPECT_EQ(0, XDR_struct_decoder(buff, dst, &used, len, borrowFields));
+   XDR_set_decode_flags(prev);
+
+   return dst;
+}
+
+static int borrow_points_into(const char *ptr, const char *buff, size_t len)
+{
+   return ptr >= buff && ptr < buff + len;
+}
+
+static void borrow_free(struct BorrowStruct *dst)
+{
+   borrowDef.deallocator((void**)&dst, &borrowDef);
+}
+
+// Test borrowed fields reference the source, which is left untouched, and
+//  are skipped when freed with the flags cleared
+TEST(TestXDRBorrow, FreedWithoutFlags) {
+   size_t len, i;
+   char *buff = borrow_encode(BORROW_BYTES, "abcde", &len);
+   char *orig = (char*)malloc(len);
+   struct BorrowStruct *dst;
+
+   memcpy(orig, buff, len);
+   dst = borrow_decode(buff, len, XDR_DECODE_BORROW);
+   EXPECT_EQ(0u, XDR_get_decode_flags());
+   EXPECT_TRUE(borrow_points_into(dst->bytes, buff, len));
+   EXPECT_TRUE(borrow_points_into(dst->name, buff, len));
+   EXPECT_STREQ("abcde", dst->name);
+   for (i = 0; i < BORROW_BYTES; i++)
+      EXPECT_EQ((char)i, dst->bytes[i]);
+   EXPECT_EQ(0, memcmp(orig, buff, len));
+
+   borrow_free(dst);
+   free(orig);
+   free(buff);
+}
+
+// Test a string that fills its words exactly is copied, not terminated in
+//  the source, and that the same buffer can be borrowed from twice
+TEST(TestXDRBorrow, UnpaddedStringAndReuse) {
+   size_t len;
+   char *buff = borrow_encode(BORROW_BYTES, "abcd", &len);
+   char *orig = (char*)malloc(len);
+   struct BorrowStruct *first, *second;
+
+   memcpy(orig, buff, len);
+   first = borrow_decode(buff, len, XDR_DECODE_BORROW);
+   second = borrow_decode(buff, len, XDR_DECODE_BORROW);
+   EXPECT_EQ(0, memcmp(orig, buff, len));
+
+   EXPECT_TRUE(borrow_points_into(first->bytes, buff, len));
+   EXPECT_EQ(first->bytes, second->bytes);
+   EXPECT_FALSE(borrow_points_into(first->name, buff, len));
+   EXPECT_STREQ("abcd", first->name);
+   EXPECT_STREQ("abcd", second->name);
+
+   // Copied strings are not freed by the field deallocator
+   free(first->name);
+   free(second->name);
+   borrow_free(first);
+   borrow_free(second);
+   free(orig);
+   free(buff);
+}
+
+// Test a negative byte array length is rejected rather than borrowed
+TEST(TestXDRBorrow, NegativeLength) {
+   char buff[16];
+   struct BorrowStruct *dst;
+   uint32_t prev;
+   size_t used;
+   int32_t len;
+
+   XDR_register_struct(&borrowDef);
+   memset(buff, 0, sizeof(buff));
+   for (len = -3; len < 0; len++) {
+      *(uint32_t*)buff = htonl((uint32_t)len);
+      dst = (struct BorrowStruct*)borrowDef.allocator(&borrowDef);
+      prev = XDR_set_decode_flags(XDR_DECODE_BORROW);
+      EXPECT_NE(0, XDR_struct_decoder(buff, dst, &used, sizeof(buff),
+               borrowFields)) << "length " << len;
+      XDR_set_decode_flags(prev);
+      borrow_free(dst);
+   }
+}
+
+static size_t heap_in_use(void)
+{
+   struct mallinfo2 info = mallinfo2();
+
+   return info.uordblks + info.hblkhd;
+}
+
+// Test an owned decode is freed even while the thread is borrowing
+TEST(TestXDRBorrow, OwnedFreedWhileBorrowing) {
+   size_t len, before;
+   char *buff = borrow_encode(BORROW_BIG, "abcde", &len);
+   struct BorrowStruct *dst;
+   uint32_t prev;
+
+   dst = borrow_decode(buff, len, 0);
+   EXPECT_FALSE(borrow_points_into(dst->bytes, buff, len));
+   free(dst->name);
+   dst->name = NULL;
+
+   before = heap_in_use();
+   prev = XDR_set_decode_flags(XDR_DECODE_BORROW);
+   borrow_free(dst);
+   XDR_set_decode_flags(prev);
+   EXPECT_LE((size_t)BORROW_BIG, before - heap_in_use());
+
+   free(buff);
+}
+
+static void *borrow_free_thread(void *arg)
+{
+   borrow_free((struct BorrowStruct*)arg);
+   return NULL;
+}
+
+static void *borrow_decode_thread(void *arg)
+{
+   char *buff = (char*)arg;
+   size_t len = 4 + BORROW_BYTES + 4 + 8;
+
+   return borrow_decode(buff, len, XDR_DECODE_BORROW);
+}
+
+// Test borrowed decodes can be freed on a thread other than the decoder's
+TEST(TestXDRBorrow, FreedOnOtherThread) {
+   size_t len;
+   char *buff = borrow_encode(BORROW_BYTES, "abcde", &len);
+   struct BorrowStruct *dst;
+   pthread_t thread;
+   void *res;
+
+   ASSERT_EQ((size_t)4 + BORROW_BYTES + 4 + 8, len);
+   dst = borrow_decode(buff, len, XDR_DECODE_BORROW);
+   ASSERT_EQ(0, pthread_create(&thread, NULL, &borrow_free_thread, dst));
+   pthread_join(thread, NULL);
+
+   ASSERT_EQ(0, pthread_create(&thread, NULL, &borrow_decode_thread, buff));
+   pthread_join(thread, &res);
+   dst = (struct BorrowStruct*)res;
+   EXPECT_TRUE(borrow_points_into(dst->bytes, buff, len));
+   borrow_free(dst);
+
+   free(buff);
+}
+
+// Test per-structure flags borrow through a union, and that the union frees
+//  cleanly once the flags have been cleared again
+TEST(TestXDRBorrow, StructFlagsThroughUnion) {
+   char *payload = (char*)malloc(BORROW_BYTES);
+   struct BorrowStruct val, *dst;
+   struct XDR_Union u, out;
+   char buff[256];
+   size_t len = 0, used = 0;
+
+   XDR_register_struct(&borrowDef);
+   memset(payload, 7, BORROW_BYTES);
+   val.len = BORROW_BYTES;
+   val.bytes = payload;
+   val.name = (char*)"abcde";
+   u.type = BORROW_TYPE;
+   u.data = &val;
+   ASSERT_EQ(0, XDR_encode_union(&u, buff, &len, sizeof(buff), NULL));
+
+   XDR_set_struct_decode_flags(XDR_DECODE_BORROW, BORROW_TYPE);
+   ASSERT_EQ(0, XDR_decode_union(buff, &out, &used, len, NULL));
+   XDR_set_struct_decode_flags(0, BORROW_TYPE);
+
+   dst = (struct BorrowStruct*)out.data;
+   EXPECT_TRUE(borrow_points_into(dst->bytes, buff, len));
+   XDR_free_union(&out);
+   free(payload);
+}
+
+// Test a string field holding a literal can be freed with its structure
+TEST(TestXDRBorrow, LiteralStringField) {
+   struct BorrowStruct *val;
+
+   XDR_register_struct(&borrowDef);
+   val = (struct BorrowStruct*)borrowDef.allocator(&borrowDef);
+   val->name = (char*)"literal";
+   borrow_free(val);
+}
+
+
+static void arena_encode(char *payload, struct BorrowStruct *val,
+      char *buff, size_t *len, size_t max)
+{
+   struct XDR_Union u;
+
+   XDR_register_struct(&borrowDef);
+   memset(payload, 7, BORROW_BYTES);
+   val->len = BORROW_BYTES;
+   val->bytes = payload;
+   val->name = (char*)"abcde";
+   u.type = BORROW_TYPE;
+   u.data = val;
+   *len = 0;
+   ASSERT_EQ(0, XDR_encode_union(&u, buff, len, max, NULL));
+}
+
+// Test a decode with an arena set allocates every field from it, that
+//  freeing the tree is skipped, and that a reset hands it all back
+TEST(TestXDRArena, DecodesIntoArena) {
+   struct MemArena *arena = MPOOL_arena_create(256);
+   struct MemArenaStats stats;
+   char payload[BORROW_BYTES];
+   struct BorrowStruct val, *dst;
+   struct XDR_Union out;
+   char buff[256];
+   size_t len, used = 0;
+
+   ASSERT_TRUE(arena != NULL);
+   arena_encode(payload, &val, buff, &len, sizeof(buff));
+
+   EXPECT_TRUE(XDR_set_decode_arena(arena) == NULL);
+   ASSERT_EQ(0, XDR_decode_union(buff, &out, &used, len, NULL));
+   dst = (struct BorrowStruct*)out.data;
+   EXPECT_TRUE(MPOOL_arena_owns(arena, dst));
+   EXPECT_TRUE(MPOOL_arena_owns(arena, dst->bytes));
+   EXPECT_TRUE(MPOOL_arena_owns(arena, dst->name));
+   EXPECT_EQ(0, memcmp(payload, dst->bytes, BORROW_BYTES));
+   EXPECT_STREQ("abcde", dst->name);
+
+   // Would abort in free() if the arena's memory were handed to it
+   XDR_free_union(&out);
+   EXPECT_TRUE(XDR_set_decode_arena(NULL) == arena);
+
+   MPOOL_arena_get_stats(arena, &stats);
+   EXPECT_LT(0u, stats.used);
+   MPOOL_arena_reset(arena);
+   MPOOL_arena_get_stats(arena, &stats);
+   EXPECT_EQ(0u, stats.used);
+   EXPECT_FALSE(MPOOL_arena_owns(arena, dst));
+
+   MPOOL_arena_free(arena);
+}
+
+// Test a negative byte array length fails an arena decode instead of
+//  copying a negative size into a wrapped allocation
+TEST(TestXDRArena, NegativeLength) {
+   struct MemArena *arena = MPOOL_arena_create(64);
+   char payload[BORROW_BYTES];
+   struct BorrowStruct val;
+   struct XDR_Union out;
+   char buff[256];
+   size_t len, used;
+   int32_t neg;
+
+   ASSERT_TRUE(arena != NULL);
+   arena_encode(payload, &val, buff, &len, sizeof(buff));
+
+   // The byte array's length follows the union's type word
+   XDR_set_decode_arena(arena);
+   for (neg = -3; neg < 0; neg++) {
+      *(uint32_t*)(buff + 4) = htonl((uint32_t)neg);
+      used = 0;
+      EXPECT_NE(0, XDR_decode_union(buff, &out, &used, len, NULL))
+         << "length " << neg;
+   }
+   XDR_set_decode_arena(NULL);
+
+   MPOOL_arena_free(arena);
+}
+
+// Test decodes that fail partway through unwind cleanly into an arena
+TEST(TestXDRArena, TruncatedInput) {
+   struct MemArena *arena = MPOOL_arena_create(64);
+   struct MemArenaStats stats;
+   char payload[BORROW_BYTES];
+   struct BorrowStruct val;
+   struct XDR_Union out;
+   char buff[256];
+   size_t len, cut, used;
+
+   ASSERT_TRUE(arena != NULL);
+   arena_encode(payload, &val, buff, &len, sizeof(buff));
+
+   XDR_set_decode_arena(arena);
+   for (cut = 0; cut < len; cut++) {
+      used = 0;
+      EXPECT_NE(0, XDR_decode_union(buff, &out, &used, cut, NULL))
+         << "cut at " << cut;
+   }
+   XDR_set_decode_arena(NULL);
+
+   MPOOL_arena_reset(arena);
+   MPOOL_arena_get_stats(arena, &stats);
+   EXPECT_EQ(0u, stats.used);
+   EXPECT_EQ(1u, stats.resets);
+   MPOOL_arena_free(arena);
+}
+
+}
@@ -0,0 +1,343 @@
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../../events.h"
+#include "../../ipc.h"
+#include "../../zmqlite.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+#define ZMQL_TEST_PORT 47010
+#define ZMQL_BURST 200
+#define ZMQL_MSG_LEN (64 * 1024)
+#define ZMQL_END_SEQ 0xFFFFFFFFu
+
+// Signature, version and NULL auth a ZMTP 3.0 peer opens with
+static const unsigned char zmq_greeting[] = {
+   0xFF, 0, 0, 0, 0, 0, 0, 0, 1, 0x7F,
+   0x03,
+   0, 'N', 'U', 'L', 'L',
+   0, 0, 0, 0, 0, 0, 0, 0,
+   0, 0, 0, 0, 0, 0, 0, 0,
+   0, 0, 0, 0, 0, 0, 0, 0,
+   0, 0, 0, 0, 0, 0, 0, 0,
+   0, 0, 0, 0, 0, 0, 0, 0,
+   0, 0, 0, 0, 0, 0, 0, 0 };
+
+// Server signature, version, auth and READY precede the first frame
+#define ZMQL_SERVER_HELLO (10 + 1 + 53 + 28)
+
+struct ZState {
+   EVTHandler *evt;
+   struct ZMQLServer *server;
+   struct ZMQLClient *client;
+   int sock;
+   char *rx;
+   size_t rxLen, rxCap;
+   int hello;
+   char accepted[ZMQL_BURST];
+   int sent, refused;
+   int got;
+   int64_t lastSeq;
+   size_t queuedAfterBurst;
+   long burstUsec;
+   int resumed;
+   int drained;
+   int ended, eof;
+   int connects, disconnects;
+   int bad;
+};
+
+static struct IPCBuffer *zmql_msg(uint32_t seq, size_t len)
+{
+   struct IPCBuffer *msg = ipc_alloc_buffer();
+   char *buff = (char*)malloc(len);
+   size_t i;
+
+   memcpy(buff, &seq, sizeof(seq));
+   for (i = sizeof(seq); i < len; i++)
+      buff[i] = (char)(seq + i);
+   ipc_append_buffer(msg, buff, len);
+   free(buff);
+
+   return msg;
+}
+
+// Checks one frame's payload and that nothing before it went missing
+static void zmql_check_frame(struct ZState *state, const char *data,
+      uint64_t len)
+{
+   uint32_t seq;
+   uint64_t i;
+
+   if (len < sizeof(seq)) {
+      state->bad++;
+      return;
+   }
+   memcpy(&seq, data, sizeof(seq));
+   if (seq == ZMQL_END_SEQ) {
+      state->ended = 1;
+      return;
+   }
+
+   if (seq >= ZMQL_BURST || len != ZMQL_MSG_LEN || !state->accepted[seq] ||
+         (int64_t)seq <= state->lastSeq) {
+      state->bad++;
+      return;
+   }
+   for (i = sizeof(seq); i < len; i++)
+      if (data[i] != (char)(seq + i)) {
+         state->bad++;
+         return;
+      }
+
+   state->lastSeq = seq;
+   state->got++;
+}
+
+// Consumes whole frames from the front of the receive buffer
+static void zmql_parse(struct ZState *state)
+{
+   size_t off = 0;
+   uint64_t len;
+   int hlen;
+
+   if (!state->hello) {
+      if (state->rxLen < ZMQL_SERVER_HELLO)
+         return;
+      if ((unsigned char)state->rx[0] != 0xFF)
+         state->bad++;
+      state->hello = 1;
+      off = ZMQL_SERVER_HELLO;
+   }
+
+   while (state->rxLen - off >= 2) {
+      if (state->rx[off] & 0x2) {
+         if (state->rxLen - off < 9)
+            break;
+         memcpy(&len, state->rx + off + 1, sizeof(len));
+         len = be64toh(len);
+         hlen = 9;
+      }
+      else {
+         len = (unsigned char)state->rx[off + 1];
+         hlen = 2;
+      }
+      if (state->rxLen - off - hlen < len)
+         break;
+      zmql_check_frame(state, state->rx + off + hlen, len);
+      off += hlen + len;
+   }
+
+   memmove(state->rx, state->rx + off, state->rxLen - off);
+   state->rxLen -= off;
+}
+
+static void zmql_maybe_done(struct ZState *state)
+{
+   if (state->ended || (state->eof && state->disconnects))
+      EVT_exit_loop(state->evt);
+}
+
+static int zmql_reader(int fd, char type, void *arg)
+{
+   struct ZState *state = (struct ZState*)arg;
+   struct IPCBuffer *msg;
+   ssize_t res;
+
+   for (;;) {
+      if (state->rxCap - state->rxLen < 65536) {
+         state->rxCap = state->rxCap * 2 + 65536;
+         state->rx = (char*)realloc(state->rx, state->rxCap);
+      }
+      res = read(fd, state->rx + state->rxLen, state->rxCap - state->rxLen);
+      if (res > 0) {
+         state->rxLen += res;
+         continue;
+      }
+      if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+         break;
+
+      state->eof = 1;
+      zmql_parse(state);
+      zmql_maybe_done(state);
+      return EVENT_REMOVE;
+   }
+   zmql_parse(state);
+
+   // Once the server's queue has drained a new message must get through
+   if (state->client && !state->drained &&
+         !zmql_client_queued(state->client)) {
+      state->drained = 1;
+      msg = zmql_msg(ZMQL_END_SEQ, 16);
+      if (zmql_write_buffer(state->client, msg) < 0)
+         state->bad++;
+      ipc_destroy_buffer(&msg);
+   }
+
+   zmql_maybe_done(state);
+   return EVENT_KEEP;
+}
+
+static int zmql_resume(void *arg)
+{
+   struct ZState *state = (struct ZState*)arg;
+
+   state->resumed = 1;
+   EVT_fd_add(state->evt, state->sock, EVENT_FD_READ, zmql_reader, state);
+   return EVENT_REMOVE;
+}
+
+// Writes the whole burst while the peer reads nothing
+static int zmql_burst(void *arg)
+{
+   struct ZState *state = (struct ZState*)arg;
+   struct IPCBuffer *msg;
+   struct timeval start, end, later = { 0, 100000 };
+   int i;
+
+   gettimeofday(&start, NULL);
+   for (i = 0; i < ZMQL_BURST; i++) {
+      msg = zmql_msg(i, ZMQL_MSG_LEN);
+      if (state->client && zmql_write_buffer(state->client, msg) == 0) {
+         state->accepted[i] = 1;
+         state->sent++;
+      }
+      else
+         state->refused++;
+      ipc_destroy_buffer(&msg);
+   }
+   gettimeofday(&end, NULL);
+
+   state->burstUsec = (end.tv_sec - start.tv_sec) * 1000000 +
+      (end.tv_usec - start.tv_usec);
+   state->queuedAfterBurst = zmql_client_queued(state->client);
+
+   // The loop has to stay live while the peer is stalled
+   EVT_sched_add(state->evt, later, zmql_resume, state);
+   return EVENT_REMOVE;
+}
+
+static void zmql_connected(struct ZMQLClient *client, void *arg)
+{
+   struct ZState *state = (struct ZState*)arg;
+   struct timeval now = { 0, 0 };
+
+   state->client = client;
+   state->connects++;
+   EVT_sched_add(state->evt, now, zmql_burst, state);
+}
+
+static void zmql_disconnected(struct ZMQLClient *client, void *arg)
+{
+   struct ZState *state = (struct ZState*)arg;
+
+   state->client = NULL;
+   state->disconnects++;
+   zmql_maybe_done(state);
+}
+
+static int zmql_timeout(void *arg)
+{
+   struct ZState *state = (struct ZState*)arg;
+
+   state->bad++;
+   EVT_exit_loop(state->evt);
+   return EVENT_REMOVE;
+}
+
+// Connects a peer that does the handshake but then stops reading
+static void zmql_run(struct ZState *state, size_t limit,
+      enum ZMQLOverflow policy)
+{
+   struct sockaddr_in addr;
+   struct timeval timeout = { 10, 0 };
+   int rcvbuf = 16 * 1024;
+
+   memset(state, 0, sizeof(*state));
+   state->lastSeq = -1;
+   state->evt = EVT_create_handler(NULL, NULL);
+   ASSERT_TRUE(state->evt != NULL);
+   state->server = zmql_create_tcp_server(state->evt, ZMQL_TEST_PORT, NULL,
+         zmql_connected, zmql_disconnected, state);
+   ASSERT_TRUE(state->server != NULL);
+   zmql_set_client_limit(state->server, limit, policy);
+
+   state->sock = socket(AF_INET, SOCK_STREAM, 0);
+   ASSERT_LE(0, state->sock);
+   setsockopt(state->sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons(ZMQL_TEST_PORT);
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   ASSERT_EQ(0, connect(state->sock, (struct sockaddr*)&addr, sizeof(addr)));
+   ASSERT_EQ((ssize_t)sizeof(zmq_greeting),
+         write(state->sock, zmq_greeting, sizeof(zmq_greeting)));
+   fcntl(state->sock, F_SETFL, fcntl(state->sock, F_GETFL) | O_NONBLOCK);
+
+   EVT_sched_add(state->evt, timeout, zmql_timeout, state);
+   EVT_start_loop(state->evt);
+}
+
+static void zmql_cleanup(struct ZState *state)
+{
+   zmql_destroy_tcp_server(&state->server);
+   close(state->sock);
+   free(state->rx);
+   EVT_free_handler(state->evt);
+}
+
+// Test a stalled peer queues up to the limit, later messages are dropped
+//  whole and the queue drains once the peer reads again
+TEST(TestZmqlite, StalledClientDrops) {
+   struct ZState state;
+
+   zmql_run(&state, 1024 * 1024, ZMQL_OVERFLOW_DROP);
+
+   EXPECT_EQ(0, state.bad);
+   EXPECT_EQ(1, state.connects);
+   EXPECT_EQ(0, state.disconnects);
+   EXPECT_EQ(1, state.resumed);
+   EXPECT_GT(1000000, state.burstUsec);
+   EXPECT_LT(0u, state.queuedAfterBurst);
+   EXPECT_GE((size_t)1024 * 1024, state.queuedAfterBurst);
+   EXPECT_LT(0, state.refused);
+   EXPECT_EQ(ZMQL_BURST, state.sent + state.refused);
+
+   // Every accepted message arrived, then the one sent after draining
+   EXPECT_EQ(state.sent, state.got);
+   EXPECT_EQ(1, state.drained);
+   EXPECT_EQ(1, state.ended);
+   EXPECT_EQ(1, zmql_client_count(state.server));
+
+   zmql_cleanup(&state);
+}
+
+// Test the disconnect policy closes a peer that falls too far behind
+TEST(TestZmqlite, StalledClientDisconnected) {
+   struct ZState state;
+
+   zmql_run(&state, 256 * 1024, ZMQL_OVERFLOW_DISCONNECT);
+
+   EXPECT_EQ(0, state.bad);
+   EXPECT_EQ(1, state.connects);
+   EXPECT_EQ(1, state.disconnects);
+   EXPECT_GT(1000000, state.burstUsec);
+   EXPECT_LT(0, state.refused);
+   EXPECT_EQ(0u, state.queuedAfterBurst);
+   EXPECT_EQ(1, state.eof);
+   EXPECT_EQ(0, state.ended);
+   EXPECT_EQ(0, zmql_client_count(state.server));
+
+   zmql_cleanup(&state);
+}
+
+}
@@ -0,0 +1,448 @@
+/*
+ * Copyright PolySat, California Polytechnic State University, San Luis Obispo. cubesat@calpoly.edu
+ * This file is part of libproc, a PolySat library.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#include "threadPool.h"
+#include "debug.h"
+
+struct TPoolJob {
+   struct TPoolJob *next;
+   uint32_t id;
+   int cancelled;
+   TPOOL_work_cb work;
+   void *arg;
+   TPOOL_done_cb done;
+   void *doneArg;
+   int retval;
+};
+
+// FIFO of jobs linked through next
+struct TPoolList {
+   struct TPoolJob *head, *tail;
+};
+
+struct ThreadPool {
+   EVTHandler *evt;
+   pthread_mutex_t lock;
+   pthread_cond_t wake;
+   struct TPoolList queues[TPOOL_PRI_COUNT];
+   struct TPoolList running;
+   struct TPoolList done;
+   pthread_t *threads;
+   unsigned int started;
+   unsigned int maxThreads;      // Workers are added on demand up to this
+   size_t stackSize;
+   unsigned int maxQueued;
+   uint32_t nextId;
+   int shutdown;
+   int notifyRead, notifyWrite;
+   struct ThreadPoolStats stats;
+};
+
+// The job the calling worker thread is running
+static __thread struct TPoolJob *currentJob = NULL;
+
+static void tpool_list_push(struct TPoolList *list, struct TPoolJob *job)
+{
+   job->next = NULL;
+   if (list->tail)
+      list->tail->next = job;
+   else
+      list->head = job;
+   list->tail = job;
+}
+
+static struct TPoolJob *tpool_list_pop(struct TPoolList *list)
+{
+   struct TPoolJob *job = list->head;
+
+   if (job) {
+      list->head = job->next;
+      if (!list->head)
+         list->tail = NULL;
+      job->next = NULL;
+   }
+   return job;
+}
+
+// Unlinks and returns the job with the given id, or NULL
+static struct TPoolJob *tpool_list_take(struct TPoolList *list, uint32_t id)
+{
+   struct TPoolJob **curr, *prev = NULL, *job;
+
+   for (curr = &list->head; *curr; prev = *curr, curr = &(*curr)->next) {
+      if ((*curr)->id != id)
+         continue;
+      job = *curr;
+      *curr = job->next;
+      if (list->tail == job)
+         list->tail = prev;
+      job->next = NULL;
+      return job;
+   }
+   return NULL;
+}
+
+static struct TPoolJob *tpool_list_find(struct TPoolList *list, uint32_t id)
+{
+   struct TPoolJob *job;
+
+   for (job = list->head; job; job = job->next)
+      if (job->id == id)
+         return job;
+   return NULL;
+}
+
+static void tpool_list_free(struct TPoolList *list)
+{
+   struct TPoolJob *job;
+
+   while ((job = tpool_list_pop(list)))
+      free(job);
+}
+
+static void tpool_notify(struct ThreadPool *pool)
+{
+#ifdef __linux__
+   uint64_t one = 1;
+
+   if (write(pool->notifyWrite, &one, sizeof(one)) < 0 && errno != EAGAIN)
+      ERRNO_WARN("thread pool notify failed");
+#else
+   char one = 1;
+
+   if (write(pool->notifyWrite, &one, sizeof(one)) < 0 && errno != EAGAIN)
+      ERRNO_WARN("thread pool notify failed");
+#endif
+}
+
+static void *tpool_worker(void *arg)
+{
+   struct ThreadPool *pool = (struct ThreadPool*)arg;
+   struct TPoolJob *job;
+   int i, notify;
+
+   pthread_mutex_lock(&pool->lock);
+   for (;;) {
+      job = NULL;
+      while (!pool->shutdown) {
+         for (i = 0; i < TPOOL_PRI_COUNT && !job; i++)
+            job = tpool_list_pop(&pool->queues[i]);
+         if (job)
+            break;
+         pthread_cond_wait(&pool->wake, &pool->lock);
+      }
+      if (!job)
+         break;
+
+      pool->stats.queued--;
+      pool->stats.running++;
+      tpool_list_push(&pool->running, job);
+      pthread_mutex_unlock(&pool->lock);
+
+      currentJob = job;
+      job->retval = job->work(job->arg);
+      currentJob = NULL;
+
+      pthread_mutex_lock(&pool->lock);
+      tpool_list_take(&pool->running, job->id);
+      pool->stats.running--;
+      // Only the first finished job needs to wake the event loop; it
+      //  collects everything on the list
+      notify = !pool->done.head;
+      tpool_list_push(&pool->done, job);
+      if (notify)
+         tpool_notify(pool);
+   }
+   pthread_mutex_unlock(&pool->lock);
+
+   return NULL;
+}
+
+// Runs the done callbacks of finished jobs in the event loop thread
+static int tpool_done_cb(int fd, char type, void *arg)
+{
+   struct ThreadPool *pool = (struct ThreadPool*)arg;
+   struct TPoolList done;
+   struct TPoolJob *job;
+   uint64_t completed = 0;
+   char buff[64];
+
+   while (read(fd, buff, sizeof(buff)) > 0)
+      ;
+
+   pthread_mutex_lock(&pool->lock);
+   done = pool->done;
+   pool->done.head = pool->done.tail = NULL;
+   pthread_mutex_unlock(&pool->lock);
+
+   while ((job = tpool_list_pop(&done))) {
+      if (job->done)
+         job->done(job->doneArg, job->retval, job->cancelled);
+      completed++;
+      free(job);
+   }
+
+   // Workers update the other counters concurrently
+   pthread_mutex_lock(&pool->lock);
+   pool->stats.completed += completed;
+   pthread_mutex_unlock(&pool->lock);
+
+   return EVENT_KEEP;
+}
+
+static int tpool_open_notify(struct ThreadPool *pool)
+{
+#ifdef __linux__
+   pool->notifyRead = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if (pool->notifyRead < 0)
+      return -1;
+   pool->notifyWrite = pool->notifyRead;
+#else
+   int fds[2];
+
+   if (pipe(fds) < 0)
+      return -1;
+   fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+   fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+   fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+   fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+   pool->notifyRead = fds[0];
+   pool->notifyWrite = fds[1];
+#endif
+
+   return 0;
+}
+
+static void tpool_close_notify(struct ThreadPool *pool)
+{
+   if (pool->notifyRead >= 0)
+      close(pool->notifyRead);
+   if (pool->notifyWrite >= 0 && pool->notifyWrite != pool->notifyRead)
+      close(pool->notifyWrite);
+}
+
+/* Starts workers until there are count of them.  Called with the lock held
+ * once the pool is running.
+ */
+static void tpool_start_workers(struct ThreadPool *pool, unsigned int count)
+{
+   pthread_attr_t attr;
+   sigset_t all, prev;
+
+   pthread_attr_init(&attr);
+   if (pool->stackSize &&
+         pthread_attr_setstacksize(&attr, pool->stackSize) != 0)
+      DBG_print(DBG_LEVEL_WARN, "Ignoring thread pool stack size %lu\n",
+            (unsigned long)pool->stackSize);
+   // Workers never take signals; they are left to the event loop
+   sigfillset(&all);
+   pthread_sigmask(SIG_BLOCK, &all, &prev);
+   for (; pool->started < count; pool->started++)
+      if (pthread_create(&pool->threads[pool->started], &attr,
+               &tpool_worker, pool))
+         break;
+   pthread_sigmask(SIG_SETMASK, &prev, NULL);
+   pthread_attr_destroy(&attr);
+
+   pool->stats.threads = pool->started;
+}
+
+struct ThreadPool *TPOOL_create(EVTHandler *evt, unsigned int threads,
+      unsigned int maxQueued, size_t stackSize)
+{
+   struct ThreadPool *pool;
+
+   if (!evt || !threads || !maxQueued)
+      return NULL;
+
+   pool = (struct ThreadPool*)malloc(sizeof(*pool));
+   if (!pool)
+      return NULL;
+   memset(pool, 0, sizeof(*pool));
+   pool->evt = evt;
+   pool->maxQueued = maxQueued;
+   pool->maxThreads = threads;
+   pool->stackSize = stackSize;
+   pool->notifyRead = pool->notifyWrite = -1;
+
+   pool->threads = (pthread_t*)malloc(sizeof(pthread_t) * threads);
+   if (!pool->threads || tpool_open_notify(pool) < 0) {
+      tpool_close_notify(pool);
+      free(pool->threads);
+      free(pool);
+      return NULL;
+   }
+   pthread_mutex_init(&pool->lock, NULL);
+   pthread_cond_init(&pool->wake, NULL);
+
+   EVT_fd_add(evt, pool->notifyRead, EVENT_FD_READ, &tpool_done_cb, pool);
+   EVT_fd_set_name(evt, pool->notifyRead, "Thread pool");
+
+   tpool_start_workers(pool, threads);
+   if (!pool->started) {
+      TPOOL_free(pool);
+      return NULL;
+   }
+
+   return pool;
+}
+
+int TPOOL_set_max_threads(struct ThreadPool *pool, unsigned int maxThreads)
+{
+   pthread_t *threads;
+
+   if (!pool || !maxThreads)
+      return -1;
+
+   pthread_mutex_lock(&pool->lock);
+   // Running workers are kept; a lower cap only stops further growth
+   if (maxThreads > pool->started) {
+      threads = (pthread_t*)realloc(pool->threads,
+            sizeof(pthread_t) * maxThreads);
+      if (!threads) {
+         pthread_mutex_unlock(&pool->lock);
+         return -1;
+      }
+      pool->threads = threads;
+   }
+   pool->maxThreads = maxThreads;
+   pthread_mutex_unlock(&pool->lock);
+
+   return 0;
+}
+
+void TPOOL_free(struct ThreadPool *pool)
+{
+   unsigned int i;
+
+   if (!pool)
+      return;
+
+   pthread_mutex_lock(&pool->lock);
+   pool->shutdown = 1;
+   for (i = 0; i < TPOOL_PRI_COUNT; i++)
+      tpool_list_free(&pool->queues[i]);
+   pthread_cond_broadcast(&pool->wake);
+   pthread_mutex_unlock(&pool->lock);
+
+   for (i = 0; i < pool->started; i++)
+      pthread_join(pool->threads[i], NULL);
+
+   tpool_list_free(&pool->done);
+   EVT_fd_remove(pool->evt, pool->notifyRead, EVENT_FD_READ);
+   tpool_close_notify(pool);
+   pthread_cond_destroy(&pool->wake);
+   pthread_mutex_destroy(&pool->lock);
+   free(pool->threads);
+   free(pool);
+}
+
+uint32_t TPOOL_submit(struct ThreadPool *pool, enum TPOOL_PRIORITY priority,
+      TPOOL_work_cb work, void *arg, TPOOL_done_cb done, void *done_arg)
+{
+   struct TPoolJob *job;
+   uint32_t id;
+
+   if (!pool || !work || priority < 0 || priority >= TPOOL_PRI_COUNT)
+      return 0;
+
+   job = (struct TPoolJob*)malloc(sizeof(*job));
+   if (!job)
+      return 0;
+   memset(job, 0, sizeof(*job));
+   job->work = work;
+   job->arg = arg;
+   job->done = done;
+   job->doneArg = done_arg;
+
+   pthread_mutex_lock(&pool->lock);
+   if (pool->stats.queued >= pool->maxQueued || pool->shutdown) {
+      pool->stats.rejected++;
+      pthread_mutex_unlock(&pool->lock);
+      free(job);
+      return 0;
+   }
+
+   if (!++pool->nextId)
+      pool->nextId++;
+   id = job->id = pool->nextId;
+   tpool_list_push(&pool->queues[priority], job);
+   pool->stats.queued++;
+   // Add a worker rather than make the job wait behind busy ones
+   if (pool->stats.queued + pool->stats.running > pool->started &&
+         pool->started < pool->maxThreads)
+      tpool_start_workers(pool, pool->started + 1);
+   pthread_cond_signal(&pool->wake);
+   pthread_mutex_unlock(&pool->lock);
+
+   return id;
+}
+
+int TPOOL_cancel(struct ThreadPool *pool, uint32_t id)
+{
+   struct TPoolJob *job = NULL;
+   int i, res = -1;
+
+   if (!pool || !id)
+      return -1;
+
+   pthread_mutex_lock(&pool->lock);
+   for (i = 0; i < TPOOL_PRI_COUNT && !job; i++)
+      job = tpool_list_take(&pool->queues[i], id);
+   if (job) {
+      pool->stats.queued--;
+      free(job);
+      res = 0;
+   }
+   else if ((job = tpool_list_find(&pool->running, id)) ||
+         (job = tpool_list_find(&pool->done, id))) {
+      __atomic_store_n(&job->cancelled, 1, __ATOMIC_RELAXED);
+      res = 1;
+   }
+   pthread_mutex_unlock(&pool->lock);
+
+   return res;
+}
+
+int TPOOL_cancel_requested(void)
+{
+   if (!currentJob)
+      return 0;
+   return __atomic_load_n(&currentJob->cancelled, __ATOMIC_RELAXED);
+}
+
+void TPOOL_get_stats(struct ThreadPool *pool, struct ThreadPoolStats *stats)
+{
+   if (!pool) {
+      memset(stats, 0, sizeof(*stats));
+      return;
+   }
+
+   pthread_mutex_lock(&pool->lock);
+   *stats = pool->stats;
+   pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,131 @@
+/*
+ * Copyright PolySat, California Polytechnic State University, San Luis Obispo. cubesat@calpoly.edu
+ * This file is part of libproc, a PolySat library.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/**
+ * @file threadPool.h Persistent worker threads for offloading blocking work.
+ *
+ * Worker threads pull jobs from a bounded, prioritized queue.  The pool starts
+ * with a few workers and adds one whenever a job would otherwise wait behind
+ * busy workers, up to a configurable cap.
+ * Finished jobs are handed back to the event loop through one eventfd (a pipe
+ * where eventfd is not available), so every done callback runs in the event
+ * loop thread.
+ */
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <stdint.h>
+#include "events.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct ThreadPool;
+
+/** Job priorities, highest first */
+enum TPOOL_PRIORITY {
+   TPOOL_PRI_HIGH = 0,
+   TPOOL_PRI_NORMAL,
+   TPOOL_PRI_LOW,
+   TPOOL_PRI_COUNT
+};
+
+/** Runs on a worker thread.  The return value is passed to the done cb. */
+typedef int (*TPOOL_work_cb)(void *arg);
+
+/**
+ * Runs on the event loop thread once a job has finished.
+ *
+ * @param arg       The done_arg given to TPOOL_submit.
+ * @param retval    The work function's return value.
+ * @param cancelled Non-zero if TPOOL_cancel was called while the job ran.
+ */
+typedef void (*TPOOL_done_cb)(void *arg, int retval, int cancelled);
+
+/** Counters for a pool */
+struct ThreadPoolStats {
+   unsigned int threads;     // Worker threads
+   unsigned int queued;      // Jobs waiting for a worker
+   unsigned int running;     // Jobs on a worker right now
+   uint64_t completed;       // Jobs whose done callback has run
+   uint64_t rejected;        // Submissions refused because the queue was full
+};
+
+/**
+ * Creates a pool and starts its workers.
+ *
+ * @param evt       The event loop that done callbacks run in.
+ * @param threads   The number of worker threads to start with, which is
+ *                  also the cap until TPOOL_set_max_threads raises it.
+ * @param maxQueued The most jobs that may wait for a worker at once.
+ * @param stackSize The stack size of each worker, or 0 for the default.
+ *
+ * @return The new pool, or NULL on failure.
+ */
+struct ThreadPool *TPOOL_create(EVTHandler *evt, unsigned int threads,
+      unsigned int maxQueued, size_t stackSize);
+
+/**
+ * Sets the most worker threads the pool will grow to.  Workers that are
+ * already running are never stopped, so lowering the cap only prevents
+ * further growth.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int TPOOL_set_max_threads(struct ThreadPool *pool, unsigned int maxThreads);
+
+/**
+ * Stops and frees the pool.  Jobs still queued are discarded, running jobs
+ * are waited for, and no further done callbacks are made.
+ */
+void TPOOL_free(struct ThreadPool *pool);
+
+/**
+ * Queues a job.
+ *
+ * @return A non-zero job id that can be passed to TPOOL_cancel, or 0 if the
+ *         queue is full or memory could not be allocated.
+ */
+uint32_t TPOOL_submit(struct ThreadPool *pool, enum TPOOL_PRIORITY priority,
+      TPOOL_work_cb work, void *arg, TPOOL_done_cb done, void *done_arg);
+
+/**
+ * Cancels a job.  A job that has not started is removed from the queue and
+ * its done callback is never called.  A running job is flagged, which its
+ * work function may poll with TPOOL_cancel_requested(), and is completed as
+ * usual with cancelled set.
+ *
+ * @return 0 if the job was removed before it started, 1 if it was running,
+ *         or -1 if no such job is pending.
+ */
+int TPOOL_cancel(struct ThreadPool *pool, uint32_t id);
+
+/**
+ * Called from a work function, returns non-zero if its job has been
+ * cancelled.
+ */
+int TPOOL_cancel_requested(void);
+
+/** Fills stats with the pool's current counters. */
+void TPOOL_get_stats(struct ThreadPool *pool, struct ThreadPoolStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
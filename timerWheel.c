@@ -0,0 +1,330 @@
+/*
+ * Copyright PolySat, California Polytechnic State University, San Luis Obispo. cubesat@calpoly.edu
+ * This file is part of libproc, a PolySat library.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file timerWheel.c Hierarchical timing wheel.
+ */
+
+#include <string.h>
+#include "timerWheel.h"
+
+#define TWHEEL_SLOT_MASK (TWHEEL_SLOTS - 1)
+#define TWHEEL_UNLINKED (-1)
+#define TWHEEL_EXPIRED (TWHEEL_LEVELS * TWHEEL_SLOTS)
+#define TWHEEL_OVERFLOW (TWHEEL_EXPIRED + 1)
+
+#define level_shift(l) ((l) * TWHEEL_BITS)
+#define prefix(t, l)   ((t) >> level_shift((l) + 1))
+#define digit(t, l)    (((t) >> level_shift(l)) & TWHEEL_SLOT_MASK)
+
+
+static uint64_t tv_to_tick(twheel_t *w, struct timeval *tv)
+{
+    if (tv->tv_sec < 0)
+        return 0;
+
+    return ((uint64_t)tv->tv_sec * 1000000 + tv->tv_usec) / w->resolution;
+}
+
+
+static void tick_to_tv(twheel_t *w, uint64_t tick, struct timeval *tv)
+{
+    uint64_t usec = tick * w->resolution;
+
+    tv->tv_sec = usec / 1000000;
+    tv->tv_usec = usec % 1000000;
+}
+
+
+static void link_entry(twheel_entry_t **head, twheel_entry_t *e, int slot)
+{
+    e->next = *head;
+    if (e->next)
+        e->next->pprev = &e->next;
+    e->pprev = head;
+    *head = e;
+    e->slot = slot;
+}
+
+
+static void unlink_entry(twheel_t *w, twheel_entry_t *e)
+{
+    int level;
+
+    *e->pprev = e->next;
+    if (e->next)
+        e->next->pprev = e->pprev;
+
+    if (e->slot < TWHEEL_EXPIRED) {
+        level = e->slot / TWHEEL_SLOTS;
+        if (!w->slots[level][e->slot % TWHEEL_SLOTS])
+            w->occupied[level] &= ~(1ULL << (e->slot % TWHEEL_SLOTS));
+    }
+
+    e->next = NULL;
+    e->pprev = NULL;
+    e->slot = TWHEEL_UNLINKED;
+}
+
+
+/* The expired list is short and kept sorted on the exact priority so
+ * elements sharing a tick still come out in priority queue order */
+static void place_expired(twheel_t *w, twheel_entry_t *e)
+{
+    twheel_entry_t **curr;
+    struct timeval pri, other;
+
+    pri = w->getpri(e->data);
+    for (curr = &w->expired; *curr; curr = &(*curr)->next) {
+        other = w->getpri((*curr)->data);
+        if (timercmp(&other, &pri, >))
+            break;
+    }
+
+    link_entry(curr, e, TWHEEL_EXPIRED);
+}
+
+
+static void place(twheel_t *w, twheel_entry_t *e)
+{
+    uint64_t diff;
+    int level, idx;
+
+    if (e->tick <= w->current) {
+        place_expired(w, e);
+        return;
+    }
+
+    // The level is picked by the most significant digit that differs from
+    //  the current time, so everything on a lower level expires first
+    diff = e->tick ^ w->current;
+    level = (63 - __builtin_clzll(diff)) / TWHEEL_BITS;
+    if (level >= TWHEEL_LEVELS) {
+        link_entry(&w->overflow, e, TWHEEL_OVERFLOW);
+        return;
+    }
+
+    idx = digit(e->tick, level);
+    link_entry(&w->slots[level][idx], e, level * TWHEEL_SLOTS + idx);
+    w->occupied[level] |= 1ULL << idx;
+}
+
+
+twheel_t *twheel_init(long resolution, twheel_get_pri_f getpri,
+      twheel_get_entry_f getentry)
+{
+    twheel_t *w;
+
+    if (resolution <= 0)
+        return NULL;
+
+    if (!(w = malloc(sizeof(twheel_t))))
+        return NULL;
+    memset(w, 0, sizeof(*w));
+
+    w->resolution = resolution;
+    w->getpri = getpri;
+    w->getentry = getentry;
+
+    return w;
+}
+
+
+void twheel_free(twheel_t *w)
+{
+    free(w);
+}
+
+
+size_t twheel_size(twheel_t *w)
+{
+    return w->size;
+}
+
+
+int twheel_insert(twheel_t *w, void *d)
+{
+    twheel_entry_t *e;
+    struct timeval pri;
+
+    if (!w || !d)
+        return 1;
+
+    e = w->getentry(d);
+    pri = w->getpri(d);
+    e->data = d;
+    e->tick = tv_to_tick(w, &pri);
+    place(w, e);
+    w->size++;
+
+    return 0;
+}
+
+
+int twheel_remove(twheel_t *w, void *d)
+{
+    twheel_entry_t *e = w->getentry(d);
+
+    if (e->slot == TWHEEL_UNLINKED || !e->pprev)
+        return -1;
+
+    unlink_entry(w, e);
+    w->size--;
+
+    return 0;
+}
+
+
+void twheel_advance(twheel_t *w, struct timeval *now)
+{
+    uint64_t t, due, mask;
+    twheel_entry_t *moved = NULL, *e, *next;
+    int level, idx;
+
+    t = tv_to_tick(w, now);
+    if (t <= w->current) {
+        // The clock was replaced or set backwards.  Rebase if nothing in
+        //  the wheel depends on the old time.
+        if (t < w->current && w->size == 0)
+            w->current = t;
+        return;
+    }
+
+    // Pull out every slot whose span starts at or before the new time
+    for (level = 0; level < TWHEEL_LEVELS; level++) {
+        if (prefix(t, level) != prefix(w->current, level))
+            mask = ~0ULL;
+        else if (digit(t, level) == TWHEEL_SLOT_MASK)
+            mask = ~0ULL;
+        else
+            mask = (1ULL << (digit(t, level) + 1)) - 1;
+
+        due = w->occupied[level] & mask;
+        while (due) {
+            idx = __builtin_ctzll(due);
+            due &= due - 1;
+
+            for (e = w->slots[level][idx]; e; e = next) {
+                next = e->next;
+                e->next = moved;
+                moved = e;
+            }
+            w->slots[level][idx] = NULL;
+            w->occupied[level] &= ~(1ULL << idx);
+        }
+    }
+
+    if (w->overflow && prefix(t, TWHEEL_LEVELS - 1) !=
+            prefix(w->current, TWHEEL_LEVELS - 1)) {
+        for (e = w->overflow; e; e = next) {
+            next = e->next;
+            e->next = moved;
+            moved = e;
+        }
+        w->overflow = NULL;
+    }
+
+    // Cascade relative to the new time
+    w->current = t;
+    for (e = moved; e; e = next) {
+        next = e->next;
+        place(w, e);
+    }
+}
+
+
+void *twheel_peek(twheel_t *w)
+{
+    if (!w || !w->expired)
+        return NULL;
+
+    return w->expired->data;
+}
+
+
+void *twheel_pop(twheel_t *w)
+{
+    twheel_entry_t *e;
+
+    if (!w || !w->expired)
+        return NULL;
+
+    e = w->expired;
+    unlink_entry(w, e);
+    w->size--;
+
+    return e->data;
+}
+
+
+int twheel_next_wakeup(twheel_t *w, struct timeval *tv)
+{
+    int level, idx;
+    uint64_t start;
+
+    if (w->expired) {
+        *tv = w->getpri(w->expired->data);
+        return 1;
+    }
+
+    // The lowest occupied level holds the earliest entries, and within a
+    //  level every occupied slot is ahead of the current digit
+    for (level = 0; level < TWHEEL_LEVELS; level++) {
+        if (!w->occupied[level])
+            continue;
+
+        idx = __builtin_ctzll(w->occupied[level]);
+        start = (prefix(w->current, level) << level_shift(level + 1)) |
+            ((uint64_t)idx << level_shift(level));
+        tick_to_tv(w, start, tv);
+        return 1;
+    }
+
+    if (w->overflow) {
+        start = (prefix(w->current, TWHEEL_LEVELS - 1) + 1) <<
+            level_shift(TWHEEL_LEVELS);
+        tick_to_tv(w, start, tv);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+static void visit_list(twheel_entry_t *e, twheel_visit_f visit, void *arg)
+{
+    twheel_entry_t *next;
+
+    for (; e; e = next) {
+        next = e->next;
+        visit(e->data, arg);
+    }
+}
+
+
+void twheel_foreach(twheel_t *w, twheel_visit_f visit, void *arg)
+{
+    int level, idx;
+
+    visit_list(w->expired, visit, arg);
+    for (level = 0; level < TWHEEL_LEVELS; level++)
+        for (idx = 0; idx < TWHEEL_SLOTS; idx++)
+            if (w->occupied[level] & (1ULL << idx))
+                visit_list(w->slots[level][idx], visit, arg);
+    visit_list(w->overflow, visit, arg);
+}
@@ -0,0 +1,181 @@
+/*
+ * Copyright PolySat, California Polytechnic State University, San Luis Obispo. cubesat@calpoly.edu
+ * This file is part of libproc, a PolySat library.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file timerWheel.h Hierarchical timing wheel.
+ *
+ * A hashed, hierarchical timing wheel that provides O(1) insertion and
+ * cancellation of timers and amortized O(1) expiry.  Entries are intrusive:
+ * each element embeds a twheel_entry_t which the wheel finds through a
+ * callback, mirroring the position callbacks used by priorityQueue.h.
+ *
+ * Time is divided into ticks of a fixed resolution.  Entries are hashed into
+ * one of TWHEEL_LEVELS wheels of TWHEEL_SLOTS slots based on the highest tick
+ * digit in which they differ from the current time, and cascade to lower
+ * levels as time advances.  Entries whose tick has been reached are moved to
+ * an expired list that is kept sorted on the exact (sub-tick) priority, so
+ * entries are always popped in the same order a priority queue would produce.
+ */
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TWHEEL_BITS 6
+#define TWHEEL_SLOTS (1 << TWHEEL_BITS)
+#define TWHEEL_LEVELS 5
+
+/** Linkage embedded in every element stored in the wheel */
+typedef struct twheel_entry
+{
+    struct twheel_entry *next;
+    struct twheel_entry **pprev;
+    void *data;
+    uint64_t tick;
+    int slot;
+} twheel_entry_t;
+
+/** callback functions to get the priority and entry of an element */
+typedef struct timeval (*twheel_get_pri_f)(void *a);
+typedef twheel_entry_t *(*twheel_get_entry_f)(void *a);
+
+/** callback used to visit every element in the wheel */
+typedef void (*twheel_visit_f)(void *a, void *arg);
+
+/** the timer wheel handle */
+typedef struct twheel_t
+{
+    uint64_t current;
+    size_t size;
+    long resolution;
+    twheel_get_pri_f getpri;
+    twheel_get_entry_f getentry;
+    uint64_t occupied[TWHEEL_LEVELS];
+    twheel_entry_t *slots[TWHEEL_LEVELS][TWHEEL_SLOTS];
+    twheel_entry_t *expired;
+    twheel_entry_t *overflow;
+} twheel_t;
+
+
+/**
+ * initialize the wheel
+ *
+ * @param resolution the length of one tick, in microseconds
+ * @param getpri the callback function to get an element's expiration time
+ * @param getentry the callback function to get an element's wheel linkage
+ *
+ * @Return the handle or NULL for insufficent memory
+ */
+twheel_t *twheel_init(long resolution, twheel_get_pri_f getpri,
+      twheel_get_entry_f getentry);
+
+
+/**
+ * free all memory used by the wheel.  Elements are not freed.
+ * @param w the wheel
+ */
+void twheel_free(twheel_t *w);
+
+
+/**
+ * return the number of elements in the wheel.
+ * @param w the wheel
+ */
+size_t twheel_size(twheel_t *w);
+
+
+/**
+ * insert an element into the wheel.  O(1) unless the element has
+ * already expired.
+ * @param w the wheel
+ * @param d the element
+ * @return 0 on success
+ */
+int twheel_insert(twheel_t *w, void *d);
+
+
+/**
+ * remove an element from the wheel in O(1).
+ * @param w the wheel
+ * @param d the element
+ * @return 0 on success, -1 if the element is not in the wheel
+ */
+int twheel_remove(twheel_t *w, void *d);
+
+
+/**
+ * advance the wheel's notion of the current time, cascading entries
+ * into lower levels and moving entries whose tick has been reached onto
+ * the expired list.
+ * @param w the wheel
+ * @param now the current time
+ */
+void twheel_advance(twheel_t *w, struct timeval *now);
+
+
+/**
+ * access the earliest expired element without removing it.  The element's
+ * exact priority may still be slightly in the future, since expiry is
+ * tracked at tick resolution.
+ * @param w the wheel
+ * @return NULL if no element has expired, otherwise the element
+ */
+void *twheel_peek(twheel_t *w);
+
+
+/**
+ * remove and return the earliest expired element.
+ * @param w the wheel
+ * @return NULL if no element has expired, otherwise the element
+ */
+void *twheel_pop(twheel_t *w);
+
+
+/**
+ * compute the time by which twheel_advance needs to be called again.
+ * This is the exact priority of the earliest expired element, or the
+ * start of the next occupied slot, which is never later than the
+ * earliest element it contains.
+ * @param w the wheel
+ * @param tv where to store the wakeup time
+ * @return 0 if the wheel is empty, otherwise 1
+ */
+int twheel_next_wakeup(twheel_t *w, struct timeval *tv);
+
+
+/**
+ * call a function for every element in the wheel.  The visitor may remove
+ * the element it is passed.
+ * @param w the wheel
+ * @param visit the callback
+ * @param arg passed through to the callback
+ */
+void twheel_foreach(twheel_t *w, twheel_visit_f visit, void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
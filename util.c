@@ -23,7 +23,10 @@
 #include <sys/types.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
+#include <signal.h>
+#include <errno.h>
 #include <sys/time.h>
 
 #include "util.h"
@@ -347,6 +350,34 @@ int UTIL_ensure_dir(const char *toDir)
    return 1;
 }
 
+/* Runs a shell command and waits for it, like system(), except that the
+ * command starts with no signals blocked.  The event loop blocks the signals
+ * it reads from a signalfd, and that mask would otherwise survive the exec.
+ */
+static int util_system(const char *cmd)
+{
+   sigset_t none;
+   pid_t pid;
+   int status;
+
+   pid = fork();
+   if (pid < 0)
+      return -1;
+
+   if (!pid) {
+      sigemptyset(&none);
+      sigprocmask(SIG_SETMASK, &none, NULL);
+      execl("/bin/sh", "sh", "-c", cmd, (char*)NULL);
+      _exit(127);
+   }
+
+   while (waitpid(pid, &status, 0) < 0)
+      if (errno != EINTR)
+         return -1;
+
+   return status;
+}
+
 int UTIL_ensure_path(const char *toDir)
 {
    char buff[PATH_MAX];
@@ -357,7 +388,7 @@ int UTIL_ensure_path(const char *toDir)
    snprintf(buff, sizeof(buff), "mkdir -p \"%s\"", toDir);
    buff[sizeof(buff)-1] = 0;
 
-   if(system(buff) == -1) {
+   if(util_system(buff) == -1) {
       ERR_REPORT(DBG_LEVEL_WARN, "error running mkdir");
       return 0;
    }
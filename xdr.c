@@ -4,16 +4,380 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <pthread.h>
 #include "xdr.h"
 #include "events.h"
 #include "hashtable.h"
+#include "memPool.h"
 #include <inttypes.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define XDR_X86_SWAP
+#endif
 
 #define ASCII2HEX(c) ( ( (c) >= '0' && (c) <= '9' ? (c) - '0' : \
       ((c) >= 'A' && (c) <= 'F' ? (c) - 'A' + 10 : \
       ((c) >= 'a' && (c) <= 'f' ? (c) - 'a' + 10 : 0 ))) & 0xF)
 
 static struct HashTable *structHash = NULL;
+static struct HashTable *settingsHash = NULL;
+static __thread uint32_t decodeFlags = 0;
+static __thread struct MemArena *decodeArena = NULL;
+
+static void xdr_codec_register(struct XDR_StructDefinition *def);
+
+// Allocation for decoded data, from the thread's arena when one is set
+static void *xdr_alloc(size_t size)
+{
+   if (decodeArena)
+      return MPOOL_arena_alloc(decodeArena, size);
+   return malloc(size);
+}
+
+// While an arena is set everything decoded comes from it, so frees are
+//  skipped rather than looked up and the reset releases the lot
+static void xdr_release(void *ptr)
+{
+   if (decodeArena)
+      return;
+   free(ptr);
+}
+
+// Opaque fields decoded with XDR_DECODE_BORROW point into the source buffer.
+//  Each one is recorded here when it is decoded, so freeing it later skips
+//  the free() whatever thread it happens on and whatever flags are set then.
+struct XDR_Borrowed {
+   char *ptr;
+   unsigned int refs;   // Fields currently borrowing ptr
+};
+
+#define BORROWED_HASH_SIZE 61
+#define BORROWED_POOL_SLAB 32
+
+static pthread_mutex_t borrowedLock = PTHREAD_MUTEX_INITIALIZER;
+static struct HashTable *borrowedHash = NULL;
+static struct MemPool *borrowedPool = NULL;
+static unsigned int borrowedCnt = 0;
+
+static size_t xdr_borrowed_hash_func(void *key)
+{
+   return ((uintptr_t)key) >> 2;
+}
+
+static void *xdr_borrowed_key_for_data(void *data)
+{
+   return ((struct XDR_Borrowed*)data)->ptr;
+}
+
+static int xdr_borrowed_cmp_key(void *key1, void *key2)
+{
+   return key1 == key2;
+}
+
+// Records a borrowed field.  Returns -1 if it couldn't be recorded, in which
+//  case the caller copies the data instead.
+static int xdr_borrow_mark(char *ptr)
+{
+   struct XDR_Borrowed *rec;
+   int res = -1;
+
+   pthread_mutex_lock(&borrowedLock);
+   if (!borrowedHash) {
+      borrowedHash = HASH_create_table(BORROWED_HASH_SIZE,
+            &xdr_borrowed_hash_func, &xdr_borrowed_cmp_key,
+            &xdr_borrowed_key_for_data);
+      borrowedPool = MPOOL_create(sizeof(struct XDR_Borrowed),
+            BORROWED_POOL_SLAB);
+   }
+
+   if (borrowedHash && borrowedPool) {
+      rec = (struct XDR_Borrowed*)HASH_find_key(borrowedHash, ptr);
+      if (rec) {
+         rec->refs++;
+         res = 0;
+      }
+      else if ((rec = (struct XDR_Borrowed*)MPOOL_alloc(borrowedPool))) {
+         rec->ptr = ptr;
+         rec->refs = 1;
+         if (HASH_add_data(borrowedHash, rec) >= 0) {
+            __atomic_add_fetch(&borrowedCnt, 1, __ATOMIC_RELEASE);
+            res = 0;
+         }
+         else
+            MPOOL_release(borrowedPool, rec);
+      }
+   }
+   pthread_mutex_unlock(&borrowedLock);
+
+   return res;
+}
+
+// Drops one borrow of ptr.  Returns non-zero if ptr was borrowed and so must
+//  not be freed.
+static int xdr_borrow_release(void *ptr)
+{
+   struct XDR_Borrowed *rec;
+
+   if (!__atomic_load_n(&borrowedCnt, __ATOMIC_ACQUIRE))
+      return 0;
+
+   pthread_mutex_lock(&borrowedLock);
+   rec = (struct XDR_Borrowed*)HASH_find_key(borrowedHash, ptr);
+   if (rec && !--rec->refs) {
+      HASH_remove_key(borrowedHash, ptr);
+      MPOOL_release(borrowedPool, rec);
+      __atomic_sub_fetch(&borrowedCnt, 1, __ATOMIC_RELEASE);
+   }
+   pthread_mutex_unlock(&borrowedLock);
+
+   return rec != NULL;
+}
+
+// Bulk conversion between host order and the big-endian wire order of
+//  32- and 64-bit array elements.  The vector kernels are picked at runtime
+//  on x86; everything else uses the scalar loop.
+typedef void (*xdr_swap_func)(void *dst, const void *src, size_t count);
+
+static void xdr_swap32_scalar(void *dst, const void *src, size_t count)
+{
+   const char *in = (const char*)src;
+   char *out = (char*)dst;
+   uint32_t val;
+   size_t i;
+
+   for (i = 0; i < count; i++, in += 4, out += 4) {
+      memcpy(&val, in, 4);
+      val = ntohl(val);
+      memcpy(out, &val, 4);
+   }
+}
+
+static void xdr_swap64_scalar(void *dst, const void *src, size_t count)
+{
+   const char *in = (const char*)src;
+   char *out = (char*)dst;
+   uint32_t hi, lo;
+   uint64_t val;
+   size_t i;
+
+   for (i = 0; i < count; i++, in += 8, out += 8) {
+      memcpy(&hi, in, 4);
+      memcpy(&lo, in + 4, 4);
+      val = ((uint64_t)ntohl(hi) << 32) | ntohl(lo);
+      memcpy(out, &val, 8);
+   }
+}
+
+#ifdef XDR_X86_SWAP
+__attribute__((target("sse2")))
+static void xdr_swap32_sse2(void *dst, const void *src, size_t count)
+{
+   const char *in = (const char*)src;
+   char *out = (char*)dst;
+   __m128i v;
+   size_t i;
+
+   for (i = 0; i + 4 <= count; i += 4, in += 16, out += 16) {
+      v = _mm_loadu_si128((const __m128i*)in);
+      v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+      v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+      v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+      _mm_storeu_si128((__m128i*)out, v);
+   }
+   xdr_swap32_scalar(out, in, count - i);
+}
+
+__attribute__((target("sse2")))
+static void xdr_swap64_sse2(void *dst, const void *src, size_t count)
+{
+   const char *in = (const char*)src;
+   char *out = (char*)dst;
+   __m128i v;
+   size_t i;
+
+   for (i = 0; i + 2 <= count; i += 2, in += 16, out += 16) {
+      v = _mm_loadu_si128((const __m128i*)in);
+      v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+      v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+      v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+      _mm_storeu_si128((__m128i*)out, v);
+   }
+   xdr_swap64_scalar(out, in, count - i);
+}
+
+__attribute__((target("avx2")))
+static void xdr_swap32_avx2(void *dst, const void *src, size_t count)
+{
+   const char *in = (const char*)src;
+   char *out = (char*)dst;
+   const __m256i mask = _mm256_setr_epi8(
+         3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+         3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+   __m256i v;
+   size_t i;
+
+   for (i = 0; i + 8 <= count; i += 8, in += 32, out += 32) {
+      v = _mm256_loadu_si256((const __m256i*)in);
+      _mm256_storeu_si256((__m256i*)out, _mm256_shuffle_epi8(v, mask));
+   }
+   xdr_swap32_sse2(out, in, count - i);
+}
+
+__attribute__((target("avx2")))
+static void xdr_swap64_avx2(void *dst, const void *src, size_t count)
+{
+   const char *in = (const char*)src;
+   char *out = (char*)dst;
+   const __m256i mask = _mm256_setr_epi8(
+         7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+         7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+   __m256i v;
+   size_t i;
+
+   for (i = 0; i + 4 <= count; i += 4, in += 32, out += 32) {
+      v = _mm256_loadu_si256((const __m256i*)in);
+      _mm256_storeu_si256((__m256i*)out, _mm256_shuffle_epi8(v, mask));
+   }
+   xdr_swap64_sse2(out, in, count - i);
+}
+#endif
+
+static void xdr_swap32_init(void *dst, const void *src, size_t count);
+static void xdr_swap64_init(void *dst, const void *src, size_t count);
+
+static xdr_swap_func xdr_swap32 = &xdr_swap32_init;
+static xdr_swap_func xdr_swap64 = &xdr_swap64_init;
+
+// Resolves the kernels on first use
+static void xdr_swap_select(void)
+{
+   xdr_swap_func s32 = &xdr_swap32_scalar, s64 = &xdr_swap64_scalar;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ && defined(XDR_X86_SWAP)
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("avx2")) {
+      s32 = &xdr_swap32_avx2;
+      s64 = &xdr_swap64_avx2;
+   }
+   else if (__builtin_cpu_supports("sse2")) {
+      s32 = &xdr_swap32_sse2;
+      s64 = &xdr_swap64_sse2;
+   }
+#endif
+
+   xdr_swap32 = s32;
+   xdr_swap64 = s64;
+}
+
+static void xdr_swap32_init(void *dst, const void *src, size_t count)
+{
+   xdr_swap_select();
+   xdr_swap32(dst, src, count);
+}
+
+static void xdr_swap64_init(void *dst, const void *src, size_t count)
+{
+   xdr_swap_select();
+   xdr_swap64(dst, src, count);
+}
+
+int XDR_swap_kernel(enum XDR_SwapKernel kernel, size_t width, void *dst,
+      const void *src, size_t count)
+{
+   xdr_swap_func s32 = NULL, s64 = NULL;
+
+   switch (kernel) {
+      case XDR_SWAP_SCALAR:
+         s32 = &xdr_swap32_scalar;
+         s64 = &xdr_swap64_scalar;
+         break;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ && defined(XDR_X86_SWAP)
+      case XDR_SWAP_SSE2:
+         __builtin_cpu_init();
+         if (__builtin_cpu_supports("sse2")) {
+            s32 = &xdr_swap32_sse2;
+            s64 = &xdr_swap64_sse2;
+         }
+         break;
+      case XDR_SWAP_AVX2:
+         __builtin_cpu_init();
+         if (__builtin_cpu_supports("avx2")) {
+            s32 = &xdr_swap32_avx2;
+            s64 = &xdr_swap64_avx2;
+         }
+         break;
+#endif
+      default:
+         break;
+   }
+
+   if (width == sizeof(uint32_t) && s32)
+      s32(dst, src, count);
+   else if (width == sizeof(uint64_t) && s64)
+      s64(dst, src, count);
+   else
+      return -1;
+
+   return 0;
+}
+
+// Decodes len elements of the given width with one bounds check.  A NULL
+//  swap copies the elements unchanged.
+static int xdr_bulk_decode(char *src, void *dst, size_t *used, size_t max,
+      int32_t len, size_t width, xdr_swap_func swap)
+{
+   size_t bytes;
+   char *buff;
+
+   *used = 0;
+   if (!dst)
+      return -2;
+   if (len < 0 || (size_t)len > max / width)
+      return -1;
+   bytes = (size_t)len * width;
+
+   buff = xdr_alloc(bytes);
+   if (!buff)
+      return -1;
+   if (swap)
+      swap(buff, src, len);
+   else
+      memcpy(buff, src, bytes);
+
+   *used = bytes;
+   *(char**)dst = buff;
+
+   return 0;
+}
+
+static int xdr_bulk_encode(void *src_ptr, char *dst, size_t *used,
+      size_t max, int32_t len, size_t width, xdr_swap_func swap)
+{
+   const char *src = NULL;
+   size_t bytes;
+
+   *used = 0;
+   if (len <= 0)
+      return 0;
+   bytes = (size_t)len * width;
+   *used = bytes;
+
+   if (!dst)
+      return 0;
+   if (src_ptr)
+      src = *(const char**)src_ptr;
+   if (!src)
+      return -1;
+   if (max < bytes)
+      return -2;
+
+   if (swap)
+      swap(dst, src, len);
+   else
+      memcpy(dst, src, bytes);
+
+   return 0;
+}
 
 static size_t xdr_struct_hash_func(void *key)
 {
@@ -47,6 +411,7 @@ void XDR_register_struct(struct XDR_StructDefinition *def)
    }
 
    HASH_add_data(structHash, def);
+   xdr_codec_register(def);
 }
 
 void XDR_register_structs(struct XDR_StructDefinition *structs)
@@ -60,9 +425,62 @@ void XDR_register_structs(struct XDR_StructDefinition *structs)
    }
 }
 
+// Per-type settings kept out of XDR_StructDefinition, whose layout is
+//  part of the library ABI
+struct XDR_StructSettings {
+   uint32_t type;
+   uint32_t decode_flags;
+   uint32_t populate_max_age_ms;
+};
+
+static void *xdr_settings_key_for_data(void *data)
+{
+   if (!data)
+      return 0;
+   return (void*)(uintptr_t)(((struct XDR_StructSettings*)data)->type);
+}
+
+static struct XDR_StructSettings *xdr_settings_for_type(uint32_t type,
+      int create)
+{
+   struct XDR_StructSettings *settings = NULL;
+
+   if (!settingsHash) {
+      if (!create)
+         return NULL;
+      settingsHash = HASH_create_table(37, &xdr_struct_hash_func,
+            &xdr_struct_cmp_key, &xdr_settings_key_for_data);
+      if (!settingsHash)
+         return NULL;
+   }
+
+   settings = (struct XDR_StructSettings*)
+      HASH_find_key(settingsHash, (void*)(uintptr_t)type);
+   if (settings || !create)
+      return settings;
+
+   settings = (struct XDR_StructSettings*)calloc(1, sizeof(*settings));
+   if (!settings)
+      return NULL;
+   settings->type = type;
+   if (HASH_add_data(settingsHash, settings) < 0) {
+      free(settings);
+      return NULL;
+   }
+
+   return settings;
+}
+
 void XDR_register_populator(XDR_populate_struct cb, void *arg, uint32_t type)
+{
+   XDR_register_populator_cached(cb, arg, type, 0);
+}
+
+void XDR_register_populator_cached(XDR_populate_struct cb, void *arg,
+      uint32_t type, uint32_t maxAgeMs)
 {
    struct XDR_StructDefinition *def = NULL;
+   struct XDR_StructSettings *settings = NULL;
 
    def = XDR_definition_for_type(type);
    if (!def)
@@ -70,6 +488,21 @@ void XDR_register_populator(XDR_populate_struct cb, void *arg, uint32_t type)
 
    def->populate = cb;
    def->populate_arg = arg;
+
+   settings = xdr_settings_for_type(type, maxAgeMs != 0);
+   if (settings)
+      settings->populate_max_age_ms = maxAgeMs;
+}
+
+uint32_t XDR_populator_max_age(uint32_t type)
+{
+   struct XDR_StructSettings *settings = NULL;
+
+   settings = xdr_settings_for_type(type, 0);
+   if (!settings)
+      return 0;
+
+   return settings->populate_max_age_ms;
 }
 
 void XDR_set_struct_print_function(XDR_print_func func, uint32_t type)
@@ -83,6 +516,39 @@ void XDR_set_struct_print_function(XDR_print_func func, uint32_t type)
    def->print_func = func;
 }
 
+void XDR_set_struct_decode_flags(uint32_t flags, uint32_t type)
+{
+   struct XDR_StructSettings *settings = NULL;
+
+   if (!XDR_definition_for_type(type))
+      return;
+
+   settings = xdr_settings_for_type(type, 1);
+   if (settings)
+      settings->decode_flags = flags;
+}
+
+uint32_t XDR_set_decode_flags(uint32_t flags)
+{
+   uint32_t prev = decodeFlags;
+
+   decodeFlags = flags;
+   return prev;
+}
+
+uint32_t XDR_get_decode_flags(void)
+{
+   return decodeFlags;
+}
+
+struct MemArena *XDR_set_decode_arena(struct MemArena *arena)
+{
+   struct MemArena *prev = decodeArena;
+
+   decodeArena = arena;
+   return prev;
+}
+
 void XDR_set_field_print_function(XDR_print_field_func func,
       uint32_t struct_type, uint32_t field)
 {
@@ -104,13 +570,26 @@ int XDR_decode_byte_array(char *src, char **dst, size_t *used,
    int padding;
 
    memcpy(&byte_len, lenptr, sizeof(byte_len));
-   padding = (4 - (byte_len % 4)) % 4;
    *used = 0;
-   if (!dst || byte_len + padding >= max)
+   // The length comes off the wire, so a negative one is malformed input
+   if (!dst || byte_len < 0)
+      return -1;
+   padding = (4 - (byte_len % 4)) % 4;
+   if ((size_t)byte_len + padding > max)
       return -1;
    *used = byte_len + padding;
 
-   *dst = malloc(byte_len);
+   // Arena decodes are released by resetting the arena and never freed
+   //  field by field, so their borrows don't need recording
+   if ((decodeFlags & XDR_DECODE_BORROW) &&
+         (decodeArena || !xdr_borrow_mark(src))) {
+      *dst = src;
+      return 0;
+   }
+
+   *dst = xdr_alloc(byte_len);
+   if (!*dst)
+      return -1;
    memcpy(*dst, src, byte_len);
 
    return 0;
@@ -125,7 +604,9 @@ int XDR_encode_byte_array(char **src, char *dst, size_t *used, size_t max,
    byte_len = *(int32_t*)lenptr;
    padding = (4 - (byte_len % 4)) % 4;
    *used = byte_len + padding;
-   if (!dst || !src || !*src || byte_len + padding >= max)
+   if (!dst)
+      return 0;
+   if (!src || !*src || byte_len + padding > max)
       return -1;
 
    memcpy(dst, *src, byte_len);
@@ -140,9 +621,8 @@ int XDR_decode_int32_array(char *src, int32_t **dst,
 {
    *used = 0;
    if (len)
-      return XDR_array_decoder(src, (char*)dst, used, max, *(int32_t*)len,
-            sizeof(uint32_t),
-            (XDR_Decoder)&XDR_decode_uint32, NULL);
+      return xdr_bulk_decode(src, dst, used, max, *(int32_t*)len,
+            sizeof(int32_t), xdr_swap32);
 
    return 0;
 }
@@ -183,9 +663,8 @@ int XDR_decode_uint32_array(char *src, uint32_t **dst,
 {
    *used = 0;
    if (len)
-      return XDR_array_decoder(src, (char*)dst, used, max, *(int32_t*)len,
-            sizeof(uint32_t),
-            (XDR_Decoder)&XDR_decode_uint32, NULL);
+      return xdr_bulk_decode(src, dst, used, max, *(int32_t*)len,
+            sizeof(uint32_t), xdr_swap32);
 
    return 0;
 }
@@ -218,9 +697,8 @@ int XDR_decode_int64_array(char *src, int64_t **dst, size_t *used,
 {
    *used = 0;
    if (len)
-      return XDR_array_decoder(src, (char*)dst, used, max, *(int32_t*)len,
-            sizeof(int64_t),
-            (XDR_Decoder)&XDR_decode_int64, NULL);
+      return xdr_bulk_decode(src, dst, used, max, *(int32_t*)len,
+            sizeof(int64_t), xdr_swap64);
 
    return 0;
 }
@@ -256,9 +734,8 @@ int XDR_decode_uint64_array(char *src, uint64_t **dst, size_t *used,
 {
    *used = 0;
    if (len)
-      return XDR_array_decoder(src, (char*)dst, used, max, *(int32_t*)len,
-            sizeof(uint64_t),
-            (XDR_Decoder)&XDR_decode_uint64, NULL);
+      return xdr_bulk_decode(src, dst, used, max, *(int32_t*)len,
+            sizeof(uint64_t), xdr_swap64);
 
    return 0;
 }
@@ -294,9 +771,8 @@ int XDR_decode_float_array(char *src, float **dst, size_t *used,
 {
    *used = 0;
    if (len)
-      return XDR_array_decoder(src, (char*)dst, used, max, *(int32_t*)len,
-            sizeof(float),
-            (XDR_Decoder)&XDR_decode_float, NULL);
+      return xdr_bulk_decode(src, dst, used, max, *(int32_t*)len,
+            sizeof(float), NULL);
 
    return 0;
 }
@@ -318,9 +794,8 @@ int XDR_encode_float_array(float **src, char *dst,
 {
    *used = 0;
    if (len)
-      return XDR_array_encoder((char*)src, dst, used, max, *(int32_t*)len,
-            sizeof(float),
-            (XDR_Encoder)&XDR_encode_float, NULL);
+      return xdr_bulk_encode(src, dst, used, max, *(int32_t*)len,
+            sizeof(float), NULL);
 
    return 0;
 }
@@ -329,6 +804,8 @@ int XDR_encode_float(float *src, char *dst, size_t *used, size_t max,
       void *len)
 {
    *used = sizeof(*src);
+   if (!dst)
+      return 0;
    if (max < *used)
       return -1;
    memcpy(dst, src, *used);
@@ -340,9 +817,8 @@ int XDR_encode_double_array(double **src, char *dst,
 {
    *used = 0;
    if (len)
-      return XDR_array_encoder((char*)src, dst, used, max, *(int32_t*)len,
-            sizeof(double),
-            (XDR_Encoder)&XDR_encode_float, NULL);
+      return xdr_bulk_encode(src, dst, used, max, *(int32_t*)len,
+            sizeof(double), NULL);
 
    return 0;
 }
@@ -351,6 +827,8 @@ int XDR_encode_double(double *src, char *dst, size_t *used, size_t max,
       void *len)
 {
    *used = sizeof(*src);
+   if (!dst)
+      return 0;
    if (max < *used)
       return -1;
    memcpy(dst, src, *used);
@@ -362,9 +840,8 @@ int XDR_decode_double_array(char *src, double **dst, size_t *used,
 {
    *used = 0;
    if (len)
-      return XDR_array_decoder(src, (char*)dst, used, max, *(int32_t*)len,
-            sizeof(double),
-            (XDR_Decoder)&XDR_decode_double, NULL);
+      return xdr_bulk_decode(src, dst, used, max, *(int32_t*)len,
+            sizeof(double), NULL);
 
    return 0;
 }
@@ -398,6 +875,9 @@ int XDR_decode_union(char *src, struct XDR_Union *dst, size_t *inc, size_t max,
 {
    size_t used;
    struct XDR_StructDefinition *def = NULL;
+   struct XDR_StructSettings *settings;
+   uint32_t prev_flags;
+   int res;
 
    *inc = 0;
    dst->data = NULL;
@@ -417,11 +897,19 @@ int XDR_decode_union(char *src, struct XDR_Union *dst, size_t *inc, size_t max,
       return -1;
 
    used = 0;
-   if (def->decoder(src, dst->data, &used, max, def->arg) < 0) {
+   prev_flags = decodeFlags;
+   settings = xdr_settings_for_type(dst->type, 0);
+   if (settings)
+      decodeFlags |= settings->decode_flags;
+   res = def->decoder(src, dst->data, &used, max, def->arg);
+   if (res < 0) {
       def->deallocator(&dst->data, def);
       dst->data = NULL;
-      return -1;
    }
+   decodeFlags = prev_flags;
+   if (res < 0)
+      return -1;
+
    *inc += used;
    return 0;
 } 
@@ -450,9 +938,19 @@ int XDR_decode_string_array(char *src, char **dst, size_t *inc,
    if (used + str_len + padding > max)
       return -1;
 
-   str = malloc(str_len + 1);
-   memcpy(str, src + used, str_len);
-   str[str_len] = 0;
+   // A string is only borrowed when its zero padding already terminates
+   //  it, since the source buffer is never written.  String fields have no
+   //  deallocator, so neither kind is freed field by field.
+   if ((decodeFlags & XDR_DECODE_BORROW) && padding &&
+         !src[used + str_len])
+      str = src + used;
+   else {
+      str = xdr_alloc(str_len + 1);
+      if (!str)
+         return -1;
+      memcpy(str, src + used, str_len);
+      str[str_len] = 0;
+   }
    *dst = str;
    *inc += str_len + padding;
 
@@ -501,9 +999,8 @@ int XDR_encode_uint32_array(uint32_t **src, char *dst,
 {
    *used = 0;
    if (len)
-      return XDR_array_encoder((char*)src, dst, used, max, *(int32_t*)len,
-            sizeof(uint32_t),
-            (XDR_Encoder)&XDR_encode_uint32, NULL);
+      return xdr_bulk_encode(src, dst, used, max, *(int32_t*)len,
+            sizeof(uint32_t), xdr_swap32);
 
    return 0;
 }
@@ -542,9 +1039,8 @@ int XDR_encode_int32_array(int32_t **src, char *dst,
 {
    *used = 0;
    if (len)
-      return XDR_array_encoder((char*)src, dst, used, max, *(int32_t*)len,
-            sizeof(int32_t),
-            (XDR_Encoder)&XDR_encode_int32, NULL);
+      return xdr_bulk_encode(src, dst, used, max, *(int32_t*)len,
+            sizeof(int32_t), xdr_swap32);
 
    return 0;
 }
@@ -573,9 +1069,8 @@ int XDR_encode_int64_array(int64_t **src, char *dst,
 {
    *used = 0;
    if (len)
-      return XDR_array_encoder((char*)src, dst, used, max, *(int32_t*)len,
-            sizeof(int64_t),
-            (XDR_Encoder)&XDR_encode_int64, NULL);
+      return xdr_bulk_encode(src, dst, used, max, *(int32_t*)len,
+            sizeof(int64_t), xdr_swap64);
 
    return 0;
 }
@@ -615,9 +1110,8 @@ int XDR_encode_uint64_array(uint64_t **src, char *dst,
 {
    *used = 0;
    if (len)
-      return XDR_array_encoder((char*)src, dst, used, max, *(int32_t*)len,
-            sizeof(uint64_t),
-            (XDR_Encoder)&XDR_encode_uint64, NULL);
+      return xdr_bulk_encode(src, dst, used, max, *(int32_t*)len,
+            sizeof(uint64_t), xdr_swap64);
 
    return 0;
 }
@@ -694,7 +1188,161 @@ int XDR_encode_union(struct XDR_Union *src, char *dst,
    return 0;
 }
 
-int XDR_struct_decoder(char *src, void *dst_void, size_t *inc,
+int XDR_struct_encoded_size(void *src, uint32_t type, size_t *size)
+{
+   struct XDR_StructDefinition *def = XDR_definition_for_type(type);
+
+   *size = 0;
+   if (!def || !def->encoder)
+      return -1;
+
+   // Encoders only measure when there is no destination
+   if (def->encoder(src, NULL, size, 0, def->type, def->arg) < 0) {
+      *size = 0;
+      return -1;
+   }
+
+   return 0;
+}
+
+int XDR_union_encoded_size(struct XDR_Union *src, size_t *size)
+{
+   size_t len = 0;
+
+   *size = 0;
+   if (!src || XDR_struct_encoded_size(src->data, src->type, &len) < 0)
+      return -1;
+
+   *size = sizeof(uint32_t) + len;
+   return 0;
+}
+
+// Ends the scratch segment that started at *seg_start, if it has any bytes
+static int xdr_iov_close(struct XDR_IOVec *vec, size_t *seg_start)
+{
+   if (vec->buffUsed == *seg_start)
+      return 0;
+   if (vec->iovCount >= vec->iovMax)
+      return -1;
+
+   vec->iov[vec->iovCount].iov_base = vec->buff + *seg_start;
+   vec->iov[vec->iovCount].iov_len = vec->buffUsed - *seg_start;
+   vec->iovCount++;
+   *seg_start = vec->buffUsed;
+
+   return 0;
+}
+
+// Encodes a value into the scratch buffer with its regular encoder
+static int xdr_iov_copy(struct XDR_IOVec *vec, XDR_Encoder enc, void *src,
+      void *len)
+{
+   size_t used = 0;
+
+   if (enc(src, vec->buff + vec->buffUsed, &used,
+            vec->buffLen - vec->buffUsed, len) < 0)
+      return -1;
+   vec->buffUsed += used;
+   vec->len += used;
+
+   return 0;
+}
+
+static int xdr_iov_fields(struct XDR_IOVec *vec, size_t *seg_start,
+      char *src, struct XDR_FieldDefinition *field);
+
+// Encodes a union, walking into its structure when it is table driven
+static int xdr_iov_union(struct XDR_IOVec *vec, size_t *seg_start,
+      struct XDR_Union *u)
+{
+   struct XDR_StructDefinition *def = XDR_definition_for_type(u->type);
+
+   if (!def || def->encoder != &XDR_struct_encoder || !def->arg)
+      return xdr_iov_copy(vec, (XDR_Encoder)&XDR_encode_union, u, NULL);
+
+   if (xdr_iov_copy(vec, (XDR_Encoder)&XDR_encode_uint32, &u->type, NULL) < 0)
+      return -1;
+   return xdr_iov_fields(vec, seg_start, (char*)u->data,
+         (struct XDR_FieldDefinition*)def->arg);
+}
+
+static int xdr_iov_fields(struct XDR_IOVec *vec, size_t *seg_start,
+      char *src, struct XDR_FieldDefinition *field)
+{
+   static const char zeros[4] = { 0, 0, 0, 0 };
+   int32_t byte_len;
+   char *bytes;
+   int padding;
+
+   for (; field->offset || field->funcs; field++) {
+      if (field->funcs == &xdr_union_functions) {
+         if (xdr_iov_union(vec, seg_start,
+                  (struct XDR_Union*)(src + field->offset)) < 0)
+            return -1;
+         continue;
+      }
+
+      if (field->funcs == &xdr_byte_arr_functions) {
+         memcpy(&byte_len, src + field->len_offset, sizeof(byte_len));
+         bytes = *(char**)(src + field->offset);
+         if (bytes && byte_len > 0 && (size_t)byte_len >= vec->refMin) {
+            // Reference the payload where it is, followed by its padding
+            if (xdr_iov_close(vec, seg_start) < 0 ||
+                  vec->iovCount >= vec->iovMax)
+               return -1;
+            vec->iov[vec->iovCount].iov_base = bytes;
+            vec->iov[vec->iovCount].iov_len = byte_len;
+            vec->iovCount++;
+            vec->len += byte_len;
+
+            padding = (4 - (byte_len % 4)) % 4;
+            if (padding) {
+               if (vec->buffLen - vec->buffUsed < padding)
+                  return -1;
+               memcpy(vec->buff + vec->buffUsed, zeros, padding);
+               vec->buffUsed += padding;
+               vec->len += padding;
+            }
+            continue;
+         }
+      }
+
+      if (xdr_iov_copy(vec, field->funcs->encoder, src + field->offset,
+               src + field->len_offset) < 0)
+         return -1;
+   }
+
+   return 0;
+}
+
+int XDR_struct_encode_iov(void *src, uint32_t type, struct XDR_IOVec *vec)
+{
+   struct XDR_StructDefinition *def = XDR_definition_for_type(type);
+   size_t seg_start = 0;
+   size_t used = 0;
+
+   vec->iovCount = 0;
+   vec->buffUsed = 0;
+   vec->len = 0;
+   if (!def || !def->encoder)
+      return -1;
+
+   if (def->encoder == &XDR_struct_encoder && def->arg) {
+      if (xdr_iov_fields(vec, &seg_start, (char*)src,
+               (struct XDR_FieldDefinition*)def->arg) < 0)
+         return -1;
+   }
+   else {
+      if (def->encoder(src, vec->buff, &used, vec->buffLen, def->type,
+               def->arg) < 0)
+         return -1;
+      vec->buffUsed = vec->len = used;
+   }
+
+   return xdr_iov_close(vec, &seg_start);
+}
+
+int XDR_table_struct_decoder(char *src, void *dst_void, size_t *inc,
       size_t max, void *arg)
 {
    size_t used = 0, len = 0;
@@ -718,6 +1366,323 @@ int XDR_struct_decoder(char *src, void *dst_void, size_t *inc,
    return 0;
 }
 
+// Fixed-size field kinds a compiled codec handles without an indirect call
+enum XDR_CodecKind { CODEC_SWAP32, CODEC_SWAP64, CODEC_RAW4, CODEC_RAW8 };
+
+// One fixed-size field inside a run
+struct XDR_CodecSlot {
+   uint32_t offset;
+   uint32_t kind;
+};
+
+// Either a run of fixed-size fields or a single field left to its decoder
+struct XDR_CodecOp {
+   struct XDR_FieldDefinition *field;
+   struct XDR_CodecSlot *slots;
+   size_t count;
+   size_t wire;
+};
+
+struct XDR_CompiledCodec {
+   struct XDR_FieldDefinition *fields;
+   size_t nops;
+   struct XDR_CodecOp *ops;
+   struct XDR_CodecSlot *slots;
+};
+
+static struct HashTable *codecHash = NULL;
+
+// Direct-mapped cache in front of codecHash, indexed by field table address
+#define CODEC_CACHE_SIZE 64
+static __thread struct XDR_CompiledCodec *codecCache[CODEC_CACHE_SIZE];
+#define CODEC_CACHE_SLOT(f) ((((uintptr_t)(f)) >> 4) & (CODEC_CACHE_SIZE - 1))
+
+static size_t xdr_codec_hash_func(void *key)
+{
+   return ((uintptr_t)key) >> 4;
+}
+
+static void *xdr_codec_key_for_data(void *data)
+{
+   if (!data)
+      return NULL;
+   return ((struct XDR_CompiledCodec*)data)->fields;
+}
+
+static int xdr_codec_cmp_key(void *key1, void *key2)
+{
+   return key1 == key2;
+}
+
+// Returns the wire size of a field the compiled codec can inline, else 0
+static size_t xdr_codec_kind(struct XDR_FieldDefinition *field, uint32_t *kind)
+{
+   if (field->funcs == &xdr_uint32_functions ||
+         field->funcs == &xdr_int32_functions) {
+      *kind = CODEC_SWAP32;
+      return 4;
+   }
+   if (field->funcs == &xdr_uint64_functions ||
+         field->funcs == &xdr_int64_functions) {
+      *kind = CODEC_SWAP64;
+      return 8;
+   }
+   if (field->funcs == &xdr_float_functions) {
+      *kind = CODEC_RAW4;
+      return 4;
+   }
+   if (field->funcs == &xdr_double_functions) {
+      *kind = CODEC_RAW8;
+      return 8;
+   }
+
+   return 0;
+}
+
+// Builds the op list for a field table, merging adjacent fixed-size fields
+//  into runs that share one bounds check
+static struct XDR_CompiledCodec *xdr_codec_compile(
+      struct XDR_FieldDefinition *fields)
+{
+   struct XDR_CompiledCodec *codec;
+   struct XDR_FieldDefinition *field;
+   struct XDR_CodecOp *op = NULL;
+   size_t nfields = 0, wire;
+   uint32_t kind;
+
+   for (field = fields; field->offset || field->funcs; field++)
+      nfields++;
+
+   codec = (struct XDR_CompiledCodec*)malloc(sizeof(*codec));
+   if (!codec)
+      return NULL;
+   memset(codec, 0, sizeof(*codec));
+   codec->fields = fields;
+   codec->ops = malloc(sizeof(*codec->ops) * (nfields + 1));
+   codec->slots = malloc(sizeof(*codec->slots) * (nfields + 1));
+   if (!codec->ops || !codec->slots) {
+      free(codec->ops);
+      free(codec->slots);
+      free(codec);
+      return NULL;
+   }
+
+   for (field = fields; field->offset || field->funcs; field++) {
+      wire = xdr_codec_kind(field, &kind);
+      if (!wire) {
+         op = &codec->ops[codec->nops++];
+         op->field = field;
+         op->slots = NULL;
+         op->count = 0;
+         op->wire = 0;
+         op = NULL;
+         continue;
+      }
+
+      if (!op) {
+         op = &codec->ops[codec->nops++];
+         op->field = field;
+         op->slots = &codec->slots[field - fields];
+         op->count = 0;
+         op->wire = 0;
+      }
+      op->slots[op->count].offset = field->offset;
+      op->slots[op->count].kind = kind;
+      op->count++;
+      op->wire += wire;
+   }
+
+   return codec;
+}
+
+static void xdr_codec_register(struct XDR_StructDefinition *def)
+{
+   struct XDR_CompiledCodec *codec;
+
+   if (def->decoder != &XDR_struct_decoder || !def->arg)
+      return;
+
+   if (!codecHash) {
+      codecHash = HASH_create_table(37, &xdr_codec_hash_func,
+            &xdr_codec_cmp_key, &xdr_codec_key_for_data);
+      if (!codecHash)
+         return;
+   }
+   if (HASH_find_key(codecHash, def->arg))
+      return;
+
+   codec = xdr_codec_compile((struct XDR_FieldDefinition*)def->arg);
+   if (!codec)
+      return;
+   HASH_add_data(codecHash, codec);
+   codecCache[CODEC_CACHE_SLOT(def->arg)] = codec;
+}
+
+static struct XDR_CompiledCodec *xdr_codec_for_fields(void *fields)
+{
+   struct XDR_CompiledCodec *codec;
+
+   codec = codecCache[CODEC_CACHE_SLOT(fields)];
+   if (codec && codec->fields == fields)
+      return codec;
+
+   if (!codecHash || !fields)
+      return NULL;
+   codec = (struct XDR_CompiledCodec*)HASH_find_key(codecHash, fields);
+   if (codec)
+      codecCache[CODEC_CACHE_SLOT(fields)] = codec;
+   return codec;
+}
+
+static void xdr_codec_decode_run(const char *src, char *dst,
+      struct XDR_CodecOp *op)
+{
+   struct XDR_CodecSlot *slot, *end = op->slots + op->count;
+   uint32_t v32, lo;
+
+   for (slot = op->slots; slot < end; slot++) {
+      switch (slot->kind) {
+         case CODEC_SWAP32:
+            memcpy(&v32, src, 4);
+            v32 = ntohl(v32);
+            memcpy(dst + slot->offset, &v32, 4);
+            src += 4;
+            break;
+         case CODEC_SWAP64:
+            memcpy(&v32, src, 4);
+            memcpy(&lo, src + 4, 4);
+            {
+               uint64_t v64 = ((uint64_t)ntohl(v32) << 32) | ntohl(lo);
+               memcpy(dst + slot->offset, &v64, 8);
+            }
+            src += 8;
+            break;
+         case CODEC_RAW4:
+            memcpy(dst + slot->offset, src, 4);
+            src += 4;
+            break;
+         case CODEC_RAW8:
+            memcpy(dst + slot->offset, src, 8);
+            src += 8;
+            break;
+      }
+   }
+}
+
+static void xdr_codec_encode_run(const char *src, char *dst,
+      struct XDR_CodecOp *op)
+{
+   struct XDR_CodecSlot *slot, *end = op->slots + op->count;
+   uint32_t v32;
+   uint64_t v64;
+
+   for (slot = op->slots; slot < end; slot++) {
+      switch (slot->kind) {
+         case CODEC_SWAP32:
+            memcpy(&v32, src + slot->offset, 4);
+            v32 = htonl(v32);
+            memcpy(dst, &v32, 4);
+            dst += 4;
+            break;
+         case CODEC_SWAP64:
+            memcpy(&v64, src + slot->offset, 8);
+            v32 = htonl((uint32_t)(v64 >> 32));
+            memcpy(dst, &v32, 4);
+            v32 = htonl((uint32_t)v64);
+            memcpy(dst + 4, &v32, 4);
+            dst += 8;
+            break;
+         case CODEC_RAW4:
+            memcpy(dst, src + slot->offset, 4);
+            dst += 4;
+            break;
+         case CODEC_RAW8:
+            memcpy(dst, src + slot->offset, 8);
+            dst += 8;
+            break;
+      }
+   }
+}
+
+static int xdr_codec_decode(struct XDR_CompiledCodec *codec, char *src,
+      char *dst, size_t *inc, size_t max)
+{
+   struct XDR_CodecOp *op, *end = codec->ops + codec->nops;
+   struct XDR_FieldDefinition *field;
+   size_t used = 0, len;
+
+   for (op = codec->ops; op < end; op++) {
+      if (op->count) {
+         if (max - used < op->wire)
+            return -1;
+         xdr_codec_decode_run(src + used, dst, op);
+         used += op->wire;
+         continue;
+      }
+
+      field = op->field;
+      len = 0;
+      if (field->funcs->decoder(src + used, dst + field->offset, &len,
+               max - used, dst + field->len_offset) < 0)
+         return -1;
+      used += len;
+   }
+
+   *inc = used;
+
+   return 0;
+}
+
+static int xdr_codec_encode(struct XDR_CompiledCodec *codec, char *src,
+      char *dst, size_t *inc, size_t max)
+{
+   struct XDR_CodecOp *op, *end = codec->ops + codec->nops;
+   struct XDR_FieldDefinition *field;
+   size_t used = 0, len;
+   int res = 0;
+
+   for (op = codec->ops; op < end; op++) {
+      if (op->count) {
+         if (dst && res >= 0) {
+            if (max < used || max - used < op->wire)
+               res = -2;
+            else
+               xdr_codec_encode_run(src, dst + used, op);
+         }
+         used += op->wire;
+         continue;
+      }
+
+      field = op->field;
+      len = 0;
+      // A failed measurement has no length to skip over, so report it
+      if (!dst || res < 0) {
+         if (field->funcs->encoder(src + field->offset, NULL, &len, max,
+                  src + field->len_offset) < 0 && !dst)
+            res = -1;
+      }
+      else
+         res = field->funcs->encoder(src + field->offset,
+               dst + used, &len, max-used, src + field->len_offset);
+      used += len;
+   }
+
+   *inc = used;
+
+   return res;
+}
+
+int XDR_struct_decoder(char *src, void *dst_void, size_t *inc,
+      size_t max, void *arg)
+{
+   struct XDR_CompiledCodec *codec = xdr_codec_for_fields(arg);
+
+   if (codec)
+      return xdr_codec_decode(codec, src, (char*)dst_void, inc, max);
+
+   return XDR_table_struct_decoder(src, dst_void, inc, max, arg);
+}
+
 int XDR_bitfield_struct_decoder(char *src, void *dst_void, size_t *inc,
       size_t max, void *arg)
 {
@@ -743,7 +1708,7 @@ int XDR_bitfield_struct_decoder(char *src, void *dst_void, size_t *inc,
    return 0;
 }
 
-int XDR_struct_encoder(void *src_void, char *dst, size_t *inc,
+int XDR_table_struct_encoder(void *src_void, char *dst, size_t *inc,
       size_t max, uint32_t type, void *arg)
 {
    size_t len = 0;
@@ -758,9 +1723,11 @@ int XDR_struct_encoder(void *src_void, char *dst, size_t *inc,
       return 0;
 
    while (field->offset || field->funcs) {
-      if (!dst || res < 0)
-         field->funcs->encoder(src + field->offset, NULL, &len, max,
-               src + field->len_offset);
+      if (!dst || res < 0) {
+         if (field->funcs->encoder(src + field->offset, NULL, &len, max,
+                  src + field->len_offset) < 0 && !dst)
+            res = -1;
+      }
       else
          res = field->funcs->encoder(src + field->offset,
                dst + used, &len, max-used, src + field->len_offset);
@@ -773,6 +1740,18 @@ int XDR_struct_encoder(void *src_void, char *dst, size_t *inc,
    return res;
 }
 
+int XDR_struct_encoder(void *src_void, char *dst, size_t *inc,
+      size_t max, uint32_t type, void *arg)
+{
+   struct XDR_CompiledCodec *codec = xdr_codec_for_fields(arg);
+
+   *inc = 0;
+   if (codec)
+      return xdr_codec_encode(codec, (char*)src_void, dst, inc, max);
+
+   return XDR_table_struct_encoder(src_void, dst, inc, max, type, arg);
+}
+
 int XDR_bitfield_struct_encoder(void *src_void, char *dst, size_t *inc,
       size_t max, uint32_t type, void *arg)
 {
@@ -805,7 +1784,7 @@ void *XDR_malloc_allocator(struct XDR_StructDefinition *def)
    if (!def || !def->in_memory_size)
       return NULL;
 
-   result = malloc(def->in_memory_size);
+   result = xdr_alloc(def->in_memory_size);
    if (result)
       memset(result, 0, def->in_memory_size);
 
@@ -841,12 +1820,12 @@ void XDR_union_field_deallocator(void **goner,
 
    if (!goner)
       return;
-   u = (struct XDR_Union*)*(struct XDR_Union**)goner;
+   u = (struct XDR_Union*)goner;
    def = XDR_definition_for_type(u->type);
    if (def && def->deallocator)
       def->deallocator(&u->data, def);
    else
-      free(u->data);
+      xdr_release(u->data);
 }
 
 void XDR_union_array_field_deallocator(void **goner,
@@ -862,7 +1841,18 @@ void XDR_array_field_deallocator(void **goner,
    if (!goner || !*goner)
       return;
 
-   free(*goner);
+   xdr_release(*goner);
+}
+
+void XDR_borrowed_field_deallocator(void **goner,
+      struct XDR_FieldDefinition *field)
+{
+   if (!goner || !*goner)
+      return;
+
+   if (!xdr_borrow_release(*goner))
+      xdr_release(*goner);
+   *goner = NULL;
 }
 
 void XDR_free_deallocator(void **goner, struct XDR_StructDefinition *def)
@@ -874,7 +1864,7 @@ void XDR_free_deallocator(void **goner, struct XDR_StructDefinition *def)
 
    to_free = *goner;
    *goner = NULL;
-   free(to_free);
+   xdr_release(to_free);
 }
 
 void XDR_struct_free_deallocator(void **goner, struct XDR_StructDefinition *def)
@@ -894,7 +1884,7 @@ void XDR_struct_free_deallocator(void **goner, struct XDR_StructDefinition *def)
    }
 
    *goner = NULL;
-   free(to_free);
+   xdr_release(to_free);
 }
 
 void XDR_print_field_double(FILE *out, void *data,
@@ -1461,7 +2451,7 @@ void XDR_free_union(struct XDR_Union *goner)
    if (def && def->deallocator)
       def->deallocator(&goner->data, def);
    else
-      free(goner->data);
+      xdr_release(goner->data);
 }
 
 void XDR_array_field_scanner(const char *in, void *dst_ptr, void *arg,
@@ -1531,7 +2521,7 @@ int XDR_array_encoder(char *src_ptr, void *dst, size_t *used, size_t max,
    char *src = NULL;
    int i;
    size_t sz = 0, enc_len = 0;
-   int res = 0;
+   int res = 0, measuring = !dst;
 
    if (src_ptr)
       src = *(char**)src_ptr;
@@ -1540,8 +2530,9 @@ int XDR_array_encoder(char *src_ptr, void *dst, size_t *used, size_t max,
       sz = 0;
       if (dst && res >= 0)
          res = enc(src + i*increment, dst + enc_len, &sz, max - enc_len, NULL);
-      else
-         enc(src + i*increment, NULL, &sz, max - enc_len, NULL);
+      else if (enc(src + i*increment, NULL, &sz, max - enc_len, NULL) < 0 &&
+            measuring)
+         res = -1;
       if (res < 0)
          dst = NULL;
 
@@ -1559,17 +2550,19 @@ int XDR_array_decoder(char *src, void *dst, size_t *used, size_t max,
    int i, res;
    char *buff;
 
-   buff = malloc(len * increment);
-   if (!buff)
-      return -1;
    if (!dst)
       return -2;
+   buff = xdr_alloc(len * increment);
+   if (!buff)
+      return -1;
 
    for (i = 0; i < len; i++) {
       sz = 0;
       res = dec(src + dec_len, buff + i*increment, &sz, max - dec_len, NULL);
-      if (res < 0)
+      if (res < 0) {
+         xdr_release(buff);
          return res;
+      }
       dec_len += sz;
    }
    *used = dec_len;
@@ -1677,7 +2670,7 @@ struct XDR_TypeFunctions xdr_string_arr_functions = {
 struct XDR_TypeFunctions xdr_byte_arr_functions = {
    (XDR_Decoder)&XDR_decode_byte_array, (XDR_Encoder)&XDR_encode_byte_array,
    &XDR_print_field_byte_array, &XDR_scan_byte_array,
-   &XDR_array_field_deallocator
+   &XDR_borrowed_field_deallocator
 };
 
 struct XDR_TypeFunctions xdr_union_functions = {
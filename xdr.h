@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include "proclib.h"
@@ -74,14 +75,60 @@ struct XDR_StructDefinition {
    void *populate_arg;
 };
 
+// Decode flags, set per thread with XDR_set_decode_flags() or per
+//  structure with XDR_set_struct_decode_flags().
+//
+// XDR_DECODE_BORROW -- Variable-length opaque fields are not copied.  The
+//    decoded pointers reference the source buffer, which must outlive the
+//    decoded structure.  Strings are borrowed the same way when their zero
+//    padding already terminates them, and copied otherwise.  The source
+//    buffer is never modified.  Borrowed opaque fields are recorded as they
+//    are decoded and skipped when the structure is freed, whichever thread
+//    frees it and whatever flags are in effect by then.
+#define XDR_DECODE_BORROW 0x0001
+
 extern void XDR_register_structs(struct XDR_StructDefinition*);
 extern void XDR_register_struct(struct XDR_StructDefinition*);
 extern void XDR_register_populator(XDR_populate_struct cb,
       void *arg, uint32_t type);
+
+// Registers a populator whose encoded result may be reused to answer
+//  DATA_REQ commands for up to maxAgeMs milliseconds.  Requests that arrive
+//  within that window share one populate and encode, as do requests that
+//  arrive while that populate is still running, including its result if it
+//  fails.  A max age of 0 runs the populator for every request, as
+//  XDR_register_populator does.
+extern void XDR_register_populator_cached(XDR_populate_struct cb,
+      void *arg, uint32_t type, uint32_t maxAgeMs);
+// Returns the max age a type's populator was registered with, or 0
+extern uint32_t XDR_populator_max_age(uint32_t type);
 extern struct XDR_StructDefinition *XDR_definition_for_type(uint32_t type);
 extern void XDR_set_struct_print_function(XDR_print_func func, uint32_t type);
 extern void XDR_set_field_print_function(XDR_print_field_func func,
       uint32_t struct_type, uint32_t field);
+extern void XDR_set_struct_decode_flags(uint32_t flags, uint32_t type);
+
+// Sets the decode flags for the calling thread and returns the previous
+//  value so callers can restore it.  Flags of a registered structure are
+//  added to these while it is decoded as part of a union.
+extern uint32_t XDR_set_decode_flags(uint32_t flags);
+extern uint32_t XDR_get_decode_flags(void);
+
+// Sets the arena that the calling thread's decoders allocate from and
+//  returns the previous one.  While an arena is set, XDR frees are skipped
+//  altogether; the decoded tree is released by resetting the arena, and
+//  must never be freed field by field.  Pass NULL to go back to malloc.
+struct MemArena;
+extern struct MemArena *XDR_set_decode_arena(struct MemArena *arena);
+
+// The byte swap kernels behind the 32- and 64-bit array codecs
+enum XDR_SwapKernel { XDR_SWAP_SCALAR, XDR_SWAP_SSE2, XDR_SWAP_AVX2 };
+
+// Runs one swap kernel on count elements of width 4 or 8, whichever kernel
+//  the array codecs picked, so each can be checked against the scalar loop.
+//  Returns -1 if the kernel is not built in or the CPU lacks it.
+extern int XDR_swap_kernel(enum XDR_SwapKernel kernel, size_t width,
+      void *dst, const void *src, size_t count);
 
 extern int XDR_array_encoder(char *src, void *dst, size_t *used, size_t max,
       int len, size_t increment, XDR_Encoder enc, void *enc_arg);
@@ -89,6 +136,34 @@ extern int XDR_array_decoder(char *src, void *dst, size_t *used, size_t max,
       int len, size_t increment, XDR_Decoder dec, void *dec_arg);
 extern int XDR_struct_encoder(void *src, char *dst, size_t *encoded_size,
       size_t max, uint32_t type, void *arg);
+extern int XDR_table_struct_encoder(void *src, char *dst,
+      size_t *encoded_size, size_t max, uint32_t type, void *arg);
+
+// Computes the exact number of bytes the registered structure of the given
+//  type, or a union holding one, encodes to without encoding anything.
+//  Returns -1 if the type, or that of a union it holds, is not registered.
+extern int XDR_struct_encoded_size(void *src, uint32_t type, size_t *size);
+extern int XDR_union_encoded_size(struct XDR_Union *src, size_t *size);
+
+// Scatter-gather encoding.  Opaque fields of at least refMin bytes are
+//  referenced in place by their own iovec entry; everything else is encoded
+//  into buff and covered by the entries in between.  The referenced memory
+//  must stay valid until the iovecs have been sent.
+struct XDR_IOVec {
+   char *buff;          // Scratch space for the non-referenced bytes
+   size_t buffLen;
+   struct iovec *iov;   // Filled with the message segments, in order
+   int iovMax;
+   size_t refMin;
+   int iovCount;        // Out: number of iov entries used
+   size_t buffUsed;     // Out: bytes of buff used
+   size_t len;          // Out: total encoded length
+};
+
+// Encodes a registered structure into vec.  Returns -1 if the structure is
+//  unknown or buff or iov is too small.
+extern int XDR_struct_encode_iov(void *src, uint32_t type,
+      struct XDR_IOVec *vec);
 extern int XDR_bitfield_struct_encoder(void *src, char *dst,
       size_t *encoded_size, size_t max, uint32_t type, void *arg);
 extern void XDR_print_structure(uint32_t type,
@@ -118,8 +193,15 @@ extern void XDR_print_fields_func(FILE *out, void *data, void *arg,
 //
 //  Returns negative number on error, or 0 on success.  Positive numbers are
 //     reserved for future use
+//
+// XDR_struct_decoder and XDR_struct_encoder use a codec compiled when the
+//  structure is registered.  Adjacent fixed-size scalar fields are merged
+//  into runs converted with one bounds check and no per-field indirect
+//  call.  The XDR_table_* variants always walk the field table.
 extern int XDR_struct_decoder(char *src, void *dst, size_t *used,
       size_t max, void *arg);
+extern int XDR_table_struct_decoder(char *src, void *dst, size_t *used,
+      size_t max, void *arg);
 extern int XDR_bitfield_struct_decoder(char *src, void *dst, size_t *used,
       size_t max, void *arg);
 extern int XDR_decodebf_int32(char *src, int32_t *dst, size_t *used,
@@ -211,6 +293,8 @@ extern void XDR_struct_array_field_deallocator(void **goner,
       struct XDR_FieldDefinition *field);
 extern void XDR_array_field_deallocator(void **goner,
       struct XDR_FieldDefinition *field);
+extern void XDR_borrowed_field_deallocator(void **goner,
+      struct XDR_FieldDefinition *field);
 extern void XDR_union_field_deallocator(void **goner,
       struct XDR_FieldDefinition *field);
 extern void XDR_union_array_field_deallocator(void **goner,
@@ -6,10 +6,13 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 
 static int zmql_client_raw_write(struct ZMQLClient *client, const void *data,
       int dlen);
+static int zmql_client_write_cb(int fd, char type, void *arg);
 
 enum ZMQLState { ZMQL_SIGNATURE, ZMQL_VERS1, ZMQL_AUTH, ZMQL_DATA };
 
@@ -35,6 +38,8 @@ static char ZMQ_HANDSHAKE_DATA[] = { 0x04, 0x1A, 0x05, 'R', 'E', 'A', 'D', 'Y',
 #define ZMQ_LONG_SIZE 0x2
 #define ZMQ_COMMAND 0x4
 
+#define ZMQL_IOV_MAX 32
+
 #define htonll(x) ((1==htonl(1)) ? (x) : ((uint64_t)htonl((x) & 0xFFFFFFFF) << 32) | htonl((x) >> 32))
 #define ntohll(x) ((1==ntohl(1)) ? (x) : ((uint64_t)ntohl((x) & 0xFFFFFFFF) << 32) | ntohl((x) >> 32))
 
@@ -44,9 +49,13 @@ struct ZMQLClient {
    enum ZMQLState state;
    struct sockaddr_in addr;
    struct IPCBuffer *data;
+   struct IPCBuffer *out;     // Bytes waiting for the socket to drain
    struct ZMQLServer *server;
    struct ZMQLClient *next;
    int closeFlag;
+   int writing;               // EVENT_FD_WRITE is registered
+   int overflowed;            // Disconnect policy tripped; write nothing more
+   unsigned int dropped;
    zmql_client_message_cb msgCb;
    zmql_client_status_cb connectCb, disconnectCb;
    void *msgArg;
@@ -60,6 +69,8 @@ struct ZMQLServer {
    zmql_client_status_cb connectCb, disconnectCb;
    void *msgArg;
    EVTHandler *evt;
+   size_t maxQueued;
+   enum ZMQLOverflow policy;
 };
 
 int zmql_server_socket(struct ZMQLServer *server)
@@ -215,6 +226,7 @@ int zmql_accept_cb(int fd, char type, void *arg)
    client->next = server->clients;
    server->clients = client;
    client->data = ipc_alloc_buffer();
+   client->out = ipc_alloc_buffer();
    client->state = ZMQL_SIGNATURE;
    client->msgCb = server->msgCb;
    client->msgArg = server->msgArg;
@@ -253,6 +265,8 @@ struct ZMQLServer *zmql_create_tcp_server(EVTHandler *evt, int port,
    server->msgArg = arg;
    server->connectCb = con_cb;
    server->disconnectCb = discon_cb;
+   server->maxQueued = ZMQL_DEFAULT_QUEUE_LIMIT;
+   server->policy = ZMQL_OVERFLOW_DROP;
 
    EVT_fd_add(evt, server->socket, EVENT_FD_READ, zmql_accept_cb, server);
    EVT_fd_set_name(evt, server->socket, "ZMQ Server port %d", port);
@@ -305,6 +319,8 @@ void zmql_destroy_client(struct ZMQLClient **goner)
       DBG_print(DBG_LEVEL_INFO, "Removing FD event for %p.", client);
       EVT_fd_remove(client->server->evt, client->socket, EVENT_FD_READ);
    }
+   if (client->writing)
+      EVT_fd_remove(client->server->evt, client->socket, EVENT_FD_WRITE);
    if (client->state == ZMQL_DATA && client->disconnectCb)
       client->disconnectCb(client, client->msgArg);
 
@@ -314,22 +330,137 @@ void zmql_destroy_client(struct ZMQLClient **goner)
    close(client->socket);
    if (client->data)
       ipc_destroy_buffer(&client->data);
+   if (client->out)
+      ipc_destroy_buffer(&client->out);
 
    DBG_print(DBG_LEVEL_INFO, "Freeing zmql client %p.", client);
    free(client);
 }
 
-static int zmql_client_raw_write(struct ZMQLClient *client, const void *data,
-      int dlen)
+// Stops all further output and shuts the socket down.  The read callback
+//  sees the hangup and destroys the client from a safe context.
+static void zmql_client_abort(struct ZMQLClient *client)
 {
-   int len;
+   client->overflowed = 1;
+   ipc_reset_buffer(client->out);
+   if (client->writing) {
+      EVT_fd_remove(client->server->evt, client->socket, EVENT_FD_WRITE);
+      client->writing = 0;
+   }
+   shutdown(client->socket, SHUT_RDWR);
+}
+
+// Copies msg, starting at offset, onto the end of the outbound queue
+static void zmql_queue_buffer(struct ZMQLClient *client, struct IPCBuffer *msg,
+      size_t offset)
+{
+   struct iovec iov[ZMQL_IOV_MAX];
+   int cnt, i;
+
+   while ((cnt = ipc_buffer_iov(msg, offset, iov, ZMQL_IOV_MAX)) > 0) {
+      for (i = 0; i < cnt; i++) {
+         ipc_append_buffer(client->out, iov[i].iov_base, iov[i].iov_len);
+         offset += iov[i].iov_len;
+      }
+   }
+}
+
+// Sends a header and optional body with one writev if nothing is queued
+//  ahead of them, and queues whatever the socket doesn't take.  Applies the
+//  server's byte limit unless force is set.
+static int zmql_client_send(struct ZMQLClient *client, const void *hdr,
+      int hlen, struct IPCBuffer *msg, int force)
+{
+   struct iovec iov[ZMQL_IOV_MAX];
+   struct ZMQLServer *server = client->server;
+   size_t total, written = 0;
+   ssize_t res;
+   int cnt;
+
+   if (client->overflowed)
+      return -1;
+
+   total = hlen + ipc_buffer_size(msg);
+   if (!force && server->maxQueued &&
+         ipc_buffer_size(client->out) + total > server->maxQueued) {
+      client->dropped++;
+      if (server->policy == ZMQL_OVERFLOW_DISCONNECT) {
+         DBG_print(DBG_LEVEL_WARN, "zmql client %p outbound queue full, "
+               "disconnecting", client);
+         zmql_client_abort(client);
+      }
+      return -1;
+   }
+
+   if (!ipc_buffer_size(client->out)) {
+      iov[0].iov_base = (void*)hdr;
+      iov[0].iov_len = hlen;
+      cnt = 1 + ipc_buffer_iov(msg, 0, iov + 1, ZMQL_IOV_MAX - 1);
+
+      res = writev(client->socket, iov, cnt);
+      if (res < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+            errno != EINTR) {
+         ERR_REPORT(DBG_LEVEL_WARN, "Error writing to zmql client.  Closing.");
+         zmql_client_abort(client);
+         return -1;
+      }
+      if (res > 0)
+         written = res;
+   }
+
+   if (written >= total)
+      return 0;
+
+   if (written < hlen) {
+      ipc_append_buffer(client->out, (const char*)hdr + written,
+            hlen - written);
+      written = hlen;
+   }
+   zmql_queue_buffer(client, msg, written - hlen);
+
+   // Without the callback the queued data would never drain
+   if (!client->writing) {
+      if (!EVT_fd_add(server->evt, client->socket, EVENT_FD_WRITE,
+               zmql_client_write_cb, client)) {
+         DBG_print(DBG_LEVEL_WARN, "Can't watch zmql client %p for writing, "
+               "disconnecting", client);
+         zmql_client_abort(client);
+         return -1;
+      }
+      client->writing = 1;
+   }
+
+   return 0;
+}
 
-   len = write(client->socket, data, dlen);
+static int zmql_client_write_cb(int fd, char type, void *arg)
+{
+   struct ZMQLClient *client = (struct ZMQLClient*)arg;
+   ssize_t res;
+
+   res = ipc_writev_buffer(client->socket, client->out);
+   if (res < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      ERR_REPORT(DBG_LEVEL_WARN, "Error writing to zmql client.  Closing.");
+      client->writing = 0;
+      zmql_client_abort(client);
+      return EVENT_REMOVE;
+   }
 
-   if (len != dlen)
-      DBG_print(DBG_LEVEL_WARN, "Short ZMQ write");
+   if (ipc_buffer_size(client->out))
+      return EVENT_KEEP;
+
+   client->writing = 0;
+   return EVENT_REMOVE;
+}
+
+static int zmql_client_raw_write(struct ZMQLClient *client, const void *data,
+      int dlen)
+{
+   // Protocol handshakes are tiny and must never be dropped
+   if (zmql_client_send(client, data, dlen, NULL, 1) < 0)
+      return -1;
 
-   return len;
+   return dlen;
 }
 
 int zmql_write_buffer(struct ZMQLClient *client, struct IPCBuffer *msg)
@@ -354,10 +485,25 @@ int zmql_write_buffer(struct ZMQLClient *client, struct IPCBuffer *msg)
       hlen = 9;
    }
 
-   zmql_client_raw_write(client, header, hlen);
-   ipc_write_buffer_sync(client->socket, msg);
+   return zmql_client_send(client, header, hlen, msg, 0);
+}
 
-   return 0;
+void zmql_set_client_limit(struct ZMQLServer *server, size_t maxQueued,
+      enum ZMQLOverflow policy)
+{
+   if (!server)
+      return;
+
+   server->maxQueued = maxQueued;
+   server->policy = policy;
+}
+
+size_t zmql_client_queued(struct ZMQLClient *client)
+{
+   if (!client)
+      return 0;
+
+   return ipc_buffer_size(client->out);
 }
 
 void zmql_broadcast_buffer(struct ZMQLServer *server, struct IPCBuffer *msg)
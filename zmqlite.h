@@ -3,6 +3,10 @@
 
 #include <unistd.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 struct ZMQLServer;
 struct ZMQLClient;
 struct EventState;
@@ -12,6 +16,15 @@ typedef int (*zmql_client_message_cb)(struct ZMQLClient *client,
       const void *data, size_t dataLen, void *arg);
 typedef void (*zmql_client_status_cb)(struct ZMQLClient *client, void *arg);
 
+// What to do with a message that would push a client's outbound queue
+//  past its byte limit
+enum ZMQLOverflow {
+   ZMQL_OVERFLOW_DROP,        // Discard the new message, keep the client
+   ZMQL_OVERFLOW_DISCONNECT,  // Close the client's connection
+};
+
+#define ZMQL_DEFAULT_QUEUE_LIMIT (1024 * 1024)
+
 struct ZMQLServer *zmql_create_tcp_server(struct EventState *evt, int port,
       zmql_client_message_cb cb, zmql_client_status_cb connect_cb,
       zmql_client_status_cb disconnect_cb, void *arg);
@@ -19,8 +32,15 @@ void zmql_destroy_tcp_server(struct ZMQLServer **goner);
 void zmql_destroy_client(struct ZMQLClient **goner);
 void zmql_broadcast_buffer(struct ZMQLServer *server, struct IPCBuffer *msg);
 int zmql_write_buffer(struct ZMQLClient *client, struct IPCBuffer *msg);
+void zmql_set_client_limit(struct ZMQLServer *server, size_t maxQueued,
+      enum ZMQLOverflow policy);
+size_t zmql_client_queued(struct ZMQLClient *client);
 int zmql_client_count(struct ZMQLServer *server);
 int zmql_server_socket(struct ZMQLServer *server);
 struct ZMQLServer *zmql_server_for_client(struct ZMQLClient *client);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif